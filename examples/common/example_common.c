@@ -135,49 +135,61 @@ esp_loader_error_t connect_to_target(uint32_t higher_transmission_rate)
     printf("Connected to target\n");
 
     if (higher_transmission_rate && esp_loader_get_target() != ESP8266_CHIP) {
-        err = esp_loader_change_transmission_rate(higher_transmission_rate);
-        if (err == ESP_LOADER_ERROR_UNSUPPORTED_FUNC) {
-            printf("ESP8266 does not support change transmission rate command.");
-            return err;
-        } else if (err != ESP_LOADER_SUCCESS) {
-            printf("Unable to change transmission rate on target.");
+        // Fall back to slower rates if the fixture cannot sustain the requested one
+        static uint32_t rates[3];
+        rates[0] = higher_transmission_rate;
+        rates[1] = higher_transmission_rate / 2;
+        rates[2] = higher_transmission_rate / 4;
+
+        uint32_t transmission_rate;
+        err = esp_loader_negotiate_transmission_rate(rates, sizeof(rates) / sizeof(rates[0]),
+                                                     DEFAULT_TRANSMISSION_RATE, &transmission_rate);
+        if (err != ESP_LOADER_SUCCESS) {
+            printf("Unable to change transmission rate.");
             return err;
-        } else {
-            err = loader_port_change_transmission_rate(higher_transmission_rate);
-            if (err != ESP_LOADER_SUCCESS) {
-                printf("Unable to change transmission rate.");
-                return err;
-            }
-            printf("Transmission rate changed changed\n");
         }
+        printf("Transmission rate changed to %"PRIu32"\n", transmission_rate);
     }
 
     return ESP_LOADER_SUCCESS;
 }
 
 
+// Called between blocks, only every few percent, so printing does not hold the blocks in flight back
+static void print_progress(const esp_loader_flash_progress_t *progress, void *arg)
+{
+    (void)arg;
+
+    uint32_t percent = (uint32_t)((uint64_t)progress->bytes_acked * 100 / progress->bytes_total);
+    printf("\rProgress: %"PRIu32" %% (%"PRIu32" kB/s)", percent, progress->rate / 1000);
+    if (progress->eta_ms != UINT32_MAX) {
+        printf(", %"PRIu32" s left   ", (progress->eta_ms + 999) / 1000);
+    }
+    fflush(stdout);
+}
+
+
 esp_loader_error_t flash_binary(const uint8_t *bin, size_t size, size_t address)
 {
     esp_loader_error_t err;
-    static uint8_t payload[1024];
+    uint32_t block_size;
     const uint8_t *bin_addr = bin;
 
+    esp_loader_set_flash_progress_callback(print_progress, size / 20, NULL);
+
     printf("Erasing flash (this may take a while)...\n");
-    err = esp_loader_flash_start(address, size, sizeof(payload));
+    // Data is sent directly from the image, so block size is only limited by the target
+    err = esp_loader_flash_start_auto(address, size, UINT32_MAX, &block_size);
     if (err != ESP_LOADER_SUCCESS) {
         printf("Erasing flash failed with error %d.\n", err);
         return err;
     }
     printf("Start programming\n");
 
-    size_t binary_size = size;
-    size_t written = 0;
-
     while (size > 0) {
-        size_t to_read = MIN(size, sizeof(payload));
-        memcpy(payload, bin_addr, to_read);
+        size_t to_read = MIN(size, block_size);
 
-        err = esp_loader_flash_write(payload, to_read);
+        err = esp_loader_flash_write(bin_addr, to_read);
         if (err != ESP_LOADER_SUCCESS) {
             printf("\nPacket could not be written! Error %d.\n", err);
             return err;
@@ -185,13 +197,15 @@ esp_loader_error_t flash_binary(const uint8_t *bin, size_t size, size_t address)
 
         size -= to_read;
         bin_addr += to_read;
-        written += to_read;
-
-        int progress = (int)(((float)written / binary_size) * 100);
-        printf("\rProgress: %d %%", progress);
-        fflush(stdout);
     };
 
+    // Last blocks in flight are reported once acknowledged
+    err = esp_loader_flash_wait_pending();
+    if (err != ESP_LOADER_SUCCESS) {
+        printf("\nPacket could not be written! Error %d.\n", err);
+        return err;
+    }
+
     printf("\nFinished programming\n");
 
 #if MD5_ENABLED
@@ -233,7 +247,8 @@ esp_loader_error_t load_ram_binary(const uint8_t *bin)
     for (seg=0; seg < header->segments; seg++) {
         printf("Downloading %"PRIu32" bytes at 0x%08"PRIx32"...\n", segments[seg].size, segments[seg].addr);
 
-        err = esp_loader_mem_start(segments[seg].addr, segments[seg].size, ESP_RAM_BLOCK);
+        uint32_t block_size;
+        err = esp_loader_mem_start_auto(segments[seg].addr, segments[seg].size, UINT32_MAX, &block_size);
         if (err != ESP_LOADER_SUCCESS) {
             printf("Loading ram start with error %d.\n", err);
             return err;
@@ -242,7 +257,7 @@ esp_loader_error_t load_ram_binary(const uint8_t *bin)
         size_t remain_size = segments[seg].size;
         uint8_t *data_pos = segments[seg].data;
         while(remain_size > 0) {
-            size_t data_size = MIN(ESP_RAM_BLOCK, remain_size);
+            size_t data_size = MIN(block_size, remain_size);
             err = esp_loader_mem_write(data_pos, data_size);
             if (err != ESP_LOADER_SUCCESS) {
                 printf("\nPacket could not be written! Error %d.\n", err);
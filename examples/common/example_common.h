@@ -16,6 +16,8 @@
 #pragma once
 
 #define BIN_FIRST_SEGMENT_OFFSET    0x18
+// Transmission rate the targets are connected at.
+#define DEFAULT_TRANSMISSION_RATE   115200
 // Maximum block sized for RAM and Flash writes, respectively.
 #define ESP_RAM_BLOCK               0x1800
 
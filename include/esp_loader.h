@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +37,66 @@ extern "C" {
     }                                   \
 } while(0)
 
+/**
+ * Size of the largest command header, including the data command header.
+ */
+#define ESP_LOADER_CMD_HEADER_MAX_SIZE 48
+
+/**
+ * Worst case size of the buffer passed to esp_loader_set_tx_buffer(), for payloads of up
+ * to block_size bytes. Every byte may need escaping, and the frame is enclosed by two delimiters.
+ */
+#define ESP_LOADER_TX_BUFFER_SIZE(block_size) (2 * (ESP_LOADER_CMD_HEADER_MAX_SIZE + (block_size)) + 2)
+
+/**
+ * Size of the history window of the built-in deflate compressor, from 1024 to 16384 bytes.
+ */
+#ifndef ESP_LOADER_DEFLATE_WINDOW_SIZE
+#ifdef ESP_LOADER_TINY
+#define ESP_LOADER_DEFLATE_WINDOW_SIZE 1024
+#else
+#define ESP_LOADER_DEFLATE_WINDOW_SIZE 4096
+#endif
+#endif
+
+/**
+ * Number of bits of the hash table used by the built-in deflate compressor to find matches.
+ */
+#ifndef ESP_LOADER_DEFLATE_HASH_BITS
+#ifdef ESP_LOADER_TINY
+#define ESP_LOADER_DEFLATE_HASH_BITS 9
+#else
+#define ESP_LOADER_DEFLATE_HASH_BITS 11
+#endif
+#endif
+
+/**
+ * Size of the work buffer passed to esp_loader_flash_deflate_start(), for compressed blocks
+ * of block_size bytes.
+ */
+#define ESP_LOADER_DEFLATE_WORK_SIZE(block_size) \
+    ((2u << ESP_LOADER_DEFLATE_HASH_BITS) + 2 * ESP_LOADER_DEFLATE_WINDOW_SIZE + (block_size))
+
+/**
+ * Number of loader contexts which can be created by esp_loader_create(), in addition
+ * to the default one using loader_port_* functions.
+ */
+#ifndef ESP_LOADER_MAX_CONTEXTS
+#define ESP_LOADER_MAX_CONTEXTS 0
+#endif
+
+/**
+ * Size of the arena passed to esp_loader_create_in(), bound of the context of any profile
+ * including its alignment. Build fails if the context does not fit, larger value can be defined.
+ */
+#ifndef ESP_LOADER_CONTEXT_SIZE
+#ifdef ESP_LOADER_TINY
+#define ESP_LOADER_CONTEXT_SIZE 1024
+#else
+#define ESP_LOADER_CONTEXT_SIZE 3072
+#endif
+#endif
+
 /**
  * @brief Error codes
  */
@@ -49,7 +110,8 @@ typedef enum {
     ESP_LOADER_ERROR_INVALID_TARGET,   /*!< Connected target is invalid */
     ESP_LOADER_ERROR_UNSUPPORTED_CHIP, /*!< Attached chip is not supported */
     ESP_LOADER_ERROR_UNSUPPORTED_FUNC, /*!< Function is not supported on attached target */
-    ESP_LOADER_ERROR_INVALID_RESPONSE  /*!< Internal error */
+    ESP_LOADER_ERROR_INVALID_RESPONSE, /*!< Internal error */
+    ESP_LOADER_IN_PROGRESS             /*!< Operation has not completed yet, poll again later */
 } esp_loader_error_t;
 
 /**
@@ -88,14 +150,28 @@ typedef union {
 typedef struct {
     uint32_t sync_timeout;  /*!< Maximum time to wait for response from serial interface. */
     int32_t trials;         /*!< Number of trials to connect to target. If greater than 1,
-                               100 millisecond delay is inserted after each try. */
+                               delay is inserted after each try. */
+    uint32_t trial_delay;   /*!< Delay after the first failed trial in milliseconds. It doubles
+                               with each next trial, up to 100 milliseconds. 0 selects 100. */
+    uint32_t transmission_rate; /*!< Rate the port communicates at while connecting, 0 if not known.
+                                   The flasher stub is told it when the rate is changed. */
 } esp_loader_connect_args_t;
 
 #define ESP_LOADER_CONNECT_DEFAULT() { \
   .sync_timeout = 100, \
   .trials = 10, \
+  .trial_delay = 0, \
+  .transmission_rate = 115200, \
 }
 
+/**
+ * @brief Connection statistics
+ */
+typedef struct {
+    uint32_t trials;        /*!< Number of sync trials made. */
+    uint32_t time_ms;       /*!< Time spent waiting for responses and between trials. */
+} esp_loader_connect_stats_t;
+
 /**
   * @brief Connects to the target
   *
@@ -108,6 +184,20 @@ typedef struct {
   */
 esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args);
 
+/**
+  * @brief Connects to the target and reports how long it took
+  *
+  * @param connect_args[in] Timing parameters to be used for connecting to target.
+  * @param stats[out]       Number of trials and time spent synchronizing, can be NULL.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_connect_with_stats(esp_loader_connect_args_t *connect_args,
+                                                 esp_loader_connect_stats_t *stats);
+
 /**
   * @brief   Returns attached target chip.
   *
@@ -118,6 +208,27 @@ esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args);
   */
 target_chip_t esp_loader_get_target(void);
 
+/**
+ * @brief Peripheral through which ROM loader of the target communicates
+ */
+typedef enum {
+    ESP_LOADER_CONSOLE_UART = 0,        /*!< UART, or the target cannot tell */
+    ESP_LOADER_CONSOLE_USB_OTG,         /*!< USB-OTG CDC of ESP32-S2 and ESP32-S3 */
+    ESP_LOADER_CONSOLE_USB_SERIAL_JTAG, /*!< USB-Serial/JTAG of ESP32-C3 and ESP32-S3 */
+} esp_loader_console_t;
+
+/**
+  * @brief   Returns console the ROM loader of attached target uses, as detected by esp_loader_connect().
+  *
+  * @note    Over USB, transmission rate has no meaning, so esp_loader_change_transmission_rate()
+  *          and esp_loader_negotiate_transmission_rate() only record the rate, without sending
+  *          any command. Over USB-OTG, blocks are limited to 2 KB, the size of the buffer
+  *          of the ROM CDC driver, in ROM and stub mode alike.
+  *
+  * @return  One of esp_loader_console_t
+  */
+esp_loader_console_t esp_loader_get_console(void);
+
 /**
   * @brief Initiates flash operation
   *
@@ -127,6 +238,7 @@ target_chip_t esp_loader_get_target(void);
   *
   * @note  image_size is size of the whole image, whereas, block_size is chunk of data sent
   *        to the target, each time esp_loader_flash_write function is called.
+  *        Region is erased as selected by esp_loader_flash_set_erase_strategy().
   *
   * @return
   *     - ESP_LOADER_SUCCESS Success
@@ -135,6 +247,27 @@ target_chip_t esp_loader_get_target(void);
   */
 esp_loader_error_t esp_loader_flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size);
 
+/**
+  * @brief Initiates flash operation with the largest block size accepted by the target
+  *
+  * Block size starts at the largest one supported by ROM loader, or by the flasher stub when it runs,
+  * limited by max_block_size. If the target rejects it with INVALID_COMMAND status,
+  * the block size is halved until it is accepted or drops below 256 bytes.
+  *
+  * @param offset[in]           Address from which flash operation will be performed.
+  * @param image_size[in]       Size of the whole binary to be loaded into flash.
+  * @param max_block_size[in]   Largest block size the host can provide to esp_loader_flash_write.
+  * @param block_size[out]      Block size to be used in subsequent calls to esp_loader_flash_write.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_INVALID_PARAM max_block_size is less than 256 bytes
+  */
+esp_loader_error_t esp_loader_flash_start_auto(uint32_t offset, uint32_t image_size,
+                                               uint32_t max_block_size, uint32_t *block_size);
+
 /**
   * @brief Initiates deflate flash operation
   *
@@ -161,15 +294,15 @@ esp_loader_error_t esp_loader_flash_defl_start(uint32_t offset, uint32_t image_s
   *
   * @note  size must not be greater that block_size supplied to previously called
   *        esp_loader_flash_start function. If size is less than block_size,
-  *        remaining bytes of payload buffer will be padded with 0xff.
-  *        Therefore, size of payload buffer has to be equal or greater than block_size.
+  *        the block is padded with 0xff on the fly. Payload is only read, so it
+  *        can point directly to an image in memory-mapped flash or mmap'd file.
   *
   * @return
   *     - ESP_LOADER_SUCCESS Success
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
   *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
   */
-esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size);
+esp_loader_error_t esp_loader_flash_write(const void *payload, uint32_t size);
 
 /**
   * @brief Writes supplied compressed data to target's flash memory.
@@ -178,16 +311,291 @@ esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size);
   * @param size[in]         Size of payload in bytes.
   *
   * @note  size must not be greater that block_size supplied to previously called
-  *        esp_loader_flash_defl_start function. If size is less than block_size,
-  *        remaining bytes of payload buffer will be padded with 0xff.
-  *        Therefore, size of payload buffer has to be equal or greater than block_size.
+  *        esp_loader_flash_defl_start function. Compressed blocks are sent as they are,
+  *        without padding. Payload is only read, so it can point directly to a compressed
+  *        image in memory-mapped flash or mmap'd file.
+  *
+  * @note  The zlib stream is followed block by block to learn how much data each block
+  *        inflates to, and the target is given time to erase and write that much only.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_defl_write(const void *payload, uint32_t size);
+
+/**
+  * @brief Returns error code reported by the target in the last response.
+  *
+  * @note  Useful to tell apart reasons of ESP_LOADER_ERROR_INVALID_RESPONSE result.
+  *
+  * @return  0 if the last response reported success, otherwise error code of ROM loader
+  *          or stub (i.e. 0x05 invalid command, 0x06 command failed, 0x07 invalid CRC).
+  */
+uint8_t esp_loader_get_last_rom_error(void);
+
+/**
+  * @brief Sets number of flash data blocks which can be in flight without being acknowledged.
+  *
+  * @param window[in]   Maximum number of unacknowledged blocks, 1 (default) waits for
+  *                     every block to be acknowledged before returning.
+  *
+  * @note  With window greater than 1, esp_loader_flash_write() and esp_loader_flash_defl_write()
+  *        return as soon as the block is sent, while the window is not full. Error of a block
+  *        is then reported by one of the subsequent calls, and the sequence number of the failed
+  *        block can be retrieved by esp_loader_flash_failed_sequence().
+  *        The target has to be able to receive further blocks while writing the previous one.
+  *        A ROM loader which does not buffer incoming packets requires window of 1.
+  */
+void esp_loader_flash_set_window(uint32_t window);
+
+/**
+ * @brief How the region is erased by esp_loader_flash_start()
+ */
+typedef enum {
+    ESP_LOADER_ERASE_REGION = 0,    /*!< Blocks the image occupies are erased by the begin command (default). */
+    ESP_LOADER_ERASE_BLOCKS,        /*!< Erased region is extended up to the next 64 KB boundary, so that
+                                         flash is erased by fast block erase instead of 4 KB sectors.
+                                         Data following the image up to the boundary are lost. */
+    ESP_LOADER_ERASE_DURING_WRITE,  /*!< Flasher stub only. Begin command does not wait for the erase,
+                                         stub erases ahead of the blocks as they arrive, so that erase
+                                         overlaps with the transfer. */
+    ESP_LOADER_ERASE_NONE,          /*!< Region is already erased, i.e. by esp_loader_flash_erase_chip(). */
+} esp_loader_erase_strategy_t;
+
+/**
+  * @brief Selects how esp_loader_flash_start() erases the region to be written.
+  *
+  * @param strategy[in]   One of esp_loader_erase_strategy_t.
+  *
+  * @note  esp_loader_flash_start() fails with ESP_LOADER_ERROR_UNSUPPORTED_FUNC when
+  *        ESP_LOADER_ERASE_DURING_WRITE is selected and flasher stub is not running.
+  *        esp_loader_flash_resume() erases the rest of the region even with ESP_LOADER_ERASE_NONE,
+  *        as the sector flashing failed in may be partially written. Compressed regions are
+  *        always erased the way the target does by default.
+  */
+void esp_loader_flash_set_erase_strategy(esp_loader_erase_strategy_t strategy);
+
+/**
+  * @brief Erases whole flash chip, faster than erasing most of it region by region.
+  *
+  * @note  Only supported by the flasher stub. Region flashed before cannot be resumed.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Flasher stub is not running
+  */
+esp_loader_error_t esp_loader_flash_erase_chip(void);
+
+/**
+  * @brief Erases region of flash.
+  *
+  * @param offset[in]   Start of the region, multiple of 4 KB.
+  * @param size[in]     Size of the region, multiple of 4 KB.
+  *
+  * @note  Only supported by the flasher stub.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Region is not sector aligned
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Flasher stub is not running
+  */
+esp_loader_error_t esp_loader_flash_erase_region(uint32_t offset, uint32_t size);
+
+/**
+  * @brief Waits until all flash data blocks in flight are acknowledged.
+  *
+  * @note  esp_loader_flash_finish(), esp_loader_flash_defl_finish() and
+  *        esp_loader_flash_verify() call this function implicitly.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_wait_pending(void);
+
+/**
+  * @brief Returns sequence number of the flash data block, acknowledgement of which failed last.
+  *
+  * @note  Sequence numbers start from zero for each esp_loader_flash_start() or
+  *        esp_loader_flash_defl_start() call.
+  */
+uint32_t esp_loader_flash_failed_sequence(void);
+
+/**
+  * @brief Resumes flashing of the region started by the last esp_loader_flash_start(),
+  *        i.e. once reconnected after a block failed.
+  *
+  * Blocks acknowledged by the target are kept. A new flash operation erases and writes
+  * the rest of the region, starting from the last sector boundary up to which all blocks
+  * were acknowledged, also with several blocks in flight. Subsequent esp_loader_flash_write() calls have to provide the image from
+  * the returned position on, with the same block size.
+  *
+  * @note  Digest of the written data is carried over, so esp_loader_flash_verify() checks
+  *        the whole region. With the STM32 HASH backend, whose state cannot be saved,
+  *        only the resumed part is verified. Compressed regions cannot be resumed.
+  *
+  * @param written[out] Bytes from the start of the image, which do not have to be written again.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_FAIL No region to be resumed
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_resume(uint32_t *written);
+
+/**
+ * @brief Called by esp_loader_poll() for each acknowledged flash data block.
+ *
+ * @param sequence_number[in]  Sequence number of the block.
+ * @param result[in]           ESP_LOADER_SUCCESS, or error reported for the block.
+ * @param arg[in]              Argument passed to esp_loader_set_ack_callback().
+ */
+typedef void (*esp_loader_ack_cb_t)(uint32_t sequence_number, esp_loader_error_t result, void *arg);
+
+/**
+  * @brief Sets function to be called when a flash data block written asynchronously
+  *        is acknowledged.
+  *
+  * @param callback[in] Callback, NULL to disable.
+  * @param arg[in]      Passed to the callback.
+  */
+void esp_loader_set_ack_callback(esp_loader_ack_cb_t callback, void *arg);
+
+/**
+ * @brief Progress of the region being flashed, reported to the callback set by
+ *        esp_loader_set_flash_progress_callback().
+ *
+ * @note  Times are derived from loader_port_remaining_time(), with its resolution.
+ *        Blocks of compressed streams count with the size they inflate to.
+ */
+typedef struct {
+    uint32_t bytes_acked;       /*!< Bytes of the region acknowledged by the target as written. */
+    uint32_t bytes_total;       /*!< Size of the region. */
+    uint32_t bytes_on_wire;     /*!< Bytes written to the port since the region was started, after encoding. */
+    uint32_t elapsed_ms;        /*!< Time since the region was started. */
+    uint32_t rate;              /*!< Bytes of the region acknowledged per second on average, 0 until measurable. */
+    uint32_t eta_ms;            /*!< Estimated time until the whole region is written, UINT32_MAX until measurable. */
+} esp_loader_flash_progress_t;
+
+typedef void (*esp_loader_flash_progress_cb_t)(const esp_loader_flash_progress_t *progress, void *arg);
+
+/**
+  * @brief Sets function to be called as blocks of the region being flashed are acknowledged.
+  *
+  * Callback is called from the write and poll functions, once at least granularity bytes
+  * were acknowledged since it was last called, and once the whole region is. It is
+  * called only between blocks, so that rendering of the progress does not stall the
+  * blocks in flight.
+  *
+  * @note  Resumed region reports bytes written before the interruption as acknowledged,
+  *        rate covers the resumed part only. Blocks of esp_loader_flash_defl_write()
+  *        count only where the stream can be followed, which ESP_LOADER_TINY does not.
+  *
+  * @param callback[in]     Callback, NULL to disable.
+  * @param granularity[in]  Bytes acknowledged between calls, 0 to be called for every block.
+  * @param arg[in]          Passed to the callback.
+  */
+void esp_loader_set_flash_progress_callback(esp_loader_flash_progress_cb_t callback, uint32_t granularity, void *arg);
+
+/**
+  * @brief Sends flash data block without waiting for any response.
+  *
+  * Same as esp_loader_flash_write(), except the block is only sent when less than
+  * window (see esp_loader_flash_set_window()) blocks are in flight. Otherwise nothing
+  * is sent and the same block has to be passed again after polling.
+  *
+  * @param payload[in]  Data to be flashed into target's memory.
+  * @param size[in]     Size of the payload in bytes.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Block was sent
+  *     - ESP_LOADER_IN_PROGRESS Window is full, block was not sent
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Payload is larger than block size
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Target reported error for a previous block
+  */
+esp_loader_error_t esp_loader_flash_write_async(const void *payload, uint32_t size);
+
+/**
+  * @brief Same as esp_loader_flash_write_async() for blocks of compressed data,
+  *        see esp_loader_flash_defl_write().
+  */
+esp_loader_error_t esp_loader_flash_defl_write_async(const void *payload, uint32_t size);
+
+/**
+  * @brief Processes responses to flash data blocks which have already been received,
+  *        without waiting for more.
+  *
+  * @note  Suitable to be called from the main loop of the host, or once the port is notified
+  *        of received data. loader_port_read_available() is called with zero timeout, so that
+  *        only data already buffered by the port are read. Timeout is measured from the last
+  *        block sent or acknowledged.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS All blocks were acknowledged
+  *     - ESP_LOADER_IN_PROGRESS Some blocks are still in flight
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Target reported error for a block
+  */
+esp_loader_error_t esp_loader_poll(void);
+
+/**
+  * @brief Initiates deflate flash operation, compressing data on the host.
+  *        Raw image data is then passed by esp_loader_flash_deflate_write(),
+  *        compressed and sent to the target in blocks of block_size bytes.
+  *
+  * @param offset[in]       Address from which flash operation will be performed.
+  * @param image_size[in]   Size of the whole uncompressed binary to be loaded into flash.
+  * @param block_size[in]   Size of compressed data blocks sent to the target.
+  * @param work[in]         Buffer used by the compressor, aligned to at least two bytes.
+  *                         Has to stay valid until esp_loader_flash_deflate_flush() returns.
+  * @param work_size[in]    Size of work buffer, at least ESP_LOADER_DEFLATE_WORK_SIZE(block_size).
+  *
+  * @note  Compressed size does not have to be known in advance. Target is told the upper bound
+  *        of number of compressed blocks, and detects end of data from the end of the zlib stream.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Work buffer is too small
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_deflate_start(uint32_t offset, uint32_t image_size, uint32_t block_size,
+                                                  void *work, uint32_t work_size);
+
+/**
+  * @brief Compresses supplied raw data and sends every completed block of compressed data.
+  *
+  * @param data[in]     Uncompressed data to be flashed into target's memory.
+  * @param size[in]     Size of data in bytes, any size is accepted.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_deflate_write(const void *data, uint32_t size);
+
+/**
+  * @brief Compresses remaining data, sends the last block and waits for all blocks to be acknowledged.
+  *
+  * @note  Afterwards, image can be verified by esp_loader_flash_verify() and the operation
+  *        ended by esp_loader_flash_defl_finish().
   *
   * @return
   *     - ESP_LOADER_SUCCESS Success
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
   *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
   */
-esp_loader_error_t esp_loader_flash_defl_write(void *payload, uint32_t size);
+esp_loader_error_t esp_loader_flash_deflate_flush(void);
 
 /**
   * @brief Ends flash operation.
@@ -232,6 +640,26 @@ esp_loader_error_t esp_loader_flash_defl_finish(bool reboot);
 esp_loader_error_t esp_loader_mem_start(uint32_t offset, uint32_t size, uint32_t block_size);
 
 
+/**
+  * @brief Initiates mem operation with the largest block size accepted by the target
+  *
+  * Same as esp_loader_mem_start, block size is chosen as in esp_loader_flash_start_auto.
+  *
+  * @param offset[in]           Address from which mem operation will be performed.
+  * @param size[in]             Size of the whole binary to be loaded into mem.
+  * @param max_block_size[in]   Largest block size the host can provide to esp_loader_mem_write.
+  * @param block_size[out]      Block size to be used in subsequent calls to esp_loader_mem_write.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_INVALID_PARAM max_block_size is less than 256 bytes
+  */
+esp_loader_error_t esp_loader_mem_start_auto(uint32_t offset, uint32_t size,
+                                             uint32_t max_block_size, uint32_t *block_size);
+
+
 /**
   * @brief Writes supplied data to target's mem memory.
   *
@@ -239,8 +667,9 @@ esp_loader_error_t esp_loader_mem_start(uint32_t offset, uint32_t size, uint32_t
   * @param size[in]         Size of data in bytes.
   *
   * @note  size must not be greater that block_size supplied to previously called
-  *        esp_loader_mem_start function. 
-  *        Therefore, size of data buffer has to be equal or greater than block_size.
+  *        esp_loader_mem_start function. Data are sent as they are, without padding.
+  *        Payload is only read, so it can point directly to an image in memory-mapped
+  *        flash or mmap'd file.
   *
   * @return
   *     - ESP_LOADER_SUCCESS Success
@@ -263,6 +692,77 @@ esp_loader_error_t esp_loader_mem_write(const void *payload, uint32_t size);
   */
 esp_loader_error_t esp_loader_mem_finish(uint32_t entrypoint);
 
+/**
+ * @brief Supplies the next part of the image loaded by esp_loader_load_ram_image().
+ *
+ * @param buffer[out]   Receives exactly size bytes following the previously read ones.
+ * @param size[in]      Number of bytes to read.
+ * @param arg[in]       Argument passed to esp_loader_load_ram_image().
+ *
+ * @return ESP_LOADER_SUCCESS to continue, anything else aborts loading and is returned.
+ */
+typedef esp_loader_error_t (*esp_loader_image_read_cb_t)(uint8_t *buffer, uint32_t size, void *arg);
+
+/**
+  * @brief Loads ESP image of a RAM application into target RAM and runs it.
+  *
+  * Header and segments are read from the callback as they are sent, so the host
+  * only needs a buffer for one block instead of a copy of the whole image.
+  * Blocks are kept in flight as set by esp_loader_flash_set_window, begin of the
+  * next segment is then sent without waiting for the blocks of the previous one.
+  *
+  * @param read[in]         Reads the image sequentially from its start.
+  * @param arg[in]          Passed to the callback.
+  * @param buffer[in]       Buffer for one block, its size limits the block size.
+  * @param buffer_size[in]  Size of the buffer, at least 256 bytes.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Not an ESP image or buffer too small
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_load_ram_image(esp_loader_image_read_cb_t read, void *arg,
+                                             uint8_t *buffer, uint32_t buffer_size);
+
+
+/**
+ * @brief Flasher stub image, i.e. as distributed with esptool in JSON format.
+ */
+typedef struct {
+    const uint8_t *text;    /*!< Code segment, loaded at text_addr. */
+    uint32_t text_addr;
+    uint32_t text_size;
+    const uint8_t *data;    /*!< Data segment, loaded at data_addr. Can be empty. */
+    uint32_t data_addr;
+    uint32_t data_size;
+    uint32_t entry;         /*!< Entry point of the stub. */
+} esp_loader_stub_t;
+
+/**
+  * @brief Loads flasher stub into target RAM and switches to communication with it.
+  *
+  * Once the stub greets the host, subsequent commands are handled by the stub instead
+  * of ROM loader. esp_loader_flash_start_auto then picks larger blocks, erase size of
+  * deflate flashing is exact and MD5 of flash is received in binary form.
+  *
+  * @note  Stub image has to match attached chip. Stub mode ends with the next
+  *        call of esp_loader_connect.
+  *
+  * @param stub[in]     Stub image to be loaded.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Stub did not start
+  */
+esp_loader_error_t esp_loader_run_stub(const esp_loader_stub_t *stub);
+
+/**
+  * @brief Returns whether flasher stub is running on the target.
+  */
+bool esp_loader_stub_running(void);
+
 
 /**
   * @brief Writes register.
@@ -291,33 +791,218 @@ esp_loader_error_t esp_loader_write_register(uint32_t address, uint32_t reg_valu
 esp_loader_error_t esp_loader_read_register(uint32_t address, uint32_t *reg_value);
 
 /**
-  * @brief Change baud rate.
+ * @brief Flash attached to the target.
+ */
+typedef struct {
+    uint32_t jedec_id;  /*!< Manufacturer, memory type and capacity bytes read by RDID command. */
+    uint32_t size;      /*!< Size of the flash in bytes. */
+} esp_loader_flash_info_t;
+
+/**
+  * @brief Returns flash attached to the target.
   *
-  * @note  Baud rate has to be also adjusted accordingly on host MCU, as
-  *        target's baud rate is changed upon return from this function.
+  * @note  Flash is detected once per connection, the result is reused by all flash
+  *        operations and by subsequent calls of this function.
   *
-  * @param transmission_rate[in]     new baud rate to be set.
+  * @param info[out]    Flash information.
   *
   * @return
   *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_CHIP Flash size could not be determined
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
   *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
-  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
   */
-esp_loader_error_t esp_loader_change_transmission_rate(uint32_t transmission_rate);
+esp_loader_error_t esp_loader_get_flash_info(esp_loader_flash_info_t *info);
 
 /**
-  * @brief Verify target's flash integrity by checking MD5.
-  *        MD5 checksum is computed from data pushed to target's memory by calling
-  *        esp_loader_flash_write() function and compared against target's MD5.
-  *        Target computes checksum based on offset and image_size passed to
-  *        esp_loader_flash_start() function.
-  *
-  * @note  This function is only available if MD5_ENABLED is set.
-  *
-  * @return
-  *     - ESP_LOADER_SUCCESS Success
-  *     - ESP_LOADER_ERROR_INVALID_MD5 MD5 does not match
+  * @brief Discards flash information detected earlier, so that the flash is detected
+  *        and configured again by the next flash operation, i.e. after it was replaced.
+  */
+void esp_loader_invalidate_flash_info(void);
+
+/**
+ * @brief Register operation of esp_loader_register_batch().
+ */
+typedef struct {
+    uint32_t address;   /*!< Address of register. */
+    uint32_t value;     /*!< Value to be written, or value read when write is false. */
+    bool write;         /*!< Whether to write or read the register. */
+} esp_loader_reg_op_t;
+
+/**
+  * @brief Reads and writes registers in the given order, without waiting for the response
+  *        to each command before sending the next one.
+  *
+  * @param ops[inout]   Operations, read values are stored in them.
+  * @param count[in]    Number of operations.
+  *
+  * @note  Only a few commands are in flight at a time, for the target not to lose any.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_register_batch(esp_loader_reg_op_t *ops, uint32_t count);
+
+/**
+  * @brief Reads consecutive 32-bit registers, without waiting for the response to each
+  *        command before sending the next one.
+  *
+  * @param address[in]  Address of the first register.
+  * @param count[in]    Number of registers.
+  * @param values[out]  Values read, count of them.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_read_registers(uint32_t address, uint32_t count, uint32_t *values);
+
+/* eFuse words kept in a snapshot */
+#define ESP_LOADER_EFUSE_SNAPSHOT_WORDS 8
+
+/**
+ * @brief Identification of the target decoded from its eFuses.
+ */
+typedef struct {
+    uint8_t mac[6];             /*!< Factory MAC address, most significant byte first. */
+    uint32_t chip_revision;     /*!< Major revision * 100 + minor revision, e.g. 301 for v3.1. */
+    uint32_t package;           /*!< Package version field. */
+    uint32_t flash_cap;         /*!< Embedded flash field, 0 if the chip has none. */
+    uint32_t psram_cap;         /*!< Embedded PSRAM field, 0 if the chip has none. */
+    uint32_t efuse_address;     /*!< Address of the first word of efuse. */
+    uint32_t efuse[ESP_LOADER_EFUSE_SNAPSHOT_WORDS]; /*!< eFuse words the fields were decoded from. */
+} esp_loader_efuse_snapshot_t;
+
+/**
+  * @brief Returns identification of the target, read from its eFuses in one burst of
+  *        register reads.
+  *
+  * @note  eFuses are read once per connection, the result is returned by subsequent calls
+  *        without communicating with the target. Fields are encoded as by the eFuse table of
+  *        the chip, only the MAC address and revision have the same meaning on all chips.
+  *
+  * @param snapshot[out] Identification of the target.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_CHIP eFuses of the target cannot be decoded
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_get_efuse_snapshot(esp_loader_efuse_snapshot_t *snapshot);
+
+/**
+  * @brief Change baud rate.
+  *
+  * @note  Baud rate has to be also adjusted accordingly on host MCU, as
+  *        target's baud rate is changed upon return from this function.
+  *
+  * @param transmission_rate[in]     new baud rate to be set.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+esp_loader_error_t esp_loader_change_transmission_rate(uint32_t transmission_rate);
+
+/**
+  * @brief Switches to the fastest of candidate transmission rates the link is stable at.
+  *
+  * Candidates faster than current_rate are tried fastest first. For each, the target and
+  * then the port (loader_port_change_transmission_rate) are switched and the link is
+  * checked with a few register reads. If the check fails, both sides return to the
+  * previous rate and the next candidate is tried. If none is stable, current_rate is kept.
+  *
+  * @param rates[in]                Candidate rates, ordered from the fastest one.
+  *                                 Array has to stay valid for esp_loader_lower_transmission_rate.
+  * @param count[in]                Number of candidates.
+  * @param current_rate[in]         Rate the connection was established at.
+  * @param transmission_rate[out]   Rate used from now on.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+esp_loader_error_t esp_loader_negotiate_transmission_rate(const uint32_t *rates, uint32_t count,
+                                                          uint32_t current_rate, uint32_t *transmission_rate);
+
+/**
+  * @brief Drops to the next slower stable rate after esp_loader_negotiate_transmission_rate.
+  *
+  * Meant to be called after repeated timeouts or checksum errors, i.e. mid-flash,
+  * before the failed region is started again. Candidates slower than the rate in use are
+  * tried, ending with the rate the connection was established at.
+  *
+  * @param transmission_rate[out]   Rate used from now on.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_FAIL No slower rate is stable
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Rates were not negotiated
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  */
+esp_loader_error_t esp_loader_lower_transmission_rate(uint32_t *transmission_rate);
+
+/**
+ * @brief Receives flash contents read by esp_loader_flash_read().
+ *
+ * @param data[in]  Next part of the contents, valid only during the call.
+ * @param size[in]  Size of the part in bytes.
+ * @param arg[in]   Argument passed to esp_loader_flash_read().
+ *
+ * @return ESP_LOADER_SUCCESS to continue, anything else aborts the read and is returned.
+ */
+typedef esp_loader_error_t (*esp_loader_read_cb_t)(const uint8_t *data, uint32_t size, void *arg);
+
+/**
+  * @brief Streams contents of flash to the callback.
+  *
+  * Target sends packets of block_size bytes, keeping at most max_in_flight of them
+  * unacknowledged, so the host only needs a buffer for one packet. When MD5_ENABLED
+  * is set, digest of the received data is compared against the one computed by target.
+  *
+  * @note  Requires flasher stub, see esp_loader_run_stub().
+  *
+  * @param address[in]          Flash address to read from.
+  * @param length[in]           Number of bytes to read.
+  * @param buffer[in]           Buffer of at least block_size bytes for one packet.
+  * @param block_size[in]       Size of the packets, i.e. 4096.
+  * @param max_in_flight[in]    Packets target can send ahead, limited by how much data
+  *                             the port can buffer while the callback runs.
+  * @param callback[in]         Receives the contents.
+  * @param arg[in]              Passed to the callback.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Invalid block size or buffer
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Flasher stub is not running
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Data do not match digest computed by target
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_flash_read(uint32_t address, uint32_t length, uint8_t *buffer,
+                                         uint32_t block_size, uint32_t max_in_flight,
+                                         esp_loader_read_cb_t callback, void *arg);
+
+/**
+  * @brief Verify target's flash integrity by checking MD5.
+  *        MD5 checksum is computed from data pushed to target's memory by calling
+  *        esp_loader_flash_write() function and compared against target's MD5.
+  *        Target computes checksum based on offset and image_size passed to
+  *        esp_loader_flash_start() function.
+  *
+  * @note  This function is only available if MD5_ENABLED is set.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_MD5 MD5 does not match
   *     - ESP_LOADER_ERROR_TIMEOUT Timeout
   *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
   *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
@@ -342,12 +1027,547 @@ esp_loader_error_t esp_loader_flash_verify(void);
 esp_loader_error_t esp_loader_get_md5_hex(uint32_t startAddress, uint32_t length, uint8_t expected_md5_hex[32]);
 #endif
 
+/**
+ * @brief Flash range checked by esp_loader_flash_audit()
+ */
+typedef struct {
+    uint32_t address;       /*!< Flash address of the range. */
+    uint32_t length;        /*!< Size of the range in bytes. */
+    uint8_t md5[16];        /*!< Expected digest of the range. */
+    bool matches;           /*!< Set when the digest computed by the target equals the expected one. */
+} esp_loader_audit_region_t;
+
+/**
+  * @brief Compares digests of flash ranges with expected ones, without writing anything.
+  *
+  * Flash size is detected once per connection, MD5 command of the next range is sent while
+  * the target computes digest of the current one and each waits only as long as its size needs.
+  *
+  * @param regions[inout]   Ranges and their expected digests, matches is set for each of them.
+  * @param count[in]        Number of ranges.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS All ranges match
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Some ranges do not match, see matches of each
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Range exceeds flash, nothing was checked
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+esp_loader_error_t esp_loader_flash_audit(esp_loader_audit_region_t *regions, uint32_t count);
+
+/**
+ * @brief Differential flashing arguments
+ */
+typedef struct {
+    uint32_t offset;        /*!< Flash address of the image, aligned to 4 KiB sector. */
+    const uint8_t *data;    /*!< Whole image to be flashed. */
+    uint32_t size;          /*!< Size of the image in bytes. */
+    uint32_t region_size;   /*!< Granularity of comparison (i.e. 4 KiB sector or 64 KiB block).
+                                 Has to be multiple of sector size and of block_size. */
+    uint32_t block_size;    /*!< Size of data blocks sent to the target. */
+} esp_loader_flash_sync_args_t;
+
+/**
+ * @brief Differential flashing statistics
+ */
+typedef struct {
+    uint32_t bytes_skipped;     /*!< Image bytes already present on the target, not rewritten. */
+    uint32_t bytes_written;     /*!< Image bytes erased and written. */
+    uint32_t ranges_written;    /*!< Number of flash operations needed to write differing regions. */
+} esp_loader_flash_sync_stats_t;
+
+/**
+  * @brief Flashes only those regions of the image, which differ from target's flash contents.
+  *        Image is split into regions of region_size bytes, MD5 of each is compared with one
+  *        computed by target, and consecutive differing regions are erased, written and verified
+  *        together.
+  *
+  * @note  This function is only available if MD5_ENABLED is set.
+  *
+  * @param args[in]     Image and its layout.
+  * @param stats[out]   Number of bytes skipped and written.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Misaligned offset or region size
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit into flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Written data could not be verified
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Unsupported on the target
+  */
+#ifdef MD5_ENABLED
+esp_loader_error_t esp_loader_flash_sync(const esp_loader_flash_sync_args_t *args,
+                                         esp_loader_flash_sync_stats_t *stats);
+#endif
+
+/* Maximum number of regions of one flashing job. */
+#ifndef ESP_LOADER_JOB_MAX_REGIONS
+#define ESP_LOADER_JOB_MAX_REGIONS 16
+#endif
+
+/**
+ * @brief Image flashed as part of a flashing job
+ */
+typedef struct {
+    uint32_t address;       /*!< Flash address, aligned to 4 KiB sector. */
+    const uint8_t *data;    /*!< Content of the region. */
+    uint32_t size;          /*!< Size of the region in bytes. */
+    bool compress;          /*!< Deflate the region while sending it. */
+} esp_loader_region_t;
+
+/**
+ * @brief Reports progress of a long running operation.
+ *
+ * @param done[in]     Bytes of the images processed so far.
+ * @param total[in]    Bytes of all images of the operation.
+ * @param arg[in]      Argument provided along with the callback.
+ */
+typedef void (*esp_loader_progress_cb_t)(uint32_t done, uint32_t total, void *arg);
+
+/**
+ * @brief Flashing job covering several regions, i.e. bootloader, partition table and application
+ */
+typedef struct {
+    const esp_loader_region_t *regions; /*!< Regions in any order, must not overlap. */
+    uint32_t region_count;      /*!< Number of regions, at most ESP_LOADER_JOB_MAX_REGIONS. */
+    uint8_t *buffer;            /*!< Buffer of the flash block size, used for blocks spanning two regions.
+                                     Needed if any region is not compressed. */
+    uint32_t buffer_size;       /*!< Size of the buffer, the largest block size to be used. */
+    void *work;                 /*!< Work area of the compressor, needed if any region is compressed. */
+    uint32_t work_size;         /*!< Size of the work area, at least ESP_LOADER_DEFLATE_WORK_SIZE(deflate_block_size). */
+    uint32_t deflate_block_size;/*!< Size of compressed blocks sent to the target. */
+    bool verify;                /*!< Verify MD5 of all written data once everything is written. */
+    esp_loader_progress_cb_t progress;  /*!< Called after each block, NULL if not needed. */
+    void *progress_arg;         /*!< Passed to the progress callback. */
+} esp_loader_flash_job_t;
+
+/**
+  * @brief Flashes all regions of the job with as few erase and verify operations as possible.
+  *
+  * Regions are sorted by address. Neighbouring regions of the same kind, which share a sector
+  * or are separated by less than one, are erased and written by a single flash operation,
+  * with the gap between them filled by 0xFF. Digests of the written data are computed while
+  * blocks are in flight. Verification of all segments is requested behind the blocks of the
+  * last one still in flight, so that the target starts on it once it wrote them.
+  *
+  * @note  Verification is only available if MD5_ENABLED is set.
+  *
+  * @param job[in]  Regions and resources of the job.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Overlapping or misaligned regions, missing buffer
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Region does not fit into flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Written data could not be verified
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Verification unsupported on the target
+  */
+esp_loader_error_t esp_loader_flash_job(const esp_loader_flash_job_t *job);
+
+/**
+ * @brief Image compressed and hashed in advance by esp_loader_artifact_build()
+ *
+ * Artifact starts with a header holding the uncompressed size and MD5 of the image, followed by
+ * a table of segments, each compressed independently and described by its offset, compressed size
+ * and MD5 of its uncompressed data. Each segment is stored as frames of one compressed block
+ * preceded by its size and the uncompressed size it inflates to. All fields are little-endian.
+ * Artifacts can be stored in a file or flash of the host and flashed to any number of targets.
+ */
+typedef struct {
+    const uint8_t *image;   /*!< Image to be compressed. */
+    uint32_t image_size;    /*!< Size of the image in bytes. */
+    uint32_t block_size;    /*!< Size of compressed blocks sent to the target. */
+    uint32_t segment_size;  /*!< Image bytes compressed independently, multiple of 4 KiB sector, so that
+                                 segments can be skipped when flashing. 0 to compress the image as a whole. */
+    void *work;             /*!< Work area of the compressor. */
+    uint32_t work_size;     /*!< Size of the work area, at least ESP_LOADER_DEFLATE_WORK_SIZE(block_size). */
+} esp_loader_artifact_build_args_t;
+
+/**
+  * @brief Returns size of the buffer esp_loader_artifact_build() needs in the worst case.
+  */
+uint32_t esp_loader_artifact_size_bound(uint32_t image_size, uint32_t block_size, uint32_t segment_size);
+
+/**
+  * @brief Compresses and hashes image into an artifact.
+  *
+  * @note  This function is only available if MD5_ENABLED is set.
+  *
+  * @param args[in]             Image and its layout.
+  * @param artifact[out]        Buffer for the artifact, esp_loader_artifact_size_bound() bytes are always enough.
+  * @param size[in]             Size of the buffer.
+  * @param artifact_size[out]   Size of the artifact.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Invalid layout, missing work area or too small buffer
+  */
+#ifdef MD5_ENABLED
+esp_loader_error_t esp_loader_artifact_build(const esp_loader_artifact_build_args_t *args,
+                                             uint8_t *artifact, uint32_t size, uint32_t *artifact_size);
+#endif
+
+/**
+ * @brief Artifact flashing arguments
+ */
+typedef struct {
+    uint32_t offset;            /*!< Flash address of the image, aligned to 4 KiB sector. */
+    const uint8_t *artifact;    /*!< Artifact made by esp_loader_artifact_build(). */
+    uint32_t size;              /*!< Size of the artifact in bytes. */
+    bool skip_unchanged;        /*!< Segments whose MD5 matches the flash contents are not written. */
+    bool verify;                /*!< Written segments are verified against MD5 of the artifact. */
+} esp_loader_artifact_flash_args_t;
+
+/**
+  * @brief Flashes artifact, sending its compressed blocks as they are stored.
+  *
+  * Each segment written takes its own compressed stream, so that segments equal to the flash
+  * contents can be skipped. Digests stored in the artifact are compared against ones computed
+  * by the target, blocks are neither compressed, inflated nor hashed by the host.
+  *
+  * @note  skip_unchanged and verify are only available if MD5_ENABLED is set.
+  *
+  * @param args[in]     Artifact and where to flash it.
+  * @param stats[out]   Number of bytes skipped and written, NULL if not needed. Each segment
+  *                     written counts as one range.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Malformed artifact or misaligned offset
+  *     - ESP_LOADER_ERROR_IMAGE_SIZE Image does not fit into flash
+  *     - ESP_LOADER_ERROR_INVALID_MD5 Written data could not be verified
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Digests requested, but unsupported on the target
+  */
+esp_loader_error_t esp_loader_flash_artifact(const esp_loader_artifact_flash_args_t *args,
+                                             esp_loader_flash_sync_stats_t *stats);
+
+/**
+  * @brief Sets buffer into which whole command frames are SLIP encoded,
+  *        so that each command is handed to loader_port_write() in a single call.
+  *
+  * @param buffer[in]   Buffer used for framing, NULL to write frames piece by piece again.
+  * @param size[in]     Size of the buffer in bytes.
+  *
+  * @note  Buffer has to stay valid until it is replaced or unset. Use ESP_LOADER_TX_BUFFER_SIZE()
+  *        to size it for the largest block passed to the write functions. Frames which do not fit
+  *        are still sent piece by piece.
+  */
+void esp_loader_set_tx_buffer(uint8_t *buffer, uint32_t size);
+
 /**
   * @brief Toggles reset pin.
   */
 void esp_loader_reset_target(void);
 
+/**
+ * @brief Hold times of the reset sequence, as measured for a board
+ */
+typedef struct {
+    uint32_t reset_hold_ms; /*!< Time the reset pin is asserted. */
+    uint32_t boot_hold_ms;  /*!< Time the boot pin stays asserted after reset is released,
+                                 until the chip samples its strapping pins. */
+} esp_loader_reset_timing_t;
+
+/**
+  * @brief Sets hold times the port applies when resetting the target of the current context.
+  *
+  * @param timing[in]   Hold times of the board, NULL for SERIAL_FLASHER_RESET_HOLD_TIME_MS
+  *                     and SERIAL_FLASHER_BOOT_HOLD_TIME_MS.
+  *
+  * @note  Board with an RC delay on its reset line needs longer times than the chip itself.
+  *        Shortest times, with which esp_loader_connect_with_stats() still succeeds at the first
+  *        trial, can be measured once per board design and kept as its profile.
+  */
+void esp_loader_set_reset_timing(const esp_loader_reset_timing_t *timing);
+
+/**
+  * @brief Returns hold times of the reset sequence of the current context, to be applied by
+  *        the enter_bootloader and reset_target functions of the port.
+  *
+  * @param timing[out]  Hold times.
+  */
+void esp_loader_get_reset_timing(esp_loader_reset_timing_t *timing);
+
+/**
+  * @brief Resets connected target by its RTC control register and connects again to its ROM loader,
+  *        without toggling reset and boot pins.
+  *
+  * Chip is told to boot into ROM loader regardless of its strapping pins. Flasher stub and
+  * transmission rate are lost with the reset. Host port returns to the rate the target was
+  * connected with if the rate was set by esp_loader_negotiate_transmission_rate(), otherwise
+  * the caller restores it before synchronization times out.
+  *
+  * @note  Only supported by ESP32-S2 and ESP32-S3 with UART console.
+  *
+  * @param connect_args[in] Timing parameters of synchronization with restarted ROM loader.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Target cannot be reset into ROM loader this way
+  */
+esp_loader_error_t esp_loader_soft_reset_to_loader(esp_loader_connect_args_t *connect_args);
+
+/**
+  * @brief Resets connected target into its application, without toggling reset and boot pins.
+  *
+  * Chips which can be reset by their RTC control register, as by esp_loader_soft_reset_to_loader(),
+  * are reset that way. Others are rebooted by the loader, as by esp_loader_flash_finish().
+  * The context is left as before esp_loader_connect(), with the port at the rate it was connected with.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout
+  *     - ESP_LOADER_ERROR_INVALID_RESPONSE Internal error
+  */
+esp_loader_error_t esp_loader_soft_reset_to_run(void);
+
+#ifdef STATS_ENABLED
+/**
+ * @brief Measurement of one command, reported to the callback set by esp_loader_set_stats_callback().
+ *
+ * Data packets, acknowledgement of which is received later, are reported once when sent
+ * and once more when acknowledged, with zero size.
+ */
+typedef struct {
+    uint8_t command;            /*!< Opcode of the command, i.e. 0x03 for FLASH_DATA. */
+    uint32_t size;              /*!< Size of the command and its data, before SLIP encoding. */
+    uint32_t send_time_ms;      /*!< Time spent handing the command over to the port. */
+    uint32_t wait_time_ms;      /*!< Time spent waiting for the response and decoding it. */
+    esp_loader_error_t result;  /*!< Result of the command. */
+} esp_loader_command_stats_t;
+
+/**
+ * @brief Counters of communication with the target, since the last esp_loader_reset_stats().
+ *
+ * @note  Times are derived from loader_port_remaining_time(), with its resolution.
+ */
+typedef struct {
+    uint32_t commands;          /*!< Commands sent, including data packets. */
+    uint32_t payload_bytes;     /*!< Bytes of commands sent, before SLIP encoding. */
+    uint32_t wire_bytes;        /*!< Bytes written to the port, after SLIP encoding. */
+    uint32_t received_bytes;    /*!< Bytes read from the port. */
+    uint32_t retries;           /*!< Connection trials, block sizes and transmission rates retried. */
+    uint32_t erase_time_ms;     /*!< Time the target took to erase the region of the last flash start. */
+    uint32_t region_size;       /*!< Size of the last region started to be flashed. */
+    uint32_t region_time_ms;    /*!< Time spent communicating from start to finish of the region. */
+} esp_loader_stats_t;
+
+typedef void (*esp_loader_stats_cb_t)(const esp_loader_command_stats_t *stats, void *arg);
+
+/**
+  * @brief Sets function to be called after each command, i.e. to collect latency per opcode.
+  *
+  * @param callback[in] Callback, NULL to disable.
+  * @param arg[in]      Passed to the callback.
+  */
+void esp_loader_set_stats_callback(esp_loader_stats_cb_t callback, void *arg);
+
+/**
+  * @brief Retrieves counters of communication with the target.
+  *
+  * @note  Effective throughput of the last region is region_size / region_time_ms
+  *        once the region is finished.
+  *
+  * @param stats[out]   Counters.
+  */
+void esp_loader_get_stats(esp_loader_stats_t *stats);
+
+/**
+  * @brief Clears all counters.
+  */
+void esp_loader_reset_stats(void);
+#endif
+
+/**
+ * @brief Protocol events recorded into the trace ring.
+ */
+typedef enum {
+    ESP_LOADER_TRACE_COMMAND,       /*!< Command sent, size before encoding. */
+    ESP_LOADER_TRACE_DATA,          /*!< Data packet sent, size of its data, value is sequence number. */
+    ESP_LOADER_TRACE_RESPONSE,      /*!< Response decoded, size stored, value, status and error bytes as received.
+                                         Responses not matching the awaited command are recorded too. */
+    ESP_LOADER_TRACE_FAILURE,       /*!< Response to command was not received, error is esp_loader_error_t. */
+    ESP_LOADER_TRACE_FRAME,         /*!< Frame without command header received, i.e. flash data read back. */
+    ESP_LOADER_TRACE_FRAME_SKIPPED, /*!< Frame too short to be the awaited response was dropped. */
+} esp_loader_trace_event_t;
+
+/**
+ * @brief Entry of the trace ring, without padding, so that entries can be stored as they are
+ *        and replayed offline.
+ */
+typedef struct {
+    uint32_t time_ms;           /*!< Time of the event, derived from loader_port_remaining_time(). */
+    uint8_t event;              /*!< One of esp_loader_trace_event_t. */
+    uint8_t command;            /*!< Opcode of the command. */
+    uint8_t status;             /*!< Failed byte of the response. */
+    uint8_t error;              /*!< Error byte of the response, or esp_loader_error_t of the failure. */
+    uint32_t size;              /*!< Bytes of the event, see esp_loader_trace_event_t. */
+    uint32_t value;             /*!< Value of the response or sequence number of the data packet. */
+} esp_loader_trace_entry_t;
+
+/**
+  * @brief Sets ring into which commands, responses and failures are recorded.
+  *
+  * Recording takes a few stores per command, contents of the frames are not kept,
+  * so that tracing does not change timing of the communication.
+  *
+  * @param entries[in]  Ring of entries, has to stay valid until replaced. NULL to stop tracing.
+  * @param count[in]    Number of entries, oldest events are overwritten once they are used up.
+  */
+void esp_loader_set_trace_buffer(esp_loader_trace_entry_t *entries, uint32_t count);
+
+/**
+  * @brief Copies recorded events, i.e. to be stored after a failure.
+  *
+  * @param entries[out] Events, oldest first.
+  * @param count[in]    Capacity of entries, the most recent events are copied if there are more.
+  *
+  * @return Number of events copied.
+  */
+uint32_t esp_loader_get_trace(esp_loader_trace_entry_t *entries, uint32_t count);
+
+/**
+ * @brief State of communication with one target.
+ */
+typedef struct esp_loader esp_loader_t;
+
+struct esp_loader_port_ops;
+
+/**
+ * @brief RAM taken by the library, excluding buffers passed by the caller
+ */
+typedef struct {
+    uint32_t context_size;          /*!< Size of one loader context */
+    uint32_t static_size;           /*!< Default context and the pool of ESP_LOADER_MAX_CONTEXTS */
+    uint32_t rx_buffer_size;        /*!< Part of each context buffering received bytes */
+    uint32_t hash_state_size;       /*!< Part of each context taken by MD5 state */
+    uint32_t inflate_state_size;    /*!< Part of each context following compressed streams,
+                                         0 with ESP_LOADER_TINY */
+} esp_loader_footprint_t;
+
+/**
+  * @brief Reports RAM used by the library as built.
+  *
+  * @param footprint[out]   Sizes in bytes.
+  *
+  * @note  Build fails if static_size exceeds ESP_LOADER_RAM_BUDGET, where defined.
+  */
+void esp_loader_get_footprint(esp_loader_footprint_t *footprint);
 
+/**
+  * @brief Creates loader context communicating through given port, so that
+  *        multiple targets can be flashed at the same time.
+  *
+  * @param ops[in]       Port functions, have to stay valid until the context is destroyed.
+  * @param port_arg[in]  Passed to each of the port functions.
+  * @param loader[out]   Created context.
+  *
+  * @note  Contexts are taken from a pool of ESP_LOADER_MAX_CONTEXTS entries. Free entry is
+  *        claimed atomically, so contexts can be created and destroyed from several threads.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Required port function is missing
+  *     - ESP_LOADER_ERROR_FAIL No free context is left
+  */
+esp_loader_error_t esp_loader_create(const struct esp_loader_port_ops *ops, void *port_arg,
+                                     esp_loader_t **loader);
+
+/**
+  * @brief Creates loader context in memory provided by the caller, i.e. a static buffer
+  *        of a device whose RAM is too small to keep a pool of contexts.
+  *
+  * @param arena[in]     Memory the context is placed in, of any alignment. It has to stay
+  *                      valid until the context is destroyed.
+  * @param size[in]      Size of the arena, at least ESP_LOADER_CONTEXT_SIZE.
+  * @param ops[in]       Port functions, have to stay valid until the context is destroyed.
+  * @param port_arg[in]  Passed to each of the port functions.
+  * @param loader[out]   Created context.
+  *
+  * @note  Works regardless of ESP_LOADER_MAX_CONTEXTS, the context is not taken from the pool.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Required port function is missing or arena is too small
+  */
+esp_loader_error_t esp_loader_create_in(void *arena, size_t size, const struct esp_loader_port_ops *ops,
+                                        void *port_arg, esp_loader_t **loader);
+
+/**
+  * @brief Returns context to the pool, or releases the arena it was created in.
+  *
+  * @param loader[in]    Context to be destroyed, it must not be selected by any thread.
+  */
+void esp_loader_destroy(esp_loader_t *loader);
+
+/**
+  * @brief Selects context on which the functions of this API operate in the calling thread.
+  *
+  * @param loader[in]    Context to be selected, NULL for the default one.
+  *
+  * @note  Selection is per thread on Linux and macOS, where each thread can drive its own
+  *        target. Elsewhere it is global, set ESP_LOADER_THREAD_LOCAL to the thread local
+  *        storage specifier of the toolchain to change that.
+  */
+void esp_loader_select(esp_loader_t *loader);
+
+#ifndef ESP_LOADER_GANG_MAX_LAG
+#define ESP_LOADER_GANG_MAX_LAG 8
+#endif
+
+/**
+ * @brief Size of one block of the given size encoded for the wire, with every byte escaped
+ */
+#define ESP_LOADER_GANG_FRAME_SIZE(block_size) ESP_LOADER_TX_BUFFER_SIZE(block_size)
+
+/**
+ * @brief Image flashed to several targets at once by esp_loader_gang_flash()
+ */
+typedef struct {
+    esp_loader_t *const *loaders;   /*!< Connected targets, NULL for the default context. */
+    uint32_t count;                 /*!< Number of targets. */
+    uint32_t offset;                /*!< Flash address the image is written to on every target. */
+    const uint8_t *image;           /*!< Image to be written. */
+    uint32_t size;                  /*!< Size of the image in bytes. */
+    uint32_t block_size;            /*!< Size of the blocks sent to the targets. */
+    uint8_t *frames;                /*!< Ring of encoded blocks, shared by all targets. */
+    uint32_t frames_size;           /*!< At least lag * ESP_LOADER_GANG_FRAME_SIZE(block_size) bytes. */
+    uint32_t lag;                   /*!< Blocks the target furthest behind may trail the one furthest
+                                         ahead, 1 to ESP_LOADER_GANG_MAX_LAG. */
+    bool verify;                    /*!< Verify MD5 of the image on every target once it is written. */
+} esp_loader_gang_flash_args_t;
+
+/**
+  * @brief Writes the same image to several targets, encoding and hashing each block only once.
+  *
+  * Begin command is sent to all targets before any of their responses is waited for, so that all
+  * of them erase at once. Each block is then encoded into the ring of frames once and the encoded
+  * frame is written to the port of every target. Acknowledgements are collected from each target
+  * separately, up to its window set by esp_loader_flash_set_window(), so that targets acknowledging
+  * slower than others may fall behind by up to lag blocks before the others wait for them. Target
+  * failing at any point is dropped from the gang with its error, while the others carry on.
+  *
+  * @note  Targets stay in the loader, esp_loader_flash_finish() can be called on each of them.
+  *        Region written by the gang cannot be resumed by esp_loader_flash_resume().
+  *        Verification is only available if MD5_ENABLED is set.
+  *
+  * @param args[in]      Targets, image and resources of the gang.
+  * @param results[out]  Result of each target, ESP_LOADER_SUCCESS or the error it was dropped with.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS All targets were written
+  *     - ESP_LOADER_ERROR_FAIL Some of the targets failed, as reported in results
+  *     - ESP_LOADER_ERROR_INVALID_PARAM Missing image or too small ring of frames
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC Verification is not available
+  */
+esp_loader_error_t esp_loader_gang_flash(const esp_loader_gang_flash_args_t *args, esp_loader_error_t *results);
 
 #ifdef __cplusplus
 }
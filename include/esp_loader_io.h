@@ -16,6 +16,7 @@
  #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "esp_loader.h"
 
 #ifdef __cplusplus
@@ -30,6 +31,11 @@ esp_loader_error_t loader_port_change_transmission_rate(uint32_t transmission_ra
 /**
   * @brief Writes data over the io interface.
   *
+  * @note  Transmission of the data has to be started before the function returns. Ports which
+  *        buffer written data, i.e. for DMA, may send it in the background, but must not hold it
+  *        back until the next write or read: commands without response, like the one resetting
+  *        the target, are followed by neither.
+  *
   * @param data[in]     Buffer with data to be written.
   * @param size[in]     Size of data in bytes.
   * @param timeout[in]  Timeout in milliseconds.
@@ -53,6 +59,25 @@ esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_
   */
 esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeout);
 
+/**
+  * @brief Reads data which is already available from the io interface.
+  *        Waits for at least one byte, then returns as many bytes as are available,
+  *        up to the given size, without waiting for the rest.
+  *
+  * @note  Implementing this function is optional. Weak default implementation
+  *        reads one byte at a time by calling loader_port_read().
+  *
+  * @param data[out]        Buffer into which received data will be written.
+  * @param size[in]         Maximum number of bytes to read.
+  * @param bytes_read[out]  Number of bytes actually read.
+  * @param timeout[in]      Timeout in milliseconds.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_TIMEOUT Timeout elapsed before any data was received
+  */
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout);
+
 /**
   * @brief Delay in milliseconds.
   *
@@ -100,6 +125,86 @@ void loader_port_reset_target(void);
   */
 void loader_port_debug_print(const char *str);
 
+/**
+ * @brief How frames of the loader protocol are delimited by a port
+ */
+typedef enum {
+    ESP_LOADER_FRAMING_SLIP = 0,    /*!< SLIP encoded, as ROM loaders and the stub expect over UART and USB (default) */
+    ESP_LOADER_FRAMING_PACKET,      /*!< Sent and received as they are, for transports which carry each frame
+                                         as a packet of their own, such as the SPI slave download mode of ROM.
+                                         Frames are delimited by the size in their command or response header. */
+} esp_loader_framing_t;
+
+/**
+ * @brief Port of a loader context created by esp_loader_create().
+ *
+ * Each member has the meaning of the loader_port_* function of the same name, with
+ * port_arg passed to esp_loader_create() as the first argument. Members marked as
+ * optional can be NULL.
+ *
+ * With ESP_LOADER_FRAMING_PACKET, each frame is written by one or more calls of write(),
+ * the first of which carries the whole header of the frame. read() and read_available()
+ * return bytes of the received frames in order.
+ */
+typedef struct esp_loader_port_ops {
+    esp_loader_error_t (*write)(void *arg, const uint8_t *data, uint16_t size, uint32_t timeout);
+    esp_loader_error_t (*read)(void *arg, uint8_t *data, uint16_t size, uint32_t timeout);
+    esp_loader_error_t (*read_available)(void *arg, uint8_t *data, uint16_t size,   /*!< Optional */
+                                         uint16_t *bytes_read, uint32_t timeout);
+    void (*delay_ms)(void *arg, uint32_t ms);
+    void (*start_timer)(void *arg, uint32_t ms);
+    uint32_t (*remaining_time)(void *arg);
+    void (*enter_bootloader)(void *arg);
+    void (*reset_target)(void *arg);
+    void (*debug_print)(void *arg, const char *str);                                /*!< Optional */
+    esp_loader_error_t (*change_transmission_rate)(void *arg, uint32_t rate);       /*!< Optional */
+    void (*spi_set_cs)(void *arg, uint32_t level);  /*!< Optional, drives chip select of a SPI bus passed
+                                                         to esp_loader_spi_port_init() */
+    esp_loader_framing_t framing;
+} esp_loader_port_ops_t;
+
+/**
+ * @brief State of a port loading RAM of the target through the SPI slave download mode of its ROM.
+ *
+ * Port functions are esp_loader_spi_port_ops, with the state as their port_arg. Members are
+ * set by esp_loader_spi_port_init() and the port itself.
+ */
+typedef struct {
+    const esp_loader_port_ops_t *bus;   /*!< SPI bus of the host */
+    void *bus_arg;
+    uint8_t rx_toggle;                  /*!< Toggle bit of the next buffer the target receives into */
+    uint8_t tx_toggle;                  /*!< Toggle bit of the next buffer the target sends */
+    bool rx_first;                      /*!< Next receive buffer is the first one since the target booted */
+    bool tx_first;
+    uint16_t tx_remaining;              /*!< Bytes of the frame being written, which are still to come */
+} esp_loader_spi_port_t;
+
+/**
+ * @brief Port functions of esp_loader_spi_port_t, with ESP_LOADER_FRAMING_PACKET.
+ */
+extern const esp_loader_port_ops_t esp_loader_spi_port_ops;
+
+/**
+  * @brief Initializes port talking to the ROM of the target over SPI.
+  *
+  * Target has to be strapped into SPI slave download mode by enter_bootloader() of the bus.
+  * Frames are exchanged through the DMA buffers of its half duplex SPI slave, whose status
+  * registers tell when a buffer is ready. Only loading RAM is supported, esp_loader_connect()
+  * detects the target without synchronizing with it and does not attach flash.
+  *
+  * @param port[out]     Port to be used with esp_loader_spi_port_ops.
+  * @param bus[in]       SPI bus of the host. write() and read() clock bytes out and in while
+  *                      chip select is held low by spi_set_cs(), which is required. The other
+  *                      functions are used by the port as they are.
+  * @param bus_arg[in]   Passed to each of the bus functions.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_INVALID_PARAM spi_set_cs() of the bus is missing
+  */
+esp_loader_error_t esp_loader_spi_port_init(esp_loader_spi_port_t *port, const esp_loader_port_ops_t *bus,
+                                            void *bus_arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,7 @@
 #include "esp_log.h"
 #include "esp_idf_version.h"
 #include <unistd.h>
+#include <sys/param.h>
 
 // #define SERIAL_DEBUG_ENABLE
 
@@ -148,21 +149,58 @@ esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeo
 }
 
 
+
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    size_t buffered = 0;
+    int received;
+
+    *bytes_read = 0;
+
+    if (uart_get_buffered_data_len(s_uart_port, &buffered) != ESP_OK) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    if (buffered == 0) {
+        // Nothing buffered yet, block until the first byte arrives
+        received = uart_read_bytes(s_uart_port, data, 1, pdMS_TO_TICKS(timeout));
+    } else {
+        received = uart_read_bytes(s_uart_port, data, MIN(buffered, size), 0);
+    }
+
+    serial_debug_print(data, received, false);
+
+    if (received < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    } else if (received == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    *bytes_read = (uint16_t)received;
+    return ESP_LOADER_SUCCESS;
+}
+
 // Set GPIO0 LOW, then
 // assert reset pin for 50 milliseconds.
 void loader_port_enter_bootloader(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     gpio_set_level(s_gpio0_trigger_pin, 0);
     loader_port_reset_target();
-    loader_port_delay_ms(SERIAL_FLASHER_BOOT_HOLD_TIME_MS);
+    loader_port_delay_ms(timing.boot_hold_ms);
     gpio_set_level(s_gpio0_trigger_pin, 1);
 }
 
 
 void loader_port_reset_target(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     gpio_set_level(s_reset_trigger_pin, 0);
-    loader_port_delay_ms(SERIAL_FLASHER_RESET_HOLD_TIME_MS);
+    loader_port_delay_ms(timing.reset_hold_ms);
     gpio_set_level(s_reset_trigger_pin, 1);
 }
 
@@ -0,0 +1,541 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "esp_loader_io.h"
+#include "linux_port.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+// struct termios2 sets any baud rate, it cannot be used together with <termios.h>
+#include <asm/termbits.h>
+#include <linux/serial.h>
+
+#ifdef SERIAL_FLASHER_LINUX_GPIOD
+#include <gpiod.h>
+#endif
+
+// #define SERIAL_DEBUG_ENABLE
+
+#ifdef SERIAL_DEBUG_ENABLE
+
+static void serial_debug_print(const uint8_t *data, uint16_t size, bool write)
+{
+    static bool write_prev = false;
+
+    if (write_prev != write) {
+        write_prev = write;
+        printf("\n--- %s ---\n", write ? "WRITE" : "READ");
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        printf("%02x ", data[i]);
+    }
+}
+
+#else
+
+static void serial_debug_print(const uint8_t *data, uint16_t size, bool write) { }
+
+#endif
+
+static loader_linux_port_t s_port = { .fd = -1 };
+
+
+static int64_t time_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Waits until the port is ready or the deadline passes, instead of polling for each byte
+static esp_loader_error_t wait_ready(int fd, short events, int64_t deadline)
+{
+    int64_t remaining = deadline - time_ms();
+    if (remaining <= 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = events };
+    int ret = poll(&pfd, 1, (int)remaining);
+
+    if (ret == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else if (ret < 0) {
+        return (errno == EINTR) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+    } else if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t set_baudrate(int fd, uint32_t baudrate)
+{
+    struct termios2 options;
+
+    if (ioctl(fd, TCGETS2, &options) != 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    options.c_cflag &= ~CBAUD;
+    options.c_cflag |= BOTHER;
+    options.c_ispeed = baudrate;
+    options.c_ospeed = baudrate;
+
+    return (ioctl(fd, TCSETS2, &options) == 0) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_INVALID_PARAM;
+}
+
+static esp_loader_error_t configure_serial(int fd, uint32_t baudrate)
+{
+    struct termios2 options;
+
+    if (ioctl(fd, TCGETS2, &options) != 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    // Raw 8N1, reads never block as waiting is done by poll()
+    options.c_iflag = 0;
+    options.c_oflag = 0;
+    options.c_lflag = 0;
+    options.c_cflag = CS8 | CREAD | CLOCAL;
+    options.c_cc[VMIN] = 0;
+    options.c_cc[VTIME] = 0;
+
+    if (ioctl(fd, TCSETS2, &options) != 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    RETURN_ON_ERROR( set_baudrate(fd, baudrate) );
+
+    // Driver otherwise hands received data over in intervals of several milliseconds.
+    // Not every driver supports it, responses are then only received later.
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+
+    ioctl(fd, TCFLSH, TCIOFLUSH);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Both lines change at once, so that auto-reset circuit does not see an intermediate state
+static void set_dtr_rts(int fd, bool dtr, bool rts)
+{
+    int status;
+
+    if (ioctl(fd, TIOCMGET, &status) != 0) {
+        return;
+    }
+
+    status = dtr ? (status | TIOCM_DTR) : (status & ~TIOCM_DTR);
+    status = rts ? (status | TIOCM_RTS) : (status & ~TIOCM_RTS);
+
+    ioctl(fd, TIOCMSET, &status);
+}
+
+// Reads attribute of the USB device a tty belongs to, such as idVendor
+static bool read_usb_attribute(const char *tty, const char *name, char *value, size_t size)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/sys/class/tty/%s/device/../%s", tty, name);
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool found = fgets(value, size, file) != NULL;
+    fclose(file);
+
+    if (found) {
+        value[strcspn(value, "\n")] = '\0';
+    }
+
+    return found;
+}
+
+// USB-Serial/JTAG of ESP32-C3 and ESP32-S3 enumerates with its own VID and PID
+static bool is_usb_serial_jtag(const char *device)
+{
+    char resolved[PATH_MAX];
+    char vid[8];
+    char pid[8];
+
+    // Links such as /dev/serial/by-id/... lead to the tty
+    if (realpath(device, resolved) == NULL) {
+        return false;
+    }
+
+    const char *tty = strrchr(resolved, '/');
+    tty = (tty != NULL) ? tty + 1 : resolved;
+
+    return read_usb_attribute(tty, "idVendor", vid, sizeof(vid)) &&
+           read_usb_attribute(tty, "idProduct", pid, sizeof(pid)) &&
+           strcmp(vid, "303a") == 0 && strcmp(pid, "1001") == 0;
+}
+
+#ifdef SERIAL_FLASHER_LINUX_GPIOD
+
+static esp_loader_error_t open_gpio(loader_linux_port_t *port, const char *gpio_chip,
+                                    uint32_t reset_trigger_pin, uint32_t gpio0_trigger_pin)
+{
+    port->chip = gpiod_chip_open_lookup(gpio_chip);
+    if (port->chip == NULL) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    port->reset_line = gpiod_chip_get_line(port->chip, reset_trigger_pin);
+    port->gpio0_line = gpiod_chip_get_line(port->chip, gpio0_trigger_pin);
+
+    if (port->reset_line == NULL || port->gpio0_line == NULL ||
+        gpiod_line_request_output(port->reset_line, "serial_flasher", 1) != 0 ||
+        gpiod_line_request_output(port->gpio0_line, "serial_flasher", 1) != 0) {
+        gpiod_chip_close(port->chip);
+        port->chip = NULL;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static void close_gpio(loader_linux_port_t *port)
+{
+    if (port->chip != NULL) {
+        gpiod_chip_close(port->chip);
+        port->chip = NULL;
+    }
+}
+
+static void set_line(struct gpiod_line *line, int value)
+{
+    gpiod_line_set_value(line, value);
+}
+
+#else
+
+static esp_loader_error_t open_gpio(loader_linux_port_t *port, const char *gpio_chip,
+                                    uint32_t reset_trigger_pin, uint32_t gpio0_trigger_pin)
+{
+    return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+}
+
+static void close_gpio(loader_linux_port_t *port) { }
+
+static void set_line(struct gpiod_line *line, int value) { }
+
+#endif
+
+
+esp_loader_error_t loader_port_linux_open(loader_linux_port_t *port, const loader_linux_config_t *config)
+{
+    port->usb_serial_jtag = is_usb_serial_jtag(config->device);
+    port->chip = NULL;
+    port->reset_line = NULL;
+    port->gpio0_line = NULL;
+    port->time_end = 0;
+
+    port->fd = open(config->device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (port->fd < 0) {
+        printf("Serial port %s could not be opened!\n", config->device);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    esp_loader_error_t err = configure_serial(port->fd, config->baudrate);
+
+    if (err == ESP_LOADER_SUCCESS) {
+        if (config->gpio_chip != NULL) {
+            err = open_gpio(port, config->gpio_chip, config->reset_trigger_pin, config->gpio0_trigger_pin);
+        } else {
+            // Released lines leave the target running
+            set_dtr_rts(port->fd, false, false);
+        }
+    }
+
+    if (err != ESP_LOADER_SUCCESS) {
+        close(port->fd);
+        port->fd = -1;
+    }
+
+    return err;
+}
+
+
+void loader_port_linux_close(loader_linux_port_t *port)
+{
+    close_gpio(port);
+
+    if (port->fd >= 0) {
+        close(port->fd);
+        port->fd = -1;
+    }
+}
+
+
+static esp_loader_error_t linux_write(void *arg, const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+    int64_t deadline = time_ms() + timeout;
+    uint16_t written = 0;
+
+    serial_debug_print(data, size, true);
+
+    while (written < size) {
+        ssize_t ret = write(port->fd, &data[written], size - written);
+        if (ret > 0) {
+            written += ret;
+        } else if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+            return ESP_LOADER_ERROR_FAIL;
+        } else {
+            RETURN_ON_ERROR( wait_ready(port->fd, POLLOUT, deadline) );
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Reads whatever the driver has buffered, up to size, without waiting
+static esp_loader_error_t read_buffered(loader_linux_port_t *port, uint8_t *data, uint16_t size, uint16_t *bytes_read)
+{
+    ssize_t ret = read(port->fd, data, size);
+
+    if (ret < 0) {
+        *bytes_read = 0;
+        return (errno == EAGAIN || errno == EINTR) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+    }
+
+    *bytes_read = (uint16_t)ret;
+    serial_debug_print(data, *bytes_read, false);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t linux_read(void *arg, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+    int64_t deadline = time_ms() + timeout;
+    uint16_t received = 0;
+
+    while (true) {
+        uint16_t bytes_read;
+        RETURN_ON_ERROR( read_buffered(port, &data[received], size - received, &bytes_read) );
+        received += bytes_read;
+
+        if (received == size) {
+            return ESP_LOADER_SUCCESS;
+        }
+
+        RETURN_ON_ERROR( wait_ready(port->fd, POLLIN, deadline) );
+    }
+}
+
+static esp_loader_error_t linux_read_available(void *arg, uint8_t *data, uint16_t size,
+                                               uint16_t *bytes_read, uint32_t timeout)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+    int64_t deadline = time_ms() + timeout;
+
+    while (true) {
+        RETURN_ON_ERROR( read_buffered(port, data, size, bytes_read) );
+
+        if (*bytes_read > 0) {
+            return ESP_LOADER_SUCCESS;
+        }
+
+        RETURN_ON_ERROR( wait_ready(port->fd, POLLIN, deadline) );
+    }
+}
+
+static void linux_delay_ms(void *arg, uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+static void linux_start_timer(void *arg, uint32_t ms)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+
+    port->time_end = time_ms() + ms;
+}
+
+static uint32_t linux_remaining_time(void *arg)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+
+    int64_t remaining = port->time_end - time_ms();
+    return (remaining > 0) ? (uint32_t)remaining : 0;
+}
+
+// RTS drives EN and DTR drives IO0, both inverted, as in the auto-reset circuit of development boards
+static void linux_reset_target(void *arg)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
+    if (port->chip != NULL) {
+        set_line(port->reset_line, 0);
+        linux_delay_ms(arg, timing.reset_hold_ms);
+        set_line(port->reset_line, 1);
+    } else {
+        set_dtr_rts(port->fd, false, true);
+        linux_delay_ms(arg, timing.reset_hold_ms);
+        set_dtr_rts(port->fd, false, false);
+    }
+}
+
+// Set GPIO0 LOW, then assert reset pin for the reset hold time.
+static void linux_enter_bootloader(void *arg)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
+    if (port->chip != NULL) {
+        set_line(port->gpio0_line, 0);
+        linux_reset_target(arg);
+        linux_delay_ms(arg, timing.boot_hold_ms);
+        set_line(port->gpio0_line, 1);
+    } else if (port->usb_serial_jtag) {
+        // The peripheral holds IO0 low while DTR is set and resets the chip while only RTS is set,
+        // RTS is set first, so that the lines pass through both set rather than both released
+        set_dtr_rts(port->fd, true, false);
+        linux_delay_ms(arg, timing.boot_hold_ms);
+        set_dtr_rts(port->fd, true, true);
+        set_dtr_rts(port->fd, false, true);
+        linux_delay_ms(arg, timing.reset_hold_ms);
+        set_dtr_rts(port->fd, false, false);
+    } else {
+        set_dtr_rts(port->fd, false, true);
+        linux_delay_ms(arg, timing.reset_hold_ms);
+        set_dtr_rts(port->fd, true, false);
+        linux_delay_ms(arg, timing.boot_hold_ms);
+        set_dtr_rts(port->fd, false, false);
+    }
+}
+
+static void linux_debug_print(void *arg, const char *str)
+{
+    printf("DEBUG: %s\n", str);
+}
+
+static esp_loader_error_t linux_change_transmission_rate(void *arg, uint32_t baudrate)
+{
+    loader_linux_port_t *port = (loader_linux_port_t *)arg;
+
+    // Data are transferred at USB speed, whatever the rate
+    if (port->usb_serial_jtag) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return set_baudrate(port->fd, baudrate);
+}
+
+
+const esp_loader_port_ops_t loader_port_linux_ops = {
+    .write = linux_write,
+    .read = linux_read,
+    .read_available = linux_read_available,
+    .delay_ms = linux_delay_ms,
+    .start_timer = linux_start_timer,
+    .remaining_time = linux_remaining_time,
+    .enter_bootloader = linux_enter_bootloader,
+    .reset_target = linux_reset_target,
+    .debug_print = linux_debug_print,
+    .change_transmission_rate = linux_change_transmission_rate,
+};
+
+
+esp_loader_error_t loader_port_linux_init(const loader_linux_config_t *config)
+{
+    return loader_port_linux_open(&s_port, config);
+}
+
+
+void loader_port_linux_deinit(void)
+{
+    loader_port_linux_close(&s_port);
+}
+
+
+esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    return linux_write(&s_port, data, size, timeout);
+}
+
+
+esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    return linux_read(&s_port, data, size, timeout);
+}
+
+
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    return linux_read_available(&s_port, data, size, bytes_read, timeout);
+}
+
+
+void loader_port_enter_bootloader(void)
+{
+    linux_enter_bootloader(&s_port);
+}
+
+
+void loader_port_reset_target(void)
+{
+    linux_reset_target(&s_port);
+}
+
+
+void loader_port_delay_ms(uint32_t ms)
+{
+    linux_delay_ms(&s_port, ms);
+}
+
+
+void loader_port_start_timer(uint32_t ms)
+{
+    linux_start_timer(&s_port, ms);
+}
+
+
+uint32_t loader_port_remaining_time(void)
+{
+    return linux_remaining_time(&s_port);
+}
+
+
+void loader_port_debug_print(const char *str)
+{
+    linux_debug_print(&s_port, str);
+}
+
+
+esp_loader_error_t loader_port_change_transmission_rate(uint32_t baudrate)
+{
+    return linux_change_transmission_rate(&s_port, baudrate);
+}
@@ -0,0 +1,80 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_loader_io.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+    const char *device;         /*!< Serial device, i.e. /dev/ttyUSB0 */
+    uint32_t baudrate;          /*!< Initial baud rate, any rate the adapter supports */
+    const char *gpio_chip;      /*!< NULL to reset the target through RTS and DTR, as wired
+                                     on development boards. Otherwise name of libgpiod chip,
+                                     i.e. "gpiochip0", with the lines below. */
+    uint32_t reset_trigger_pin; /*!< Line of gpio_chip connected to EN of the target */
+    uint32_t gpio0_trigger_pin; /*!< Line of gpio_chip connected to IO0 of the target */
+} loader_linux_config_t;
+
+/**
+ * @brief Serial port of one target, passed as port_arg of esp_loader_create().
+ */
+typedef struct {
+    int fd;
+    int64_t time_end;
+    struct gpiod_chip *chip;        /*!< NULL when reset through RTS and DTR */
+    struct gpiod_line *reset_line;
+    struct gpiod_line *gpio0_line;
+    bool usb_serial_jtag;           /*!< Device is USB-Serial/JTAG of the target, detected on opening */
+} loader_linux_port_t;
+
+/**
+ * @brief Port functions of loader_linux_port_t, to be passed to esp_loader_create().
+ */
+extern const esp_loader_port_ops_t loader_port_linux_ops;
+
+/**
+  * @brief Opens serial port of one target.
+  *
+  * @param port[out]    Port to be opened.
+  * @param config[in]   Configuration of the port.
+  *
+  * @return
+  *     - ESP_LOADER_SUCCESS Success
+  *     - ESP_LOADER_ERROR_FAIL Device or GPIO could not be opened
+  *     - ESP_LOADER_ERROR_UNSUPPORTED_FUNC GPIO requested, but built without libgpiod
+  */
+esp_loader_error_t loader_port_linux_open(loader_linux_port_t *port, const loader_linux_config_t *config);
+
+/**
+  * @brief Closes serial port and releases its GPIO lines.
+  */
+void loader_port_linux_close(loader_linux_port_t *port);
+
+/**
+  * @brief Opens serial port used by the loader_port_* functions of the default context.
+  */
+esp_loader_error_t loader_port_linux_init(const loader_linux_config_t *config);
+
+void loader_port_linux_deinit(void);
+
+#ifdef __cplusplus
+}
+#endif
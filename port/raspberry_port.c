@@ -257,20 +257,46 @@ esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeo
 }
 
 
+
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    *bytes_read = 0;
+
+    set_timeout(timeout);
+    int read_bytes = read(serial, data, size);
+
+    if (read_bytes == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    } else if (read_bytes < 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    serial_debug_print(data, read_bytes, false);
+
+    *bytes_read = (uint16_t)read_bytes;
+    return ESP_LOADER_SUCCESS;
+}
+
 // Set GPIO0 LOW, then assert reset pin for 50 milliseconds.
 void loader_port_enter_bootloader(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     gpioWrite(s_gpio0_trigger_pin, 0);
     loader_port_reset_target();
-    loader_port_delay_ms(SERIAL_FLASHER_BOOT_HOLD_TIME_MS);
+    loader_port_delay_ms(timing.boot_hold_ms);
     gpioWrite(s_gpio0_trigger_pin, 1);
 }
 
 
 void loader_port_reset_target(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     gpioWrite(s_reset_trigger_pin, 0);
-    loader_port_delay_ms(SERIAL_FLASHER_RESET_HOLD_TIME_MS);
+    loader_port_delay_ms(timing.reset_hold_ms);
     gpioWrite(s_reset_trigger_pin, 1);
 }
 
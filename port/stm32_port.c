@@ -64,12 +64,19 @@ static void serial_debug_print(const uint8_t *data, uint16_t size, bool write) {
 
 static uint32_t s_time_end;
 
-esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+static uint8_t *s_rx_buffer;
+static uint16_t s_rx_buffer_size;
+static uint16_t s_rx_tail;              // Position of the next byte to be read
+static volatile uint32_t s_rx_wraps;    // Times the DMA filled the buffer, counted by reception events
+static uint32_t s_rx_read;              // Bytes read since reception started, modulo 2^32
+static uint32_t s_rx_written;           // Bytes written by the DMA at the last check
+static uint8_t *s_tx_half[2];
+static uint16_t s_tx_half_size;
+static uint16_t s_tx_filled;            // Bytes of the half not being transmitted
+static uint8_t s_tx_current;
+
+static esp_loader_error_t hal_to_loader_error(HAL_StatusTypeDef err)
 {
-    serial_debug_print(data, size, true);
-
-    HAL_StatusTypeDef err = HAL_UART_Transmit(uart, (uint8_t *)data, size, timeout);
-
     if (err == HAL_OK) {
         return ESP_LOADER_SUCCESS;
     } else if (err == HAL_TIMEOUT) {
@@ -79,22 +86,200 @@ esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_
     }
 }
 
+static esp_loader_error_t start_rx_dma(void)
+{
+    s_rx_tail = 0;
+    s_rx_wraps = 0;
+    s_rx_read = 0;
+    s_rx_written = 0;
+    return hal_to_loader_error( HAL_UARTEx_ReceiveToIdle_DMA(uart, s_rx_buffer, s_rx_buffer_size) );
+}
+
+void loader_port_stm32_rx_event(UART_HandleTypeDef *huart, uint16_t size)
+{
+    // Half transfer and idle line events report positions within the buffer, only the
+    // transfer complete one reports all of it
+    if (huart == uart && size == s_rx_buffer_size) {
+        s_rx_wraps++;
+    }
+}
+
+#ifndef SERIAL_FLASHER_STM32_NO_RX_EVENT_CALLBACK
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t size)
+{
+    loader_port_stm32_rx_event(huart, size);
+}
+#endif
+
+// Bytes written by the DMA since reception started, modulo 2^32
+static uint32_t rx_dma_written(void)
+{
+    uint32_t wraps;
+    uint16_t head;
+
+    // Counter reloads when the buffer is full, the event counting it follows a moment later
+    do {
+        wraps = s_rx_wraps;
+        head = (s_rx_buffer_size - __HAL_DMA_GET_COUNTER(uart->hdmarx)) % s_rx_buffer_size;
+    } while (wraps != s_rx_wraps);
+
+    uint32_t written = wraps * s_rx_buffer_size + head;
+    if (written - s_rx_written > UINT32_MAX / 2) {
+        written += s_rx_buffer_size;
+    }
+    s_rx_written = written;
+
+    return written;
+}
+
+static esp_loader_error_t wait_tx_dma(uint32_t timeout)
+{
+    uint32_t start = HAL_GetTick();
+
+    while (uart->gState != HAL_UART_STATE_READY) {
+        if (HAL_GetTick() - start >= timeout) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Starts transmission of the filled half once the previous one is sent, the other half
+// is filled meanwhile
+static esp_loader_error_t flush_tx_dma(uint32_t timeout)
+{
+    if (s_tx_filled == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    RETURN_ON_ERROR( wait_tx_dma(timeout) );
+    RETURN_ON_ERROR( hal_to_loader_error( HAL_UART_Transmit_DMA(uart, s_tx_half[s_tx_current], s_tx_filled) ) );
+
+    s_tx_current ^= 1;
+    s_tx_filled = 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Data are on their way once written, the caller may not read or write anything after them
+static esp_loader_error_t write_dma(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    while (size > 0) {
+        uint16_t to_copy = MIN(size, s_tx_half_size - s_tx_filled);
+        memcpy(&s_tx_half[s_tx_current][s_tx_filled], data, to_copy);
+        s_tx_filled += to_copy;
+        data += to_copy;
+        size -= to_copy;
+
+        if (s_tx_filled == s_tx_half_size) {
+            RETURN_ON_ERROR( flush_tx_dma(timeout) );
+        }
+    }
+
+    return flush_tx_dma(timeout);
+}
+
+static esp_loader_error_t read_available_dma(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    *bytes_read = 0;
+
+    // Response is only awaited once the whole command is on its way
+    RETURN_ON_ERROR( flush_tx_dma(timeout) );
+
+    // Reception error aborts the DMA
+    if (uart->RxState == HAL_UART_STATE_READY) {
+        RETURN_ON_ERROR( start_rx_dma() );
+    }
+
+    uint32_t start = HAL_GetTick();
+    uint32_t unread;
+
+    while ((unread = rx_dma_written() - s_rx_read) == 0) {
+        if (HAL_GetTick() - start >= timeout) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+    }
+
+    // Bytes not read yet were overwritten, reception starts over from what arrives next
+    if (unread > s_rx_buffer_size) {
+        HAL_UART_AbortReceive(uart);
+        RETURN_ON_ERROR( start_rx_dma() );
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    // Contiguous part only, the rest is returned by the next call
+    uint16_t available = MIN(unread, (uint32_t)(s_rx_buffer_size - s_rx_tail));
+    uint16_t to_copy = MIN(size, available);
+
+    memcpy(data, &s_rx_buffer[s_rx_tail], to_copy);
+    s_rx_tail = (s_rx_tail + to_copy) % s_rx_buffer_size;
+    s_rx_read += to_copy;
+    *bytes_read = to_copy;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t read_dma(uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    uint32_t start = HAL_GetTick();
+
+    while (size > 0) {
+        uint32_t elapsed = HAL_GetTick() - start;
+        uint16_t bytes_read;
+
+        RETURN_ON_ERROR( read_available_dma(data, size, &bytes_read, (elapsed < timeout) ? timeout - elapsed : 0) );
+        data += bytes_read;
+        size -= bytes_read;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    serial_debug_print(data, size, true);
+
+    if (s_tx_half_size != 0) {
+        return write_dma(data, size, timeout);
+    }
+
+    return hal_to_loader_error( HAL_UART_Transmit(uart, (uint8_t *)data, size, timeout) );
+}
+
 
 esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeout)
 {
+    if (s_rx_buffer != NULL) {
+        RETURN_ON_ERROR( read_dma(data, size, timeout) );
+        serial_debug_print(data, size, false);
+        return ESP_LOADER_SUCCESS;
+    }
+
     memset(data, 0x22, size);
 
     HAL_StatusTypeDef err = HAL_UART_Receive(uart, data, size, timeout);
 
     serial_debug_print(data, size, false);
 
-    if (err == HAL_OK) {
+    return hal_to_loader_error(err);
+}
+
+
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    if (s_rx_buffer != NULL) {
+        RETURN_ON_ERROR( read_available_dma(data, size, bytes_read, timeout) );
+        serial_debug_print(data, *bytes_read, false);
         return ESP_LOADER_SUCCESS;
-    } else if (err == HAL_TIMEOUT) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    } else {
-        return ESP_LOADER_ERROR_FAIL;
     }
+
+    // Blocking HAL cannot tell how much was received
+    *bytes_read = 0;
+    RETURN_ON_ERROR( loader_port_read(data, 1, timeout) );
+    *bytes_read = 1;
+
+    return ESP_LOADER_SUCCESS;
 }
 
 void loader_port_stm32_init(loader_stm32_config_t *config)
@@ -105,23 +290,41 @@ void loader_port_stm32_init(loader_stm32_config_t *config)
     gpio_port_rst = config->port_rst;
     gpio_num_io0 = config->pin_num_io0;
     gpio_num_rst = config->pin_num_rst;
+
+    s_rx_buffer = config->rx_buffer;
+    s_rx_buffer_size = config->rx_buffer_size;
+    s_tx_half[0] = config->tx_buffer;
+    s_tx_half[1] = config->tx_buffer + config->tx_buffer_size / 2;
+    s_tx_half_size = (config->tx_buffer != NULL) ? config->tx_buffer_size / 2 : 0;
+    s_tx_filled = 0;
+    s_tx_current = 0;
+
+    if (s_rx_buffer != NULL) {
+        start_rx_dma();
+    }
 }
 
 // Set GPIO0 LOW, then
 // assert reset pin for 100 milliseconds.
 void loader_port_enter_bootloader(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     HAL_GPIO_WritePin(gpio_port_io0, gpio_num_io0, GPIO_PIN_RESET);
     loader_port_reset_target();
-    HAL_Delay(SERIAL_FLASHER_BOOT_HOLD_TIME_MS);
+    HAL_Delay(timing.boot_hold_ms);
     HAL_GPIO_WritePin(gpio_port_io0, gpio_num_io0, GPIO_PIN_SET);
 }
 
 
 void loader_port_reset_target(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     HAL_GPIO_WritePin(gpio_port_rst, gpio_num_rst, GPIO_PIN_RESET);
-    HAL_Delay(SERIAL_FLASHER_RESET_HOLD_TIME_MS);
+    HAL_Delay(timing.reset_hold_ms);
     HAL_GPIO_WritePin(gpio_port_rst, gpio_num_rst, GPIO_PIN_SET);
 }
 
@@ -152,11 +355,23 @@ void loader_port_debug_print(const char *str)
 
 esp_loader_error_t loader_port_change_transmission_rate(uint32_t baudrate)
 {
+    if (s_tx_half_size != 0) {
+        RETURN_ON_ERROR( flush_tx_dma(loader_port_remaining_time()) );
+        RETURN_ON_ERROR( wait_tx_dma(loader_port_remaining_time()) );
+    }
+    if (s_rx_buffer != NULL) {
+        HAL_UART_AbortReceive(uart);
+    }
+
     uart->Init.BaudRate = baudrate;
 
     if( HAL_UART_Init(uart) != HAL_OK ) {
         return ESP_LOADER_ERROR_FAIL;
     }
 
+    if (s_rx_buffer != NULL) {
+        return start_rx_dma();
+    }
+
     return ESP_LOADER_SUCCESS;
 }
@@ -29,10 +29,26 @@ typedef struct {
     uint16_t pin_num_io0;
     GPIO_TypeDef *port_rst;
     uint16_t pin_num_rst;
+    uint8_t *rx_buffer;         /*!< Buffer of circular RX DMA, NULL to use blocking transfers.
+                                     DMA streams of huart have to be linked, the RX one in
+                                     circular mode, and UART interrupt enabled. */
+    uint16_t rx_buffer_size;    /*!< Has to hold data arriving while the host does not read,
+                                     reading reports ESP_LOADER_ERROR_FAIL once it overflows */
+    uint8_t *tx_buffer;         /*!< Its halves are filled and sent by TX DMA alternately */
+    uint16_t tx_buffer_size;
 } loader_stm32_config_t;
 
 void loader_port_stm32_init(loader_stm32_config_t *config);
 
+/**
+  * @brief Counts wraps of the RX DMA buffer, so that overwritten data are detected.
+  *
+  * @note  Called by HAL_UARTEx_RxEventCallback() defined by the port. Applications which
+  *        define the callback themselves build with SERIAL_FLASHER_STM32_NO_RX_EVENT_CALLBACK
+  *        and call this function from it.
+  */
+void loader_port_stm32_rx_event(UART_HandleTypeDef *huart, uint16_t size);
+
 #ifdef __cplusplus
 }
 #endif
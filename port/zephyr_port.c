@@ -16,17 +16,199 @@
 
 #include "zephyr_port.h"
 #include <zephyr/drivers/uart.h>
+#include <zephyr/sys/util.h>
+#include <string.h>
+
+#ifdef CONFIG_ESP_SERIAL_FLASHER_UART_ASYNC
+#include <zephyr/sys/ring_buffer.h>
+#else
 #include <zephyr/console/tty.h>
+#endif
 
 static const struct device *uart_dev;
 static struct gpio_dt_spec enable_spec;
 static struct gpio_dt_spec boot_spec;
 
+#ifdef CONFIG_ESP_SERIAL_FLASHER_UART_ASYNC
+
+/* Driver fills the two RX buffers alternately, received data are moved to the ring
+   buffer from the callback and consumed from there by the flasher. */
+static uint8_t rx_buf[2][CONFIG_ESP_SERIAL_FLASHER_UART_BUFSIZE];
+static uint8_t rx_next;
+static volatile bool rx_enabled;
+static volatile bool rx_overrun;
+RING_BUF_DECLARE(esp_flasher_rx_ring, CONFIG_ESP_SERIAL_FLASHER_UART_RX_RING_SIZE);
+static K_SEM_DEFINE(rx_sem, 0, 1);
+static K_SEM_DEFINE(rx_disabled_sem, 0, 1);
+
+/* Written data are collected in one TX buffer while the other one is transmitted */
+static uint8_t tx_buf[2][CONFIG_ESP_SERIAL_FLASHER_UART_BUFSIZE];
+static uint8_t tx_current;
+static uint16_t tx_filled;
+static K_SEM_DEFINE(tx_done_sem, 1, 1);
+
+static void uart_callback(const struct device *dev, struct uart_event *evt, void *user_data)
+{
+    switch (evt->type) {
+    case UART_TX_DONE:
+    case UART_TX_ABORTED:
+        k_sem_give(&tx_done_sem);
+        break;
+    case UART_RX_RDY:
+        if (ring_buf_put(&esp_flasher_rx_ring, &evt->data.rx.buf[evt->data.rx.offset], evt->data.rx.len) < evt->data.rx.len) {
+            rx_overrun = true;
+        }
+        k_sem_give(&rx_sem);
+        break;
+    case UART_RX_BUF_REQUEST:
+        uart_rx_buf_rsp(dev, rx_buf[rx_next], sizeof(rx_buf[0]));
+        rx_next ^= 1;
+        break;
+    case UART_RX_DISABLED:
+        rx_enabled = false;
+        k_sem_give(&rx_disabled_sem);
+        k_sem_give(&rx_sem);
+        break;
+    default:
+        break;
+    }
+}
+
+static esp_loader_error_t enable_rx(void)
+{
+    rx_next = 1;
+    rx_enabled = uart_rx_enable(uart_dev, rx_buf[0], sizeof(rx_buf[0]),
+                                CONFIG_ESP_SERIAL_FLASHER_UART_RX_TIMEOUT_US) == 0;
+
+    return rx_enabled ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+}
+
+static esp_loader_error_t configure_uart(void)
+{
+    if (!device_is_ready(uart_dev) || uart_callback_set(uart_dev, uart_callback, NULL) != 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    ring_buf_reset(&esp_flasher_rx_ring);
+    rx_overrun = false;
+    tx_filled = 0;
+
+    return enable_rx();
+}
+
+/* Starts transmission of the collected data as soon as the previous buffer is sent */
+static esp_loader_error_t flush_tx(k_timepoint_t end)
+{
+    if (tx_filled == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    if (k_sem_take(&tx_done_sem, sys_timepoint_timeout(end)) != 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    if (uart_tx(uart_dev, tx_buf[tx_current], tx_filled, SYS_FOREVER_US) != 0) {
+        k_sem_give(&tx_done_sem);
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    tx_current ^= 1;
+    tx_filled = 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, k_timepoint_t end)
+{
+    *bytes_read = 0;
+
+    /* Response is only awaited once the whole command is on its way */
+    RETURN_ON_ERROR( flush_tx(end) );
+
+    while ((*bytes_read = ring_buf_get(&esp_flasher_rx_ring, data, size)) == 0) {
+        /* Reception error disables the receiver */
+        if (!rx_enabled) {
+            RETURN_ON_ERROR( enable_rx() );
+        }
+        if (k_sem_take(&rx_sem, sys_timepoint_timeout(end)) != 0) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+    }
+
+    if (rx_overrun) {
+        rx_overrun = false;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    return read_available(data, size, bytes_read, sys_timepoint_calc(K_MSEC(timeout)));
+}
+
+esp_loader_error_t loader_port_read(uint8_t *data, const uint16_t size, const uint32_t timeout)
+{
+    k_timepoint_t end = sys_timepoint_calc(K_MSEC(timeout));
+    uint16_t total_read = 0;
+
+    while (total_read < size) {
+        uint16_t bytes_read;
+        RETURN_ON_ERROR( read_available(&data[total_read], size - total_read, &bytes_read, end) );
+        total_read += bytes_read;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t loader_port_write(const uint8_t *data, const uint16_t size, const uint32_t timeout)
+{
+    k_timepoint_t end = sys_timepoint_calc(K_MSEC(timeout));
+    uint16_t total_written = 0;
+
+    while (total_written < size) {
+        uint16_t chunk_size = MIN(size - total_written, sizeof(tx_buf[0]) - tx_filled);
+        memcpy(&tx_buf[tx_current][tx_filled], &data[total_written], chunk_size);
+        tx_filled += chunk_size;
+        total_written += chunk_size;
+
+        if (tx_filled == sizeof(tx_buf[0])) {
+            RETURN_ON_ERROR( flush_tx(end) );
+        }
+    }
+
+    /* Data are on their way once written, the caller may not read or write anything after them */
+    return flush_tx(end);
+}
+
+/* Transmission has to finish and reception to stop before the rate changes */
+static esp_loader_error_t stop_uart(void)
+{
+    k_timepoint_t end = sys_timepoint_calc(K_MSEC(loader_port_remaining_time()));
+
+    RETURN_ON_ERROR( flush_tx(end) );
+    if (k_sem_take(&tx_done_sem, sys_timepoint_timeout(end)) != 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    k_sem_give(&tx_done_sem);
+
+    k_sem_reset(&rx_disabled_sem);
+    if (rx_enabled && uart_rx_disable(uart_dev) == 0 &&
+        k_sem_take(&rx_disabled_sem, sys_timepoint_timeout(end)) != 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+#else
+
 static struct tty_serial tty;
 static char tty_rx_buf[CONFIG_ESP_SERIAL_FLASHER_UART_BUFSIZE];
 static char tty_tx_buf[CONFIG_ESP_SERIAL_FLASHER_UART_BUFSIZE];
 
-esp_loader_error_t configure_tty()
+static esp_loader_error_t configure_uart(void)
 {
     if (tty_init(&tty, uart_dev) < 0 ||
         tty_set_rx_buf(&tty, tty_rx_buf, sizeof(tty_rx_buf)) < 0 ||
@@ -85,26 +267,39 @@ esp_loader_error_t loader_port_write(const uint8_t *data, const uint16_t size, c
     return ESP_LOADER_SUCCESS;
 }
 
+static esp_loader_error_t stop_uart(void)
+{
+    return ESP_LOADER_SUCCESS;
+}
+
+#endif /* CONFIG_ESP_SERIAL_FLASHER_UART_ASYNC */
+
 esp_loader_error_t loader_port_zephyr_init(const loader_zephyr_config_t *config)
 {
     uart_dev = config->uart_dev;
     enable_spec = config->enable_spec;
     boot_spec = config->boot_spec;
-    return configure_tty();
+    return configure_uart();
 }
 
 void loader_port_reset_target(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     gpio_pin_set_dt(&enable_spec, false);
-    loader_port_delay_ms(CONFIG_SERIAL_FLASHER_RESET_HOLD_TIME_MS);
+    loader_port_delay_ms(timing.reset_hold_ms);
     gpio_pin_set_dt(&enable_spec, true);
 }
 
 void loader_port_enter_bootloader(void)
 {
+    esp_loader_reset_timing_t timing;
+    esp_loader_get_reset_timing(&timing);
+
     gpio_pin_set_dt(&boot_spec, false);
     loader_port_reset_target();
-    loader_port_delay_ms(CONFIG_SERIAL_FLASHER_BOOT_HOLD_TIME_MS);
+    loader_port_delay_ms(timing.boot_hold_ms);
     gpio_pin_set_dt(&boot_spec, true);
 }
 
@@ -113,17 +308,16 @@ void loader_port_delay_ms(uint32_t ms)
     k_msleep(ms);
 }
 
-static uint64_t s_time_end;
+static k_timepoint_t s_time_end;
 
 void loader_port_start_timer(uint32_t ms)
 {
-    s_time_end = sys_clock_timeout_end_calc(Z_TIMEOUT_MS(ms));
+    s_time_end = sys_timepoint_calc(K_MSEC(ms));
 }
 
 uint32_t loader_port_remaining_time(void)
 {
-    int64_t remaining = k_ticks_to_ms_floor64(s_time_end - k_uptime_ticks());
-    return (remaining > 0) ? (uint32_t)remaining : 0;
+    return (uint32_t)k_ticks_to_ms_floor64(sys_timepoint_timeout(s_time_end).ticks);
 }
 
 esp_loader_error_t loader_port_change_transmission_rate(uint32_t baudrate)
@@ -134,6 +328,8 @@ esp_loader_error_t loader_port_change_transmission_rate(uint32_t baudrate)
         return ESP_LOADER_ERROR_FAIL;
     }
 
+    RETURN_ON_ERROR( stop_uart() );
+
     if (uart_config_get(uart_dev, &uart_config) != 0) {
         return ESP_LOADER_ERROR_FAIL;
     }
@@ -144,5 +340,5 @@ esp_loader_error_t loader_port_change_transmission_rate(uint32_t baudrate)
     }
 
     /* bitrate-change can require tty re-configuration */
-    return configure_tty();
+    return configure_uart();
 }
@@ -0,0 +1,58 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "esp_loader.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Called every time a block of compressed data is ready to be sent */
+typedef esp_loader_error_t (*deflate_output_t)(void *arg, const uint8_t *data, uint32_t size);
+
+typedef struct {
+    uint8_t *window;        // Input history followed by lookahead, 2 * ESP_LOADER_DEFLATE_WINDOW_SIZE bytes
+    uint16_t *hash_head;    // Most recent window position of each hashed 3-byte sequence
+    uint8_t *out;           // Block of compressed data being assembled
+    uint32_t out_size;
+    uint32_t out_len;
+    uint32_t window_pos;    // Next byte to be compressed
+    uint32_t window_end;    // End of valid input in the window
+    uint32_t bit_buffer;
+    uint32_t bit_count;
+    uint32_t adler_a;
+    uint32_t adler_b;
+    uint32_t block_input;   // Input bytes encoded into the block being assembled
+    deflate_output_t output;
+    void *output_arg;
+    esp_loader_error_t error;
+} deflate_t;
+
+/* Work buffer is laid out as hash table, window and output block, in that order */
+esp_loader_error_t deflate_init(deflate_t *d, void *work, uint32_t work_size, uint32_t block_size,
+                                deflate_output_t output, void *output_arg);
+
+esp_loader_error_t deflate_write(deflate_t *d, const uint8_t *data, uint32_t size);
+
+/* Compresses remaining input, terminates the zlib stream and outputs the last, partial block */
+esp_loader_error_t deflate_finish(deflate_t *d);
+
+#ifdef __cplusplus
+}
+#endif
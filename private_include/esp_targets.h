@@ -18,6 +18,34 @@
 #include <stdint.h>
 #include "esp_loader.h"
 
+// This ROM address has a different value on each chip model
+#define CHIP_DETECT_MAGIC_REG_ADDR 0x40001000
+
+// Library built for one target only, selected by SERIAL_FLASHER_TARGET_<chip>
+#if defined(SERIAL_FLASHER_TARGET_ESP8266)
+#define SINGLE_TARGET ESP8266_CHIP
+#elif defined(SERIAL_FLASHER_TARGET_ESP32)
+#define SINGLE_TARGET ESP32_CHIP
+#elif defined(SERIAL_FLASHER_TARGET_ESP32S2)
+#define SINGLE_TARGET ESP32S2_CHIP
+#elif defined(SERIAL_FLASHER_TARGET_ESP32C3)
+#define SINGLE_TARGET ESP32C3_CHIP
+#elif defined(SERIAL_FLASHER_TARGET_ESP32S3)
+#define SINGLE_TARGET ESP32S3_CHIP
+#elif defined(SERIAL_FLASHER_TARGET_ESP32C2)
+#define SINGLE_TARGET ESP32C2_CHIP
+#elif defined(SERIAL_FLASHER_TARGET_ESP32H4)
+#define SINGLE_TARGET ESP32H4_CHIP
+#endif
+
+// Compares connected target with a chip, constant when built for single target,
+// so that code for other chips is left out
+#ifdef SINGLE_TARGET
+#define TARGET_IS(target, chip) ((void)(target), SINGLE_TARGET == (chip))
+#else
+#define TARGET_IS(target, chip) ((target) == (chip))
+#endif
+
 typedef struct {
     uint32_t cmd;
     uint32_t usr;
@@ -29,5 +57,17 @@ typedef struct {
 } target_registers_t;
 
 esp_loader_error_t loader_detect_chip(target_chip_t *target, const target_registers_t **regs);
+esp_loader_error_t loader_detect_console(target_chip_t target, esp_loader_console_t *console);
 esp_loader_error_t loader_read_spi_config(target_chip_t target_chip, uint32_t *spi_config);
-bool encryption_in_begin_flash_cmd(target_chip_t target);
\ No newline at end of file
+bool encryption_in_begin_flash_cmd(target_chip_t target);
+uint32_t target_flash_block_size(target_chip_t target, bool stub);
+uint32_t target_ram_block_size(target_chip_t target);
+/* 0 if the chip has no USB-OTG console */
+uint32_t target_usb_otg_block_size(target_chip_t target);
+bool target_soft_reset_regs(target_chip_t target, uint32_t *options0, uint32_t *option1);
+
+/* Registers read for the eFuse snapshot, ESP_LOADER_EFUSE_SNAPSHOT_WORDS consecutive eFuse words
+   followed by those the target needs besides, 0 of them if its eFuses cannot be decoded */
+#define EFUSE_SNAPSHOT_MAX_REGS (ESP_LOADER_EFUSE_SNAPSHOT_WORDS + 1)
+uint32_t target_efuse_snapshot_regs(target_chip_t target, uint32_t *addresses);
+void target_decode_efuse(target_chip_t target, const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
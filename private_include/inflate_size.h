@@ -0,0 +1,87 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "esp_loader.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INFLATE_SIZE_MAX_BITS       15
+#define INFLATE_SIZE_LITLEN_CODES   288
+#define INFLATE_SIZE_DIST_CODES     30
+#define INFLATE_SIZE_CLEN_CODES     19
+
+typedef enum {
+    INFLATE_SIZE_ZLIB_HEADER,
+    INFLATE_SIZE_BLOCK_HEADER,
+    INFLATE_SIZE_STORED_LENGTH,
+    INFLATE_SIZE_STORED,
+    INFLATE_SIZE_TABLE_SIZES,
+    INFLATE_SIZE_CLEN_LENGTHS,
+    INFLATE_SIZE_CODE_LENGTHS,
+    INFLATE_SIZE_CODES,
+    INFLATE_SIZE_TRAILER,
+    INFLATE_SIZE_DONE,
+    INFLATE_SIZE_ERROR,
+} inflate_size_state_t;
+
+/* Canonical Huffman code, symbols ordered by code */
+typedef struct {
+    uint16_t count[INFLATE_SIZE_MAX_BITS + 1];
+    uint16_t symbol[INFLATE_SIZE_LITLEN_CODES];
+} inflate_size_litlen_t;
+
+typedef struct {
+    uint16_t count[INFLATE_SIZE_MAX_BITS + 1];
+    uint16_t symbol[INFLATE_SIZE_DIST_CODES];
+} inflate_size_dist_t;
+
+typedef struct {
+    uint16_t count[INFLATE_SIZE_MAX_BITS + 1];
+    uint16_t symbol[INFLATE_SIZE_CLEN_CODES];
+} inflate_size_clen_t;
+
+/* Scanner of a zlib stream, which only determines how many bytes the stream inflates to */
+typedef struct {
+    inflate_size_state_t state;
+    uint64_t bit_buffer;    // Bits received but not consumed yet, least significant first
+    uint32_t bit_count;
+    bool final_block;
+    uint32_t stored_left;   // Bytes of the stored block not received yet
+    uint32_t litlen_count;  // Sizes of the dynamic block header
+    uint32_t dist_count;
+    uint32_t clen_count;
+    uint32_t index;         // Next code length of the dynamic block header
+    uint8_t lengths[INFLATE_SIZE_LITLEN_CODES + INFLATE_SIZE_DIST_CODES];
+    inflate_size_clen_t clen;
+    inflate_size_litlen_t litlen;
+    inflate_size_dist_t dist;
+} inflate_size_t;
+
+void inflate_size_init(inflate_size_t *s);
+
+/* Consumes next part of the stream, produced is set to the number of bytes the target
+   inflates from it, complete symbols only. Returns ESP_LOADER_ERROR_INVALID_PARAM
+   if the stream is not valid, then all following calls fail too. */
+esp_loader_error_t inflate_size_scan(inflate_size_t *s, const uint8_t *data, uint32_t size, uint32_t *produced);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,247 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_loader.h"
+#include "esp_loader_io.h"
+#include "esp_targets.h"
+#include "protocol.h"
+#include "deflate.h"
+#include "inflate_size.h"
+#include "md5_hash.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SLIP_RX_BUFFER_SIZE
+#ifdef ESP_LOADER_TINY
+#define SLIP_RX_BUFFER_SIZE 64
+#else
+#define SLIP_RX_BUFFER_SIZE 256
+#endif
+#endif
+
+/* Digest state is saved at checkpoints, so that resumed region is verified as a whole.
+   Tiny profile hashes the rest of the region only. */
+#if defined(MD5_ENABLED) && defined(MD5_CONTEXT_COPYABLE) && !defined(ESP_LOADER_TINY)
+#define RESUME_MD5 1
+#endif
+
+/* Digest states saved for blocks in flight which end a sector, until they are acknowledged */
+#if defined(RESUME_MD5) && !defined(RESUME_CHECKPOINTS)
+#define RESUME_CHECKPOINTS 2
+#endif
+
+/* Blocks in flight whose sizes are kept for progress reports, acknowledgements of the older
+   ones are not reported until one of these is acknowledged */
+#ifndef PROGRESS_TRACKED_BLOCKS
+#ifdef ESP_LOADER_TINY
+#define PROGRESS_TRACKED_BLOCKS 4
+#else
+#define PROGRESS_TRACKED_BLOCKS 16
+#endif
+#endif
+
+/* Hold times of the reset sequence, until a board profile is set */
+#if !defined(SERIAL_FLASHER_RESET_HOLD_TIME_MS) && defined(CONFIG_SERIAL_FLASHER_RESET_HOLD_TIME_MS)
+#define SERIAL_FLASHER_RESET_HOLD_TIME_MS CONFIG_SERIAL_FLASHER_RESET_HOLD_TIME_MS
+#endif
+#if !defined(SERIAL_FLASHER_BOOT_HOLD_TIME_MS) && defined(CONFIG_SERIAL_FLASHER_BOOT_HOLD_TIME_MS)
+#define SERIAL_FLASHER_BOOT_HOLD_TIME_MS CONFIG_SERIAL_FLASHER_BOOT_HOLD_TIME_MS
+#endif
+#ifndef SERIAL_FLASHER_RESET_HOLD_TIME_MS
+#define SERIAL_FLASHER_RESET_HOLD_TIME_MS 100
+#endif
+#ifndef SERIAL_FLASHER_BOOT_HOLD_TIME_MS
+#define SERIAL_FLASHER_BOOT_HOLD_TIME_MS 50
+#endif
+
+#define DEFAULT_RESET_TIMING { SERIAL_FLASHER_RESET_HOLD_TIME_MS, SERIAL_FLASHER_BOOT_HOLD_TIME_MS }
+
+/* Time allowed for acknowledgement of a flash data block written asynchronously, until a write sets it */
+#define DEFAULT_ACK_TIMEOUT 1000
+
+/* Storage of the pointer to the selected context. Threads only select their own contexts
+   where it is thread local, which is the default on hosted platforms. */
+#ifndef ESP_LOADER_THREAD_LOCAL
+#if defined(__linux__) || defined(__APPLE__)
+#define ESP_LOADER_THREAD_LOCAL __thread
+#else
+#define ESP_LOADER_THREAD_LOCAL
+#endif
+#endif
+
+/* All state of communication with one target */
+struct esp_loader {
+    const esp_loader_port_ops_t *ops;
+    void *port_arg;
+    bool in_use;                    // Claimed atomically, fields following it are cleared on creation
+
+    // SLIP layer
+    uint8_t *tx_buffer;             // Optional buffer into which whole frames are encoded
+    size_t tx_buffer_size;
+    uint8_t rx_buffer[SLIP_RX_BUFFER_SIZE]; // Bytes pulled from the port but not yet decoded
+    uint16_t rx_head;
+    uint16_t rx_tail;
+    uint16_t rx_frame_size;         // Decoded bytes of the frame being received
+    bool rx_in_frame;
+    bool rx_escape;
+    uint32_t rx_response_length;    // Length of the response being received, from its header
+
+    // Protocol layer
+    uint32_t sequence_number;
+    uint32_t acked_sequence_number; // Sequence number of the oldest unacknowledged data command
+    command_t data_command;         // Command of the data packets in flight
+    uint8_t last_status_error;      // One of error_code_t reported in the last response
+    bool stub_mode;
+    response_t ack_response;        // Acknowledgement being received, possibly over several polls
+
+    // Loader
+    target_chip_t target;
+    const target_registers_t *reg;
+    esp_loader_console_t console;   // Peripheral through which ROM loader communicates
+    uint32_t flash_write_size;
+    uint32_t flash_write_window;
+    uint32_t failed_sequence;
+    uint32_t ack_timeout;           // Time allowed for acknowledgement of the blocks in flight
+    esp_loader_erase_strategy_t erase_strategy;
+    uint32_t block_erase_timeout;   // Added to timeout of every block, if the target erases while writing
+    esp_loader_reset_timing_t reset_timing;
+    esp_loader_ack_cb_t ack_callback;
+    void *ack_callback_arg;
+    deflate_t deflate;
+#ifndef ESP_LOADER_TINY
+    inflate_size_t inflate_size;    // Follows compressed blocks to know how much the target writes
+#endif
+    uint32_t transmission_rate;     // Rate the target communicates at, 0 if not known
+    const uint32_t *rates;          // Candidates for negotiation, fastest first
+    uint32_t rate_count;
+    uint32_t base_rate;             // Rate at which the connection was established
+    esp_loader_flash_info_t flash_info;
+    bool flash_info_valid;          // Flash was detected since the connection was established
+    bool spi_params_set;            // Target was told the flash size
+    esp_loader_efuse_snapshot_t efuse_snapshot;
+    bool efuse_snapshot_valid;      // eFuses were read since the connection was established
+#ifdef MD5_ENABLED
+    struct MD5Context md5_context;
+    uint32_t start_address;
+    uint32_t image_size;
+#endif
+
+    // Checkpoint of the region being flashed by esp_loader_flash_start()
+    uint32_t resume_offset;
+    uint32_t resume_size;           // 0 if there is no region to resume
+    uint32_t resume_base;           // Bytes of the region written before the last begin command
+    uint32_t resume_written;        // Bytes of the region acknowledged, in whole sectors
+#ifdef RESUME_MD5
+    struct MD5Context resume_md5;   // Digest state of the region up to resume_written
+    struct MD5Context checkpoint_md5[RESUME_CHECKPOINTS]; // Digest state after each block saved
+    uint32_t checkpoint_sequence[RESUME_CHECKPOINTS];    // Sequence number of the block, UINT32_MAX if none
+    uint32_t checkpoint_head;       // Entry the next block is saved into
+#endif
+
+    // Progress of the region being flashed, reported to progress_callback
+    esp_loader_flash_progress_cb_t progress_callback;
+    void *progress_callback_arg;
+    uint32_t progress_granularity;
+    uint32_t progress_total;
+    uint32_t progress_base;         // Bytes written before the region was resumed
+    uint32_t progress_sent;         // Bytes of the blocks sent
+    uint32_t progress_acked;
+    uint32_t progress_reported;     // Bytes acknowledged at the last report
+    uint32_t progress_wire_bytes;
+    uint32_t progress_start;        // Clock when the region was started
+    uint32_t progress_blocks[PROGRESS_TRACKED_BLOCKS]; // Bytes sent up to each block in flight
+
+    // Ports have no clock but the timer, time accumulates as it is restarted
+    uint32_t timer_duration;        // Duration the port timer was last started with
+    uint32_t clock;                 // Time until the port timer was last started
+    esp_loader_trace_entry_t *trace; // Ring of recent protocol events, NULL if not traced
+    uint32_t trace_size;
+    uint32_t trace_head;            // Entry the next event is recorded into
+    uint32_t trace_count;           // Events in the ring
+#ifdef STATS_ENABLED
+    esp_loader_stats_t stats;
+    esp_loader_stats_cb_t stats_callback;
+    void *stats_callback_arg;
+    bool stats_in_region;           // Region is being flashed, until FLASH_END
+#endif
+};
+
+/* Context used by the calling thread, the default one unless another was selected */
+esp_loader_t *loader_current(void);
+
+/* Sends block of compressed stream, whose inflated size is already known, so that the stream
+   is not followed, and waits for acknowledgements once the window is full */
+esp_loader_error_t loader_flash_defl_block(const uint8_t *data, uint32_t size, uint32_t inflated_size);
+
+/* Checks digests of ranges of the flash region being written, the commands queue up behind
+   its blocks still in flight. Flash parameters are those the region was started with. */
+esp_loader_error_t loader_flash_audit_pending(esp_loader_audit_region_t *regions, uint32_t count);
+
+/* Port functions of the current context */
+esp_loader_error_t port_write(const uint8_t *data, uint16_t size, uint32_t timeout);
+esp_loader_error_t port_read(uint8_t *data, uint16_t size, uint32_t timeout);
+esp_loader_error_t port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout);
+void port_delay_ms(uint32_t ms);
+void port_start_timer(uint32_t ms);
+uint32_t port_remaining_time(void);
+/* Time elapsed since the port timer was started */
+uint32_t port_elapsed_time(void);
+/* Time of the context, from the first start of the port timer */
+uint32_t port_clock(void);
+void port_enter_bootloader(void);
+void port_reset_target(void);
+void port_debug_print(const char *str);
+esp_loader_error_t port_change_transmission_rate(uint32_t rate);
+esp_loader_framing_t port_framing(void);
+
+/* Records protocol event into the trace ring of the current context, if it has one */
+void trace_event(esp_loader_trace_event_t event, uint8_t command, uint32_t size, uint32_t value,
+                 uint8_t status, uint8_t error);
+
+/* Instrumentation of the current context, compiled out unless STATS_ENABLED is defined */
+#ifdef STATS_ENABLED
+
+/* Time elapsed since the port timer was started, compiled to 0 without measurements */
+uint32_t stats_time(void);
+void stats_command(command_t command, uint32_t size, uint32_t send_time, uint32_t wait_time,
+                   esp_loader_error_t result);
+void stats_bytes(uint32_t payload, uint32_t wire, uint32_t received);
+void stats_retry(void);
+void stats_region_start(uint32_t size);
+
+#else
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+static inline uint32_t stats_time(void) { return 0; }
+static inline void stats_command(command_t command, uint32_t size, uint32_t send_time, uint32_t wait_time,
+                                 esp_loader_error_t result) { }
+static inline void stats_bytes(uint32_t payload, uint32_t wire, uint32_t received) { }
+static inline void stats_retry(void) { }
+static inline void stats_region_start(uint32_t size) { }
+#pragma GCC diagnostic pop
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
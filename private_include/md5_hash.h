@@ -13,16 +13,52 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+
+/*
+ * Backend is selected at build time:
+ *  - software implementation in md5_hash.c (default)
+ *  - SERIAL_FLASHER_MD5_BACKEND_ESP_ROM, MD5 routines of ESP-IDF ROM
+ *  - SERIAL_FLASHER_MD5_BACKEND_STM32_HASH, HASH peripheral in md5_hash_stm32.c
+ */
+#if defined(SERIAL_FLASHER_MD5_BACKEND_ESP_ROM)
+
+#include "esp_rom_md5.h" /* Defines struct MD5Context */
+
+#define MD5Init(context)            esp_rom_md5_init(context)
+#define MD5Update(context, buf, len) esp_rom_md5_update(context, buf, len)
+#define MD5Final(digest, context)   esp_rom_md5_final(digest, context)
+#define MD5_CONTEXT_COPYABLE        1
+
+#else
+
+#if defined(SERIAL_FLASHER_MD5_BACKEND_STM32_HASH)
+/* IMR, STR and CR followed by the 54 context swap registers, as saved by HAL_HASH_ContextSaving() */
+#define MD5_STM32_SAVED_WORDS (3 + 54)
+
+/* Peripheral holds the state of one digest at a time. State of the other contexts
+   is swapped out into them, so digests may be interleaved, but not computed
+   from several threads at once. */
+struct MD5Context {
+	uint32_t saved[MD5_STM32_SAVED_WORDS];	/* Peripheral state while another context uses it */
+	uint8_t in[4];	/* Peripheral consumes whole words, bytes of incomplete one */
+	uint32_t count;
+	uint8_t started;	/* Words were fed to the peripheral, saved state is valid once swapped out */
+};
+#else
 struct MD5Context {
 	uint32_t buf[4];
 	uint32_t bits[2];
 	uint8_t in[64];
 };
+#define MD5_CONTEXT_COPYABLE 1 /* Whole state is in the context, unlike with the peripheral */
+#endif
 
 void MD5Init(struct MD5Context *context);
 void MD5Update(struct MD5Context *context, unsigned char const *buf, unsigned len);
 void MD5Final(unsigned char digest[16], struct MD5Context *context);
 
+#endif
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "esp_loader.h"
 
 #ifdef __cplusplus
@@ -50,6 +51,11 @@ typedef enum __attribute__((packed))
     FLASH_DEFL_DATA  = 0x11,
     FLASH_DEFL_END   = 0x12,
     SPI_FLASH_MD5    = 0x13,
+
+    // Flasher stub only
+    ERASE_FLASH      = 0xd0,
+    ERASE_REGION     = 0xd1,
+    READ_FLASH       = 0xd2,
 } command_t;
 
 typedef enum __attribute__((packed))
@@ -167,6 +173,22 @@ typedef struct __attribute__((packed))
     uint32_t reserved_1;
 } spi_flash_md5_command_t;
 
+typedef struct __attribute__((packed))
+{
+    command_common_t common;
+    uint32_t address;
+    uint32_t size;
+    uint32_t block_size;
+    uint32_t max_in_flight;
+} read_flash_command_t;
+
+typedef struct __attribute__((packed))
+{
+    command_common_t common;
+    uint32_t offset;
+    uint32_t size;
+} erase_region_command_t;
+
 typedef struct __attribute__((packed))
 {
     uint8_t direction;
@@ -187,6 +209,9 @@ typedef struct __attribute__((packed))
     response_status_t status;
 } response_t;
 
+/* Shortest frame which can be a response */
+#define RESPONSE_MIN_SIZE sizeof(response_t)
+
 typedef struct __attribute__((packed))
 {
     common_response_t common;
@@ -194,6 +219,13 @@ typedef struct __attribute__((packed))
     response_status_t status;
 } rom_md5_response_t;
 
+typedef struct __attribute__((packed))
+{
+    common_response_t common;
+    uint8_t md5[MD5_SIZE / 2]; // Stub sends raw digest
+    response_status_t status;
+} stub_md5_response_t;
+
 typedef struct __attribute__((packed))
 {
     command_common_t common;
@@ -207,10 +239,60 @@ typedef struct __attribute__((packed))
 
 esp_loader_error_t loader_flash_begin_cmd(uint32_t offset, uint32_t erase_size, uint32_t block_size, uint32_t blocks_to_write, bool encryption);
 
+/* Sends begin command, so that several targets erase at once, its response is collected later
+   by loader_flash_begin_cmd_wait(). Numbering of blocks then restarts. */
+esp_loader_error_t loader_flash_begin_cmd_send(uint32_t offset, uint32_t erase_size, uint32_t block_size, uint32_t blocks_to_write, bool encryption);
+
+esp_loader_error_t loader_flash_begin_cmd_wait(void);
+
 esp_loader_error_t loader_flash_defl_begin_cmd(uint32_t offset, uint32_t uncompressed_size, uint32_t block_size, uint32_t blocks_to_write, bool encryption);
 
 esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size);
 
+/* Sends data packet (FLASH_DATA, FLASH_DEFL_DATA or MEM_DATA) without waiting for its response */
+esp_loader_error_t loader_data_cmd_send(command_t command, const uint8_t *data, uint32_t size);
+
+/* Same as loader_data_cmd_send, data is followed by padding_size copies of the padding byte */
+esp_loader_error_t loader_data_cmd_send_padded(command_t command, const uint8_t *data, uint32_t size,
+                                               uint8_t padding, uint32_t padding_size);
+
+/* Encodes data packet with given sequence number into frame, once for any number of targets */
+esp_loader_error_t loader_data_cmd_encode(command_t command, const uint8_t *data, uint32_t size,
+                                          uint8_t padding, uint32_t padding_size, uint32_t sequence_number,
+                                          uint8_t *frame, size_t frame_size, size_t *encoded_size);
+
+/* Sends frame encoded by loader_data_cmd_encode() with the next sequence number of the current context,
+   data_size being the size of its data with padding */
+esp_loader_error_t loader_data_cmd_send_encoded(command_t command, const uint8_t *frame, size_t size,
+                                                uint32_t data_size);
+
+/* Waits for response to the oldest data packet in flight, reports its sequence number.
+   Once it times out, the link is taken as broken and no packet is in flight any more. */
+esp_loader_error_t loader_data_cmd_wait_ack(uint32_t *sequence_number);
+
+/* Same as loader_data_cmd_wait_ack, but returns ESP_LOADER_IN_PROGRESS instead of waiting */
+esp_loader_error_t loader_data_cmd_poll_ack(uint32_t *sequence_number);
+
+/* Number of data packets sent, but not acknowledged yet */
+uint32_t loader_data_cmds_pending(void);
+
+/* Forgets data packets in flight, the acknowledgement being received and the sequence numbers */
+void loader_reset_data_cmds(void);
+
+/* Converts size bytes to 2 * size lowercase hex characters, as in MD5 response of ROM loader */
+void loader_hexify(const uint8_t *raw, uint32_t size, uint8_t *hex_out);
+
+/* Selects whether responses are decoded as sent by ROM loader or by flasher stub */
+void loader_set_stub_mode(bool stub);
+
+bool loader_stub_mode(void);
+
+/* Waits for greeting packet the flasher stub sends once it starts */
+esp_loader_error_t loader_wait_stub_greeting(void);
+
+/* Error code (one of error_code_t) from status of the last received response, RESPONSE_OK if it succeeded */
+uint8_t loader_last_status_error(void);
+
 esp_loader_error_t loader_flash_defl_data_cmd(const uint8_t *data, uint32_t size);
 
 esp_loader_error_t loader_flash_end_cmd(bool stay_in_loader);
@@ -229,20 +311,56 @@ esp_loader_error_t loader_mem_data_cmd(const uint8_t *data, uint32_t size);
 
 esp_loader_error_t loader_mem_end_cmd(uint32_t entrypoint);
 
+/* Sends begin command while blocks of the previous segment may still be in flight,
+   its response is waited for once they are acknowledged. Numbering of blocks then restarts. */
+esp_loader_error_t loader_mem_begin_cmd_send(uint32_t offset, uint32_t size, uint32_t blocks_to_write, uint32_t block_size);
+
+esp_loader_error_t loader_mem_begin_cmd_wait(void);
+
 esp_loader_error_t loader_write_reg_cmd(uint32_t address, uint32_t value, uint32_t mask, uint32_t delay_us);
 
 esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg);
 
+/* Send register commands without waiting, responses arrive in the order of the commands */
+esp_loader_error_t loader_write_reg_cmd_send(uint32_t address, uint32_t value, uint32_t mask, uint32_t delay_us);
+
+esp_loader_error_t loader_read_reg_cmd_send(uint32_t address);
+
+/* Waits for response to the oldest register command sent by the functions above */
+esp_loader_error_t loader_reg_cmd_wait(command_t command, uint32_t *reg);
+
 esp_loader_error_t loader_sync_cmd(void);
 
 esp_loader_error_t loader_spi_attach_cmd(uint32_t config);
 
-esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate);
+esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate, uint32_t old_baudrate);
 
 esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_out);
 
+/* Send MD5 command without waiting, digests arrive in the order of the commands, in hex */
+esp_loader_error_t loader_md5_cmd_send(uint32_t address, uint32_t size);
+
+esp_loader_error_t loader_md5_cmd_wait(uint8_t *md5_out);
+
 esp_loader_error_t loader_spi_parameters(uint32_t total_size);
 
+/* Stub erases whole flash chip */
+esp_loader_error_t loader_erase_flash_cmd(void);
+
+/* Stub erases sector aligned region */
+esp_loader_error_t loader_erase_region_cmd(uint32_t offset, uint32_t size);
+
+/* Requests stub to stream flash contents in packets of block_size bytes, at most
+   max_in_flight of them are sent ahead of acknowledgement */
+esp_loader_error_t loader_read_flash_cmd(uint32_t address, uint32_t size, uint32_t block_size,
+                                         uint32_t max_in_flight);
+
+/* Receives next packet of the flash read stream, or the final MD5 digest */
+esp_loader_error_t loader_read_flash_data(uint8_t *data, uint32_t max_size, uint32_t *size);
+
+/* Acknowledges total number of bytes of the flash read stream received so far */
+esp_loader_error_t loader_read_flash_ack(uint32_t received);
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
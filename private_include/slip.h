@@ -19,10 +19,50 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 esp_loader_error_t SLIP_receive_data(uint8_t *buff, size_t size);
 
 esp_loader_error_t SLIP_receive_packet(uint8_t *buff, size_t size);
 
+/* Receives response of the length its header tells, up to size bytes are stored and received
+   is set to the length of the frame. Frames which are not responses or are broken off are
+   skipped. Unless wait is set, only bytes already received are decoded and ESP_LOADER_IN_PROGRESS
+   is returned when the frame is not complete yet, the same buffer has to be passed again then. */
+esp_loader_error_t SLIP_receive_response(uint8_t *buff, size_t size, size_t *received, bool wait);
+
+/* Receives frame of any length, up to max_size bytes are stored. Reported size can be
+   larger than max_size when the rest of the frame was dropped. */
+esp_loader_error_t SLIP_receive_frame(uint8_t *buff, size_t max_size, size_t *size);
+
+void SLIP_flush_rx(void);
+
 esp_loader_error_t SLIP_send(const uint8_t *data, size_t size);
 
 esp_loader_error_t SLIP_send_delimiter(void);
+
+void SLIP_set_tx_buffer(uint8_t *buffer, size_t size);
+
+esp_loader_error_t SLIP_send_frame(const uint8_t *header, size_t header_size,
+                                   const uint8_t *data, size_t data_size);
+
+/* Same as SLIP_send_frame, data is followed by padding_size copies of the padding byte */
+esp_loader_error_t SLIP_send_frame_padded(const uint8_t *header, size_t header_size,
+                                          const uint8_t *data, size_t data_size,
+                                          uint8_t padding, size_t padding_size);
+
+/* Encodes frame as SLIP_send_frame_padded sends it,
+   fails with ESP_LOADER_ERROR_INVALID_PARAM if it does not fit into frame_size bytes */
+esp_loader_error_t SLIP_encode_frame(const uint8_t *header, size_t header_size,
+                                     const uint8_t *data, size_t data_size,
+                                     uint8_t padding, size_t padding_size,
+                                     uint8_t *frame, size_t frame_size, size_t *encoded_size);
+
+/* Sends frame encoded by SLIP_encode_frame, which carries payload_size bytes of packet */
+esp_loader_error_t SLIP_send_encoded(const uint8_t *frame, size_t size, size_t payload_size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,386 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loader_context.h"
+#include "protocol.h"
+#include <string.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b)) ? (a) : (b)
+#endif
+
+#define ARTIFACT_MAGIC   0x41505345  // "ESPA"
+#define ARTIFACT_VERSION 1
+
+static const uint32_t SECTOR_SIZE = 4096;
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_size;
+    uint32_t image_size;
+    uint32_t block_size;
+    uint32_t segment_size;      // Image bytes of each segment, but the last one
+    uint32_t segment_count;
+    uint8_t image_md5[16];
+} artifact_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t frames_offset;     // From the start of the artifact
+    uint32_t compressed_size;   // Sum of sizes of the frames
+    uint8_t md5[16];            // Of the uncompressed segment
+} artifact_segment_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t size;              // Compressed bytes following, padded to whole words
+    uint32_t inflated_size;
+} artifact_frame_t;
+
+
+static inline uint32_t word_align(uint32_t size)
+{
+    return (size + 3u) & ~3u;
+}
+
+
+// Converts between little-endian byte order of the artifact and that of the host, either way
+static inline uint32_t le32(uint32_t value)
+{
+    const uint8_t *bytes = (const uint8_t *)&value;
+    return bytes[0] | ((uint32_t)bytes[1] << 8) | ((uint32_t)bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static inline uint16_t le16(uint16_t value)
+{
+    const uint8_t *bytes = (const uint8_t *)&value;
+    return bytes[0] | (uint16_t)(bytes[1] << 8);
+}
+
+static void header_byte_order(artifact_header_t *header)
+{
+    header->magic = le32(header->magic);
+    header->version = le16(header->version);
+    header->header_size = le16(header->header_size);
+    header->image_size = le32(header->image_size);
+    header->block_size = le32(header->block_size);
+    header->segment_size = le32(header->segment_size);
+    header->segment_count = le32(header->segment_count);
+}
+
+static void segment_byte_order(artifact_segment_t *segment)
+{
+    segment->frames_offset = le32(segment->frames_offset);
+    segment->compressed_size = le32(segment->compressed_size);
+}
+
+static void read_frame(const uint8_t *artifact, uint32_t pos, artifact_frame_t *frame)
+{
+    memcpy(frame, &artifact[pos], sizeof(*frame));
+    frame->size = le32(frame->size);
+    frame->inflated_size = le32(frame->inflated_size);
+}
+
+
+static inline uint32_t segment_count(uint32_t image_size, uint32_t segment_size)
+{
+    return (segment_size != 0) ? (image_size + segment_size - 1) / segment_size : 1;
+}
+
+
+uint32_t esp_loader_artifact_size_bound(uint32_t image_size, uint32_t block_size, uint32_t segment_size)
+{
+    uint32_t segments = segment_count(image_size, segment_size);
+
+    // Fixed Huffman codes take at most 9 bits per byte, plus zlib header and trailer of each segment
+    uint64_t compressed = (uint64_t)image_size + image_size / 8 + 17 * segments;
+    uint64_t frames = compressed / block_size + segments;
+    uint64_t bound = sizeof(artifact_header_t) + segments * sizeof(artifact_segment_t) +
+                     frames * (sizeof(artifact_frame_t) + 3) + compressed;
+
+    return (bound < UINT32_MAX) ? (uint32_t)bound : UINT32_MAX;
+}
+
+
+#ifdef MD5_ENABLED
+
+typedef struct {
+    deflate_t deflate;
+    uint8_t *out;
+    uint32_t out_size;
+    uint32_t out_len;
+    uint32_t compressed_size;   // Of the segment being compressed
+} build_state_t;
+
+static esp_loader_error_t store_frame(void *arg, const uint8_t *data, uint32_t size)
+{
+    build_state_t *state = (build_state_t *)arg;
+    uint32_t padded = word_align(size);
+
+    if (state->out_size - state->out_len < sizeof(artifact_frame_t) + padded) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    artifact_frame_t frame = { .size = le32(size), .inflated_size = le32(state->deflate.block_input) };
+    memcpy(&state->out[state->out_len], &frame, sizeof(frame));
+    state->out_len += sizeof(frame);
+
+    memcpy(&state->out[state->out_len], data, size);
+    memset(&state->out[state->out_len + size], 0, padded - size);
+    state->out_len += padded;
+    state->compressed_size += size;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_artifact_build(const esp_loader_artifact_build_args_t *args,
+                                             uint8_t *artifact, uint32_t size, uint32_t *artifact_size)
+{
+    if (args->image == NULL || args->image_size == 0 || args->segment_size % SECTOR_SIZE != 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    uint32_t segment_size = (args->segment_size != 0) ? MIN(args->segment_size, args->image_size)
+                                                      : args->image_size;
+    uint32_t segments = segment_count(args->image_size, segment_size);
+    uint32_t table_size = sizeof(artifact_header_t) + segments * sizeof(artifact_segment_t);
+
+    if (size < table_size) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    build_state_t state = { .out = artifact, .out_size = size, .out_len = table_size };
+    artifact_header_t header = {
+        .magic = ARTIFACT_MAGIC,
+        .version = ARTIFACT_VERSION,
+        .header_size = sizeof(artifact_header_t),
+        .image_size = args->image_size,
+        .block_size = args->block_size,
+        .segment_size = segment_size,
+        .segment_count = segments,
+    };
+    struct MD5Context image_md5;
+    MD5Init(&image_md5);
+
+    for (uint32_t i = 0; i < segments; i++) {
+        uint32_t offset = i * segment_size;
+        uint32_t length = MIN(segment_size, args->image_size - offset);
+        artifact_segment_t segment = { .frames_offset = state.out_len };
+        struct MD5Context segment_md5;
+
+        state.compressed_size = 0;
+        RETURN_ON_ERROR( deflate_init(&state.deflate, args->work, args->work_size, args->block_size,
+                                      store_frame, &state) );
+        RETURN_ON_ERROR( deflate_write(&state.deflate, &args->image[offset], length) );
+        RETURN_ON_ERROR( deflate_finish(&state.deflate) );
+        segment.compressed_size = state.compressed_size;
+
+        MD5Init(&segment_md5);
+        MD5Update(&segment_md5, &args->image[offset], length);
+        MD5Final(segment.md5, &segment_md5);
+        MD5Update(&image_md5, &args->image[offset], length);
+
+        segment_byte_order(&segment);
+        memcpy(&artifact[sizeof(header) + i * sizeof(segment)], &segment, sizeof(segment));
+    }
+
+    MD5Final(header.image_md5, &image_md5);
+    header_byte_order(&header);
+    memcpy(artifact, &header, sizeof(header));
+    *artifact_size = state.out_len;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+#endif /* MD5_ENABLED */
+
+
+static void read_segment(const uint8_t *artifact, uint32_t index, artifact_segment_t *segment)
+{
+    memcpy(segment, &artifact[sizeof(artifact_header_t) + index * sizeof(artifact_segment_t)], sizeof(*segment));
+    segment_byte_order(segment);
+}
+
+
+// Checks the whole artifact before anything is written, so that a damaged one leaves flash untouched
+static esp_loader_error_t check_artifact(const uint8_t *artifact, uint32_t size, artifact_header_t *header)
+{
+    if (artifact == NULL || size < sizeof(*header)) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    memcpy(header, artifact, sizeof(*header));
+    header_byte_order(header);
+
+    if (header->magic != ARTIFACT_MAGIC || header->version != ARTIFACT_VERSION ||
+            header->header_size != sizeof(*header) || header->image_size == 0 ||
+            header->block_size == 0 || header->segment_size == 0 ||
+            header->segment_count != segment_count(header->image_size, header->segment_size) ||
+            (header->segment_count > 1 && header->segment_size % SECTOR_SIZE != 0) ||
+            (size - sizeof(*header)) / sizeof(artifact_segment_t) < header->segment_count) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    for (uint32_t i = 0; i < header->segment_count; i++) {
+        artifact_segment_t segment;
+        read_segment(artifact, i, &segment);
+
+        uint32_t length = MIN(header->segment_size, header->image_size - i * header->segment_size);
+        uint32_t pos = segment.frames_offset;
+        uint32_t compressed = 0;
+        uint32_t inflated = 0;
+
+        while (compressed < segment.compressed_size) {
+            artifact_frame_t frame;
+            if (pos > size || size - pos < sizeof(frame)) {
+                return ESP_LOADER_ERROR_INVALID_PARAM;
+            }
+            read_frame(artifact, pos, &frame);
+            pos += sizeof(frame);
+
+            if (frame.size == 0 || frame.size > header->block_size || size - pos < word_align(frame.size) ||
+                    segment.compressed_size - compressed < frame.size || length - inflated < frame.inflated_size) {
+                return ESP_LOADER_ERROR_INVALID_PARAM;
+            }
+            pos += word_align(frame.size);
+            compressed += frame.size;
+            inflated += frame.inflated_size;
+        }
+
+        // Frames missing from the segment would leave the end of its flash region erased
+        if (inflated != length) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+static esp_loader_error_t write_segment(const artifact_header_t *header, const uint8_t *artifact,
+                                        const artifact_segment_t *segment, uint32_t address, uint32_t length)
+{
+    RETURN_ON_ERROR( esp_loader_flash_defl_start(address, length, segment->compressed_size, header->block_size) );
+
+    uint32_t pos = segment->frames_offset;
+    uint32_t compressed = 0;
+
+    while (compressed < segment->compressed_size) {
+        artifact_frame_t frame;
+        read_frame(artifact, pos, &frame);
+        pos += sizeof(frame);
+
+        RETURN_ON_ERROR( loader_flash_defl_block(&artifact[pos], frame.size, frame.inflated_size) );
+        pos += word_align(frame.size);
+        compressed += frame.size;
+    }
+
+    return esp_loader_flash_wait_pending();
+}
+
+
+#ifdef MD5_ENABLED
+static esp_loader_error_t flash_matches(uint32_t address, uint32_t length, const uint8_t digest[16], bool *matches)
+{
+    uint8_t expected[MD5_SIZE + 1];
+    uint8_t received[MD5_SIZE + 1];
+
+    loader_hexify(digest, 16, expected);
+
+    RETURN_ON_ERROR( esp_loader_get_md5_hex(address, length, received) );
+
+    *matches = memcmp(expected, received, MD5_SIZE) == 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+#endif
+
+
+esp_loader_error_t esp_loader_flash_artifact(const esp_loader_artifact_flash_args_t *args,
+                                             esp_loader_flash_sync_stats_t *stats)
+{
+    esp_loader_flash_sync_stats_t counts = { 0 };
+    artifact_header_t header;
+
+    if (args->offset % SECTOR_SIZE != 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+#ifdef MD5_ENABLED
+    esp_loader_t *ctx = loader_current();
+
+    if ((args->skip_unchanged || args->verify) && TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+#else
+    if (args->skip_unchanged || args->verify) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+#endif
+
+    RETURN_ON_ERROR( check_artifact(args->artifact, args->size, &header) );
+
+    for (uint32_t i = 0; i < header.segment_count; i++) {
+        artifact_segment_t segment;
+        uint32_t address = args->offset + i * header.segment_size;
+        uint32_t length = MIN(header.segment_size, header.image_size - i * header.segment_size);
+        bool matches = false;
+
+        read_segment(args->artifact, i, &segment);
+
+#ifdef MD5_ENABLED
+        if (args->skip_unchanged) {
+            RETURN_ON_ERROR( flash_matches(address, length, segment.md5, &matches) );
+        }
+#endif
+
+        if (matches) {
+            counts.bytes_skipped += length;
+            continue;
+        }
+
+        RETURN_ON_ERROR( write_segment(&header, args->artifact, &segment, address, length) );
+        counts.bytes_written += length;
+        counts.ranges_written++;
+
+#ifdef MD5_ENABLED
+        // Image written as a whole is verified at once below
+        if (args->verify && args->skip_unchanged) {
+            RETURN_ON_ERROR( flash_matches(address, length, segment.md5, &matches) );
+            if (!matches) {
+                port_debug_print("Error: MD5 of artifact segment does not match\n");
+                return ESP_LOADER_ERROR_INVALID_MD5;
+            }
+        }
+#endif
+    }
+
+#ifdef MD5_ENABLED
+    if (args->verify && !args->skip_unchanged) {
+        bool matches;
+        RETURN_ON_ERROR( flash_matches(args->offset, header.image_size, header.image_md5, &matches) );
+        if (!matches) {
+            port_debug_print("Error: MD5 of artifact does not match\n");
+            return ESP_LOADER_ERROR_INVALID_MD5;
+        }
+    }
+#endif
+
+    if (stats != NULL) {
+        *stats = counts;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
@@ -0,0 +1,287 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Streaming zlib (RFC 1950) encoder producing a single deflate (RFC 1951) block
+ * with fixed Huffman codes. Matches are found with a single-probe hash table,
+ * which keeps memory usage bounded and small, at the cost of compression ratio. */
+
+#include "deflate.h"
+#include <string.h>
+
+#define WINDOW_SIZE     ESP_LOADER_DEFLATE_WINDOW_SIZE
+#define HASH_SIZE       (1u << ESP_LOADER_DEFLATE_HASH_BITS)
+#define NO_POSITION     0xFFFF
+#define MIN_MATCH       3
+#define MAX_MATCH       258
+#define END_OF_BLOCK    256
+#define ADLER_MOD       65521
+#define ADLER_NMAX      5552 // Largest chunk for which adler sums cannot overflow
+
+#if (WINDOW_SIZE < 1024) || (WINDOW_SIZE > 16384)
+#error "ESP_LOADER_DEFLATE_WINDOW_SIZE has to be in range from 1024 to 16384"
+#endif
+
+static const uint16_t s_length_base[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t s_length_extra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint16_t s_dist_base[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const uint8_t s_dist_extra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void put_byte(deflate_t *d, uint8_t byte)
+{
+    d->out[d->out_len++] = byte;
+
+    if (d->out_len == d->out_size) {
+        if (d->error == ESP_LOADER_SUCCESS) {
+            d->error = d->output(d->output_arg, d->out, d->out_len);
+        }
+        d->out_len = 0;
+        d->block_input = 0;
+    }
+}
+
+static void put_bits(deflate_t *d, uint32_t value, uint32_t bits)
+{
+    d->bit_buffer |= value << d->bit_count;
+    d->bit_count += bits;
+
+    while (d->bit_count >= 8) {
+        put_byte(d, (uint8_t)d->bit_buffer);
+        d->bit_buffer >>= 8;
+        d->bit_count -= 8;
+    }
+}
+
+// Huffman codes are stored starting from the most significant bit
+static void put_code(deflate_t *d, uint32_t code, uint32_t bits)
+{
+    uint32_t reversed = 0;
+
+    for (uint32_t i = 0; i < bits; i++) {
+        reversed = (reversed << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    put_bits(d, reversed, bits);
+}
+
+static void put_literal_length(deflate_t *d, uint32_t symbol)
+{
+    if (symbol < 144) {
+        put_code(d, 0x30 + symbol, 8);
+    } else if (symbol < 256) {
+        put_code(d, 0x190 + symbol - 144, 9);
+    } else if (symbol < 280) {
+        put_code(d, symbol - 256, 7);
+    } else {
+        put_code(d, 0xC0 + symbol - 280, 8);
+    }
+}
+
+static void put_match(deflate_t *d, uint32_t length, uint32_t distance)
+{
+    uint32_t code = sizeof(s_length_base) / sizeof(s_length_base[0]) - 1;
+    while (s_length_base[code] > length) {
+        code--;
+    }
+    put_literal_length(d, 257 + code);
+    put_bits(d, length - s_length_base[code], s_length_extra[code]);
+
+    code = sizeof(s_dist_base) / sizeof(s_dist_base[0]) - 1;
+    while (s_dist_base[code] > distance) {
+        code--;
+    }
+    put_code(d, code, 5);
+    put_bits(d, distance - s_dist_base[code], s_dist_extra[code]);
+}
+
+static inline uint32_t hash(const uint8_t *data)
+{
+    uint32_t value = ((uint32_t)data[0] << 16) | ((uint32_t)data[1] << 8) | data[2];
+    return (value * 2654435761u) >> (32 - ESP_LOADER_DEFLATE_HASH_BITS);
+}
+
+static void insert_hash(deflate_t *d, uint32_t pos)
+{
+    if (pos + MIN_MATCH <= d->window_end) {
+        d->hash_head[hash(&d->window[pos])] = (uint16_t)pos;
+    }
+}
+
+// Compresses the input until less than maximal match length is left, or all of it if finishing
+static void compress(deflate_t *d, bool finish)
+{
+    const uint32_t lookahead = finish ? 1 : MAX_MATCH;
+
+    while (d->window_end - d->window_pos >= lookahead && d->error == ESP_LOADER_SUCCESS) {
+        uint32_t pos = d->window_pos;
+        uint32_t available = d->window_end - pos;
+        uint32_t length = 0;
+        uint32_t candidate = NO_POSITION;
+
+        if (available >= MIN_MATCH) {
+            uint32_t h = hash(&d->window[pos]);
+            candidate = d->hash_head[h];
+            d->hash_head[h] = (uint16_t)pos;
+        }
+
+        if (candidate != NO_POSITION) {
+            const uint32_t max_length = available < MAX_MATCH ? available : MAX_MATCH;
+            const uint8_t *match = &d->window[candidate];
+            const uint8_t *current = &d->window[pos];
+
+            while (length < max_length && match[length] == current[length]) {
+                length++;
+            }
+        }
+
+        // Symbol counts towards the block it starts in
+        if (length >= MIN_MATCH) {
+            d->block_input += length;
+            put_match(d, length, pos - candidate);
+            for (uint32_t i = 1; i < length; i++) {
+                insert_hash(d, pos + i);
+            }
+            d->window_pos += length;
+        } else {
+            d->block_input++;
+            put_literal_length(d, d->window[pos]);
+            d->window_pos++;
+        }
+    }
+}
+
+// Drops the older half of the window to make space for new input
+static void slide_window(deflate_t *d)
+{
+    memmove(d->window, &d->window[WINDOW_SIZE], WINDOW_SIZE);
+    d->window_pos -= WINDOW_SIZE;
+    d->window_end -= WINDOW_SIZE;
+
+    for (uint32_t i = 0; i < HASH_SIZE; i++) {
+        uint16_t pos = d->hash_head[i];
+        d->hash_head[i] = (pos != NO_POSITION && pos >= WINDOW_SIZE) ? pos - WINDOW_SIZE : NO_POSITION;
+    }
+}
+
+static void update_adler(deflate_t *d, const uint8_t *data, uint32_t size)
+{
+    while (size > 0) {
+        uint32_t chunk = size < ADLER_NMAX ? size : ADLER_NMAX;
+        size -= chunk;
+
+        while (chunk--) {
+            d->adler_a += *data++;
+            d->adler_b += d->adler_a;
+        }
+
+        d->adler_a %= ADLER_MOD;
+        d->adler_b %= ADLER_MOD;
+    }
+}
+
+esp_loader_error_t deflate_init(deflate_t *d, void *work, uint32_t work_size, uint32_t block_size,
+                                deflate_output_t output, void *output_arg)
+{
+    if (work == NULL || block_size == 0 || work_size < ESP_LOADER_DEFLATE_WORK_SIZE(block_size) ||
+        ((uintptr_t)work & 1) != 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    d->hash_head = (uint16_t *)work;
+    d->window = (uint8_t *)work + HASH_SIZE * sizeof(uint16_t);
+    d->out = d->window + 2 * WINDOW_SIZE;
+    d->out_size = block_size;
+    d->out_len = 0;
+    d->window_pos = 0;
+    d->window_end = 0;
+    d->bit_buffer = 0;
+    d->bit_count = 0;
+    d->adler_a = 1;
+    d->adler_b = 0;
+    d->block_input = 0;
+    d->output = output;
+    d->output_arg = output_arg;
+    d->error = ESP_LOADER_SUCCESS;
+
+    memset(d->hash_head, 0xFF, HASH_SIZE * sizeof(uint16_t));
+
+    // zlib header: deflate with 32K window, no dictionary, FLEVEL 0 (fastest compression)
+    put_byte(d, 0x78);
+    put_byte(d, 0x01);
+    // Final block, compressed with fixed Huffman codes
+    put_bits(d, 1, 1);
+    put_bits(d, 1, 2);
+
+    return d->error;
+}
+
+esp_loader_error_t deflate_write(deflate_t *d, const uint8_t *data, uint32_t size)
+{
+    while (size > 0 && d->error == ESP_LOADER_SUCCESS) {
+        if (d->window_end == 2 * WINDOW_SIZE) {
+            slide_window(d);
+        }
+
+        uint32_t to_copy = 2 * WINDOW_SIZE - d->window_end;
+        if (to_copy > size) {
+            to_copy = size;
+        }
+
+        memcpy(&d->window[d->window_end], data, to_copy);
+        update_adler(d, data, to_copy);
+        d->window_end += to_copy;
+        data += to_copy;
+        size -= to_copy;
+
+        compress(d, false);
+    }
+
+    return d->error;
+}
+
+esp_loader_error_t deflate_finish(deflate_t *d)
+{
+    compress(d, true);
+    put_literal_length(d, END_OF_BLOCK);
+
+    // Align to byte boundary before the trailer
+    if (d->bit_count > 0) {
+        put_bits(d, 0, 8 - d->bit_count);
+    }
+
+    uint32_t adler = (d->adler_b << 16) | d->adler_a;
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        put_byte(d, (uint8_t)(adler >> shift));
+    }
+
+    if (d->out_len > 0 && d->error == ESP_LOADER_SUCCESS) {
+        d->error = d->output(d->output_arg, d->out, d->out_len);
+        d->out_len = 0;
+    }
+
+    return d->error;
+}
@@ -14,10 +14,13 @@
  */
 
 #include "protocol.h"
-#include "esp_loader_io.h"
+#include "slip.h"
+#include "loader_context.h"
 #include "esp_loader.h"
 #include "esp_targets.h"
 #include "md5_hash.h"
+#include "inflate_size.h"
+#include "deflate.h"
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
@@ -37,39 +40,46 @@
 static const uint32_t DEFAULT_TIMEOUT = 1000;
 static const uint32_t DEFAULT_FLASH_TIMEOUT = 3000;       // timeout for most flash operations
 static const uint32_t ERASE_REGION_TIMEOUT_PER_MB = 10000; // timeout (per megabyte) for erasing a region
-static const uint32_t LOAD_RAM_TIMEOUT_PER_MB = 2000000; // timeout (per megabyte) for erasing a region
+static const uint32_t ERASE_WRITE_TIMEOUT_PER_MB = 40000; // timeout (per megabyte) for erasing and writing data
+static const uint32_t LOAD_RAM_TIMEOUT_PER_MB = 100000; // timeout (per megabyte) for loading RAM, covers transfer at 115200 baud
+static const uint32_t RATE_SETTLE_TIME_MS = 50; // target switches transmission rate after sending the response
+static const uint32_t RATE_CHECK_ROUNDS = 3;    // round trips needed to consider transmission rate stable
+static const uint32_t MAX_TRIAL_DELAY_MS = 100; // longest delay between connection trials
+static const uint32_t DRAIN_MAX_READS = 64;    // reads discarding bytes received before a connection trial
 static const uint8_t  PADDING_PATTERN = 0xFF;
+static const uint32_t FLASH_SECTOR_SIZE = 4096;
+static const uint32_t FLASH_ERASE_BLOCK_SIZE = 0x10000; // Erased by a single block erase command
+static const uint32_t DEFAULT_CHIP_SIZE = 16 * 1024 * 1024; // Assumed for timeout of chip erase, if not detected
 
 typedef enum {
     SPI_FLASH_READ_ID = 0x9F
 } spi_flash_cmd_t;
 
-static uint32_t s_flash_write_size = 0;
-static const target_registers_t *s_reg = NULL;
-static target_chip_t s_target = ESP_UNKNOWN_CHIP;
+static const uint32_t MD5_TIMEOUT_PER_MB = 8000;
 
 #ifdef MD5_ENABLED
 
-static const uint32_t MD5_TIMEOUT_PER_MB = 8000;
-static struct MD5Context s_md5_context;
-static uint32_t s_start_address;
-static uint32_t s_image_size;
-
 static inline void init_md5(uint32_t address, uint32_t size)
 {
-    s_start_address = address;
-    s_image_size = size;
-    MD5Init(&s_md5_context);
+    esp_loader_t *ctx = loader_current();
+
+    ctx->start_address = address;
+    ctx->image_size = size;
+    MD5Init(&ctx->md5_context);
 }
 
 static inline void md5_update(const uint8_t *data, uint32_t size)
 {
-    MD5Update(&s_md5_context, data, size);
+    esp_loader_t *ctx = loader_current();
+
+    MD5Update(&ctx->md5_context, data, size);
 }
 
 static inline void md5_final(uint8_t digets[16])
 {
-    MD5Final(digets, &s_md5_context);
+    esp_loader_t *ctx = loader_current();
+
+    MD5Final(digets, &ctx->md5_context);
 }
 
 #else
@@ -86,70 +96,277 @@ static inline void md5_final(uint8_t digets[16]) { }
 
 static uint32_t timeout_per_mb(uint32_t size_bytes, uint32_t time_per_mb)
 {
-    uint32_t timeout = time_per_mb * (size_bytes / (uint32_t)1e6f);
-    return MAX(timeout, DEFAULT_FLASH_TIMEOUT);
+    // Rounded up, so that sizes below one megabyte get their share of time too
+    uint64_t timeout = ((uint64_t)time_per_mb * size_bytes + 999999) / 1000000;
+    if (timeout < DEFAULT_FLASH_TIMEOUT) {
+        return DEFAULT_FLASH_TIMEOUT;
+    }
+    return (timeout < UINT32_MAX) ? (uint32_t)timeout : UINT32_MAX;
 }
 
 esp_loader_error_t esp_loader_connect(esp_loader_connect_args_t *connect_args)
 {
-    uint32_t spi_config;
+    return esp_loader_connect_with_stats(connect_args, NULL);
+}
+
+// Reads out bytes the port has already received, a bounded number of them, so that
+// a target flooding the line does not stall connecting
+static void drain_port(void)
+{
+    uint8_t discarded[32];
+    uint16_t bytes_read;
+
+    for (uint32_t i = 0; i < DRAIN_MAX_READS; i++) {
+        if (port_read_available(discarded, sizeof(discarded), &bytes_read, 0) != ESP_LOADER_SUCCESS ||
+                bytes_read == 0) {
+            break;
+        }
+    }
+}
+
+// Synchronizes with ROM loader while it boots, retrying as configured
+static esp_loader_error_t sync_with_target(esp_loader_connect_args_t *connect_args,
+                                           esp_loader_connect_stats_t *stats)
+{
     esp_loader_error_t err;
     int32_t trials = connect_args->trials;
-
-    loader_port_enter_bootloader();
+    uint32_t trial_delay = connect_args->trial_delay ? connect_args->trial_delay : MAX_TRIAL_DELAY_MS;
+    uint32_t trial_count = 0;
+    uint32_t elapsed = 0;
 
     do {
-        loader_port_start_timer(connect_args->sync_timeout);
-        err = loader_sync_cmd();
+        // Late responses of previous trial would be taken for the response to this one.
+        // Boot messages before the first trial are not frames, the decoder skips them.
+        if (trial_count > 0) {
+            drain_port();
+        }
+        SLIP_flush_rx();
+
+        trial_count++;
+        port_start_timer(connect_args->sync_timeout);
+        if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+            // ROM loader has nothing to synchronize over packet transports, it is up once it responds
+            uint32_t magic;
+            err = loader_read_reg_cmd(CHIP_DETECT_MAGIC_REG_ADDR, &magic);
+        } else {
+            err = loader_sync_cmd();
+        }
+        elapsed += connect_args->sync_timeout - port_remaining_time();
+
         if (err == ESP_LOADER_ERROR_TIMEOUT) {
             if (--trials == 0) {
-                return ESP_LOADER_ERROR_TIMEOUT;
+                break;
             }
-            loader_port_delay_ms(100);
-        } else if (err != ESP_LOADER_SUCCESS) {
-            return err;
+            stats_retry();
+            // Retry quickly at first, back off if the target takes longer to boot
+            port_delay_ms(trial_delay);
+            elapsed += trial_delay;
+            trial_delay = MIN(trial_delay * 2, MAX_TRIAL_DELAY_MS);
         }
-    } while (err != ESP_LOADER_SUCCESS);
-
-    RETURN_ON_ERROR( loader_detect_chip(&s_target, &s_reg) );
+    } while (err == ESP_LOADER_ERROR_TIMEOUT);
 
-    if (s_target == ESP8266_CHIP) {
-        err = loader_flash_begin_cmd(0, 0, 0, 0, s_target);
-    } else {
-        RETURN_ON_ERROR( loader_read_spi_config(s_target, &spi_config) );
-        loader_port_start_timer(DEFAULT_TIMEOUT);
-        err = loader_spi_attach_cmd(spi_config);
+    if (stats != NULL) {
+        stats->trials = trial_count;
+        stats->time_ms = elapsed;
     }
 
     return err;
 }
 
+static esp_loader_error_t attach_flash(void)
+{
+    esp_loader_t *ctx = loader_current();
+    uint32_t spi_config;
+
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return loader_flash_begin_cmd(0, 0, 0, 0, ctx->target);
+    }
+
+    RETURN_ON_ERROR( loader_read_spi_config(ctx->target, &spi_config) );
+    port_start_timer(DEFAULT_TIMEOUT);
+    return loader_spi_attach_cmd(spi_config);
+}
+
+// Target boots into ROM loader at the rate it was connected with, 0 if not known
+static void reset_link_state(uint32_t transmission_rate)
+{
+    esp_loader_t *ctx = loader_current();
+
+    loader_set_stub_mode(false);
+    loader_reset_data_cmds();
+    SLIP_flush_rx();
+    ctx->transmission_rate = transmission_rate;
+    ctx->rates = NULL;
+    ctx->efuse_snapshot_valid = false;
+    esp_loader_invalidate_flash_info();
+}
+
+esp_loader_error_t esp_loader_connect_with_stats(esp_loader_connect_args_t *connect_args,
+                                                 esp_loader_connect_stats_t *stats)
+{
+    esp_loader_t *ctx = loader_current();
+
+    port_enter_bootloader();
+    reset_link_state(connect_args->transmission_rate);
+
+    RETURN_ON_ERROR( sync_with_target(connect_args, stats) );
+
+    RETURN_ON_ERROR( loader_detect_chip(&ctx->target, &ctx->reg) );
+    RETURN_ON_ERROR( loader_detect_console(ctx->target, &ctx->console) );
+
+    // SPI slave download mode of ROM loads RAM only
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return attach_flash();
+}
+
 target_chip_t esp_loader_get_target(void)
 {
-    return s_target;
+    esp_loader_t *ctx = loader_current();
+
+    return ctx->target;
 }
 
-static esp_loader_error_t spi_set_data_lengths(size_t mosi_bits, size_t miso_bits)
+esp_loader_console_t esp_loader_get_console(void)
 {
-    if (mosi_bits > 0) {
-        RETURN_ON_ERROR( esp_loader_write_register(s_reg->mosi_dlen, mosi_bits - 1) );
+    esp_loader_t *ctx = loader_current();
+
+    return ctx->console;
+}
+
+// Register commands in flight, so that their frames fit into UART FIFO of the target
+static const uint32_t REG_BATCH_WINDOW = 4;
+
+static esp_loader_error_t wait_reg_op(esp_loader_reg_op_t *op)
+{
+    port_start_timer(DEFAULT_TIMEOUT);
+
+    return loader_reg_cmd_wait(op->write ? WRITE_REG : READ_REG, op->write ? NULL : &op->value);
+}
+
+// Consecutive words from address are read into values when there are no operations
+static esp_loader_error_t reg_batch(esp_loader_reg_op_t *ops, uint32_t count, uint32_t address, uint32_t *values)
+{
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+    uint32_t sent = 0;
+    uint32_t acked = 0;
+
+    while (acked < count) {
+        if (sent < count && sent - acked < REG_BATCH_WINDOW && err == ESP_LOADER_SUCCESS) {
+            port_start_timer(DEFAULT_TIMEOUT);
+            if (ops == NULL) {
+                err = loader_read_reg_cmd_send(address + sent * 4);
+            } else if (ops[sent].write) {
+                err = loader_write_reg_cmd_send(ops[sent].address, ops[sent].value, 0xFFFFFFFF, 0);
+            } else {
+                err = loader_read_reg_cmd_send(ops[sent].address);
+            }
+            if (err == ESP_LOADER_SUCCESS) {
+                sent++;
+            }
+            continue;
+        }
+
+        if (acked == sent) {
+            break;
+        }
+
+        // After an error, responses to the commands already sent are still consumed,
+        // so that they are not mistaken for responses to subsequent commands
+        esp_loader_error_t ack_err;
+        if (ops == NULL) {
+            port_start_timer(DEFAULT_TIMEOUT);
+            ack_err = loader_reg_cmd_wait(READ_REG, &values[acked++]);
+        } else {
+            ack_err = wait_reg_op(&ops[acked++]);
+        }
+        if (err == ESP_LOADER_SUCCESS) {
+            err = ack_err;
+        }
+        if (ack_err == ESP_LOADER_ERROR_TIMEOUT) {
+            break;
+        }
     }
-    if (miso_bits > 0) {
-        RETURN_ON_ERROR( esp_loader_write_register(s_reg->miso_dlen, miso_bits - 1) );
+
+    return err;
+}
+
+esp_loader_error_t esp_loader_register_batch(esp_loader_reg_op_t *ops, uint32_t count)
+{
+    return reg_batch(ops, count, 0, NULL);
+}
+
+esp_loader_error_t esp_loader_read_registers(uint32_t address, uint32_t count, uint32_t *values)
+{
+    return reg_batch(NULL, count, address, values);
+}
+
+esp_loader_error_t esp_loader_get_efuse_snapshot(esp_loader_efuse_snapshot_t *snapshot)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (!ctx->efuse_snapshot_valid) {
+        uint32_t addresses[EFUSE_SNAPSHOT_MAX_REGS];
+        esp_loader_reg_op_t ops[EFUSE_SNAPSHOT_MAX_REGS];
+        uint32_t values[EFUSE_SNAPSHOT_MAX_REGS];
+        uint32_t count = target_efuse_snapshot_regs(ctx->target, addresses);
+
+        if (count == 0) {
+            return ESP_LOADER_ERROR_UNSUPPORTED_CHIP;
+        }
+
+        for (uint32_t i = 0; i < count; i++) {
+            ops[i] = (esp_loader_reg_op_t) { .address = addresses[i], .write = false };
+        }
+        RETURN_ON_ERROR( esp_loader_register_batch(ops, count) );
+        for (uint32_t i = 0; i < count; i++) {
+            values[i] = ops[i].value;
+        }
+
+        target_decode_efuse(ctx->target, values, &ctx->efuse_snapshot);
+        ctx->efuse_snapshot_valid = true;
     }
 
+    *snapshot = ctx->efuse_snapshot;
+
     return ESP_LOADER_SUCCESS;
 }
 
-static esp_loader_error_t spi_set_data_lengths_8266(size_t mosi_bits, size_t miso_bits)
+static void add_reg_op(esp_loader_reg_op_t *ops, uint32_t *count, bool write, uint32_t address, uint32_t value)
+{
+    ops[*count].address = address;
+    ops[*count].value = value;
+    ops[*count].write = write;
+    (*count)++;
+}
+
+static void spi_set_data_lengths(esp_loader_reg_op_t *ops, uint32_t *count, size_t mosi_bits, size_t miso_bits)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (mosi_bits > 0) {
+        add_reg_op(ops, count, true, ctx->reg->mosi_dlen, mosi_bits - 1);
+    }
+    if (miso_bits > 0) {
+        add_reg_op(ops, count, true, ctx->reg->miso_dlen, miso_bits - 1);
+    }
+}
+
+static void spi_set_data_lengths_8266(esp_loader_reg_op_t *ops, uint32_t *count, size_t mosi_bits, size_t miso_bits)
 {
+    esp_loader_t *ctx = loader_current();
+
     uint32_t mosi_mask = (mosi_bits == 0) ? 0 : mosi_bits - 1;
     uint32_t miso_mask = (miso_bits == 0) ? 0 : miso_bits - 1;
-    return esp_loader_write_register(s_reg->usr1, (miso_mask << 8) | (mosi_mask << 17));
+    add_reg_op(ops, count, true, ctx->reg->usr1, (miso_mask << 8) | (mosi_mask << 17));
 }
 
 static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx, size_t tx_size, void *data_rx, size_t rx_size)
 {
+    esp_loader_t *ctx = loader_current();
+
     assert(rx_size <= 32); // Reading more than 32 bits back from a SPI flash operation is unsupported
     assert(tx_size <= 64); // Writing more than 64 bytes of data with one SPI command is unsupported
 
@@ -159,16 +376,19 @@ static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx,
     uint32_t SPI_CMD_USR  = (1u << 18);
     uint32_t CMD_LEN_SHIFT = 28;
 
+    // Setup, start and completion check of the transaction are sent as one batch,
+    // the transaction is over long before the target gets to the check
+    esp_loader_reg_op_t ops[2 + 2 + 2 + 16 + 1 + 2];
+    uint32_t count = 0;
+
     // Save SPI configuration
-    uint32_t old_spi_usr;
-    uint32_t old_spi_usr2;
-    RETURN_ON_ERROR( esp_loader_read_register(s_reg->usr, &old_spi_usr) );
-    RETURN_ON_ERROR( esp_loader_read_register(s_reg->usr2, &old_spi_usr2) );
+    add_reg_op(ops, &count, false, ctx->reg->usr, 0);
+    add_reg_op(ops, &count, false, ctx->reg->usr2, 0);
 
-    if (s_target == ESP8266_CHIP) {
-        RETURN_ON_ERROR( spi_set_data_lengths_8266(tx_size, rx_size) );
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        spi_set_data_lengths_8266(ops, &count, tx_size, rx_size);
     } else {
-        RETURN_ON_ERROR( spi_set_data_lengths(tx_size, rx_size) );
+        spi_set_data_lengths(ops, &count, tx_size, rx_size);
     }
 
     uint32_t usr_reg_2 = (7u << CMD_LEN_SHIFT) | cmd;
@@ -180,297 +400,1794 @@ static esp_loader_error_t spi_flash_command(spi_flash_cmd_t cmd, void *data_tx,
         usr_reg |= SPI_USR_MOSI;
     }
 
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr, usr_reg) );
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr2, usr_reg_2 ) );
+    add_reg_op(ops, &count, true, ctx->reg->usr, usr_reg);
+    add_reg_op(ops, &count, true, ctx->reg->usr2, usr_reg_2);
 
     if (tx_size == 0) {
         // clear data register before we read it
-        RETURN_ON_ERROR( esp_loader_write_register(s_reg->w0, 0) );
+        add_reg_op(ops, &count, true, ctx->reg->w0, 0);
     } else {
         uint32_t *data = (uint32_t *)data_tx;
         uint32_t words_to_write = (tx_size + 31) / (8 * 4);
-        uint32_t data_reg_addr = s_reg->w0;
+        uint32_t data_reg_addr = ctx->reg->w0;
 
         while (words_to_write--) {
-            uint32_t word = *data++;
-            RETURN_ON_ERROR( esp_loader_write_register(data_reg_addr, word) );
+            add_reg_op(ops, &count, true, data_reg_addr, *data++);
             data_reg_addr += 4;
         }
     }
 
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->cmd, SPI_CMD_USR) );
+    add_reg_op(ops, &count, true, ctx->reg->cmd, SPI_CMD_USR);
+    add_reg_op(ops, &count, false, ctx->reg->cmd, 0);
+    add_reg_op(ops, &count, false, ctx->reg->w0, 0);
+
+    RETURN_ON_ERROR( esp_loader_register_batch(ops, count) );
+
+    uint32_t old_spi_usr = ops[0].value;
+    uint32_t old_spi_usr2 = ops[1].value;
+    uint32_t cmd_reg = ops[count - 2].value;
+    *(uint32_t *)data_rx = ops[count - 1].value;
 
     uint32_t trials = 10;
-    while (trials--) {
-        uint32_t cmd_reg;
-        RETURN_ON_ERROR( esp_loader_read_register(s_reg->cmd, &cmd_reg) );
+    while ((cmd_reg & SPI_CMD_USR) != 0) {
+        if (--trials == 0) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+        RETURN_ON_ERROR( esp_loader_read_register(ctx->reg->cmd, &cmd_reg) );
         if ((cmd_reg & SPI_CMD_USR) == 0) {
-            break;
+            RETURN_ON_ERROR( esp_loader_read_register(ctx->reg->w0, data_rx) );
         }
     }
 
-    if (trials == 0) {
-        return ESP_LOADER_ERROR_TIMEOUT;
-    }
-
-    RETURN_ON_ERROR( esp_loader_read_register(s_reg->w0, data_rx) );
-
     // Restore SPI configuration
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr, old_spi_usr) );
-    RETURN_ON_ERROR( esp_loader_write_register(s_reg->usr2, old_spi_usr2) );
+    count = 0;
+    add_reg_op(ops, &count, true, ctx->reg->usr, old_spi_usr);
+    add_reg_op(ops, &count, true, ctx->reg->usr2, old_spi_usr2);
 
-    return ESP_LOADER_SUCCESS;
+    return esp_loader_register_batch(ops, count);
 }
 
 static esp_loader_error_t detect_flash_size(size_t *flash_size)
 {
-    uint32_t flash_id = 0;
+    esp_loader_t *ctx = loader_current();
 
-    RETURN_ON_ERROR( spi_flash_command(SPI_FLASH_READ_ID, NULL, 0, &flash_id, 24) );
-    uint32_t size_id = flash_id >> 16;
+    if (!ctx->flash_info_valid) {
+        uint32_t flash_id = 0;
 
-    if (size_id < 0x12 || size_id > 0x18) {
-        return ESP_LOADER_ERROR_UNSUPPORTED_CHIP;
+        RETURN_ON_ERROR( spi_flash_command(SPI_FLASH_READ_ID, NULL, 0, &flash_id, 24) );
+        uint32_t size_id = flash_id >> 16;
+
+        if (size_id < 0x12 || size_id > 0x18) {
+            return ESP_LOADER_ERROR_UNSUPPORTED_CHIP;
+        }
+
+        ctx->flash_info.jedec_id = flash_id & 0xFFFFFF;
+        ctx->flash_info.size = 1 << size_id;
+        ctx->flash_info_valid = true;
     }
 
-    *flash_size = 1 << size_id;
+    *flash_size = ctx->flash_info.size;
 
     return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t esp_loader_flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size)
+// Tells flash size to the target, only once per connection
+static esp_loader_error_t set_spi_parameters(size_t flash_size)
 {
-    uint32_t blocks_to_write = (image_size + block_size - 1) / block_size;
-    uint32_t erase_size = block_size * blocks_to_write;
-    s_flash_write_size = block_size;
+    esp_loader_t *ctx = loader_current();
 
-    size_t flash_size = 0;
-    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS) {
-        if (image_size + offset > flash_size) {
-            return ESP_LOADER_ERROR_IMAGE_SIZE;
-        }
-        loader_port_start_timer(DEFAULT_TIMEOUT);
+    if (!ctx->spi_params_set) {
+        port_start_timer(DEFAULT_TIMEOUT);
         RETURN_ON_ERROR( loader_spi_parameters(flash_size) );
-    } else {
-        loader_port_debug_print("Flash size detection failed, falling back to default");
+        ctx->spi_params_set = true;
     }
 
-    init_md5(offset, image_size);
-
-    bool encryption_in_cmd = encryption_in_begin_flash_cmd(s_target);
-
-    loader_port_start_timer(timeout_per_mb(erase_size, ERASE_REGION_TIMEOUT_PER_MB));
-    return loader_flash_begin_cmd(offset, erase_size, block_size, blocks_to_write, encryption_in_cmd);
+    return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t esp_loader_flash_defl_start(uint32_t offset, uint32_t image_size, uint32_t compressed_size, uint32_t block_size)
+
+esp_loader_error_t esp_loader_get_flash_info(esp_loader_flash_info_t *info)
 {
-    uint32_t blocks_to_write = (compressed_size + block_size - 1) / block_size;
+    esp_loader_t *ctx = loader_current();
+    size_t flash_size;
 
-    // only support ROM loader here
-    // uncompressed size is rounded up to full blocks
-    uint32_t blocks_to_erase = (image_size + block_size - 1) / block_size;
-    uint32_t erase_size = block_size * blocks_to_erase;
+    RETURN_ON_ERROR( detect_flash_size(&flash_size) );
 
-    s_flash_write_size = block_size;
+    *info = ctx->flash_info;
 
-	loader_port_delay_ms(20);
-    size_t flash_size = 0;
-    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS) {
-		loader_port_delay_ms(20);
-        if (image_size + offset > flash_size) {
-            return ESP_LOADER_ERROR_IMAGE_SIZE;
-        }
-        loader_port_start_timer(DEFAULT_TIMEOUT);
-        RETURN_ON_ERROR( loader_spi_parameters(flash_size) );
-		loader_port_delay_ms(20);
-    } else {
-        loader_port_debug_print("Flash size detection failed, falling back to default");
-    }
+    return ESP_LOADER_SUCCESS;
+}
 
-	loader_port_delay_ms(10);
-    init_md5(offset, image_size);
 
-	loader_port_delay_ms(10);
-    bool encryption_in_cmd = encryption_in_begin_flash_cmd(s_target);
+void esp_loader_invalidate_flash_info(void)
+{
+    esp_loader_t *ctx = loader_current();
 
-	loader_port_delay_ms(10);
-    loader_port_start_timer(timeout_per_mb(erase_size, ERASE_REGION_TIMEOUT_PER_MB));
-    return loader_flash_defl_begin_cmd(offset, erase_size, block_size, blocks_to_write, encryption_in_cmd);
+    ctx->flash_info_valid = false;
+    ctx->spi_params_set = false;
 }
 
-esp_loader_error_t esp_loader_flash_write(void *payload, uint32_t size)
+// Blocks in flight are allowed the time the slowest of them needs to be written
+static void add_block_timeout(uint32_t timeout)
 {
-    uint32_t padding_bytes = s_flash_write_size - size;
-    uint8_t *data = (uint8_t *)payload;
-    uint32_t padding_index = size;
+    esp_loader_t *ctx = loader_current();
 
-    if (size > s_flash_write_size) {
-        return ESP_LOADER_ERROR_INVALID_PARAM;
+    if (loader_data_cmds_pending() <= 1 || timeout > ctx->ack_timeout) {
+        ctx->ack_timeout = timeout;
+    }
+}
+
+// Bytes of the region written with the block, if the region can be resumed after it, 0 otherwise.
+// Resumed region has to start a sector to be erased again.
+static uint32_t block_checkpoint(uint32_t sequence_number)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->resume_size == 0 || ctx->data_command != FLASH_DATA) {
+        return 0;
     }
 
-    while (padding_bytes--) {
-        data[padding_index++] = PADDING_PATTERN;
+    uint32_t written = ctx->resume_base + (sequence_number + 1) * ctx->flash_write_size;
+    if (written >= ctx->resume_size) {
+        return ctx->resume_size;
     }
+    return (written % FLASH_SECTOR_SIZE == 0) ? written : 0;
+}
 
-    md5_update(payload, (size + 3u) & ~3u);
+// Blocks are hashed when sent, digest is saved for the ones the region can be resumed after
+static void checkpoint_block_sent(uint32_t sequence_number)
+{
+#ifdef RESUME_MD5
+    esp_loader_t *ctx = loader_current();
 
-    loader_port_start_timer(DEFAULT_TIMEOUT);
+    if (block_checkpoint(sequence_number) == 0) {
+        return;
+    }
 
-    return loader_flash_data_cmd(data, s_flash_write_size);
+    uint32_t slot = ctx->checkpoint_head++ % RESUME_CHECKPOINTS;
+    ctx->checkpoint_md5[slot] = ctx->md5_context;
+    ctx->checkpoint_sequence[slot] = sequence_number;
+#endif
 }
 
-esp_loader_error_t esp_loader_flash_defl_write(void *payload, uint32_t size)
+// Moves the point the region can be resumed from, once the block is acknowledged
+static void checkpoint_block(uint32_t sequence_number)
 {
-    if (size > s_flash_write_size) {
-        return ESP_LOADER_ERROR_INVALID_PARAM;
-    }
+    esp_loader_t *ctx = loader_current();
 
-    md5_update(payload, (size + 3u) & ~3u);
+    uint32_t written = block_checkpoint(sequence_number);
+    if (written == 0) {
+        return;
+    }
 
-    // increase timeout because a single block of compressed data can cause large flash writes
-    // the proper way to solve this is to decompress the block here to find the exact write size
-    loader_port_start_timer(DEFAULT_TIMEOUT * 50);
+#ifdef RESUME_MD5
+    // Digest of the block is overwritten by a later one, once more of them are in flight than saved
+    uint32_t slot = 0;
+    while (ctx->checkpoint_sequence[slot] != sequence_number) {
+        if (++slot == RESUME_CHECKPOINTS) {
+            return;
+        }
+    }
+    ctx->resume_md5 = ctx->checkpoint_md5[slot];
+#endif
 
-    return loader_flash_defl_data_cmd(payload, size);
+    ctx->resume_written = written;
 }
 
 
-esp_loader_error_t esp_loader_flash_finish(bool reboot)
+static void progress_region_start(uint32_t size, uint32_t written)
 {
-    loader_port_start_timer(DEFAULT_TIMEOUT);
-
-    return loader_flash_end_cmd(!reboot);
+    esp_loader_t *ctx = loader_current();
+
+    ctx->progress_total = size;
+    ctx->progress_base = written;
+    ctx->progress_sent = written;
+    ctx->progress_acked = written;
+    ctx->progress_reported = written;
+    ctx->progress_wire_bytes = 0;
+    ctx->progress_start = port_clock();
 }
 
-esp_loader_error_t esp_loader_flash_defl_finish(bool reboot)
+// Called once the block is handed to the port, with the bytes of the region it carries
+static void progress_block_sent(uint32_t size)
 {
-    loader_port_start_timer(DEFAULT_TIMEOUT);
+    esp_loader_t *ctx = loader_current();
 
-    return loader_flash_defl_end_cmd(!reboot);
-}
+    if (ctx->progress_callback == NULL) {
+        return;
+    }
 
+    ctx->progress_sent = MIN(ctx->progress_sent + size, ctx->progress_total);
+    ctx->progress_blocks[(ctx->sequence_number - 1) % PROGRESS_TRACKED_BLOCKS] = ctx->progress_sent;
+}
 
-esp_loader_error_t esp_loader_mem_start(uint32_t offset, uint32_t size, uint32_t block_size)
+static void progress_block_acked(uint32_t sequence_number)
 {
-    uint32_t blocks_to_write = ROUNDUP(size, block_size);
-    loader_port_start_timer(timeout_per_mb(size, LOAD_RAM_TIMEOUT_PER_MB));
-    return loader_mem_begin_cmd(offset, size, blocks_to_write, block_size);
-}
+    esp_loader_t *ctx = loader_current();
 
+    if (ctx->progress_callback == NULL || ctx->data_command == MEM_DATA) {
+        return;
+    }
 
-esp_loader_error_t esp_loader_mem_write(const void *payload, uint32_t size)
-{
-    const uint8_t *data = (const uint8_t *)payload;
-    loader_port_start_timer(timeout_per_mb(size, LOAD_RAM_TIMEOUT_PER_MB));
-    return loader_mem_data_cmd(data, size);
-}
+    // Entry of the block is reused by a later one once more blocks are in flight than tracked
+    if (ctx->sequence_number - sequence_number > PROGRESS_TRACKED_BLOCKS) {
+        return;
+    }
+    ctx->progress_acked = ctx->progress_blocks[sequence_number % PROGRESS_TRACKED_BLOCKS];
 
+    bool done = ctx->progress_acked == ctx->progress_total;
+    if (ctx->progress_acked - ctx->progress_reported < ctx->progress_granularity && !done) {
+        return;
+    }
+    ctx->progress_reported = ctx->progress_acked;
+
+    uint32_t measured = ctx->progress_acked - ctx->progress_base;
+    uint32_t elapsed = port_clock() - ctx->progress_start;
+    esp_loader_flash_progress_t progress = {
+        .bytes_acked = ctx->progress_acked,
+        .bytes_total = ctx->progress_total,
+        .bytes_on_wire = ctx->progress_wire_bytes,
+        .elapsed_ms = elapsed,
+        .rate = 0,
+        .eta_ms = done ? 0 : UINT32_MAX,
+    };
 
-esp_loader_error_t esp_loader_mem_finish(uint32_t entrypoint)
-{
-    loader_port_start_timer(DEFAULT_TIMEOUT);
-    return loader_mem_end_cmd(entrypoint);
+    if (elapsed > 0 && measured > 0) {
+        progress.rate = (uint32_t)((uint64_t)measured * 1000 / elapsed);
+        uint64_t eta = (uint64_t)(ctx->progress_total - ctx->progress_acked) * elapsed / measured;
+        progress.eta_ms = (eta < UINT32_MAX) ? (uint32_t)eta : UINT32_MAX;
+    }
+
+    ctx->progress_callback(&progress, ctx->progress_callback_arg);
 }
 
 
-esp_loader_error_t esp_loader_read_register(uint32_t address, uint32_t *reg_value)
+void esp_loader_set_flash_progress_callback(esp_loader_flash_progress_cb_t callback, uint32_t granularity, void *arg)
 {
-    loader_port_start_timer(DEFAULT_TIMEOUT);
+    esp_loader_t *ctx = loader_current();
 
-    return loader_read_reg_cmd(address, reg_value);
+    ctx->progress_callback = callback;
+    ctx->progress_callback_arg = arg;
+    ctx->progress_granularity = granularity;
 }
 
-
-esp_loader_error_t esp_loader_write_register(uint32_t address, uint32_t reg_value)
+static esp_loader_error_t wait_flash_acks(uint32_t keep_pending)
 {
-    loader_port_start_timer(DEFAULT_TIMEOUT);
+    esp_loader_t *ctx = loader_current();
+
+    while (loader_data_cmds_pending() > keep_pending) {
+        uint32_t sequence_number;
+        port_start_timer(ctx->ack_timeout);
+        esp_loader_error_t err = loader_data_cmd_wait_ack(&sequence_number);
+        if (err != ESP_LOADER_SUCCESS) {
+            ctx->failed_sequence = sequence_number;
+            return err;
+        }
+        checkpoint_block(sequence_number);
+        progress_block_acked(sequence_number);
+    }
 
-    return loader_write_reg_cmd(address, reg_value, 0xFFFFFFFF, 0);
+    return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t esp_loader_change_transmission_rate(uint32_t transmission_rate)
+// Response to the begin command is waited for later by loader_flash_begin_cmd_wait(), unless wait is set
+static esp_loader_error_t flash_begin(uint32_t offset, uint32_t image_size, uint32_t block_size,
+                                      esp_loader_erase_strategy_t strategy, bool wait)
 {
-    if (s_target == ESP8266_CHIP) {
+    esp_loader_t *ctx = loader_current();
+
+    if (strategy == ESP_LOADER_ERASE_DURING_WRITE && !loader_stub_mode()) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
-    loader_port_start_timer(DEFAULT_TIMEOUT);
+    uint32_t blocks_to_write = (image_size + block_size - 1) / block_size;
+    uint32_t erase_size = block_size * blocks_to_write;
 
-    return loader_change_baudrate_cmd(transmission_rate);
-}
+    ctx->flash_write_size = block_size;
 
-#ifdef MD5_ENABLED
+#ifdef RESUME_MD5
+    // Begin command numbers the blocks anew
+    for (uint32_t i = 0; i < RESUME_CHECKPOINTS; i++) {
+        ctx->checkpoint_sequence[i] = UINT32_MAX;
+    }
+#endif
 
-static void hexify(const uint8_t raw_md5[16], uint8_t hex_md5_out[32])
-{
-    static const uint8_t dec_to_hex[] = {
-        '0', '1', '2', '3', '4', '5', '6', '7',
-        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
-    };
-    for (int i = 0; i < 16; i++) {
-        *hex_md5_out++ = dec_to_hex[raw_md5[i] >> 4];
-        *hex_md5_out++ = dec_to_hex[raw_md5[i] & 0xF];
+    size_t flash_size = 0;
+    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS) {
+        if (image_size + offset > flash_size) {
+            return ESP_LOADER_ERROR_IMAGE_SIZE;
+        }
+        RETURN_ON_ERROR( set_spi_parameters(flash_size) );
+    } else {
+        port_debug_print("Flash size detection failed, falling back to default");
     }
-}
 
+    if (strategy == ESP_LOADER_ERASE_BLOCKS) {
+        // Region ends on a block boundary, so that only its head is erased sector by sector
+        uint32_t end = ROUNDUP(offset + erase_size, FLASH_ERASE_BLOCK_SIZE) * FLASH_ERASE_BLOCK_SIZE;
+        if (flash_size != 0 && end > flash_size) {
+            end = flash_size;
+        }
+        erase_size = MAX(end - offset, erase_size);
+    } else if (strategy == ESP_LOADER_ERASE_NONE) {
+        erase_size = 0;
+    }
 
-esp_loader_error_t esp_loader_flash_verify(void)
+    // Stub erases ahead of the blocks received, the block which crosses into the next
+    // erase block waits for it
+    uint32_t begin_timeout = timeout_per_mb(erase_size, ERASE_REGION_TIMEOUT_PER_MB);
+    ctx->block_erase_timeout = 0;
+    if (strategy == ESP_LOADER_ERASE_DURING_WRITE) {
+        begin_timeout = DEFAULT_TIMEOUT;
+        ctx->block_erase_timeout = timeout_per_mb(MAX(block_size, FLASH_ERASE_BLOCK_SIZE),
+                                                  ERASE_REGION_TIMEOUT_PER_MB);
+    } else if (erase_size == 0) {
+        begin_timeout = DEFAULT_TIMEOUT;
+    }
+
+    bool encryption_in_cmd = encryption_in_begin_flash_cmd(ctx->target);
+
+    port_start_timer(begin_timeout);
+    if (!wait) {
+        return loader_flash_begin_cmd_send(offset, erase_size, block_size, blocks_to_write, encryption_in_cmd);
+    }
+    return loader_flash_begin_cmd(offset, erase_size, block_size, blocks_to_write, encryption_in_cmd);
+}
+
+static esp_loader_error_t flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size, bool wait)
 {
-    if (s_target == ESP8266_CHIP) {
+    esp_loader_t *ctx = loader_current();
+
+    // Flash is not attached over packet transports
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
         return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
     }
 
-    uint8_t raw_md5[16] = {0};
+    // Responses to the previous region's blocks must not be mistaken for the ones of this region
+    RETURN_ON_ERROR( wait_flash_acks(0) );
 
-    /* Zero termination and new line character require 2 bytes */
-    uint8_t hex_md5[MD5_SIZE + 2] = {0};
-    uint8_t received_md5[MD5_SIZE + 2] = {0};
+    init_md5(offset, image_size);
+    stats_region_start(image_size);
+    progress_region_start(image_size, 0);
+
+    ctx->resume_offset = offset;
+    ctx->resume_size = image_size;
+    ctx->resume_base = 0;
+    ctx->resume_written = 0;
+#ifdef RESUME_MD5
+    ctx->resume_md5 = ctx->md5_context;
+#endif
 
-    md5_final(raw_md5);
-    hexify(raw_md5, hex_md5);
+    return flash_begin(offset, image_size, block_size, ctx->erase_strategy, wait);
+}
+
+esp_loader_error_t esp_loader_flash_start(uint32_t offset, uint32_t image_size, uint32_t block_size)
+{
+    return flash_start(offset, image_size, block_size, true);
+}
 
-    loader_port_start_timer(timeout_per_mb(s_image_size, MD5_TIMEOUT_PER_MB));
+esp_loader_error_t esp_loader_flash_resume(uint32_t *written)
+{
+    esp_loader_t *ctx = loader_current();
 
-    RETURN_ON_ERROR( loader_md5_cmd(s_start_address, s_image_size, received_md5) );
+    if (ctx->resume_size == 0) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
 
-    bool md5_match = memcmp(hex_md5, received_md5, MD5_SIZE) == 0;
+    uint32_t resume_at = ctx->resume_written;
 
-    if (!md5_match) {
-        hex_md5[MD5_SIZE] = '\n';
-        received_md5[MD5_SIZE] = '\n';
+#ifdef MD5_ENABLED
+#ifdef RESUME_MD5
+    // Digest continues, so that the whole region is verified at the end
+    ctx->md5_context = ctx->resume_md5;
+    ctx->start_address = ctx->resume_offset;
+    ctx->image_size = ctx->resume_size;
+#else
+    init_md5(ctx->resume_offset + resume_at, ctx->resume_size - resume_at);
+#endif
+#endif
+    stats_region_start(ctx->resume_size - resume_at);
+    progress_region_start(ctx->resume_size, resume_at);
 
-        loader_port_debug_print("Error: MD5 checksum does not match:\n");
-        loader_port_debug_print("Expected:\n");
-        loader_port_debug_print((char *)received_md5);
-        loader_port_debug_print("Actual:\n");
-        loader_port_debug_print((char *)hex_md5);
+    ctx->resume_base = resume_at;
+    *written = resume_at;
 
-        return ESP_LOADER_ERROR_INVALID_MD5;
+    if (resume_at == ctx->resume_size) {
+        return ESP_LOADER_SUCCESS;
     }
 
-    return ESP_LOADER_SUCCESS;
+    // Blocks in flight were lost with the connection, begin command starts numbering them anew.
+    // Sector the failure occurred in may be partially written, so the rest is always erased.
+    esp_loader_erase_strategy_t strategy = ctx->erase_strategy;
+    if (strategy == ESP_LOADER_ERASE_NONE) {
+        strategy = ESP_LOADER_ERASE_REGION;
+    }
+    return flash_begin(ctx->resume_offset + resume_at, ctx->resume_size - resume_at, ctx->flash_write_size,
+                       strategy, true);
 }
 
-esp_loader_error_t esp_loader_get_md5_hex(uint32_t startAddress, uint32_t length, uint8_t expected_md5_hex[32])
+static const uint32_t MIN_AUTO_BLOCK_SIZE = 256;
+
+// Blocks received by ROM CDC driver over USB-OTG are limited by its buffer
+static uint32_t console_block_size(uint32_t block_size)
 {
-    size_t flash_size = 0;
-    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS)
-    {
-        loader_port_start_timer(DEFAULT_TIMEOUT);
-        RETURN_ON_ERROR( loader_spi_parameters(flash_size) );
-    }
+    esp_loader_t *ctx = loader_current();
 
-    loader_port_start_timer(timeout_per_mb(length, MD5_TIMEOUT_PER_MB));
+    if (ctx->console != ESP_LOADER_CONSOLE_USB_OTG) {
+        return block_size;
+    }
 
-    RETURN_ON_ERROR( loader_md5_cmd(startAddress, length, expected_md5_hex) );
-    
-    return ESP_LOADER_SUCCESS;
+    return MIN(block_size, target_usb_otg_block_size(ctx->target));
 }
 
+typedef esp_loader_error_t (*start_fn_t)(uint32_t offset, uint32_t size, uint32_t block_size);
+
+// Halves block size for as long as target reports it as invalid
+static esp_loader_error_t start_with_block_fallback(start_fn_t start, uint32_t offset, uint32_t size,
+                                                    uint32_t target_block_size, uint32_t max_block_size,
+                                                    uint32_t *block_size)
+{
+    uint32_t try_size = MIN(target_block_size, max_block_size);
+    esp_loader_error_t err;
+
+    if (try_size < MIN_AUTO_BLOCK_SIZE) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    while (true) {
+        err = start(offset, size, try_size);
+        if (err != ESP_LOADER_ERROR_INVALID_RESPONSE ||
+            loader_last_status_error() != INVALID_COMMAND ||
+            try_size / 2 < MIN_AUTO_BLOCK_SIZE) {
+            break;
+        }
+        stats_retry();
+        try_size /= 2;
+    }
+
+    if (err == ESP_LOADER_SUCCESS) {
+        *block_size = try_size;
+    }
+
+    return err;
+}
+
+
+esp_loader_error_t esp_loader_flash_start_auto(uint32_t offset, uint32_t image_size,
+                                               uint32_t max_block_size, uint32_t *block_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    uint32_t target_block_size = target_flash_block_size(ctx->target, loader_stub_mode());
+
+    return start_with_block_fallback(esp_loader_flash_start, offset, image_size,
+                                     console_block_size(target_block_size), max_block_size, block_size);
+}
+
+
+esp_loader_error_t esp_loader_flash_defl_start(uint32_t offset, uint32_t image_size, uint32_t compressed_size, uint32_t block_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    uint32_t blocks_to_write = (compressed_size + block_size - 1) / block_size;
+
+    // ROM loader expects uncompressed size rounded up to full blocks, stub the exact one
+    uint32_t erase_size = image_size;
+    if (!loader_stub_mode()) {
+        uint32_t blocks_to_erase = (image_size + block_size - 1) / block_size;
+        erase_size = block_size * blocks_to_erase;
+    }
+
+    // Responses to the previous region's blocks must not be mistaken for the ones of this region
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    ctx->flash_write_size = block_size;
+
+    size_t flash_size = 0;
+    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS) {
+        if (image_size + offset > flash_size) {
+            return ESP_LOADER_ERROR_IMAGE_SIZE;
+        }
+        RETURN_ON_ERROR( set_spi_parameters(flash_size) );
+    } else {
+        port_debug_print("Flash size detection failed, falling back to default");
+    }
+
+    init_md5(offset, image_size);
+    stats_region_start(image_size);
+    progress_region_start(image_size, 0);
+#ifndef ESP_LOADER_TINY
+    inflate_size_init(&ctx->inflate_size);
+#endif
+    ctx->resume_size = 0; // Target's inflater state cannot be restored
+
+    bool encryption_in_cmd = encryption_in_begin_flash_cmd(ctx->target);
+
+    port_start_timer(timeout_per_mb(erase_size, ERASE_REGION_TIMEOUT_PER_MB));
+    return loader_flash_defl_begin_cmd(offset, erase_size, block_size, blocks_to_write, encryption_in_cmd);
+}
+
+static esp_loader_error_t send_flash_block(const void *payload, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    static const uint8_t padding[4] = { PADDING_PATTERN, PADDING_PATTERN, PADDING_PATTERN, PADDING_PATTERN };
+    const uint8_t *data = (const uint8_t *)payload;
+
+    if (size > ctx->flash_write_size) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    uint32_t padding_bytes = ctx->flash_write_size - size;
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_data_cmd_send_padded(FLASH_DATA, data, size, PADDING_PATTERN, padding_bytes) );
+
+    // Hash the block while it is being transmitted and written by the target,
+    // it is computed over the data rounded up to whole words of padding
+    md5_update(data, size);
+    md5_update(padding, MIN(padding_bytes, ((size + 3u) & ~3u) - size));
+    checkpoint_block_sent(ctx->sequence_number - 1);
+    add_block_timeout(DEFAULT_TIMEOUT + ctx->block_erase_timeout);
+    progress_block_sent(size);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_write(const void *payload, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( send_flash_block(payload, size) );
+
+    // Only wait for responses once the window of unacknowledged blocks is full
+    return wait_flash_acks(ctx->flash_write_window - 1);
+}
+
+static esp_loader_error_t send_defl_block(const void *payload, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (size > ctx->flash_write_size) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_data_cmd_send(FLASH_DEFL_DATA, payload, size) );
+
+    // Hash the block while it is being transmitted and inflated by the target
+    md5_update(payload, size);
+
+    // Target writes as much as the block inflates to, which only the stream itself tells.
+    // A stream which cannot be followed keeps the bound of the largest possible write,
+    // so does the tiny profile, which does not follow streams at all.
+    uint32_t timeout = DEFAULT_TIMEOUT * 50;
+    uint32_t inflated_size = 0;
+#ifndef ESP_LOADER_TINY
+    if (inflate_size_scan(&ctx->inflate_size, payload, size, &inflated_size) == ESP_LOADER_SUCCESS) {
+        timeout = timeout_per_mb(inflated_size, ERASE_WRITE_TIMEOUT_PER_MB);
+    } else {
+        inflated_size = 0;
+    }
+#endif
+    add_block_timeout(timeout);
+    progress_block_sent(inflated_size);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_defl_write(const void *payload, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( send_defl_block(payload, size) );
+
+    return wait_flash_acks(ctx->flash_write_window - 1);
+}
+
+
+uint8_t esp_loader_get_last_rom_error(void)
+{
+    return loader_last_status_error();
+}
+
+
+void esp_loader_flash_set_window(uint32_t window)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->flash_write_window = (window > 0) ? window : 1;
+}
+
+
+void esp_loader_flash_set_erase_strategy(esp_loader_erase_strategy_t strategy)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->erase_strategy = strategy;
+}
+
+
+esp_loader_error_t esp_loader_flash_erase_chip(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (!loader_stub_mode()) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    size_t flash_size = DEFAULT_CHIP_SIZE;
+    if (detect_flash_size(&flash_size) != ESP_LOADER_SUCCESS) {
+        flash_size = DEFAULT_CHIP_SIZE;
+    }
+
+    // Region written before cannot be resumed anymore
+    ctx->resume_size = 0;
+
+    port_start_timer(timeout_per_mb(flash_size, ERASE_REGION_TIMEOUT_PER_MB));
+    return loader_erase_flash_cmd();
+}
+
+
+esp_loader_error_t esp_loader_flash_erase_region(uint32_t offset, uint32_t size)
+{
+    if (!loader_stub_mode()) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    if (offset % FLASH_SECTOR_SIZE != 0 || size % FLASH_SECTOR_SIZE != 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    port_start_timer(timeout_per_mb(size, ERASE_REGION_TIMEOUT_PER_MB));
+    return loader_erase_region_cmd(offset, size);
+}
+
+
+esp_loader_error_t esp_loader_flash_wait_pending(void)
+{
+    return wait_flash_acks(0);
+}
+
+
+void esp_loader_set_ack_callback(esp_loader_ack_cb_t callback, void *arg)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->ack_callback = callback;
+    ctx->ack_callback_arg = arg;
+}
+
+
+esp_loader_error_t esp_loader_poll(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    while (loader_data_cmds_pending() > 0) {
+        uint32_t sequence_number;
+        esp_loader_error_t err = loader_data_cmd_poll_ack(&sequence_number);
+        if (err == ESP_LOADER_IN_PROGRESS) {
+            if (port_remaining_time() > 0) {
+                return ESP_LOADER_IN_PROGRESS;
+            }
+            err = ESP_LOADER_ERROR_TIMEOUT;
+        }
+
+        if (ctx->ack_callback != NULL) {
+            ctx->ack_callback(sequence_number, err, ctx->ack_callback_arg);
+        }
+
+        if (err != ESP_LOADER_SUCCESS) {
+            ctx->failed_sequence = sequence_number;
+            return err;
+        }
+        checkpoint_block(sequence_number);
+        progress_block_acked(sequence_number);
+
+        // Next block in flight gets the whole timeout
+        port_start_timer(ctx->ack_timeout);
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+// Blocks are only sent while the window of unacknowledged blocks is not full
+static esp_loader_error_t wait_async_window(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    esp_loader_error_t err = esp_loader_poll();
+    if (err != ESP_LOADER_SUCCESS && err != ESP_LOADER_IN_PROGRESS) {
+        return err;
+    }
+
+    return (loader_data_cmds_pending() < ctx->flash_write_window) ? ESP_LOADER_SUCCESS : ESP_LOADER_IN_PROGRESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_write_async(const void *payload, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( wait_async_window() );
+    RETURN_ON_ERROR( send_flash_block(payload, size) );
+
+    port_start_timer(ctx->ack_timeout);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_defl_write_async(const void *payload, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( wait_async_window() );
+    RETURN_ON_ERROR( send_defl_block(payload, size) );
+
+    port_start_timer(ctx->ack_timeout);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+uint32_t esp_loader_flash_failed_sequence(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    return ctx->failed_sequence;
+}
+
+
+esp_loader_error_t loader_flash_defl_block(const uint8_t *data, uint32_t size, uint32_t inflated_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (size > ctx->flash_write_size) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_data_cmd_send(FLASH_DEFL_DATA, data, size) );
+
+    add_block_timeout(timeout_per_mb(inflated_size, ERASE_WRITE_TIMEOUT_PER_MB));
+    progress_block_sent(inflated_size);
+
+    return wait_flash_acks(ctx->flash_write_window - 1);
+}
+
+
+static esp_loader_error_t send_deflated_block(void *arg, const uint8_t *data, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    (void)arg;
+
+    // Compressor knows how much input went into the block
+    return loader_flash_defl_block(data, size, ctx->deflate.block_input);
+}
+
+
+esp_loader_error_t esp_loader_flash_deflate_start(uint32_t offset, uint32_t image_size, uint32_t block_size,
+                                                  void *work, uint32_t work_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    // Fixed Huffman codes take at most 9 bits per byte, plus zlib header and trailer
+    uint32_t compressed_size_bound = image_size + image_size / 8 + 16;
+
+    RETURN_ON_ERROR( deflate_init(&ctx->deflate, work, work_size, block_size, send_deflated_block, NULL) );
+
+    return esp_loader_flash_defl_start(offset, image_size, compressed_size_bound, block_size);
+}
+
+
+esp_loader_error_t esp_loader_flash_deflate_write(const void *data, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( deflate_write(&ctx->deflate, data, size) );
+
+    // Target computes MD5 of the uncompressed image. Hashing after compression
+    // lets any block completed by this call go out on the wire first.
+    md5_update(data, size);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_flash_deflate_flush(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( deflate_finish(&ctx->deflate) );
+
+    return esp_loader_flash_wait_pending();
+}
+
+
+esp_loader_error_t esp_loader_flash_finish(bool reboot)
+{
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    port_start_timer(DEFAULT_TIMEOUT);
+
+    return loader_flash_end_cmd(!reboot);
+}
+
+esp_loader_error_t esp_loader_flash_defl_finish(bool reboot)
+{
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    port_start_timer(DEFAULT_TIMEOUT);
+
+    return loader_flash_defl_end_cmd(!reboot);
+}
+
+
+esp_loader_error_t esp_loader_mem_start(uint32_t offset, uint32_t size, uint32_t block_size)
+{
+    uint32_t blocks_to_write = ROUNDUP(size, block_size);
+    port_start_timer(timeout_per_mb(size, LOAD_RAM_TIMEOUT_PER_MB));
+    return loader_mem_begin_cmd(offset, size, blocks_to_write, block_size);
+}
+
+
+esp_loader_error_t esp_loader_mem_start_auto(uint32_t offset, uint32_t size,
+                                             uint32_t max_block_size, uint32_t *block_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    uint32_t target_block_size = console_block_size(target_ram_block_size(ctx->target));
+
+    return start_with_block_fallback(esp_loader_mem_start, offset, size,
+                                     target_block_size, max_block_size, block_size);
+}
+
+
+esp_loader_error_t esp_loader_mem_write(const void *payload, uint32_t size)
+{
+    const uint8_t *data = (const uint8_t *)payload;
+    port_start_timer(timeout_per_mb(size, LOAD_RAM_TIMEOUT_PER_MB));
+    return loader_mem_data_cmd(data, size);
+}
+
+
+esp_loader_error_t esp_loader_mem_finish(uint32_t entrypoint)
+{
+    port_start_timer(DEFAULT_TIMEOUT);
+    return loader_mem_end_cmd(entrypoint);
+}
+
+
+#define ESP_IMAGE_MAGIC                 0xE9
+#define ESP_IMAGE_EXTENDED_HEADER_SIZE  16
+
+typedef struct __attribute__((packed)) {
+    uint8_t magic;
+    uint8_t segments;
+    uint8_t flash_mode;
+    uint8_t flash_size_freq;
+    uint32_t entrypoint;
+} image_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t address;
+    uint32_t size;
+} image_segment_t;
+
+// Begin command is sent behind the blocks of the previous segment still in flight
+static esp_loader_error_t begin_image_segment(const image_segment_t *segment, uint32_t block_size)
+{
+    uint32_t blocks_to_write = ROUNDUP(segment->size, block_size);
+
+    RETURN_ON_ERROR( loader_mem_begin_cmd_send(segment->address, segment->size, blocks_to_write, block_size) );
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    port_start_timer(timeout_per_mb(segment->size, LOAD_RAM_TIMEOUT_PER_MB));
+    return loader_mem_begin_cmd_wait();
+}
+
+static esp_loader_error_t stream_image_segment(esp_loader_image_read_cb_t read, void *arg,
+                                               uint8_t *buffer, uint32_t size, uint32_t block_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    while (size > 0) {
+        uint32_t to_write = MIN(size, block_size);
+        RETURN_ON_ERROR( read(buffer, to_write, arg) );
+
+        // Buffer is free again once the block is handed to the port
+        port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_data_cmd_send(MEM_DATA, buffer, to_write) );
+        add_block_timeout(timeout_per_mb(to_write, LOAD_RAM_TIMEOUT_PER_MB));
+
+        RETURN_ON_ERROR( wait_flash_acks(ctx->flash_write_window - 1) );
+        size -= to_write;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_load_ram_image(esp_loader_image_read_cb_t read, void *arg,
+                                             uint8_t *buffer, uint32_t buffer_size)
+{
+    esp_loader_t *ctx = loader_current();
+    image_header_t header;
+    uint32_t block_size = 0;
+
+    if (buffer_size < ESP_IMAGE_EXTENDED_HEADER_SIZE) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    RETURN_ON_ERROR( read((uint8_t *)&header, sizeof(header), arg) );
+    if (header.magic != ESP_IMAGE_MAGIC) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    // Only ESP8266 images lack the extended header, nothing in it matters for loading
+    if (!TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        RETURN_ON_ERROR( read(buffer, ESP_IMAGE_EXTENDED_HEADER_SIZE, arg) );
+    }
+
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    for (uint32_t i = 0; i < header.segments; i++) {
+        image_segment_t segment;
+        RETURN_ON_ERROR( read((uint8_t *)&segment, sizeof(segment), arg) );
+
+        // Block size target accepts is found with the first segment, the rest uses it as well
+        if (block_size == 0) {
+            RETURN_ON_ERROR( esp_loader_mem_start_auto(segment.address, segment.size, buffer_size, &block_size) );
+        } else {
+            RETURN_ON_ERROR( begin_image_segment(&segment, block_size) );
+        }
+
+        RETURN_ON_ERROR( stream_image_segment(read, arg, buffer, segment.size, block_size) );
+    }
+
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    return esp_loader_mem_finish(header.entrypoint);
+}
+
+
+static esp_loader_error_t load_stub_segment(uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    uint32_t block_size;
+
+    if (size == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    RETURN_ON_ERROR( esp_loader_mem_start_auto(addr, size, UINT32_MAX, &block_size) );
+
+    while (size > 0) {
+        uint32_t to_write = MIN(size, block_size);
+        RETURN_ON_ERROR( esp_loader_mem_write(data, to_write) );
+        data += to_write;
+        size -= to_write;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_run_stub(const esp_loader_stub_t *stub)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (loader_stub_mode()) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    RETURN_ON_ERROR( load_stub_segment(stub->text_addr, stub->text, stub->text_size) );
+    RETURN_ON_ERROR( load_stub_segment(stub->data_addr, stub->data, stub->data_size) );
+    RETURN_ON_ERROR( esp_loader_mem_finish(stub->entry) );
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_wait_stub_greeting() );
+
+    loader_set_stub_mode(true);
+    // Stub keeps its own flash configuration
+    ctx->spi_params_set = false;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+bool esp_loader_stub_running(void)
+{
+    return loader_stub_mode();
+}
+
+
+esp_loader_error_t esp_loader_read_register(uint32_t address, uint32_t *reg_value)
+{
+    port_start_timer(DEFAULT_TIMEOUT);
+
+    return loader_read_reg_cmd(address, reg_value);
+}
+
+
+esp_loader_error_t esp_loader_write_register(uint32_t address, uint32_t reg_value)
+{
+    port_start_timer(DEFAULT_TIMEOUT);
+
+    return loader_write_reg_cmd(address, reg_value, 0xFFFFFFFF, 0);
+}
+
+esp_loader_error_t esp_loader_change_transmission_rate(uint32_t transmission_rate)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    // Rate of USB has no effect, the target would only acknowledge the command
+    if (ctx->console == ESP_LOADER_CONSOLE_UART) {
+        port_start_timer(DEFAULT_TIMEOUT);
+
+        RETURN_ON_ERROR( loader_change_baudrate_cmd(transmission_rate, ctx->transmission_rate) );
+    }
+
+    ctx->transmission_rate = transmission_rate;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+// Ports which cannot change the transmission rate do not have to implement it
+__attribute__ ((weak)) esp_loader_error_t loader_port_change_transmission_rate(uint32_t transmission_rate)
+{
+    (void)transmission_rate;
+
+    return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+}
+
+
+static esp_loader_error_t check_transmission_rate(void)
+{
+    uint32_t value;
+
+    for (uint32_t i = 0; i < RATE_CHECK_ROUNDS; i++) {
+        RETURN_ON_ERROR( esp_loader_read_register(CHIP_DETECT_MAGIC_REG_ADDR, &value) );
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+// Switches both sides to the new rate and checks the link with a few round trips
+static esp_loader_error_t try_transmission_rate(uint32_t transmission_rate)
+{
+    RETURN_ON_ERROR( esp_loader_change_transmission_rate(transmission_rate) );
+    RETURN_ON_ERROR( port_change_transmission_rate(transmission_rate) );
+
+    // Garbage received while the rates did not match is skipped when looking for the response
+    port_delay_ms(RATE_SETTLE_TIME_MS);
+
+    return check_transmission_rate();
+}
+
+
+static esp_loader_error_t restore_transmission_rate(uint32_t transmission_rate)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->transmission_rate == transmission_rate) {
+        // Target did not accept the change
+        return port_change_transmission_rate(transmission_rate);
+    }
+
+    // Target switched, ask it to return over the unreliable link
+    esp_loader_error_t err = ESP_LOADER_ERROR_FAIL;
+    for (uint32_t i = 0; i < RATE_CHECK_ROUNDS && err != ESP_LOADER_SUCCESS; i++) {
+        err = try_transmission_rate(transmission_rate);
+    }
+
+    return err;
+}
+
+
+// Settles on the fastest stable candidate slower than limit, or on the base rate
+static esp_loader_error_t select_transmission_rate(uint32_t limit, uint32_t *transmission_rate)
+{
+    esp_loader_t *ctx = loader_current();
+
+    for (uint32_t i = 0; i <= ctx->rate_count; i++) {
+        uint32_t candidate = (i < ctx->rate_count) ? ctx->rates[i] : ctx->base_rate;
+        uint32_t previous_rate = ctx->transmission_rate;
+
+        if (candidate >= limit || candidate < ctx->base_rate || candidate == previous_rate) {
+            continue;
+        }
+
+        if (try_transmission_rate(candidate) == ESP_LOADER_SUCCESS) {
+            break;
+        }
+
+        stats_retry();
+        RETURN_ON_ERROR( restore_transmission_rate(previous_rate) );
+    }
+
+    *transmission_rate = ctx->transmission_rate;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t esp_loader_negotiate_transmission_rate(const uint32_t *rates, uint32_t count,
+                                                          uint32_t current_rate, uint32_t *transmission_rate)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    ctx->rates = rates;
+    ctx->rate_count = count;
+    ctx->base_rate = current_rate;
+    ctx->transmission_rate = current_rate;
+
+    // Nothing to gain over USB, there is no lower rate to fall back to either
+    if (ctx->console != ESP_LOADER_CONSOLE_UART) {
+        ctx->rate_count = 0;
+        *transmission_rate = current_rate;
+        return ESP_LOADER_SUCCESS;
+    }
+
+    return select_transmission_rate(UINT32_MAX, transmission_rate);
+}
+
+
+esp_loader_error_t esp_loader_lower_transmission_rate(uint32_t *transmission_rate)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->rates == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    uint32_t previous_rate = ctx->transmission_rate;
+
+    RETURN_ON_ERROR( select_transmission_rate(previous_rate, transmission_rate) );
+
+    return (*transmission_rate < previous_rate) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_FAIL;
+}
+
+
+esp_loader_error_t esp_loader_flash_read(uint32_t address, uint32_t length, uint8_t *buffer,
+                                         uint32_t block_size, uint32_t max_in_flight,
+                                         esp_loader_read_cb_t callback, void *arg)
+{
+    if (!loader_stub_mode()) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    // Digest frame is received into the same buffer
+    if (buffer == NULL || block_size < MD5_SIZE / 2 || max_in_flight == 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_read_flash_cmd(address, length, block_size, max_in_flight) );
+
+#ifdef MD5_ENABLED
+    struct MD5Context md5_context;
+    MD5Init(&md5_context);
+#endif
+
+    uint32_t received = 0;
+    while (received < length) {
+        uint32_t size;
+        port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_read_flash_data(buffer, block_size, &size) );
+
+        // Only the last packet can be shorter
+        if (size > block_size || size > length - received ||
+            (size < block_size && received + size < length)) {
+            return ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+
+        received += size;
+        // Let the target continue while the data is consumed
+        RETURN_ON_ERROR( loader_read_flash_ack(received) );
+
+#ifdef MD5_ENABLED
+        MD5Update(&md5_context, buffer, size);
+#endif
+        RETURN_ON_ERROR( callback(buffer, size, arg) );
+    }
+
+    uint32_t digest_size;
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_read_flash_data(buffer, block_size, &digest_size) );
+    if (digest_size != MD5_SIZE / 2) {
+        return ESP_LOADER_ERROR_INVALID_RESPONSE;
+    }
+
+#ifdef MD5_ENABLED
+    uint8_t digest[MD5_SIZE / 2];
+    MD5Final(digest, &md5_context);
+    if (memcmp(digest, buffer, sizeof(digest)) != 0) {
+        port_debug_print("Error: MD5 of flash read does not match\n");
+        return ESP_LOADER_ERROR_INVALID_MD5;
+    }
 #endif
 
+    return ESP_LOADER_SUCCESS;
+}
+
+#ifdef MD5_ENABLED
+
+esp_loader_error_t esp_loader_flash_verify(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR( esp_loader_flash_wait_pending() );
+
+    uint8_t raw_md5[16] = {0};
+
+    /* Zero termination and new line character require 2 bytes */
+    uint8_t hex_md5[MD5_SIZE + 2] = {0};
+    uint8_t received_md5[MD5_SIZE + 2] = {0};
+
+    md5_final(raw_md5);
+    loader_hexify(raw_md5, sizeof(raw_md5), hex_md5);
+
+    port_start_timer(timeout_per_mb(ctx->image_size, MD5_TIMEOUT_PER_MB));
+
+    RETURN_ON_ERROR( loader_md5_cmd(ctx->start_address, ctx->image_size, received_md5) );
+
+    bool md5_match = memcmp(hex_md5, received_md5, MD5_SIZE) == 0;
+
+    if (!md5_match) {
+        hex_md5[MD5_SIZE] = '\n';
+        received_md5[MD5_SIZE] = '\n';
+
+        port_debug_print("Error: MD5 checksum does not match:\n");
+        port_debug_print("Expected:\n");
+        port_debug_print((char *)received_md5);
+        port_debug_print("Actual:\n");
+        port_debug_print((char *)hex_md5);
+
+        return ESP_LOADER_ERROR_INVALID_MD5;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t esp_loader_get_md5_hex(uint32_t startAddress, uint32_t length, uint8_t expected_md5_hex[32])
+{
+    size_t flash_size = 0;
+    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS)
+    {
+        RETURN_ON_ERROR( set_spi_parameters(flash_size) );
+    }
+
+    port_start_timer(timeout_per_mb(length, MD5_TIMEOUT_PER_MB));
+
+    RETURN_ON_ERROR( loader_md5_cmd(startAddress, length, expected_md5_hex) );
+    
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t flash_sync_write(const esp_loader_flash_sync_args_t *args,
+                                           uint32_t start, uint32_t size)
+{
+    const uint8_t *data = args->data + start;
+
+    RETURN_ON_ERROR( esp_loader_flash_start(args->offset + start, size, args->block_size) );
+
+    while (size > 0) {
+        uint32_t to_write = MIN(size, args->block_size);
+        RETURN_ON_ERROR( esp_loader_flash_write(data, to_write) );
+
+        data += to_write;
+        size -= to_write;
+    }
+
+    return esp_loader_flash_verify();
+}
+
+esp_loader_error_t esp_loader_flash_sync(const esp_loader_flash_sync_args_t *args,
+                                         esp_loader_flash_sync_stats_t *stats)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    // Erase of a written range must never reach into a neighbouring, skipped one
+    if (args->block_size == 0 || args->region_size == 0 ||
+        args->offset % FLASH_SECTOR_SIZE != 0 || args->region_size % FLASH_SECTOR_SIZE != 0 ||
+        args->region_size % args->block_size != 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    size_t flash_size = 0;
+    if (detect_flash_size(&flash_size) == ESP_LOADER_SUCCESS) {
+        if (args->size + args->offset > flash_size) {
+            return ESP_LOADER_ERROR_IMAGE_SIZE;
+        }
+        RETURN_ON_ERROR( set_spi_parameters(flash_size) );
+    }
+
+    // Range of consecutive regions which differ and are yet to be written
+    uint32_t pending_start = 0;
+    uint32_t pending_size = 0;
+
+    for (uint32_t pos = 0; pos < args->size; pos += args->region_size) {
+        uint32_t region_size = MIN(args->region_size, args->size - pos);
+        struct MD5Context md5_context;
+        uint8_t raw_md5[16];
+        uint8_t host_md5[MD5_SIZE];
+        uint8_t target_md5[MD5_SIZE];
+
+        MD5Init(&md5_context);
+        MD5Update(&md5_context, args->data + pos, region_size);
+        MD5Final(raw_md5, &md5_context);
+        loader_hexify(raw_md5, sizeof(raw_md5), host_md5);
+
+        port_start_timer(timeout_per_mb(region_size, MD5_TIMEOUT_PER_MB));
+        RETURN_ON_ERROR( loader_md5_cmd(args->offset + pos, region_size, target_md5) );
+
+        if (memcmp(host_md5, target_md5, MD5_SIZE) != 0) {
+            if (pending_size == 0) {
+                pending_start = pos;
+            }
+            pending_size += region_size;
+            continue;
+        }
+
+        stats->bytes_skipped += region_size;
+
+        if (pending_size > 0) {
+            RETURN_ON_ERROR( flash_sync_write(args, pending_start, pending_size) );
+            stats->bytes_written += pending_size;
+            stats->ranges_written++;
+            pending_size = 0;
+        }
+    }
+
+    if (pending_size > 0) {
+        RETURN_ON_ERROR( flash_sync_write(args, pending_start, pending_size) );
+        stats->bytes_written += pending_size;
+        stats->ranges_written++;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+#endif
+
+// MD5 commands in flight, one being computed by the target while the next one waits in its FIFO
+static const uint32_t MD5_BATCH_WINDOW = 2;
+
+static esp_loader_error_t audit_wait(esp_loader_audit_region_t *region)
+{
+    uint8_t expected[MD5_SIZE + 1];
+    uint8_t received[MD5_SIZE + 1];
+
+    // Target starts on the range once it is done with the previous one
+    port_start_timer(timeout_per_mb(region->length, MD5_TIMEOUT_PER_MB));
+    RETURN_ON_ERROR( loader_md5_cmd_wait(received) );
+
+    loader_hexify(region->md5, sizeof(region->md5), expected);
+    region->matches = memcmp(expected, received, MD5_SIZE) == 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Digests are requested behind the blocks still in flight, each command taking the place of
+// a block, and the acknowledgements of the blocks come before them
+static esp_loader_error_t audit_regions(esp_loader_audit_region_t *regions, uint32_t count)
+{
+    esp_loader_t *ctx = loader_current();
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+    uint32_t mismatches = 0;
+    uint32_t sent = 0;
+    uint32_t done = 0;
+
+    while (done < count) {
+        if (sent < count && sent - done < MD5_BATCH_WINDOW && err == ESP_LOADER_SUCCESS) {
+            uint32_t in_flight = sent - done + 1;
+            err = wait_flash_acks((ctx->flash_write_window > in_flight) ? ctx->flash_write_window - in_flight : 0);
+            if (err == ESP_LOADER_SUCCESS) {
+                port_start_timer(DEFAULT_TIMEOUT);
+                err = loader_md5_cmd_send(regions[sent].address, regions[sent].length);
+            }
+            if (err == ESP_LOADER_SUCCESS) {
+                sent++;
+            }
+            continue;
+        }
+
+        if (done == sent) {
+            break;
+        }
+
+        // Responses to the commands already sent are consumed even after an error
+        esp_loader_error_t wait_err = wait_flash_acks(0);
+        if (wait_err == ESP_LOADER_SUCCESS) {
+            wait_err = audit_wait(&regions[done]);
+        }
+        mismatches += (wait_err == ESP_LOADER_SUCCESS && !regions[done].matches) ? 1 : 0;
+        done++;
+        if (err == ESP_LOADER_SUCCESS) {
+            err = wait_err;
+        }
+        if (wait_err == ESP_LOADER_ERROR_TIMEOUT) {
+            break;
+        }
+    }
+
+    RETURN_ON_ERROR( err );
+
+    return (mismatches == 0) ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_INVALID_MD5;
+}
+
+esp_loader_error_t esp_loader_flash_audit(esp_loader_audit_region_t *regions, uint32_t count)
+{
+    esp_loader_t *ctx = loader_current();
+    size_t flash_size;
+
+    if (TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    // Commands below would take acknowledgements of blocks still in flight for their responses
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    RETURN_ON_ERROR( detect_flash_size(&flash_size) );
+
+    for (uint32_t i = 0; i < count; i++) {
+        regions[i].matches = false;
+        if (regions[i].address > flash_size || regions[i].length > flash_size - regions[i].address) {
+            return ESP_LOADER_ERROR_IMAGE_SIZE;
+        }
+    }
+
+    RETURN_ON_ERROR( set_spi_parameters(flash_size) );
+
+    return audit_regions(regions, count);
+}
+
+esp_loader_error_t loader_flash_audit_pending(esp_loader_audit_region_t *regions, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        regions[i].matches = false;
+    }
+
+    return audit_regions(regions, count);
+}
+
+
+// Target of the gang leaves it with its first error, the others carry on without it
+static bool gang_live(const esp_loader_error_t *results, uint32_t i)
+{
+    return results[i] == ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t gang_start(const esp_loader_gang_flash_args_t *args)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (args->verify && TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR( flash_start(args->offset, args->size, args->block_size, false) );
+
+    // Digest is kept by the gang, the region cannot be resumed by the target alone
+    ctx->resume_size = 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t gang_send(const uint8_t *frame, size_t frame_size, uint32_t block_size, uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_data_cmd_send_encoded(FLASH_DATA, frame, frame_size, block_size) );
+
+    add_block_timeout(DEFAULT_TIMEOUT + ctx->block_erase_timeout);
+    progress_block_sent(size);
+
+    port_start_timer(ctx->ack_timeout);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+#ifdef MD5_ENABLED
+static void gang_verify(const esp_loader_gang_flash_args_t *args, esp_loader_error_t *results,
+                        struct MD5Context *md5_context)
+{
+    uint8_t raw_md5[16];
+    uint8_t expected[MD5_SIZE + 1];
+
+    MD5Final(raw_md5, md5_context);
+    loader_hexify(raw_md5, sizeof(raw_md5), expected);
+
+    // Targets compute their digests at once
+    for (uint32_t i = 0; i < args->count; i++) {
+        if (gang_live(results, i)) {
+            esp_loader_select(args->loaders[i]);
+            port_start_timer(timeout_per_mb(args->size, MD5_TIMEOUT_PER_MB));
+            results[i] = loader_md5_cmd_send(args->offset, args->size);
+        }
+    }
+
+    for (uint32_t i = 0; i < args->count; i++) {
+        uint8_t received[MD5_SIZE + 1];
+
+        if (!gang_live(results, i)) {
+            continue;
+        }
+        esp_loader_select(args->loaders[i]);
+        results[i] = loader_md5_cmd_wait(received);
+        if (results[i] == ESP_LOADER_SUCCESS && memcmp(expected, received, MD5_SIZE) != 0) {
+            results[i] = ESP_LOADER_ERROR_INVALID_MD5;
+        }
+    }
+}
+#endif
+
+esp_loader_error_t esp_loader_gang_flash(const esp_loader_gang_flash_args_t *args, esp_loader_error_t *results)
+{
+    const uint32_t slot_size = ESP_LOADER_GANG_FRAME_SIZE(args->block_size);
+
+    if (args->count == 0 || args->image == NULL || args->size == 0 || args->block_size == 0 ||
+        args->lag == 0 || args->lag > ESP_LOADER_GANG_MAX_LAG || args->frames == NULL ||
+        args->frames_size / slot_size < args->lag) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+#ifdef MD5_ENABLED
+    struct MD5Context md5_context;
+    MD5Init(&md5_context);
+#else
+    if (args->verify) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+#endif
+
+    esp_loader_t *selected = loader_current();
+
+    // Erase takes the longest, all targets are told to start before any response is waited for
+    for (uint32_t i = 0; i < args->count; i++) {
+        esp_loader_select(args->loaders[i]);
+        results[i] = gang_start(args);
+    }
+    for (uint32_t i = 0; i < args->count; i++) {
+        if (gang_live(results, i)) {
+            esp_loader_select(args->loaders[i]);
+            results[i] = loader_flash_begin_cmd_wait();
+        }
+    }
+
+    // Ring of the last lag blocks encoded, target which is furthest ahead encodes the next one.
+    // Sequence number of each block is its index, the same on every target.
+    const uint32_t blocks = ROUNDUP(args->size, args->block_size);
+    size_t frame_sizes[ESP_LOADER_GANG_MAX_LAG];
+    uint32_t encoded = 0;
+
+    while (true) {
+        uint32_t slowest = UINT32_MAX;      // Blocks sent to the target furthest behind
+        uint32_t straggler = args->count;   // Target furthest behind, with blocks in flight
+        uint32_t straggler_sent = UINT32_MAX;
+        bool busy = false;
+        bool sent = false;
+
+        for (uint32_t i = 0; i < args->count; i++) {
+            if (gang_live(results, i)) {
+                esp_loader_select(args->loaders[i]);
+                slowest = MIN(slowest, loader_current()->sequence_number);
+            }
+        }
+
+        for (uint32_t i = 0; i < args->count; i++) {
+            if (!gang_live(results, i)) {
+                continue;
+            }
+            esp_loader_select(args->loaders[i]);
+            esp_loader_t *ctx = loader_current();
+
+            esp_loader_error_t err = esp_loader_poll();
+            if (err != ESP_LOADER_SUCCESS && err != ESP_LOADER_IN_PROGRESS) {
+                results[i] = err;
+                continue;
+            }
+
+            while (ctx->sequence_number < blocks && loader_data_cmds_pending() < ctx->flash_write_window) {
+                uint32_t block = ctx->sequence_number;
+                uint32_t slot = block % args->lag;
+                uint32_t pos = block * args->block_size;
+                uint32_t size = MIN(args->block_size, args->size - pos);
+
+                if (block == encoded) {
+                    // Slot is still needed by the target furthest behind
+                    if (encoded - slowest >= args->lag) {
+                        break;
+                    }
+
+                    uint32_t padding_bytes = args->block_size - size;
+                    err = loader_data_cmd_encode(FLASH_DATA, &args->image[pos], size, PADDING_PATTERN,
+                                                 padding_bytes, block, &args->frames[slot * slot_size],
+                                                 slot_size, &frame_sizes[slot]);
+                    if (err != ESP_LOADER_SUCCESS) {
+                        results[i] = err;
+                        break;
+                    }
+#ifdef MD5_ENABLED
+                    // Same digest as send_flash_block() computes
+                    static const uint8_t padding[4] = { PADDING_PATTERN, PADDING_PATTERN, PADDING_PATTERN, PADDING_PATTERN };
+                    MD5Update(&md5_context, &args->image[pos], size);
+                    MD5Update(&md5_context, padding, MIN(padding_bytes, ((size + 3u) & ~3u) - size));
+#endif
+                    encoded++;
+                }
+
+                err = gang_send(&args->frames[slot * slot_size], frame_sizes[slot], args->block_size, size);
+                if (err != ESP_LOADER_SUCCESS) {
+                    results[i] = err;
+                    break;
+                }
+                sent = true;
+            }
+
+            if (!gang_live(results, i)) {
+                continue;
+            }
+            if (ctx->sequence_number < blocks || loader_data_cmds_pending() > 0) {
+                busy = true;
+            }
+            if (loader_data_cmds_pending() > 0 && ctx->sequence_number < straggler_sent) {
+                straggler = i;
+                straggler_sent = ctx->sequence_number;
+            }
+        }
+
+        if (!busy) {
+            break;
+        }
+
+        // Nothing could be sent, the target holding back the others is waited for
+        if (!sent && straggler < args->count) {
+            esp_loader_select(args->loaders[straggler]);
+            results[straggler] = wait_flash_acks(loader_data_cmds_pending() - 1);
+        }
+    }
+
+#ifdef MD5_ENABLED
+    if (args->verify) {
+        gang_verify(args, results, &md5_context);
+    }
+#endif
+
+    esp_loader_select(selected);
+
+    for (uint32_t i = 0; i < args->count; i++) {
+        if (!gang_live(results, i)) {
+            return ESP_LOADER_ERROR_FAIL;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+void esp_loader_set_tx_buffer(uint8_t *buffer, uint32_t size)
+{
+    SLIP_set_tx_buffer(buffer, size);
+}
+
 void esp_loader_reset_target(void)
 {
-    loader_port_reset_target();
+    port_reset_target();
+}
+
+void esp_loader_set_reset_timing(const esp_loader_reset_timing_t *timing)
+{
+    esp_loader_t *ctx = loader_current();
+    const esp_loader_reset_timing_t defaults = DEFAULT_RESET_TIMING;
+
+    ctx->reset_timing = (timing != NULL) ? *timing : defaults;
+}
+
+void esp_loader_get_reset_timing(esp_loader_reset_timing_t *timing)
+{
+    esp_loader_t *ctx = loader_current();
+
+    *timing = ctx->reset_timing;
+}
+
+// Bits of RTC_CNTL_OPTIONS0_REG and RTC_CNTL_OPTION1_REG
+#define RTC_CNTL_SW_SYS_RST             (1u << 31)
+#define RTC_CNTL_FORCE_DOWNLOAD_BOOT    (1u << 0)
+
+esp_loader_error_t esp_loader_soft_reset_to_loader(esp_loader_connect_args_t *connect_args)
+{
+    esp_loader_t *ctx = loader_current();
+    uint32_t options0, option1;
+
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    // USB console of the target is re-enumerated by the reset, the host port would be lost with it
+    if (!target_soft_reset_regs(ctx->target, &options0, &option1) ||
+            ctx->console != ESP_LOADER_CONSOLE_UART) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_write_reg_cmd(option1, RTC_CNTL_FORCE_DOWNLOAD_BOOT,
+                                          RTC_CNTL_FORCE_DOWNLOAD_BOOT, 0) );
+
+    // Target resets before it could respond
+    port_start_timer(DEFAULT_TIMEOUT);
+    RETURN_ON_ERROR( loader_write_reg_cmd_send(options0, RTC_CNTL_SW_SYS_RST, RTC_CNTL_SW_SYS_RST, 0) );
+
+    if (ctx->rates != NULL && ctx->transmission_rate != ctx->base_rate) {
+        RETURN_ON_ERROR( port_change_transmission_rate(ctx->base_rate) );
+    }
+
+    reset_link_state(connect_args->transmission_rate);
+
+    RETURN_ON_ERROR( sync_with_target(connect_args, NULL) );
+
+    return attach_flash();
+}
+
+esp_loader_error_t esp_loader_soft_reset_to_run(void)
+{
+    esp_loader_t *ctx = loader_current();
+    uint32_t options0, option1;
+
+    RETURN_ON_ERROR( wait_flash_acks(0) );
+
+    if (target_soft_reset_regs(ctx->target, &options0, &option1)) {
+        port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_write_reg_cmd(option1, 0, RTC_CNTL_FORCE_DOWNLOAD_BOOT, 0) );
+
+        port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_write_reg_cmd_send(options0, RTC_CNTL_SW_SYS_RST, RTC_CNTL_SW_SYS_RST, 0) );
+    } else {
+        // ROM loader only reboots at the end of a flash region, an empty one is begun for that
+        port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_flash_begin_cmd(0, 0, 0, 0, encryption_in_begin_flash_cmd(ctx->target)) );
+
+        port_start_timer(DEFAULT_TIMEOUT);
+        RETURN_ON_ERROR( loader_flash_end_cmd(false) );
+    }
+
+    if (ctx->rates != NULL && ctx->transmission_rate != ctx->base_rate) {
+        RETURN_ON_ERROR( port_change_transmission_rate(ctx->base_rate) );
+    }
+
+    // Nothing set up with the loader outlives the reboot
+    reset_link_state(0);
+
+    return ESP_LOADER_SUCCESS;
 }
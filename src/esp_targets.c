@@ -15,10 +15,13 @@
 
 #include "esp_targets.h"
 #include <stddef.h>
+#include <string.h>
 
 #define MAX_MAGIC_VALUES 2
 
 typedef esp_loader_error_t (*read_spi_config_t)(uint32_t efuse_base, uint32_t *spi_config);
+// Decodes snapshot fields from eFuse words, followed by the value of efuse_snapshot_extra
+typedef void (*decode_efuse_t)(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
 
 typedef struct {
     target_registers_t regs;
@@ -26,21 +29,77 @@ typedef struct {
     uint32_t chip_magic_value[MAX_MAGIC_VALUES];
     read_spi_config_t read_spi_config;
     bool encryption_in_begin_flash_cmd;
+    uint32_t uartdev_buf_no;        // ROM variable holding console in use, 0 if UART is the only one
+    uint32_t flash_block_size;      // Largest FLASH_DATA payload accepted by ROM loader
+    uint32_t ram_block_size;        // Largest MEM_DATA payload accepted by ROM loader
+    uint32_t stub_block_size;       // Largest FLASH_DATA payload accepted by flasher stub
+    uint32_t usb_otg_block_size;    // Largest block ROM CDC driver receives over USB-OTG, 0 if not available
+    uint32_t usb_otg_buf_no;        // Its value while ROM uses USB-OTG CDC, 0 if not available
+    uint32_t usb_serial_jtag_buf_no;// Its value while ROM uses USB-Serial/JTAG, 0 if not available
+    uint32_t rtc_options0;          // RTC_CNTL_OPTIONS0_REG, whose SW_SYS_RST bit resets the chip
+    uint32_t rtc_option1;           // RTC_CNTL_OPTION1_REG, whose FORCE_DOWNLOAD_BOOT bit keeps it in ROM loader
+    uint32_t efuse_snapshot_addr;   // First eFuse word of the snapshot, holding low bits of MAC
+    uint32_t efuse_snapshot_extra;  // Register read besides eFuse words, 0 if none
+    decode_efuse_t decode_efuse;    // NULL if eFuses are not decoded
 } esp_target_t;
 
-// This ROM address has a different value on each chip model
-#define CHIP_DETECT_MAGIC_REG_ADDR 0x40001000
-
 #define ESP8266_SPI_REG_BASE 0x60000200
 #define ESP32S2_SPI_REG_BASE 0x3f402000
 #define ESP32xx_SPI_REG_BASE 0x60002000
 #define ESP32_SPI_REG_BASE   0x3ff42000
 
+#define ROM_FLASH_BLOCK_SIZE 0x400
+#define ROM_RAM_BLOCK_SIZE   0x1800
+#define STUB_BLOCK_SIZE      0x4000
+#define USB_OTG_BLOCK_SIZE   0x800      // Receive buffer of ROM CDC driver, the stub keeps using it
+
+// Only the target the library is built for is described, if any
+#ifdef SINGLE_TARGET
+#define TARGET_COUNT 1
+#define TARGET_INDEX(chip) 0
+#else
+#define TARGET_COUNT ESP_MAX_CHIP
+#define TARGET_INDEX(chip) (chip)
+#define SERIAL_FLASHER_TARGET_ESP8266
+#define SERIAL_FLASHER_TARGET_ESP32
+#define SERIAL_FLASHER_TARGET_ESP32S2
+#define SERIAL_FLASHER_TARGET_ESP32C3
+#define SERIAL_FLASHER_TARGET_ESP32S3
+#define SERIAL_FLASHER_TARGET_ESP32C2
+#define SERIAL_FLASHER_TARGET_ESP32H4
+#endif
+
+#if defined(SERIAL_FLASHER_TARGET_ESP32S2) || defined(SERIAL_FLASHER_TARGET_ESP32C3) || \
+    defined(SERIAL_FLASHER_TARGET_ESP32S3) || defined(SERIAL_FLASHER_TARGET_ESP32C2) || \
+    defined(SERIAL_FLASHER_TARGET_ESP32H4)
+#define SPI_CONFIG_ESP32XX
+#endif
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32
 static esp_loader_error_t spi_config_esp32(uint32_t efuse_base, uint32_t *spi_config);
+#endif
+#ifdef SPI_CONFIG_ESP32XX
 static esp_loader_error_t spi_config_esp32xx(uint32_t efuse_base, uint32_t *spi_config);
-
-static const esp_target_t esp_target[ESP_MAX_CHIP] = {
-
+#endif
+#ifdef SERIAL_FLASHER_TARGET_ESP32
+static void decode_efuse_esp32(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
+#endif
+#ifdef SERIAL_FLASHER_TARGET_ESP32S2
+static void decode_efuse_esp32s2(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
+#endif
+#ifdef SERIAL_FLASHER_TARGET_ESP32C3
+static void decode_efuse_esp32c3(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
+#endif
+#ifdef SERIAL_FLASHER_TARGET_ESP32S3
+static void decode_efuse_esp32s3(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
+#endif
+#ifdef SERIAL_FLASHER_TARGET_ESP32C2
+static void decode_efuse_esp32c2(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot);
+#endif
+
+static const esp_target_t esp_target[TARGET_COUNT] = {
+
+#ifdef SERIAL_FLASHER_TARGET_ESP8266
     // ESP8266
     {
         .regs = {
@@ -55,8 +114,13 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0,            // Not used
         .chip_magic_value  = { 0xfff0c101, 0 },
         .read_spi_config = NULL,    // Not used
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
     },
+#endif
 
+#ifdef SERIAL_FLASHER_TARGET_ESP32
     // ESP32
     {
         .regs = {
@@ -71,8 +135,16 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x3ff5A000,
         .chip_magic_value  = { 0x00f01d83, 0 },
         .read_spi_config = spi_config_esp32,
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
+        .efuse_snapshot_addr = 0x3ff5A000,  // Block 0
+        .efuse_snapshot_extra = 0x3FF6607C, // APB_CTL_DATE_REG
+        .decode_efuse = decode_efuse_esp32,
     },
+#endif
 
+#ifdef SERIAL_FLASHER_TARGET_ESP32S2
     // ESP32S2
     {
         .regs = {
@@ -87,8 +159,20 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x3f41A000,
         .chip_magic_value  = { 0x000007c6, 0 },
         .read_spi_config = spi_config_esp32xx,
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
+        .usb_otg_block_size = USB_OTG_BLOCK_SIZE,
+        .uartdev_buf_no = 0x3FFFFD14,
+        .usb_otg_buf_no = 2,
+        .rtc_options0 = 0x3F408000,
+        .rtc_option1 = 0x3F408128,
+        .efuse_snapshot_addr = 0x3f41A044,  // Block 1
+        .decode_efuse = decode_efuse_esp32s2,
     },
+#endif
 
+#ifdef SERIAL_FLASHER_TARGET_ESP32C3
     // ESP32C3
     {
         .regs = {
@@ -103,8 +187,17 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x60008800,
         .chip_magic_value = { 0x6921506f, 0x1b31506f },
         .read_spi_config = spi_config_esp32xx,
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
+        .uartdev_buf_no = 0x3FCDF07C,
+        .usb_serial_jtag_buf_no = 3,
+        .efuse_snapshot_addr = 0x60008844,  // Block 1
+        .decode_efuse = decode_efuse_esp32c3,
     },
+#endif
 
+#ifdef SERIAL_FLASHER_TARGET_ESP32S3
     // ESP32S3
     {
         .regs = {
@@ -119,8 +212,21 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x60007000,
         .chip_magic_value = { 0x00000009, 0 },
         .read_spi_config = spi_config_esp32xx,
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
+        .usb_otg_block_size = USB_OTG_BLOCK_SIZE,
+        .uartdev_buf_no = 0x3FCEF14C,
+        .usb_otg_buf_no = 3,
+        .usb_serial_jtag_buf_no = 4,
+        .rtc_options0 = 0x60008000,
+        .rtc_option1 = 0x6000812C,
+        .efuse_snapshot_addr = 0x60007044,  // Block 1
+        .decode_efuse = decode_efuse_esp32s3,
     },
+#endif
 
+#ifdef SERIAL_FLASHER_TARGET_ESP32C2
     // ESP32C2
     {
         .regs = {
@@ -135,7 +241,15 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x60008800,
         .chip_magic_value = { 0x6f51306f, 0 },
         .read_spi_config = spi_config_esp32xx,
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
+        .efuse_snapshot_addr = 0x60008840,  // Block 2
+        .decode_efuse = decode_efuse_esp32c2,
     },
+#endif
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32H4
     // ESP32H4
     {
         .regs = {
@@ -150,11 +264,21 @@ static const esp_target_t esp_target[ESP_MAX_CHIP] = {
         .efuse_base = 0x6001A000,
         .chip_magic_value = {0xca26cc22, 0x6881b06f}, // ESP32H4-BETA1, ESP32H4-BETA2
         .read_spi_config = spi_config_esp32xx,
+        .flash_block_size = ROM_FLASH_BLOCK_SIZE,
+        .ram_block_size = ROM_RAM_BLOCK_SIZE,
+        .stub_block_size = STUB_BLOCK_SIZE,
     },
+#endif
 };
 
 esp_loader_error_t loader_detect_chip(target_chip_t *target_chip, const target_registers_t **target_data)
 {
+#ifdef SINGLE_TARGET
+    // Nothing to tell apart, reading the magic value would only delay connection
+    *target_chip = SINGLE_TARGET;
+    *target_data = &esp_target[0].regs;
+    return ESP_LOADER_SUCCESS;
+#else
     uint32_t magic_value;
     RETURN_ON_ERROR( esp_loader_read_register(CHIP_DETECT_MAGIC_REG_ADDR,  &magic_value) );
 
@@ -169,14 +293,40 @@ esp_loader_error_t loader_detect_chip(target_chip_t *target_chip, const target_r
     }
 
     return ESP_LOADER_ERROR_INVALID_TARGET;
+#endif
 }
 
 esp_loader_error_t loader_read_spi_config(target_chip_t target_chip, uint32_t *spi_config)
 {
-    const esp_target_t *target = &esp_target[target_chip];
+    const esp_target_t *target = &esp_target[TARGET_INDEX(target_chip)];
     return target->read_spi_config(target->efuse_base, spi_config);
 }
 
+esp_loader_error_t loader_detect_console(target_chip_t target_chip, esp_loader_console_t *console)
+{
+    const esp_target_t *target = &esp_target[TARGET_INDEX(target_chip)];
+    uint32_t buf_no;
+
+    *console = ESP_LOADER_CONSOLE_UART;
+
+    if (target->uartdev_buf_no == 0) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    RETURN_ON_ERROR( esp_loader_read_register(target->uartdev_buf_no, &buf_no) );
+
+    // Only the low byte of the ROM variable is defined
+    buf_no &= 0xFF;
+
+    if (target->usb_otg_buf_no != 0 && buf_no == target->usb_otg_buf_no) {
+        *console = ESP_LOADER_CONSOLE_USB_OTG;
+    } else if (target->usb_serial_jtag_buf_no != 0 && buf_no == target->usb_serial_jtag_buf_no) {
+        *console = ESP_LOADER_CONSOLE_USB_SERIAL_JTAG;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
 static inline uint32_t efuse_word_addr(uint32_t efuse_base, uint32_t n)
 {
     return efuse_base + (n * 4);
@@ -188,7 +338,7 @@ static inline uint8_t adjust_pin_number(uint8_t num)
     return (num >= 30) ? num + 2 : num;
 }
 
-
+#ifdef SERIAL_FLASHER_TARGET_ESP32
 static esp_loader_error_t spi_config_esp32(uint32_t efuse_base, uint32_t *spi_config)
 {
     *spi_config = 0;
@@ -217,7 +367,9 @@ static esp_loader_error_t spi_config_esp32(uint32_t efuse_base, uint32_t *spi_co
 
     return ESP_LOADER_SUCCESS;
 }
+#endif
 
+#ifdef SPI_CONFIG_ESP32XX
 // Applies for esp32s2, esp32c3 and esp32c3
 static esp_loader_error_t spi_config_esp32xx(uint32_t efuse_base, uint32_t *spi_config)
 {
@@ -236,8 +388,157 @@ static esp_loader_error_t spi_config_esp32xx(uint32_t efuse_base, uint32_t *spi_
     *spi_config = pins;
     return ESP_LOADER_SUCCESS;
 }
+#endif
 
 bool encryption_in_begin_flash_cmd(target_chip_t target)
 {
-    return target == ESP32_CHIP || target == ESP8266_CHIP;
+    return TARGET_IS(target, ESP32_CHIP) || TARGET_IS(target, ESP8266_CHIP);
+}
+
+uint32_t target_flash_block_size(target_chip_t target, bool stub)
+{
+    if (target >= ESP_MAX_CHIP) {
+        return stub ? STUB_BLOCK_SIZE : ROM_FLASH_BLOCK_SIZE;
+    }
+
+    const esp_target_t *t = &esp_target[TARGET_INDEX(target)];
+    return stub ? t->stub_block_size : t->flash_block_size;
+}
+
+uint32_t target_ram_block_size(target_chip_t target)
+{
+    return target < ESP_MAX_CHIP ? esp_target[TARGET_INDEX(target)].ram_block_size : ROM_RAM_BLOCK_SIZE;
+}
+
+uint32_t target_usb_otg_block_size(target_chip_t target)
+{
+    return target < ESP_MAX_CHIP ? esp_target[TARGET_INDEX(target)].usb_otg_block_size : 0;
+}
+
+// False if the chip cannot be told to stay in ROM loader over a software reset
+bool target_soft_reset_regs(target_chip_t target, uint32_t *options0, uint32_t *option1)
+{
+    if (target >= ESP_MAX_CHIP || esp_target[TARGET_INDEX(target)].rtc_option1 == 0) {
+        return false;
+    }
+
+    *options0 = esp_target[TARGET_INDEX(target)].rtc_options0;
+    *option1 = esp_target[TARGET_INDEX(target)].rtc_option1;
+
+    return true;
+}
+
+uint32_t target_efuse_snapshot_regs(target_chip_t target_chip, uint32_t *addresses)
+{
+    if (target_chip >= ESP_MAX_CHIP || esp_target[TARGET_INDEX(target_chip)].decode_efuse == NULL) {
+        return 0;
+    }
+
+    const esp_target_t *target = &esp_target[TARGET_INDEX(target_chip)];
+    uint32_t count = 0;
+
+    for (; count < ESP_LOADER_EFUSE_SNAPSHOT_WORDS; count++) {
+        addresses[count] = efuse_word_addr(target->efuse_snapshot_addr, count);
+    }
+    if (target->efuse_snapshot_extra != 0) {
+        addresses[count++] = target->efuse_snapshot_extra;
+    }
+
+    return count;
+}
+
+// MAC is stored as 32 low bits followed by 16 high bits
+static void decode_mac(uint32_t low, uint32_t high, uint8_t mac[6])
+{
+    mac[0] = (high >> 8) & 0xff;
+    mac[1] = high & 0xff;
+    mac[2] = (low >> 24) & 0xff;
+    mac[3] = (low >> 16) & 0xff;
+    mac[4] = (low >> 8) & 0xff;
+    mac[5] = low & 0xff;
+}
+
+static inline uint32_t efuse_field(uint32_t word, uint32_t shift, uint32_t width)
+{
+    return (word >> shift) & ((1u << width) - 1);
+}
+
+void target_decode_efuse(target_chip_t target_chip, const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    const esp_target_t *target = &esp_target[TARGET_INDEX(target_chip)];
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    snapshot->efuse_address = target->efuse_snapshot_addr;
+    memcpy(snapshot->efuse, values, sizeof(snapshot->efuse));
+    decode_mac(values[0], values[1], snapshot->mac);
+    target->decode_efuse(values, snapshot);
+}
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32
+static void decode_efuse_esp32(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    // MAC starts at word 1 of block 0, revision bits are spread over two words and APB_CTL_DATE
+    decode_mac(values[1], values[2], snapshot->mac);
+
+    uint32_t revision_bits = efuse_field(values[3], 15, 1) | (efuse_field(values[5], 20, 1) << 1) |
+                             (efuse_field(values[ESP_LOADER_EFUSE_SNAPSHOT_WORDS], 31, 1) << 2);
+    uint32_t major = 0;
+
+    switch (revision_bits) {
+    case 1: major = 1; break;
+    case 3: major = 2; break;
+    case 7: major = 3; break;
+    default: break;
+    }
+
+    snapshot->chip_revision = major * 100 + efuse_field(values[5], 24, 2);
+    snapshot->package = efuse_field(values[3], 9, 3) | (efuse_field(values[3], 2, 1) << 3);
+}
+#endif
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32S2
+static void decode_efuse_esp32s2(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    uint32_t minor = (efuse_field(values[3], 20, 1) << 3) | efuse_field(values[4], 4, 3);
+
+    snapshot->chip_revision = efuse_field(values[3], 18, 2) * 100 + minor;
+    snapshot->package = efuse_field(values[4], 0, 4);
+    snapshot->flash_cap = efuse_field(values[3], 21, 4);
+    snapshot->psram_cap = efuse_field(values[3], 28, 4);
+}
+#endif
+
+#if defined(SERIAL_FLASHER_TARGET_ESP32C3) || defined(SERIAL_FLASHER_TARGET_ESP32S3)
+// Block 1 of ESP32-C3 and ESP32-S3 share the layout of these fields
+static void decode_efuse_block1_esp32xx(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    uint32_t minor = (efuse_field(values[5], 23, 1) << 3) | efuse_field(values[3], 18, 3);
+
+    snapshot->chip_revision = efuse_field(values[5], 24, 2) * 100 + minor;
+    snapshot->package = efuse_field(values[3], 21, 3);
+    snapshot->flash_cap = efuse_field(values[3], 27, 3);
+}
+#endif
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32C3
+static void decode_efuse_esp32c3(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    decode_efuse_block1_esp32xx(values, snapshot);
+}
+#endif
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32S3
+static void decode_efuse_esp32s3(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    decode_efuse_block1_esp32xx(values, snapshot);
+    snapshot->psram_cap = efuse_field(values[4], 3, 2) | (efuse_field(values[5], 19, 1) << 2);
+}
+#endif
+
+#ifdef SERIAL_FLASHER_TARGET_ESP32C2
+static void decode_efuse_esp32c2(const uint32_t *values, esp_loader_efuse_snapshot_t *snapshot)
+{
+    snapshot->chip_revision = efuse_field(values[1], 20, 2) * 100 + efuse_field(values[1], 16, 4);
+    snapshot->package = efuse_field(values[1], 22, 3);
 }
+#endif
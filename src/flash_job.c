@@ -0,0 +1,307 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loader_context.h"
+#include "protocol.h"
+#include <string.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b)) ? (a) : (b)
+#endif
+
+static const uint32_t SECTOR_SIZE = 4096;
+static const uint8_t FILL_BYTE = 0xFF;  // Content of erased flash
+
+/* Regions of the job flashed by one start command */
+typedef struct {
+    uint32_t first;     // Index into order
+    uint32_t last;
+    uint32_t address;
+    uint32_t size;
+    bool compress;
+} segment_t;
+
+typedef struct {
+    const esp_loader_flash_job_t *job;
+    uint8_t order[ESP_LOADER_JOB_MAX_REGIONS];  // Regions sorted by address
+    uint32_t written;
+    uint32_t total;
+} job_state_t;
+
+
+static inline const esp_loader_region_t *region_at(const job_state_t *state, uint32_t i)
+{
+    return &state->job->regions[state->order[i]];
+}
+
+
+static inline uint32_t sector_end(uint32_t address)
+{
+    return (address + SECTOR_SIZE - 1) & ~(SECTOR_SIZE - 1);
+}
+
+
+static esp_loader_error_t sort_regions(job_state_t *state)
+{
+    const esp_loader_flash_job_t *job = state->job;
+
+    if (job->region_count == 0 || job->region_count > ESP_LOADER_JOB_MAX_REGIONS) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    for (uint32_t i = 0; i < job->region_count; i++) {
+        const esp_loader_region_t *region = &job->regions[i];
+        if (region->address % SECTOR_SIZE != 0 || region->size == 0 || region->data == NULL) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+
+        uint32_t pos = i;
+        while (pos > 0 && region_at(state, pos - 1)->address > region->address) {
+            state->order[pos] = state->order[pos - 1];
+            pos--;
+        }
+        state->order[pos] = (uint8_t)i;
+        state->total += region->size;
+    }
+
+    for (uint32_t i = 1; i < job->region_count; i++) {
+        const esp_loader_region_t *prev = region_at(state, i - 1);
+        if (prev->address + prev->size > region_at(state, i)->address) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+// Joins regions which would otherwise erase the same or adjacent sectors
+static void next_segment(const job_state_t *state, uint32_t first, segment_t *segment)
+{
+    const esp_loader_region_t *region = region_at(state, first);
+    uint32_t last = first;
+
+    while (last + 1 < state->job->region_count) {
+        const esp_loader_region_t *prev = region_at(state, last);
+        const esp_loader_region_t *next = region_at(state, last + 1);
+        if (next->compress != region->compress || next->address > sector_end(prev->address + prev->size)) {
+            break;
+        }
+        last++;
+    }
+
+    const esp_loader_region_t *end = region_at(state, last);
+    segment->first = first;
+    segment->last = last;
+    segment->address = region->address;
+    segment->size = end->address + end->size - region->address;
+    segment->compress = region->compress;
+}
+
+
+// Copies bytes of the segment, gaps between regions read as erased flash
+static void segment_read(const job_state_t *state, const segment_t *segment,
+                         uint32_t offset, uint32_t size, uint8_t *out)
+{
+    uint32_t address = segment->address + offset;
+
+    memset(out, FILL_BYTE, size);
+
+    for (uint32_t i = segment->first; i <= segment->last; i++) {
+        const esp_loader_region_t *region = region_at(state, i);
+        uint32_t start = (region->address > address) ? region->address : address;
+        uint32_t end = MIN(region->address + region->size, address + size);
+        if (start < end) {
+            memcpy(&out[start - address], &region->data[start - region->address], end - start);
+        }
+    }
+}
+
+
+static void report_progress(job_state_t *state, uint32_t written)
+{
+    state->written += written;
+
+    if (state->job->progress != NULL) {
+        state->job->progress(state->written, state->total, state->job->progress_arg);
+    }
+}
+
+
+// Region bytes within the range, for progress
+static uint32_t payload_in_range(const job_state_t *state, const segment_t *segment,
+                                 uint32_t offset, uint32_t size)
+{
+    uint32_t address = segment->address + offset;
+    uint32_t payload = 0;
+
+    for (uint32_t i = segment->first; i <= segment->last; i++) {
+        const esp_loader_region_t *region = region_at(state, i);
+        uint32_t start = (region->address > address) ? region->address : address;
+        uint32_t end = MIN(region->address + region->size, address + size);
+        if (start < end) {
+            payload += end - start;
+        }
+    }
+
+    return payload;
+}
+
+
+static esp_loader_error_t write_segment(job_state_t *state, const segment_t *segment)
+{
+    const esp_loader_flash_job_t *job = state->job;
+    uint32_t block_size;
+
+    if (job->buffer == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    RETURN_ON_ERROR( esp_loader_flash_start_auto(segment->address, segment->size, job->buffer_size, &block_size) );
+
+    for (uint32_t offset = 0; offset < segment->size; offset += block_size) {
+        uint32_t size = MIN(block_size, segment->size - offset);
+        uint32_t address = segment->address + offset;
+        const uint8_t *block = NULL;
+
+        // Blocks within one region are sent without copying
+        for (uint32_t i = segment->first; i <= segment->last && block == NULL; i++) {
+            const esp_loader_region_t *region = region_at(state, i);
+            if (address >= region->address && address + size <= region->address + region->size) {
+                block = &region->data[address - region->address];
+            }
+        }
+
+        if (block == NULL) {
+            segment_read(state, segment, offset, size, job->buffer);
+            block = job->buffer;
+        }
+
+        RETURN_ON_ERROR( esp_loader_flash_write(block, size) );
+        report_progress(state, payload_in_range(state, segment, offset, size));
+    }
+
+    // Blocks still in flight are waited for by the start of the next segment or the end of the job
+    return ESP_LOADER_SUCCESS;
+}
+
+
+static esp_loader_error_t write_compressed_segment(job_state_t *state, const segment_t *segment)
+{
+    const esp_loader_flash_job_t *job = state->job;
+    uint8_t fill[64];
+
+    if (job->work == NULL || job->deflate_block_size == 0) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    memset(fill, FILL_BYTE, sizeof(fill));
+
+    RETURN_ON_ERROR( esp_loader_flash_deflate_start(segment->address, segment->size, job->deflate_block_size,
+                                                    job->work, job->work_size) );
+
+    uint32_t address = segment->address;
+
+    for (uint32_t i = segment->first; i <= segment->last; i++) {
+        const esp_loader_region_t *region = region_at(state, i);
+
+        while (address < region->address) {
+            uint32_t size = MIN(sizeof(fill), region->address - address);
+            RETURN_ON_ERROR( esp_loader_flash_deflate_write(fill, size) );
+            address += size;
+        }
+
+        // Pieces of one block keep progress reports frequent
+        for (uint32_t offset = 0; offset < region->size; offset += job->deflate_block_size) {
+            uint32_t size = MIN(job->deflate_block_size, region->size - offset);
+            RETURN_ON_ERROR( esp_loader_flash_deflate_write(&region->data[offset], size) );
+            report_progress(state, size);
+        }
+
+        address += region->size;
+    }
+
+    return deflate_finish(&loader_current()->deflate);
+}
+
+
+#ifdef MD5_ENABLED
+// Digests of all segments are requested behind the blocks of the last one still in flight
+static esp_loader_error_t verify_segments(const segment_t *segments, uint8_t digests[][16], uint32_t count)
+{
+    esp_loader_audit_region_t checks[ESP_LOADER_JOB_MAX_REGIONS];
+
+    for (uint32_t i = 0; i < count; i++) {
+        checks[i].address = segments[i].address;
+        // Raw blocks were hashed with the padding of their last word, which is written too
+        checks[i].length = segments[i].compress ? segments[i].size : (segments[i].size + 3u) & ~3u;
+        memcpy(checks[i].md5, digests[i], sizeof(checks[i].md5));
+    }
+
+    esp_loader_error_t err = loader_flash_audit_pending(checks, count);
+    if (err == ESP_LOADER_ERROR_INVALID_MD5) {
+        port_debug_print("Error: MD5 of flash job segment does not match\n");
+    }
+
+    return err;
+}
+#endif
+
+
+esp_loader_error_t esp_loader_flash_job(const esp_loader_flash_job_t *job)
+{
+    job_state_t state = { .job = job };
+    segment_t segments[ESP_LOADER_JOB_MAX_REGIONS];
+    uint32_t segment_count = 0;
+#ifdef MD5_ENABLED
+    esp_loader_t *ctx = loader_current();
+    uint8_t digests[ESP_LOADER_JOB_MAX_REGIONS][16];
+
+    if (job->verify && TARGET_IS(ctx->target, ESP8266_CHIP)) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+#else
+    if (job->verify) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+#endif
+
+    RETURN_ON_ERROR( sort_regions(&state) );
+
+    for (uint32_t first = 0; first < job->region_count; first = segments[segment_count++].last + 1) {
+        segment_t *segment = &segments[segment_count];
+        next_segment(&state, first, segment);
+
+        if (segment->compress) {
+            RETURN_ON_ERROR( write_compressed_segment(&state, segment) );
+        } else {
+            RETURN_ON_ERROR( write_segment(&state, segment) );
+        }
+
+#ifdef MD5_ENABLED
+        // Loader hashed the segment while its blocks were in flight,
+        // the digest is kept so that all segments are verified at the end
+        MD5Final(digests[segment_count], &ctx->md5_context);
+#endif
+    }
+
+#ifdef MD5_ENABLED
+    if (job->verify) {
+        return verify_segments(segments, digests, segment_count);
+    }
+#endif
+
+    return esp_loader_flash_wait_pending();
+}
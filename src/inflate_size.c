@@ -0,0 +1,472 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Decoder of zlib (RFC 1950) streams, which walks deflate (RFC 1951) symbols and sums
+ * the lengths of literals, matches and stored blocks, without producing any output.
+ * It lets the host know how much flash the target writes for each compressed block.
+ * Input may be split at any bit; a symbol is only consumed once all of its bits,
+ * extra bits included, were received, so no more than 64 bits are kept between calls. */
+
+#include "inflate_size.h"
+#include <string.h>
+
+#define END_OF_BLOCK    256
+#define LENGTH_CODES    29
+#define MAX_LITLEN      286
+#define MAX_DIST        30
+
+typedef enum {
+    STEP_DONE,
+    STEP_NEED_INPUT,
+    STEP_ERROR,
+} step_t;
+
+typedef struct {
+    inflate_size_t *s;
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t pos;
+} reader_t;
+
+static const uint16_t s_length_base[LENGTH_CODES] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const uint8_t s_length_extra[LENGTH_CODES] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const uint8_t s_dist_extra[MAX_DIST] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const uint8_t s_clen_order[INFLATE_SIZE_CLEN_CODES] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+// Makes sure that bits from offset on are in the bit buffer, without consuming them
+static bool peek(reader_t *r, uint32_t offset, uint32_t bits, uint32_t *value)
+{
+    inflate_size_t *s = r->s;
+
+    while (s->bit_count < offset + bits) {
+        if (r->pos == r->size) {
+            return false;
+        }
+        s->bit_buffer |= (uint64_t)r->data[r->pos++] << s->bit_count;
+        s->bit_count += 8;
+    }
+
+    *value = (uint32_t)(s->bit_buffer >> offset) & ((1u << bits) - 1);
+    return true;
+}
+
+static void consume(inflate_size_t *s, uint32_t bits)
+{
+    s->bit_buffer >>= bits;
+    s->bit_count -= bits;
+}
+
+// Read bits are dropped up to the byte boundary
+static void align(inflate_size_t *s)
+{
+    consume(s, s->bit_count % 8);
+}
+
+// Builds canonical code from code lengths, incomplete codes are accepted
+static bool build(uint16_t *count, uint16_t *symbol, const uint8_t *lengths, uint32_t n)
+{
+    uint16_t offsets[INFLATE_SIZE_MAX_BITS + 1];
+    int32_t left = 1;
+
+    memset(count, 0, (INFLATE_SIZE_MAX_BITS + 1) * sizeof(uint16_t));
+    for (uint32_t i = 0; i < n; i++) {
+        count[lengths[i]]++;
+    }
+
+    for (uint32_t len = 1; len <= INFLATE_SIZE_MAX_BITS; len++) {
+        left = (left << 1) - count[len];
+        if (left < 0) {
+            return false;
+        }
+    }
+
+    offsets[1] = 0;
+    for (uint32_t len = 1; len < INFLATE_SIZE_MAX_BITS; len++) {
+        offsets[len + 1] = offsets[len] + count[len];
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (lengths[i] != 0) {
+            symbol[offsets[lengths[i]]++] = (uint16_t)i;
+        }
+    }
+
+    return true;
+}
+
+static step_t decode(reader_t *r, uint32_t offset, const uint16_t *count, const uint16_t *symbol,
+                     uint32_t *decoded, uint32_t *bits)
+{
+    int32_t code = 0;
+    int32_t first = 0;
+    int32_t index = 0;
+
+    for (uint32_t len = 1; len <= INFLATE_SIZE_MAX_BITS; len++) {
+        uint32_t bit;
+        if (!peek(r, offset + len - 1, 1, &bit)) {
+            return STEP_NEED_INPUT;
+        }
+
+        code |= (int32_t)bit;
+        if (code - count[len] < first) {
+            *decoded = symbol[index + (code - first)];
+            *bits = len;
+            return STEP_DONE;
+        }
+
+        index += count[len];
+        first = (first + count[len]) << 1;
+        code <<= 1;
+    }
+
+    return STEP_ERROR;
+}
+
+static void build_fixed(inflate_size_t *s)
+{
+    uint32_t i = 0;
+
+    for (; i < 144; i++) {
+        s->lengths[i] = 8;
+    }
+    for (; i < 256; i++) {
+        s->lengths[i] = 9;
+    }
+    for (; i < 280; i++) {
+        s->lengths[i] = 7;
+    }
+    for (; i < INFLATE_SIZE_LITLEN_CODES; i++) {
+        s->lengths[i] = 8;
+    }
+    build(s->litlen.count, s->litlen.symbol, s->lengths, INFLATE_SIZE_LITLEN_CODES);
+
+    memset(s->lengths, 5, MAX_DIST);
+    build(s->dist.count, s->dist.symbol, s->lengths, MAX_DIST);
+}
+
+static step_t zlib_header(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t header;
+
+    if (!peek(r, 0, 16, &header)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, 16);
+
+    uint32_t cmf = header & 0xFF;
+    uint32_t flg = header >> 8;
+    if ((cmf & 0x0F) != 8 || (flg & 0x20) != 0 || ((cmf << 8) | flg) % 31 != 0) {
+        return STEP_ERROR;
+    }
+
+    s->state = INFLATE_SIZE_BLOCK_HEADER;
+    return STEP_DONE;
+}
+
+static step_t block_header(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t header;
+
+    if (!peek(r, 0, 3, &header)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, 3);
+
+    s->final_block = header & 1;
+    switch (header >> 1) {
+    case 0:
+        align(s);
+        s->state = INFLATE_SIZE_STORED_LENGTH;
+        return STEP_DONE;
+    case 1:
+        build_fixed(s);
+        s->state = INFLATE_SIZE_CODES;
+        return STEP_DONE;
+    case 2:
+        s->state = INFLATE_SIZE_TABLE_SIZES;
+        return STEP_DONE;
+    default:
+        return STEP_ERROR;
+    }
+}
+
+static step_t stored_length(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t lengths;
+
+    if (!peek(r, 0, 16, &lengths)) {
+        return STEP_NEED_INPUT;
+    }
+    uint32_t complement;
+    if (!peek(r, 16, 16, &complement)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, 32);
+
+    if ((lengths ^ complement) != 0xFFFF) {
+        return STEP_ERROR;
+    }
+
+    s->stored_left = lengths;
+    s->state = INFLATE_SIZE_STORED;
+    return STEP_DONE;
+}
+
+static step_t stored(reader_t *r, uint32_t *produced)
+{
+    inflate_size_t *s = r->s;
+
+    // Whole bytes already taken into the bit buffer go first
+    while (s->stored_left > 0 && s->bit_count >= 8) {
+        consume(s, 8);
+        s->stored_left--;
+        (*produced)++;
+    }
+
+    uint32_t available = r->size - r->pos;
+    uint32_t skipped = (s->stored_left < available) ? s->stored_left : available;
+    r->pos += skipped;
+    s->stored_left -= skipped;
+    *produced += skipped;
+
+    if (s->stored_left > 0) {
+        return STEP_NEED_INPUT;
+    }
+
+    s->state = s->final_block ? INFLATE_SIZE_TRAILER : INFLATE_SIZE_BLOCK_HEADER;
+    return STEP_DONE;
+}
+
+static step_t table_sizes(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t sizes;
+
+    if (!peek(r, 0, 14, &sizes)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, 14);
+
+    s->litlen_count = 257 + (sizes & 0x1F);
+    s->dist_count = 1 + ((sizes >> 5) & 0x1F);
+    s->clen_count = 4 + (sizes >> 10);
+    if (s->litlen_count > MAX_LITLEN || s->dist_count > MAX_DIST) {
+        return STEP_ERROR;
+    }
+
+    memset(s->lengths, 0, INFLATE_SIZE_CLEN_CODES);
+    s->index = 0;
+    s->state = INFLATE_SIZE_CLEN_LENGTHS;
+    return STEP_DONE;
+}
+
+static step_t clen_lengths(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t length;
+
+    if (!peek(r, 0, 3, &length)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, 3);
+
+    s->lengths[s_clen_order[s->index++]] = (uint8_t)length;
+    if (s->index < s->clen_count) {
+        return STEP_DONE;
+    }
+
+    if (!build(s->clen.count, s->clen.symbol, s->lengths, INFLATE_SIZE_CLEN_CODES)) {
+        return STEP_ERROR;
+    }
+
+    s->index = 0;
+    s->state = INFLATE_SIZE_CODE_LENGTHS;
+    return STEP_DONE;
+}
+
+static step_t code_lengths(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t total = s->litlen_count + s->dist_count;
+    uint32_t symbol;
+    uint32_t bits;
+
+    step_t step = decode(r, 0, s->clen.count, s->clen.symbol, &symbol, &bits);
+    if (step != STEP_DONE) {
+        return step;
+    }
+
+    if (symbol < 16) {
+        consume(s, bits);
+        s->lengths[s->index++] = (uint8_t)symbol;
+    } else {
+        static const uint8_t extra_bits[] = { 2, 3, 7 };
+        static const uint8_t repeat_base[] = { 3, 3, 11 };
+        uint32_t extra;
+
+        if (!peek(r, bits, extra_bits[symbol - 16], &extra)) {
+            return STEP_NEED_INPUT;
+        }
+        consume(s, bits + extra_bits[symbol - 16]);
+
+        uint32_t repeat = repeat_base[symbol - 16] + extra;
+        if (symbol == 16 && s->index == 0) {
+            return STEP_ERROR;
+        }
+        if (s->index + repeat > total) {
+            return STEP_ERROR;
+        }
+
+        uint8_t length = (symbol == 16) ? s->lengths[s->index - 1] : 0;
+        memset(&s->lengths[s->index], length, repeat);
+        s->index += repeat;
+    }
+
+    if (s->index < total) {
+        return STEP_DONE;
+    }
+
+    if (s->lengths[END_OF_BLOCK] == 0 ||
+        !build(s->litlen.count, s->litlen.symbol, s->lengths, s->litlen_count) ||
+        !build(s->dist.count, s->dist.symbol, &s->lengths[s->litlen_count], s->dist_count)) {
+        return STEP_ERROR;
+    }
+
+    s->state = INFLATE_SIZE_CODES;
+    return STEP_DONE;
+}
+
+static step_t codes(reader_t *r, uint32_t *produced)
+{
+    inflate_size_t *s = r->s;
+    uint32_t symbol;
+    uint32_t bits;
+
+    step_t step = decode(r, 0, s->litlen.count, s->litlen.symbol, &symbol, &bits);
+    if (step != STEP_DONE) {
+        return step;
+    }
+
+    if (symbol < END_OF_BLOCK) {
+        consume(s, bits);
+        (*produced)++;
+        return STEP_DONE;
+    }
+
+    if (symbol == END_OF_BLOCK) {
+        consume(s, bits);
+        s->state = s->final_block ? INFLATE_SIZE_TRAILER : INFLATE_SIZE_BLOCK_HEADER;
+        return STEP_DONE;
+    }
+
+    symbol -= 257;
+    if (symbol >= LENGTH_CODES) {
+        return STEP_ERROR;
+    }
+
+    uint32_t extra;
+    if (!peek(r, bits, s_length_extra[symbol], &extra)) {
+        return STEP_NEED_INPUT;
+    }
+    uint32_t length = s_length_base[symbol] + extra;
+    bits += s_length_extra[symbol];
+
+    // Distance is only decoded to know where the next symbol starts
+    uint32_t dist_bits;
+    step = decode(r, bits, s->dist.count, s->dist.symbol, &symbol, &dist_bits);
+    if (step != STEP_DONE) {
+        return step;
+    }
+    if (symbol >= MAX_DIST) {
+        return STEP_ERROR;
+    }
+    bits += dist_bits;
+
+    if (!peek(r, bits, s_dist_extra[symbol], &extra)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, bits + s_dist_extra[symbol]);
+
+    *produced += length;
+    return STEP_DONE;
+}
+
+static step_t trailer(reader_t *r)
+{
+    inflate_size_t *s = r->s;
+    uint32_t adler;
+
+    align(s);
+    if (!peek(r, 0, 16, &adler) || !peek(r, 16, 16, &adler)) {
+        return STEP_NEED_INPUT;
+    }
+    consume(s, 32);
+
+    s->state = INFLATE_SIZE_DONE;
+    return STEP_DONE;
+}
+
+void inflate_size_init(inflate_size_t *s)
+{
+    s->state = INFLATE_SIZE_ZLIB_HEADER;
+    s->bit_buffer = 0;
+    s->bit_count = 0;
+    s->final_block = false;
+}
+
+esp_loader_error_t inflate_size_scan(inflate_size_t *s, const uint8_t *data, uint32_t size, uint32_t *produced)
+{
+    reader_t r = { .s = s, .data = data, .size = size, .pos = 0 };
+    step_t step = STEP_DONE;
+
+    *produced = 0;
+
+    while (step == STEP_DONE) {
+        switch (s->state) {
+        case INFLATE_SIZE_ZLIB_HEADER:  step = zlib_header(&r); break;
+        case INFLATE_SIZE_BLOCK_HEADER: step = block_header(&r); break;
+        case INFLATE_SIZE_STORED_LENGTH: step = stored_length(&r); break;
+        case INFLATE_SIZE_STORED:       step = stored(&r, produced); break;
+        case INFLATE_SIZE_TABLE_SIZES:  step = table_sizes(&r); break;
+        case INFLATE_SIZE_CLEN_LENGTHS: step = clen_lengths(&r); break;
+        case INFLATE_SIZE_CODE_LENGTHS: step = code_lengths(&r); break;
+        case INFLATE_SIZE_CODES:        step = codes(&r, produced); break;
+        case INFLATE_SIZE_TRAILER:      step = trailer(&r); break;
+        case INFLATE_SIZE_DONE:         return ESP_LOADER_SUCCESS;
+        default:                        step = STEP_ERROR; break;
+        }
+    }
+
+    if (step == STEP_ERROR) {
+        s->state = INFLATE_SIZE_ERROR;
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
@@ -0,0 +1,490 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "loader_context.h"
+#include <string.h>
+
+// Default context talks through the global loader_port_* functions
+static esp_loader_error_t global_write(void *arg, const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    (void)arg;
+    return loader_port_write(data, size, timeout);
+}
+
+static esp_loader_error_t global_read(void *arg, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    (void)arg;
+    return loader_port_read(data, size, timeout);
+}
+
+static esp_loader_error_t global_read_available(void *arg, uint8_t *data, uint16_t size,
+                                                uint16_t *bytes_read, uint32_t timeout)
+{
+    (void)arg;
+    return loader_port_read_available(data, size, bytes_read, timeout);
+}
+
+static void global_delay_ms(void *arg, uint32_t ms)
+{
+    (void)arg;
+    loader_port_delay_ms(ms);
+}
+
+static void global_start_timer(void *arg, uint32_t ms)
+{
+    (void)arg;
+    loader_port_start_timer(ms);
+}
+
+static uint32_t global_remaining_time(void *arg)
+{
+    (void)arg;
+    return loader_port_remaining_time();
+}
+
+static void global_enter_bootloader(void *arg)
+{
+    (void)arg;
+    loader_port_enter_bootloader();
+}
+
+static void global_reset_target(void *arg)
+{
+    (void)arg;
+    loader_port_reset_target();
+}
+
+static void global_debug_print(void *arg, const char *str)
+{
+    (void)arg;
+    loader_port_debug_print(str);
+}
+
+static esp_loader_error_t global_change_transmission_rate(void *arg, uint32_t rate)
+{
+    (void)arg;
+    return loader_port_change_transmission_rate(rate);
+}
+
+static const esp_loader_port_ops_t s_global_port_ops = {
+    .write = global_write,
+    .read = global_read,
+    .read_available = global_read_available,
+    .delay_ms = global_delay_ms,
+    .start_timer = global_start_timer,
+    .remaining_time = global_remaining_time,
+    .enter_bootloader = global_enter_bootloader,
+    .reset_target = global_reset_target,
+    .debug_print = global_debug_print,
+    .change_transmission_rate = global_change_transmission_rate,
+};
+
+static esp_loader_t s_default_loader = {
+    .ops = &s_global_port_ops,
+    .in_use = true,
+    .data_command = FLASH_DATA,
+    .target = ESP_UNKNOWN_CHIP,
+    .flash_write_window = 1,
+    .ack_timeout = DEFAULT_ACK_TIMEOUT,
+    .reset_timing = DEFAULT_RESET_TIMING,
+};
+
+#if ESP_LOADER_MAX_CONTEXTS > 0
+static esp_loader_t s_loaders[ESP_LOADER_MAX_CONTEXTS];
+#endif
+
+static ESP_LOADER_THREAD_LOCAL esp_loader_t *s_current = NULL;
+
+#define LOADER_STATIC_SIZE ((1 + ESP_LOADER_MAX_CONTEXTS) * sizeof(esp_loader_t))
+
+#ifdef ESP_LOADER_RAM_BUDGET
+_Static_assert(LOADER_STATIC_SIZE <= ESP_LOADER_RAM_BUDGET, "Loader contexts exceed ESP_LOADER_RAM_BUDGET");
+#endif
+
+// Arena of any alignment holds the context once its start is aligned
+_Static_assert(sizeof(esp_loader_t) + _Alignof(esp_loader_t) - 1 <= ESP_LOADER_CONTEXT_SIZE,
+               "Loader context exceeds ESP_LOADER_CONTEXT_SIZE");
+
+
+esp_loader_t *loader_current(void)
+{
+    return (s_current != NULL) ? s_current : &s_default_loader;
+}
+
+
+static bool valid_port_ops(const esp_loader_port_ops_t *ops)
+{
+    return ops != NULL && ops->write != NULL && ops->read != NULL && ops->delay_ms != NULL &&
+           ops->start_timer != NULL && ops->remaining_time != NULL &&
+           ops->enter_bootloader != NULL && ops->reset_target != NULL;
+}
+
+// Claimed flag is left as it is, everything following it is cleared
+static void init_context(esp_loader_t *ctx, const esp_loader_port_ops_t *ops, void *port_arg)
+{
+    size_t cleared = offsetof(esp_loader_t, in_use) + sizeof(ctx->in_use);
+    memset((uint8_t *)ctx + cleared, 0, sizeof(esp_loader_t) - cleared);
+    ctx->ops = ops;
+    ctx->port_arg = port_arg;
+    ctx->data_command = FLASH_DATA;
+    ctx->target = ESP_UNKNOWN_CHIP;
+    ctx->flash_write_window = 1;
+    ctx->ack_timeout = DEFAULT_ACK_TIMEOUT;
+    ctx->reset_timing = (esp_loader_reset_timing_t)DEFAULT_RESET_TIMING;
+}
+
+
+esp_loader_error_t esp_loader_create(const esp_loader_port_ops_t *ops, void *port_arg, esp_loader_t **loader)
+{
+    if (!valid_port_ops(ops)) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+#if ESP_LOADER_MAX_CONTEXTS > 0
+    for (size_t i = 0; i < ESP_LOADER_MAX_CONTEXTS; i++) {
+        esp_loader_t *ctx = &s_loaders[i];
+
+        // Threads creating contexts at the same time claim different slots
+        if (__atomic_exchange_n(&ctx->in_use, true, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+
+        init_context(ctx, ops, port_arg);
+        *loader = ctx;
+        return ESP_LOADER_SUCCESS;
+    }
+#else
+    (void)port_arg;
+    (void)loader;
+#endif
+
+    return ESP_LOADER_ERROR_FAIL;
+}
+
+
+esp_loader_error_t esp_loader_create_in(void *arena, size_t size, const esp_loader_port_ops_t *ops,
+                                        void *port_arg, esp_loader_t **loader)
+{
+    if (!valid_port_ops(ops) || arena == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    uintptr_t start = (uintptr_t)arena;
+    uintptr_t aligned = (start + _Alignof(esp_loader_t) - 1) & ~(uintptr_t)(_Alignof(esp_loader_t) - 1);
+    if (size < aligned - start + sizeof(esp_loader_t)) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    esp_loader_t *ctx = (esp_loader_t *)aligned;
+    ctx->in_use = true;
+    init_context(ctx, ops, port_arg);
+    *loader = ctx;
+    return ESP_LOADER_SUCCESS;
+}
+
+
+void esp_loader_destroy(esp_loader_t *loader)
+{
+    if (loader != NULL && loader != &s_default_loader) {
+        __atomic_store_n(&loader->in_use, false, __ATOMIC_RELEASE);
+    }
+}
+
+
+void esp_loader_select(esp_loader_t *loader)
+{
+    s_current = loader;
+}
+
+
+void esp_loader_get_footprint(esp_loader_footprint_t *footprint)
+{
+    footprint->context_size = sizeof(esp_loader_t);
+    footprint->static_size = LOADER_STATIC_SIZE;
+    footprint->rx_buffer_size = SLIP_RX_BUFFER_SIZE;
+#ifdef MD5_ENABLED
+    footprint->hash_state_size = sizeof(struct MD5Context);
+#ifdef RESUME_MD5
+    footprint->hash_state_size += (1 + RESUME_CHECKPOINTS) * sizeof(struct MD5Context);
+#endif
+#else
+    footprint->hash_state_size = 0;
+#endif
+#ifdef ESP_LOADER_TINY
+    footprint->inflate_state_size = 0;
+#else
+    footprint->inflate_state_size = sizeof(inflate_size_t);
+#endif
+}
+
+
+esp_loader_error_t port_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    esp_loader_t *ctx = loader_current();
+    ctx->progress_wire_bytes += size;
+    return ctx->ops->write(ctx->port_arg, data, size, timeout);
+}
+
+
+esp_loader_error_t port_read(uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    esp_loader_t *ctx = loader_current();
+    return ctx->ops->read(ctx->port_arg, data, size, timeout);
+}
+
+
+esp_loader_error_t port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->ops->read_available != NULL) {
+        return ctx->ops->read_available(ctx->port_arg, data, size, bytes_read, timeout);
+    }
+
+    *bytes_read = 0;
+    RETURN_ON_ERROR( ctx->ops->read(ctx->port_arg, data, 1, timeout) );
+    *bytes_read = 1;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+void port_delay_ms(uint32_t ms)
+{
+    esp_loader_t *ctx = loader_current();
+    ctx->ops->delay_ms(ctx->port_arg, ms);
+}
+
+
+void port_start_timer(uint32_t ms)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->clock += port_elapsed_time();
+    ctx->timer_duration = ms;
+    ctx->ops->start_timer(ctx->port_arg, ms);
+}
+
+
+uint32_t port_remaining_time(void)
+{
+    esp_loader_t *ctx = loader_current();
+    return ctx->ops->remaining_time(ctx->port_arg);
+}
+
+
+uint32_t port_elapsed_time(void)
+{
+    esp_loader_t *ctx = loader_current();
+    uint32_t remaining = port_remaining_time();
+
+    return (remaining < ctx->timer_duration) ? ctx->timer_duration - remaining : 0;
+}
+
+
+uint32_t port_clock(void)
+{
+    return loader_current()->clock + port_elapsed_time();
+}
+
+
+void port_enter_bootloader(void)
+{
+    esp_loader_t *ctx = loader_current();
+    ctx->ops->enter_bootloader(ctx->port_arg);
+}
+
+
+void port_reset_target(void)
+{
+    esp_loader_t *ctx = loader_current();
+    ctx->ops->reset_target(ctx->port_arg);
+}
+
+
+void port_debug_print(const char *str)
+{
+    esp_loader_t *ctx = loader_current();
+    if (ctx->ops->debug_print != NULL) {
+        ctx->ops->debug_print(ctx->port_arg, str);
+    }
+}
+
+
+esp_loader_error_t port_change_transmission_rate(uint32_t rate)
+{
+    esp_loader_t *ctx = loader_current();
+    if (ctx->ops->change_transmission_rate == NULL) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+    return ctx->ops->change_transmission_rate(ctx->port_arg, rate);
+}
+
+
+esp_loader_framing_t port_framing(void)
+{
+    esp_loader_t *ctx = loader_current();
+    return ctx->ops->framing;
+}
+
+
+void trace_event(esp_loader_trace_event_t event, uint8_t command, uint32_t size, uint32_t value,
+                 uint8_t status, uint8_t error)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->trace == NULL) {
+        return;
+    }
+
+    esp_loader_trace_entry_t *entry = &ctx->trace[ctx->trace_head];
+    entry->time_ms = port_clock();
+    entry->event = (uint8_t)event;
+    entry->command = command;
+    entry->status = status;
+    entry->error = error;
+    entry->size = size;
+    entry->value = value;
+
+    // Oldest event is overwritten once the ring is full
+    ctx->trace_head = (ctx->trace_head + 1 < ctx->trace_size) ? ctx->trace_head + 1 : 0;
+    if (ctx->trace_count < ctx->trace_size) {
+        ctx->trace_count++;
+    }
+}
+
+
+void esp_loader_set_trace_buffer(esp_loader_trace_entry_t *entries, uint32_t count)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->trace = (count > 0) ? entries : NULL;
+    ctx->trace_size = count;
+    ctx->trace_head = 0;
+    ctx->trace_count = 0;
+}
+
+
+uint32_t esp_loader_get_trace(esp_loader_trace_entry_t *entries, uint32_t count)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->trace == NULL) {
+        return 0;
+    }
+
+    // Oldest events are left out, if not all of them fit
+    uint32_t copied = (ctx->trace_count < count) ? ctx->trace_count : count;
+    uint32_t index = (ctx->trace_head + ctx->trace_size - copied) % ctx->trace_size;
+
+    for (uint32_t i = 0; i < copied; i++) {
+        entries[i] = ctx->trace[index];
+        index = (index + 1 < ctx->trace_size) ? index + 1 : 0;
+    }
+
+    return copied;
+}
+
+
+#ifdef STATS_ENABLED
+
+uint32_t stats_time(void)
+{
+    return port_elapsed_time();
+}
+
+
+void stats_command(command_t command, uint32_t size, uint32_t send_time, uint32_t wait_time,
+                   esp_loader_error_t result)
+{
+    esp_loader_t *ctx = loader_current();
+
+    if (size > 0) {
+        ctx->stats.commands++;
+    }
+
+    // Target erases the region before responding to the begin command
+    if (command == FLASH_BEGIN || command == FLASH_DEFL_BEGIN) {
+        ctx->stats.erase_time_ms = wait_time;
+    }
+
+    if (ctx->stats_in_region) {
+        ctx->stats.region_time_ms += send_time + wait_time;
+        ctx->stats_in_region = (command != FLASH_END && command != FLASH_DEFL_END);
+    }
+
+    if (ctx->stats_callback != NULL) {
+        esp_loader_command_stats_t command_stats = {
+            .command = (uint8_t)command,
+            .size = size,
+            .send_time_ms = send_time,
+            .wait_time_ms = wait_time,
+            .result = result,
+        };
+        ctx->stats_callback(&command_stats, ctx->stats_callback_arg);
+    }
+}
+
+
+void stats_bytes(uint32_t payload, uint32_t wire, uint32_t received)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->stats.payload_bytes += payload;
+    ctx->stats.wire_bytes += wire;
+    ctx->stats.received_bytes += received;
+}
+
+
+void stats_retry(void)
+{
+    loader_current()->stats.retries++;
+}
+
+
+void stats_region_start(uint32_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->stats.region_size = size;
+    ctx->stats.region_time_ms = 0;
+    ctx->stats_in_region = true;
+}
+
+
+void esp_loader_set_stats_callback(esp_loader_stats_cb_t callback, void *arg)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->stats_callback = callback;
+    ctx->stats_callback_arg = arg;
+}
+
+
+void esp_loader_get_stats(esp_loader_stats_t *stats)
+{
+    *stats = loader_current()->stats;
+}
+
+
+void esp_loader_reset_stats(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    memset(&ctx->stats, 0, sizeof(esp_loader_stats_t));
+    ctx->stats_in_region = false;
+}
+
+#endif
@@ -103,6 +103,16 @@ void MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len)
     /* Process data in 64-byte chunks */
 
     while (len >= 64) {
+#ifndef WORDS_BIGENDIAN
+        /* Word aligned input of little-endian cores is already in the
+           layout MD5Transform expects, no need to copy it first */
+        if (((uintptr_t) buf & 3) == 0) {
+            MD5Transform((uint32_t *)ctx->buf, (uint32_t const *) buf);
+            buf += 64;
+            len -= 64;
+            continue;
+        }
+#endif
         memcpy(ctx->in, buf, 64);
         byteReverse(ctx->in, 16);
         MD5Transform((uint32_t *)ctx->buf, (uint32_t *) ctx->in);
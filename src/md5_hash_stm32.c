@@ -0,0 +1,113 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* MD5 backend using HASH peripheral of STM32 (i.e. STM32F415/417/437/439) */
+
+#include "md5_hash.h"
+#include "stm32f4xx_hal.h"
+#include <string.h>
+
+#ifndef HAL_HASH_MODULE_ENABLED
+#error "STM32 HASH backend requires HAL_HASH_MODULE_ENABLED in stm32f4xx_hal_conf.h"
+#endif
+
+static HASH_HandleTypeDef s_hash;
+static struct MD5Context *s_owner;      // Context whose state is in the peripheral
+
+// Makes the peripheral hold the state of the context, saving that of its previous owner
+static void acquire(struct MD5Context *ctx)
+{
+    if (s_owner == ctx) {
+        return;
+    }
+
+    if (s_owner == NULL && s_hash.State == HAL_HASH_STATE_RESET) {
+        __HAL_RCC_HASH_CLK_ENABLE();
+        s_hash.Init.DataType = HASH_DATATYPE_8B;
+        HAL_HASH_Init(&s_hash);
+    }
+
+    if (s_owner != NULL && s_owner->started) {
+        HAL_HASH_ContextSaving(&s_hash, (uint8_t *)s_owner->saved);
+    }
+
+    if (ctx->started) {
+        HAL_HASH_ContextRestoring(&s_hash, (uint8_t *)ctx->saved);
+        s_hash.Phase = HAL_HASH_PHASE_PROCESS;
+    } else {
+        // Next accumulation starts a new digest
+        s_hash.Phase = HAL_HASH_PHASE_READY;
+    }
+
+    s_owner = ctx;
+}
+
+static void accumulate(struct MD5Context *ctx, uint8_t *data, unsigned size)
+{
+    acquire(ctx);
+    HAL_HASH_MD5_Accmlt(&s_hash, data, size);
+    ctx->started = 1;
+}
+
+void MD5Init(struct MD5Context *ctx)
+{
+    // State of an abandoned digest is not worth saving
+    if (s_owner == ctx) {
+        s_owner = NULL;
+    }
+
+    ctx->count = 0;
+    ctx->started = 0;
+}
+
+void MD5Update(struct MD5Context *ctx, unsigned char const *buf, unsigned len)
+{
+    // Complete word left over from previous call first
+    if (ctx->count > 0) {
+        unsigned to_copy = sizeof(ctx->in) - ctx->count;
+        if (len < to_copy) {
+            to_copy = len;
+        }
+
+        memcpy(&ctx->in[ctx->count], buf, to_copy);
+        ctx->count += to_copy;
+        buf += to_copy;
+        len -= to_copy;
+
+        if (ctx->count < sizeof(ctx->in)) {
+            return;
+        }
+
+        accumulate(ctx, ctx->in, sizeof(ctx->in));
+        ctx->count = 0;
+    }
+
+    unsigned words_size = len & ~3u;
+    if (words_size > 0) {
+        accumulate(ctx, (uint8_t *)buf, words_size);
+    }
+
+    ctx->count = len - words_size;
+    memcpy(ctx->in, buf + words_size, ctx->count);
+}
+
+void MD5Final(unsigned char digest[16], struct MD5Context *ctx)
+{
+    acquire(ctx);
+    HAL_HASH_MD5_Accmlt_End(&s_hash, ctx->in, ctx->count, digest, HAL_MAX_DELAY);
+    s_owner = NULL;
+
+    memset(ctx, 0, sizeof(struct MD5Context));
+}
@@ -14,26 +14,30 @@
  */
 
 #include "protocol.h"
-#include "esp_loader_io.h"
+#include "loader_context.h"
 #include "slip.h"
 #include <stddef.h>
 #include <string.h>
 
-//#define LOG_MESSAGES
-
-#ifdef LOG_MESSAGES
-#include <stdio.h>
-#endif
-
 #define CMD_SIZE(cmd) ( sizeof(cmd) - sizeof(command_common_t) )
 
-static uint32_t s_sequence_number = 0;
-
 static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, void* resp, uint32_t resp_size);
+static esp_loader_error_t send_cmd_no_response(const void *cmd_data, uint32_t size);
 
 static uint8_t compute_checksum(const uint8_t *data, uint32_t size)
 {
-    uint8_t checksum = 0xEF;
+    uint32_t words = 0;
+
+    // XOR of whole words, folded into one byte
+    for (; size >= 4; size -= 4, data += 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        words ^= word;
+    }
+    words ^= words >> 16;
+    words ^= words >> 8;
+
+    uint8_t checksum = 0xEF ^ (uint8_t)words;
 
     while (size--) {
         checksum ^= *data++;
@@ -47,112 +51,142 @@ static esp_loader_error_t send_cmd(const void *cmd_data, uint32_t size, uint32_t
     response_t response;
     command_t command = ((const command_common_t *)cmd_data)->command;
 
-    #ifdef LOG_MESSAGES
-    printf("Command op=0x%02x data len %u: ", (uint8_t)command, size);
-    for (int i=0; i<size; i++)
-    {
-        printf("%02x", ((const uint8_t *)cmd_data)[i]);
-    }
-    printf("\n");
-    #endif
+    trace_event(ESP_LOADER_TRACE_COMMAND, command, size, 0, 0, 0);
 
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
-    RETURN_ON_ERROR( SLIP_send((const uint8_t *)cmd_data, size) );
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
+    uint32_t start = stats_time();
+    esp_loader_error_t err = SLIP_send_frame((const uint8_t *)cmd_data, size, NULL, 0);
+    uint32_t sent = stats_time();
 
-    const uint8_t response_cnt = command == SYNC ? 8 : 1;
-    
-    for (uint8_t recv_cnt = 0; recv_cnt < response_cnt; recv_cnt++) {
-        RETURN_ON_ERROR(check_response(command, reg_value, &response, sizeof(response)));
+    // Target answers SYNC several times, the extra responses are skipped by the next
+    // check_response as they do not match the command it waits for
+    if (err == ESP_LOADER_SUCCESS) {
+        err = check_response(command, reg_value, &response, sizeof(response));
     }
 
-    return ESP_LOADER_SUCCESS;
+    stats_command(command, size, sent - start, stats_time() - sent, err);
+
+    return err;
 }
 
 
-static esp_loader_error_t send_cmd_with_data(const void *cmd_data, size_t cmd_size,
-                                             const void *data, size_t data_size)
+static esp_loader_error_t send_cmd_with_data_no_response(const void *cmd_data, size_t cmd_size,
+                                                         const void *data, size_t data_size,
+                                                         uint8_t padding, size_t padding_size)
 {
-    response_t response;
-    command_t command = ((const command_common_t *)cmd_data)->command;
+    return SLIP_send_frame_padded((const uint8_t *)cmd_data, cmd_size, data, data_size,
+                                  padding, padding_size);
+}
+
 
-    #ifdef LOG_MESSAGES
-    printf("Command op=0x%02x data len %u + %u: ", (uint8_t)command, cmd_size, data_size);
-    for (int i=0; i<cmd_size; i++)
-    {
-        printf("%02x", ((const uint8_t *)cmd_data)[i]);
+void loader_hexify(const uint8_t *raw, uint32_t size, uint8_t *hex_out)
+{
+    static const uint8_t dec_to_hex[] = {
+        '0', '1', '2', '3', '4', '5', '6', '7',
+        '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+    };
+
+    for (uint32_t i = 0; i < size; i++) {
+        *hex_out++ = dec_to_hex[raw[i] >> 4];
+        *hex_out++ = dec_to_hex[raw[i] & 0xF];
     }
-    printf(" ");
-    for (int i=0; i<data_size; i++)
-    {
-        printf("%02x", ((const uint8_t *)data)[i]);
+}
+
+
+static void log_loader_internal_error(error_code_t error)
+{
+    port_debug_print("Error: ");
+
+    switch (error) {
+        case INVALID_CRC:     port_debug_print("INVALID_CRC"); break;
+        case INVALID_COMMAND: port_debug_print("INVALID_COMMAND"); break;
+        case COMMAND_FAILED:  port_debug_print("COMMAND_FAILED"); break;
+        case FLASH_WRITE_ERR: port_debug_print("FLASH_WRITE_ERR"); break;
+        case FLASH_READ_ERR:  port_debug_print("FLASH_READ_ERR"); break;
+        case READ_LENGTH_ERR: port_debug_print("READ_LENGTH_ERR"); break;
+        case DEFLATE_ERROR:   port_debug_print("DEFLATE_ERROR"); break;
+        default:              port_debug_print("UNKNOWN ERROR"); break;
     }
-    printf("\n");
-    #endif
 
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
-    RETURN_ON_ERROR( SLIP_send((const uint8_t *)cmd_data, cmd_size) );
-    RETURN_ON_ERROR( SLIP_send(data, data_size) );
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
+    port_debug_print("\n");
+}
+
 
-    return check_response(command, NULL, &response, sizeof(response));
+void loader_set_stub_mode(bool stub)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->stub_mode = stub;
 }
 
 
-static esp_loader_error_t send_cmd_md5(const void *cmd_data, size_t cmd_size, uint8_t md5_out[MD5_SIZE])
+bool loader_stub_mode(void)
 {
-    rom_md5_response_t response;
-    command_t command = ((const command_common_t *)cmd_data)->command;
+    esp_loader_t *ctx = loader_current();
+
+    return ctx->stub_mode;
+}
 
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
-    RETURN_ON_ERROR( SLIP_send((const uint8_t *)cmd_data, cmd_size) );
-    RETURN_ON_ERROR( SLIP_send_delimiter() );
 
-    RETURN_ON_ERROR( check_response(command, NULL, &response, sizeof(response)) );
+esp_loader_error_t loader_wait_stub_greeting(void)
+{
+    static const uint8_t greeting[] = { 'O', 'H', 'A', 'I' };
+    uint8_t packet[sizeof(greeting)];
 
-    memcpy(md5_out, response.md5, MD5_SIZE);
+    RETURN_ON_ERROR( SLIP_receive_packet(packet, sizeof(packet)) );
 
-    return ESP_LOADER_SUCCESS;
+    return memcmp(packet, greeting, sizeof(greeting)) == 0 ? ESP_LOADER_SUCCESS : ESP_LOADER_ERROR_INVALID_RESPONSE;
 }
 
 
-static void log_loader_internal_error(error_code_t error)
+uint8_t loader_last_status_error(void)
 {
-    loader_port_debug_print("Error: ");
+    esp_loader_t *ctx = loader_current();
 
-    switch (error) {
-        case INVALID_CRC:     loader_port_debug_print("INVALID_CRC"); break;
-        case INVALID_COMMAND: loader_port_debug_print("INVALID_COMMAND"); break;
-        case COMMAND_FAILED:  loader_port_debug_print("COMMAND_FAILED"); break;
-        case FLASH_WRITE_ERR: loader_port_debug_print("FLASH_WRITE_ERR"); break;
-        case FLASH_READ_ERR:  loader_port_debug_print("FLASH_READ_ERR"); break;
-        case READ_LENGTH_ERR: loader_port_debug_print("READ_LENGTH_ERR"); break;
-        case DEFLATE_ERROR:   loader_port_debug_print("DEFLATE_ERROR"); break;
-        default:              loader_port_debug_print("UNKNOWN ERROR"); break;
+    return ctx->last_status_error;
+}
+
+
+// Status follows the data the caller expects, which also holds for ROM loaders sending four
+// status bytes. Response carrying less data has its status at the end of the frame instead.
+static response_status_t *response_status(void *resp, uint32_t resp_size, size_t received)
+{
+    esp_loader_t *ctx = loader_current();
+
+    size_t offset = resp_size - sizeof(response_status_t);
+
+    if (received < resp_size) {
+        size_t status_size = (ctx->stub_mode || TARGET_IS(ctx->target, ESP8266_CHIP)) ? 2 : 4;
+        offset = (received >= sizeof(common_response_t) + status_size) ? received - status_size
+                                                                       : received - sizeof(response_status_t);
     }
 
-    loader_port_debug_print("\n");
+    return (response_status_t *)((uint8_t *)resp + offset);
 }
 
 
-static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, void* resp, uint32_t resp_size)
+static esp_loader_error_t receive_response(command_t cmd, uint32_t *reg_value, void* resp, uint32_t resp_size,
+                                           bool wait, size_t *received)
 {
+    esp_loader_t *ctx = loader_current();
+
     esp_loader_error_t err;
     common_response_t *response = (common_response_t *)resp;
+    response_status_t *status;
 
     do {
-        err = SLIP_receive_packet(resp, resp_size);
+        err = SLIP_receive_response(resp, resp_size, received, wait);
         if (err != ESP_LOADER_SUCCESS) {
+            if (err != ESP_LOADER_IN_PROGRESS) {
+                trace_event(ESP_LOADER_TRACE_FAILURE, cmd, 0, 0, 0, (uint8_t)err);
+            }
             return err;
         }
-    } while ((response->direction != READ_DIRECTION) || (response->command != cmd));
+        status = response_status(resp, resp_size, *received);
+        trace_event(ESP_LOADER_TRACE_RESPONSE, response->command, (*received < resp_size) ? *received : resp_size,
+                    response->value, status->failed, status->error);
+    } while (response->command != cmd);
 
-    response_status_t *status = (response_status_t *)((uint8_t *)resp + resp_size - sizeof(response_status_t));
-
-    #ifdef LOG_MESSAGES
-    printf("Check response cmd 0x%02x: ", (uint8_t)cmd);
-    printf("Direction %u, command 0x%02x, size %u, failed 0x%02x, error 0x%02x\n", response->direction, response->command, response->size, status->failed, status->error);
-    #endif
+    ctx->last_status_error = status->failed ? status->error : RESPONSE_OK;
 
     if (status->failed) {
         log_loader_internal_error(status->error);
@@ -166,11 +200,16 @@ static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, voi
     return ESP_LOADER_SUCCESS;
 }
 
-esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
-                                          uint32_t erase_size,
-                                          uint32_t block_size,
-                                          uint32_t blocks_to_write,
-                                          bool encryption)
+
+static esp_loader_error_t check_response(command_t cmd, uint32_t *reg_value, void* resp, uint32_t resp_size)
+{
+    size_t received;
+
+    return receive_response(cmd, reg_value, resp, resp_size, true, &received);
+}
+
+static flash_begin_command_t flash_begin_command(uint32_t offset, uint32_t erase_size, uint32_t block_size,
+                                                 uint32_t blocks_to_write, bool encryption)
 {
     uint32_t encryption_size = encryption ? sizeof(uint32_t) : 0;
 
@@ -188,17 +227,57 @@ esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
         .encrypted = 0
     };
 
-    s_sequence_number = 0;
+    return flash_begin_cmd;
+}
+
+esp_loader_error_t loader_flash_begin_cmd(uint32_t offset,
+                                          uint32_t erase_size,
+                                          uint32_t block_size,
+                                          uint32_t blocks_to_write,
+                                          bool encryption)
+{
+    esp_loader_t *ctx = loader_current();
+
+    uint32_t encryption_size = encryption ? sizeof(uint32_t) : 0;
+    flash_begin_command_t flash_begin_cmd = flash_begin_command(offset, erase_size, block_size,
+                                                                blocks_to_write, encryption);
+
+    ctx->sequence_number = 0;
+    ctx->acked_sequence_number = 0;
 
     return send_cmd(&flash_begin_cmd, sizeof(flash_begin_cmd) - encryption_size, NULL);
 }
 
+esp_loader_error_t loader_flash_begin_cmd_send(uint32_t offset, uint32_t erase_size, uint32_t block_size,
+                                               uint32_t blocks_to_write, bool encryption)
+{
+    uint32_t encryption_size = encryption ? sizeof(uint32_t) : 0;
+    flash_begin_command_t flash_begin_cmd = flash_begin_command(offset, erase_size, block_size,
+                                                                blocks_to_write, encryption);
+
+    return send_cmd_no_response(&flash_begin_cmd, sizeof(flash_begin_cmd) - encryption_size);
+}
+
+esp_loader_error_t loader_flash_begin_cmd_wait(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( loader_reg_cmd_wait(FLASH_BEGIN, NULL) );
+
+    ctx->sequence_number = 0;
+    ctx->acked_sequence_number = 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+
 esp_loader_error_t loader_flash_defl_begin_cmd(uint32_t offset,
                                           uint32_t uncompressed_size,
                                           uint32_t block_size,
                                           uint32_t blocks_to_write,
                                           bool encryption)
 {
+    esp_loader_t *ctx = loader_current();
+
     uint32_t encryption_size = encryption ? sizeof(uint32_t) : 0;
 
     flash_defl_begin_command_t flash_begin_cmd = {
@@ -215,42 +294,163 @@ esp_loader_error_t loader_flash_defl_begin_cmd(uint32_t offset,
         .encrypted = 0
     };
 
-    s_sequence_number = 0;
+    ctx->sequence_number = 0;
+    ctx->acked_sequence_number = 0;
 
     return send_cmd(&flash_begin_cmd, sizeof(flash_begin_cmd) - encryption_size, NULL);
 }
 
 
-esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size)
+esp_loader_error_t loader_data_cmd_send(command_t command, const uint8_t *data, uint32_t size)
+{
+    return loader_data_cmd_send_padded(command, data, size, 0, 0);
+}
+
+
+static data_command_t data_command(command_t command, const uint8_t *data, uint32_t size,
+                                   uint8_t padding, uint32_t padding_size, uint32_t sequence_number)
 {
+    uint8_t checksum = compute_checksum(data, size);
+    // XOR of an even number of equal bytes cancels out
+    if (padding_size % 2 != 0) {
+        checksum ^= padding;
+    }
+
     data_command_t data_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
-            .command = FLASH_DATA,
-            .size = CMD_SIZE(data_cmd) + size,
-            .checksum = compute_checksum(data, size)
+            .command = command,
+            .size = CMD_SIZE(data_cmd) + size + padding_size,
+            .checksum = checksum
         },
-        .data_size = size,
-        .sequence_number = s_sequence_number++,
+        .data_size = size + padding_size,
+        .sequence_number = sequence_number,
     };
 
-    return send_cmd_with_data(&data_cmd, sizeof(data_cmd), data, size);
+    return data_cmd;
+}
+
+
+esp_loader_error_t loader_data_cmd_send_padded(command_t command, const uint8_t *data, uint32_t size,
+                                               uint8_t padding, uint32_t padding_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    data_command_t data_cmd = data_command(command, data, size, padding, padding_size, ctx->sequence_number++);
+
+    ctx->data_command = command;
+    trace_event(ESP_LOADER_TRACE_DATA, command, size + padding_size, data_cmd.sequence_number, 0, 0);
+
+    uint32_t start = stats_time();
+    esp_loader_error_t err = send_cmd_with_data_no_response(&data_cmd, sizeof(data_cmd), data, size,
+                                                            padding, padding_size);
+    stats_command(command, sizeof(data_cmd) + size + padding_size, stats_time() - start, 0, err);
+
+    return err;
+}
+
+
+esp_loader_error_t loader_data_cmd_encode(command_t command, const uint8_t *data, uint32_t size,
+                                          uint8_t padding, uint32_t padding_size, uint32_t sequence_number,
+                                          uint8_t *frame, size_t frame_size, size_t *encoded_size)
+{
+    data_command_t data_cmd = data_command(command, data, size, padding, padding_size, sequence_number);
+
+    return SLIP_encode_frame((const uint8_t *)&data_cmd, sizeof(data_cmd), data, size, padding, padding_size,
+                             frame, frame_size, encoded_size);
+}
+
+
+esp_loader_error_t loader_data_cmd_send_encoded(command_t command, const uint8_t *frame, size_t size,
+                                                uint32_t data_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->data_command = command;
+    trace_event(ESP_LOADER_TRACE_DATA, command, data_size, ctx->sequence_number++, 0, 0);
+
+    uint32_t start = stats_time();
+    esp_loader_error_t err = SLIP_send_encoded(frame, size, sizeof(data_command_t) + data_size);
+    stats_command(command, sizeof(data_command_t) + data_size, stats_time() - start, 0, err);
+
+    return err;
+}
+
+
+static esp_loader_error_t receive_ack(uint32_t *sequence_number, bool wait)
+{
+    esp_loader_t *ctx = loader_current();
+
+    // Responses arrive in the order in which the packets were sent
+    *sequence_number = ctx->acked_sequence_number;
+
+    // Response is received into the context, as it can be partially decoded by a previous poll
+    uint32_t start = stats_time();
+    size_t received;
+    esp_loader_error_t err = receive_response(ctx->data_command, NULL, &ctx->ack_response,
+                                              sizeof(ctx->ack_response), wait, &received);
+    if (err == ESP_LOADER_ERROR_TIMEOUT) {
+        // Acknowledgements which did not arrive in time are not waited for again, so that
+        // the next operation, i.e. after reconnecting, does not get stuck on them
+        ctx->acked_sequence_number = ctx->sequence_number;
+        memset(&ctx->ack_response, 0, sizeof(ctx->ack_response));
+        SLIP_flush_rx();
+    } else if (err != ESP_LOADER_IN_PROGRESS) {
+        ctx->acked_sequence_number++;
+    }
+
+    if (err != ESP_LOADER_IN_PROGRESS) {
+        stats_command(ctx->data_command, 0, 0, stats_time() - start, err);
+    }
+
+    return err;
+}
+
+
+esp_loader_error_t loader_data_cmd_wait_ack(uint32_t *sequence_number)
+{
+    return receive_ack(sequence_number, true);
+}
+
+
+esp_loader_error_t loader_data_cmd_poll_ack(uint32_t *sequence_number)
+{
+    return receive_ack(sequence_number, false);
+}
+
+
+uint32_t loader_data_cmds_pending(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    return ctx->sequence_number - ctx->acked_sequence_number;
+}
+
+
+void loader_reset_data_cmds(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->sequence_number = 0;
+    ctx->acked_sequence_number = 0;
+    memset(&ctx->ack_response, 0, sizeof(ctx->ack_response));
+}
+
+
+esp_loader_error_t loader_flash_data_cmd(const uint8_t *data, uint32_t size)
+{
+    uint32_t sequence_number;
+
+    RETURN_ON_ERROR( loader_data_cmd_send(FLASH_DATA, data, size) );
+    return loader_data_cmd_wait_ack(&sequence_number);
 }
 
 esp_loader_error_t loader_flash_defl_data_cmd(const uint8_t *data, uint32_t size)
 {
-    data_command_t data_cmd = {
-        .common = {
-            .direction = WRITE_DIRECTION,
-            .command = FLASH_DEFL_DATA,
-            .size = CMD_SIZE(data_cmd) + size,
-            .checksum = compute_checksum(data, size)
-        },
-        .data_size = size,
-        .sequence_number = s_sequence_number++,
-    };
+    uint32_t sequence_number;
 
-    return send_cmd_with_data(&data_cmd, sizeof(data_cmd), data, size);
+    RETURN_ON_ERROR( loader_data_cmd_send(FLASH_DEFL_DATA, data, size) );
+    return loader_data_cmd_wait_ack(&sequence_number);
 }
 
 
@@ -285,9 +485,8 @@ esp_loader_error_t loader_flash_defl_end_cmd(bool stay_in_loader)
 }
 
 
-esp_loader_error_t loader_mem_begin_cmd(uint32_t offset, uint32_t size, uint32_t blocks_to_write, uint32_t block_size)
+static mem_begin_command_t mem_begin_command(uint32_t offset, uint32_t size, uint32_t blocks_to_write, uint32_t block_size)
 {
-
     mem_begin_command_t mem_begin_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
@@ -301,25 +500,49 @@ esp_loader_error_t loader_mem_begin_cmd(uint32_t offset, uint32_t size, uint32_t
         .offset = offset
     };
 
-    s_sequence_number = 0;
+    return mem_begin_cmd;
+}
+
+esp_loader_error_t loader_mem_begin_cmd(uint32_t offset, uint32_t size, uint32_t blocks_to_write, uint32_t block_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    mem_begin_command_t mem_begin_cmd = mem_begin_command(offset, size, blocks_to_write, block_size);
+
+    ctx->sequence_number = 0;
+    ctx->acked_sequence_number = 0;
 
     return send_cmd(&mem_begin_cmd, sizeof(mem_begin_cmd), NULL);
 }
 
 
+esp_loader_error_t loader_mem_begin_cmd_send(uint32_t offset, uint32_t size, uint32_t blocks_to_write, uint32_t block_size)
+{
+    mem_begin_command_t mem_begin_cmd = mem_begin_command(offset, size, blocks_to_write, block_size);
+
+    return send_cmd_no_response(&mem_begin_cmd, sizeof(mem_begin_cmd));
+}
+
+
+esp_loader_error_t loader_mem_begin_cmd_wait(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    RETURN_ON_ERROR( loader_reg_cmd_wait(MEM_BEGIN, NULL) );
+
+    ctx->sequence_number = 0;
+    ctx->acked_sequence_number = 0;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
 esp_loader_error_t loader_mem_data_cmd(const uint8_t *data, uint32_t size)
 {
-    data_command_t data_cmd = {
-        .common = {
-            .direction = WRITE_DIRECTION,
-            .command = MEM_DATA,
-            .size = CMD_SIZE(data_cmd) + size,
-            .checksum = compute_checksum(data, size)
-        },
-        .data_size = size,
-        .sequence_number = s_sequence_number++,
-    };
-    return send_cmd_with_data(&data_cmd, sizeof(data_cmd), data, size);
+    uint32_t sequence_number;
+
+    RETURN_ON_ERROR( loader_data_cmd_send(MEM_DATA, data, size) );
+    return loader_data_cmd_wait_ack(&sequence_number);
 }
 
 esp_loader_error_t loader_mem_end_cmd(uint32_t entrypoint)
@@ -360,8 +583,8 @@ esp_loader_error_t loader_sync_cmd(void)
 }
 
 
-esp_loader_error_t loader_write_reg_cmd(uint32_t address, uint32_t value,
-                                        uint32_t mask, uint32_t delay_us)
+static write_reg_command_t write_reg_command(uint32_t address, uint32_t value,
+                                             uint32_t mask, uint32_t delay_us)
 {
     write_reg_command_t write_cmd = {
         .common = {
@@ -376,11 +599,11 @@ esp_loader_error_t loader_write_reg_cmd(uint32_t address, uint32_t value,
         .delay_us = delay_us
     };
 
-    return send_cmd(&write_cmd, sizeof(write_cmd), NULL);
+    return write_cmd;
 }
 
 
-esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg)
+static read_reg_command_t read_reg_command(uint32_t address)
 {
     read_reg_command_t read_cmd = {
         .common = {
@@ -392,6 +615,67 @@ esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg)
         .address = address,
     };
 
+    return read_cmd;
+}
+
+
+// Sends command, response of which is collected later by loader_reg_cmd_wait()
+static esp_loader_error_t send_cmd_no_response(const void *cmd_data, uint32_t size)
+{
+    command_t command = ((const command_common_t *)cmd_data)->command;
+
+    trace_event(ESP_LOADER_TRACE_COMMAND, command, size, 0, 0, 0);
+
+    uint32_t start = stats_time();
+    esp_loader_error_t err = SLIP_send_frame((const uint8_t *)cmd_data, size, NULL, 0);
+    stats_command(command, size, stats_time() - start, 0, err);
+
+    return err;
+}
+
+
+esp_loader_error_t loader_write_reg_cmd(uint32_t address, uint32_t value,
+                                        uint32_t mask, uint32_t delay_us)
+{
+    write_reg_command_t write_cmd = write_reg_command(address, value, mask, delay_us);
+
+    return send_cmd(&write_cmd, sizeof(write_cmd), NULL);
+}
+
+
+esp_loader_error_t loader_write_reg_cmd_send(uint32_t address, uint32_t value,
+                                             uint32_t mask, uint32_t delay_us)
+{
+    write_reg_command_t write_cmd = write_reg_command(address, value, mask, delay_us);
+
+    return send_cmd_no_response(&write_cmd, sizeof(write_cmd));
+}
+
+
+esp_loader_error_t loader_read_reg_cmd_send(uint32_t address)
+{
+    read_reg_command_t read_cmd = read_reg_command(address);
+
+    return send_cmd_no_response(&read_cmd, sizeof(read_cmd));
+}
+
+
+esp_loader_error_t loader_reg_cmd_wait(command_t command, uint32_t *reg)
+{
+    response_t response;
+
+    uint32_t start = stats_time();
+    esp_loader_error_t err = check_response(command, reg, &response, sizeof(response));
+    stats_command(command, 0, 0, stats_time() - start, err);
+
+    return err;
+}
+
+
+esp_loader_error_t loader_read_reg_cmd(uint32_t address, uint32_t *reg)
+{
+    read_reg_command_t read_cmd = read_reg_command(address);
+
     return send_cmd(&read_cmd, sizeof(read_cmd), reg);
 }
 
@@ -412,8 +696,10 @@ esp_loader_error_t loader_spi_attach_cmd(uint32_t config)
     return send_cmd(&attach_cmd, sizeof(attach_cmd), NULL);
 }
 
-esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate)
+esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate, uint32_t old_baudrate)
 {
+    esp_loader_t *ctx = loader_current();
+
     change_baudrate_command_t baudrate_cmd = {
         .common = {
             .direction = WRITE_DIRECTION,
@@ -422,13 +708,13 @@ esp_loader_error_t loader_change_baudrate_cmd(uint32_t baudrate)
             .checksum = 0
         },
         .new_baudrate = baudrate,
-        .old_baudrate = 0 // ESP32 ROM only
+        .old_baudrate = ctx->stub_mode ? old_baudrate : 0 // Stub needs it to compute the divider
     };
 
     return send_cmd(&baudrate_cmd, sizeof(baudrate_cmd), NULL);
 }
 
-esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_out)
+esp_loader_error_t loader_md5_cmd_send(uint32_t address, uint32_t size)
 {
     spi_flash_md5_command_t md5_cmd = {
         .common = {
@@ -443,7 +729,41 @@ esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_
         .reserved_1 = 0
     };
 
-    return send_cmd_md5(&md5_cmd, sizeof(md5_cmd), md5_out);
+    return send_cmd_no_response(&md5_cmd, sizeof(md5_cmd));
+}
+
+
+esp_loader_error_t loader_md5_cmd_wait(uint8_t *md5_out)
+{
+    esp_loader_error_t err;
+
+    uint32_t start = stats_time();
+
+    // ROM loader sends the digest as text, stub as raw bytes, told apart by length of the response
+    rom_md5_response_t response;
+    size_t received;
+    err = receive_response(SPI_FLASH_MD5, NULL, &response, sizeof(response), true, &received);
+    if (err == ESP_LOADER_SUCCESS) {
+        if (received >= sizeof(rom_md5_response_t)) {
+            memcpy(md5_out, response.md5, MD5_SIZE);
+        } else if (received >= sizeof(stub_md5_response_t)) {
+            loader_hexify(response.md5, MD5_SIZE / 2, md5_out);
+        } else {
+            err = ESP_LOADER_ERROR_INVALID_RESPONSE;
+        }
+    }
+
+    stats_command(SPI_FLASH_MD5, 0, 0, stats_time() - start, err);
+
+    return err;
+}
+
+
+esp_loader_error_t loader_md5_cmd(uint32_t address, uint32_t size, uint8_t *md5_out)
+{
+    RETURN_ON_ERROR( loader_md5_cmd_send(address, size) );
+
+    return loader_md5_cmd_wait(md5_out);
 }
 
 esp_loader_error_t loader_spi_parameters(uint32_t total_size)
@@ -466,6 +786,70 @@ esp_loader_error_t loader_spi_parameters(uint32_t total_size)
     return send_cmd(&spi_cmd, sizeof(spi_cmd), NULL);
 }
 
+esp_loader_error_t loader_erase_flash_cmd(void)
+{
+    command_common_t erase_cmd = {
+        .direction = WRITE_DIRECTION,
+        .command = ERASE_FLASH,
+        .size = 0,
+        .checksum = 0
+    };
+
+    return send_cmd(&erase_cmd, sizeof(erase_cmd), NULL);
+}
+
+esp_loader_error_t loader_erase_region_cmd(uint32_t offset, uint32_t size)
+{
+    erase_region_command_t erase_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = ERASE_REGION,
+            .size = CMD_SIZE(erase_cmd),
+            .checksum = 0
+        },
+        .offset = offset,
+        .size = size,
+    };
+
+    return send_cmd(&erase_cmd, sizeof(erase_cmd), NULL);
+}
+
+esp_loader_error_t loader_read_flash_cmd(uint32_t address, uint32_t size, uint32_t block_size,
+                                         uint32_t max_in_flight)
+{
+    read_flash_command_t read_cmd = {
+        .common = {
+            .direction = WRITE_DIRECTION,
+            .command = READ_FLASH,
+            .size = CMD_SIZE(read_cmd),
+            .checksum = 0
+        },
+        .address = address,
+        .size = size,
+        .block_size = block_size,
+        .max_in_flight = max_in_flight,
+    };
+
+    return send_cmd(&read_cmd, sizeof(read_cmd), NULL);
+}
+
+esp_loader_error_t loader_read_flash_data(uint8_t *data, uint32_t max_size, uint32_t *size)
+{
+    size_t received;
+
+    RETURN_ON_ERROR( SLIP_receive_frame(data, max_size, &received) );
+
+    *size = (uint32_t)received;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t loader_read_flash_ack(uint32_t received)
+{
+    // Acknowledgement is a bare frame, without command header
+    return SLIP_send_frame((const uint8_t *)&received, sizeof(received), NULL, 0);
+}
+
 __attribute__ ((weak)) void loader_port_debug_print(const char *str)
 {
     (void)str;
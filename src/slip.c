@@ -14,20 +14,70 @@
  */
 
 #include "slip.h"
-#include "esp_loader_io.h"
+#include "loader_context.h"
+#include <stddef.h>
+#include <string.h>
 
 static const uint8_t DELIMITER = 0xC0;
 static const uint8_t C0_REPLACEMENT[2] = {0xDB, 0xDC};
 static const uint8_t DB_REPLACEMENT[2] = {0xDB, 0xDD};
 
-static inline esp_loader_error_t peripheral_read(uint8_t *buff, const size_t size)
+// Non-zero if any byte of the word is zero
+#define HAS_ZERO_BYTE(word) (((word) - 0x01010101u) & ~(word) & 0x80808080u)
+
+// Number of bytes from the start of data which do not need encoding, a word at a time
+static inline size_t plain_run(const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        uint32_t word;
+        memcpy(&word, &data[i], sizeof(word));
+        if (HAS_ZERO_BYTE(word ^ 0xC0C0C0C0u) | HAS_ZERO_BYTE(word ^ 0xDBDBDBDBu)) {
+            break;
+        }
+    }
+
+    while (i < size && data[i] != 0xC0 && data[i] != 0xDB) {
+        i++;
+    }
+
+    return i;
+}
+
+static esp_loader_error_t peripheral_fill_rx_buffer(esp_loader_t *ctx, uint32_t timeout)
+{
+    uint16_t received = 0;
+
+    RETURN_ON_ERROR( port_read_available(ctx->rx_buffer, sizeof(ctx->rx_buffer), &received, timeout) );
+    if (received == 0) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    ctx->rx_head = 0;
+    ctx->rx_tail = received;
+    stats_bytes(0, 0, received);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static inline esp_loader_error_t peripheral_read_char(uint8_t *ch)
 {
-    return loader_port_read(buff, (uint16_t)size, loader_port_remaining_time());
+    esp_loader_t *ctx = loader_current();
+
+    if (ctx->rx_head == ctx->rx_tail) {
+        RETURN_ON_ERROR( peripheral_fill_rx_buffer(ctx, port_remaining_time()) );
+    }
+
+    *ch = ctx->rx_buffer[ctx->rx_head++];
+
+    return ESP_LOADER_SUCCESS;
 }
 
 static inline esp_loader_error_t peripheral_write(const uint8_t *buff, const size_t size)
 {
-    return loader_port_write(buff, (uint16_t)size, loader_port_remaining_time());
+    stats_bytes(0, size, 0);
+    return port_write(buff, (uint16_t)size, port_remaining_time());
 }
 
 esp_loader_error_t SLIP_receive_data(uint8_t *buff, const size_t size)
@@ -35,10 +85,10 @@ esp_loader_error_t SLIP_receive_data(uint8_t *buff, const size_t size)
     uint8_t ch;
 
     for (uint32_t i = 0; i < size; i++) {
-        RETURN_ON_ERROR( peripheral_read(&ch, 1) );
+        RETURN_ON_ERROR( peripheral_read_char(&ch) );
 
         if (ch == 0xDB) {
-            RETURN_ON_ERROR( peripheral_read(&ch, 1) );
+            RETURN_ON_ERROR( peripheral_read_char(&ch) );
             if (ch == 0xDC) {
                 buff[i] = 0xC0;
             } else if (ch == 0xDD) {
@@ -55,64 +105,250 @@ esp_loader_error_t SLIP_receive_data(uint8_t *buff, const size_t size)
 }
 
 
-esp_loader_error_t SLIP_receive_packet(uint8_t *buff, const size_t size)
+// Bytes past the expected size are dropped, but counted
+static inline void store_byte(esp_loader_t *ctx, uint8_t *buff, const size_t size, uint8_t ch)
 {
-    uint8_t ch;
+    if (ctx->rx_frame_size < size) {
+        buff[ctx->rx_frame_size++] = ch;
+    } else if (ctx->rx_frame_size < UINT16_MAX) {
+        ctx->rx_frame_size++;
+    }
+}
 
-    // Wait for delimiter
-    do {
-        RETURN_ON_ERROR( peripheral_read(&ch, 1) );
-    } while (ch != DELIMITER);
+static void drop_frame(esp_loader_t *ctx)
+{
+    trace_event(ESP_LOADER_TRACE_FRAME_SKIPPED, 0, ctx->rx_frame_size, 0, 0, 0);
+    ctx->rx_in_frame = false;
+}
 
-    // Workaround: bootloader sends two dummy(0xC0) bytes after response when baud rate is changed.
-    do {
-        RETURN_ON_ERROR( peripheral_read(&ch, 1) );
-    } while (ch == DELIMITER);
+// Stores decoded byte of a response, whose header tells the length of the frame.
+// Returns true once the frame is complete, without waiting for anything past it.
+static bool store_response_byte(esp_loader_t *ctx, uint8_t *buff, const size_t size, uint8_t ch)
+{
+    uint16_t pos = ctx->rx_frame_size;
 
-    buff[0] = ch;
+    if (pos == 0 && ch != READ_DIRECTION) {
+        drop_frame(ctx);
+        return false;
+    }
 
-    RETURN_ON_ERROR( SLIP_receive_data(&buff[1], size - 1) );
+    store_byte(ctx, buff, size, ch);
 
-    // Wait for delimiter
-    do {
-        RETURN_ON_ERROR( peripheral_read(&ch, 1) );
-    } while (ch != DELIMITER);
+    if (pos == offsetof(common_response_t, size)) {
+        ctx->rx_response_length = ch;
+    } else if (pos == offsetof(common_response_t, size) + 1) {
+        ctx->rx_response_length += ((uint32_t)ch << 8) + sizeof(common_response_t);
+        if (ctx->rx_response_length < RESPONSE_MIN_SIZE || ctx->rx_response_length >= UINT16_MAX) {
+            drop_frame(ctx);
+            return false;
+        }
+    }
 
-    return ESP_LOADER_SUCCESS;
+    return pos > offsetof(common_response_t, size) && ctx->rx_frame_size == ctx->rx_response_length;
 }
 
+// Consumes one byte of a SLIP encoded response. Delimiter within a frame means that it was
+// broken off, i.e. by stale bytes left from before a reset, so the delimiter starts the next
+// frame. Decoding thus gets in step again within the frame following the garbage.
+static bool receive_response_byte(esp_loader_t *ctx, uint8_t *buff, const size_t size, uint8_t ch)
+{
+    if (ch == DELIMITER) {
+        if (ctx->rx_in_frame && ctx->rx_frame_size > 0) {
+            drop_frame(ctx);
+        }
+        ctx->rx_in_frame = true;
+        ctx->rx_escape = false;
+        ctx->rx_frame_size = 0;
+        return false;
+    }
 
-esp_loader_error_t SLIP_send(const uint8_t *data, const size_t size)
+    if (!ctx->rx_in_frame) {
+        return false;
+    }
+
+    if (ctx->rx_escape) {
+        ctx->rx_escape = false;
+        if (ch == 0xDC) {
+            ch = 0xC0;
+        } else if (ch == 0xDD) {
+            ch = 0xDB;
+        } else {
+            drop_frame(ctx);
+            return false;
+        }
+    } else if (ch == 0xDB) {
+        ctx->rx_escape = true;
+        return false;
+    }
+
+    if (store_response_byte(ctx, buff, size, ch)) {
+        ctx->rx_in_frame = false;
+        return true;
+    }
+
+    return false;
+}
+
+
+// Consumes one byte of a response of packet framing, which is not delimited. Bytes which
+// cannot start a response are skipped, so that decoding gets in step with the next one.
+static bool receive_plain_response_byte(esp_loader_t *ctx, uint8_t *buff, const size_t size, uint8_t ch)
 {
-    uint32_t to_write = 0;  // Bytes ready to write as they are
-    uint32_t written = 0;   // Bytes already written
+    if (!ctx->rx_in_frame) {
+        ctx->rx_in_frame = true;
+        ctx->rx_frame_size = 0;
+    }
 
-    for (uint32_t i = 0; i < size; i++) {
-        if (data[i] != 0xC0 && data[i] != 0xDB) {
-            to_write++; // Queue this byte for writing
+    if (store_response_byte(ctx, buff, size, ch)) {
+        ctx->rx_in_frame = false;
+        return true;
+    }
+
+    return false;
+}
+
+
+// Decodes frames from received bytes until one of at least min_size bytes is complete,
+// up to size bytes are stored. Progress within the frame is kept in the context, so that
+// decoding can continue into the same buffer with the next call when wait is false.
+// Responses are decoded by the length in their header, frames of other kinds by delimiters.
+static esp_loader_error_t receive_packet(uint8_t *buff, const size_t size, const size_t min_size, bool wait,
+                                         bool response)
+{
+    esp_loader_t *ctx = loader_current();
+    bool plain = port_framing() == ESP_LOADER_FRAMING_PACKET;
+
+    while (true) {
+        if (ctx->rx_head == ctx->rx_tail) {
+            esp_loader_error_t err = peripheral_fill_rx_buffer(ctx, wait ? port_remaining_time() : 0);
+            if (err == ESP_LOADER_ERROR_TIMEOUT && !wait) {
+                return ESP_LOADER_IN_PROGRESS;
+            } else if (err != ESP_LOADER_SUCCESS) {
+                ctx->rx_in_frame = false;
+                return err;
+            }
+        }
+
+        uint8_t ch = ctx->rx_buffer[ctx->rx_head++];
+
+        if (response) {
+            bool complete = plain ? receive_plain_response_byte(ctx, buff, size, ch)
+                                  : receive_response_byte(ctx, buff, size, ch);
+            if (complete) {
+                return ESP_LOADER_SUCCESS;
+            }
+            continue;
+        }
+
+        if (!ctx->rx_in_frame) {
+            // Wait for delimiter
+            if (ch == DELIMITER) {
+                ctx->rx_in_frame = true;
+                ctx->rx_escape = false;
+                ctx->rx_frame_size = 0;
+            }
             continue;
         }
 
-        // We have a byte that needs encoding, write the queue first
-        if (to_write > 0) {
-            RETURN_ON_ERROR( peripheral_write(&data[written], to_write) );
+        if (ch == DELIMITER) {
+            // Workaround: bootloader sends two dummy(0xC0) bytes after response when baud rate is changed.
+            if (ctx->rx_frame_size == 0) {
+                continue;
+            }
+
+            ctx->rx_in_frame = false;
+            if (ctx->rx_frame_size >= min_size) {
+                return ESP_LOADER_SUCCESS;
+            }
+            // Frame is too short to be the response, skip it
+            trace_event(ESP_LOADER_TRACE_FRAME_SKIPPED, 0, ctx->rx_frame_size, 0, 0, 0);
+            continue;
         }
 
-        // Write the encoded byte
-        if (data[i] == 0xC0) {
-            RETURN_ON_ERROR( peripheral_write(C0_REPLACEMENT, 2) );
-        } else {
-            RETURN_ON_ERROR( peripheral_write(DB_REPLACEMENT, 2) );
+        if (ctx->rx_escape) {
+            ctx->rx_escape = false;
+            if (ch == 0xDC) {
+                ch = 0xC0;
+            } else if (ch == 0xDD) {
+                ch = 0xDB;
+            } else {
+                ctx->rx_in_frame = false;
+                return ESP_LOADER_ERROR_INVALID_RESPONSE;
+            }
+        } else if (ch == 0xDB) {
+            ctx->rx_escape = true;
+            continue;
         }
 
-        // Update to start again after the encoded byte
-        written = i + 1;
-        to_write = 0;
+        store_byte(ctx, buff, size, ch);
     }
+}
+
 
-    // Write the rest of the bytes that didn't need encoding
-    if (to_write > 0) {
-        RETURN_ON_ERROR( peripheral_write(&data[written], to_write) );
+esp_loader_error_t SLIP_receive_packet(uint8_t *buff, const size_t size)
+{
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    return receive_packet(buff, size, size, true, false);
+}
+
+
+esp_loader_error_t SLIP_receive_response(uint8_t *buff, const size_t size, size_t *received, bool wait)
+{
+    RETURN_ON_ERROR( receive_packet(buff, size, RESPONSE_MIN_SIZE, wait, true) );
+
+    *received = loader_current()->rx_frame_size;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t SLIP_receive_frame(uint8_t *buff, const size_t max_size, size_t *size)
+{
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    RETURN_ON_ERROR( receive_packet(buff, max_size, 1, true, false) );
+
+    *size = loader_current()->rx_frame_size;
+    trace_event(ESP_LOADER_TRACE_FRAME, 0, (uint32_t)*size, 0, 0, 0);
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+void SLIP_flush_rx(void)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->rx_head = 0;
+    ctx->rx_tail = 0;
+    ctx->rx_in_frame = false;
+    ctx->rx_escape = false;
+    ctx->rx_frame_size = 0;
+    ctx->rx_response_length = 0;
+}
+
+
+esp_loader_error_t SLIP_send(const uint8_t *data, const size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        // Bytes which do not need encoding are written as they are
+        size_t run = plain_run(&data[i], size - i);
+        if (run > 0) {
+            RETURN_ON_ERROR( peripheral_write(&data[i], run) );
+            i += run;
+        }
+
+        if (i < size) {
+            RETURN_ON_ERROR( peripheral_write(data[i] == 0xC0 ? C0_REPLACEMENT : DB_REPLACEMENT, 2) );
+            i++;
+        }
     }
 
     return ESP_LOADER_SUCCESS;
@@ -123,3 +359,205 @@ esp_loader_error_t SLIP_send_delimiter(void)
 {
     return peripheral_write(&DELIMITER, 1);
 }
+
+
+void SLIP_set_tx_buffer(uint8_t *buffer, size_t size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    ctx->tx_buffer = buffer;
+    ctx->tx_buffer_size = (buffer != NULL) ? size : 0;
+}
+
+
+// Returns position after the encoded data, or NULL if it does not fit
+static uint8_t *encode(uint8_t *out, const uint8_t *out_end, const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+
+    while (i < size) {
+        size_t run = plain_run(&data[i], size - i);
+        if (run > (size_t)(out_end - out)) {
+            return NULL;
+        }
+        memcpy(out, &data[i], run);
+        out += run;
+        i += run;
+
+        if (i < size) {
+            if (out + 2 > out_end) {
+                return NULL;
+            }
+            const uint8_t *replacement = (data[i] == 0xC0) ? C0_REPLACEMENT : DB_REPLACEMENT;
+            *out++ = replacement[0];
+            *out++ = replacement[1];
+            i++;
+        }
+    }
+
+    return out;
+}
+
+
+// Returns position after the encoded fill bytes, or NULL if they do not fit
+static uint8_t *encode_fill(uint8_t *out, const uint8_t *out_end, uint8_t fill, size_t count)
+{
+    if (plain_run(&fill, 1) == 1) {
+        if (count > (size_t)(out_end - out)) {
+            return NULL;
+        }
+        memset(out, fill, count);
+        return out + count;
+    }
+
+    while (count--) {
+        out = encode(out, out_end, &fill, 1);
+        if (out == NULL) {
+            return NULL;
+        }
+    }
+
+    return out;
+}
+
+
+esp_loader_error_t SLIP_send_frame(const uint8_t *header, size_t header_size,
+                                   const uint8_t *data, size_t data_size)
+{
+    return SLIP_send_frame_padded(header, header_size, data, data_size, 0, 0);
+}
+
+
+static esp_loader_error_t send_fill(uint8_t fill, size_t count, esp_loader_error_t (*send)(const uint8_t *, size_t))
+{
+    uint8_t chunk[16];
+    memset(chunk, fill, sizeof(chunk));
+    while (count > 0) {
+        size_t to_send = count < sizeof(chunk) ? count : sizeof(chunk);
+        RETURN_ON_ERROR( send(chunk, to_send) );
+        count -= to_send;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t SLIP_encode_frame(const uint8_t *header, size_t header_size,
+                                     const uint8_t *data, size_t data_size,
+                                     uint8_t padding, size_t padding_size,
+                                     uint8_t *frame, size_t frame_size, size_t *encoded_size)
+{
+    uint8_t *out = frame;
+
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+        return ESP_LOADER_ERROR_UNSUPPORTED_FUNC;
+    }
+
+    if (frame_size < 2) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    const uint8_t *end = frame + frame_size - 1; // Keep space for end delimiter
+
+    *out++ = DELIMITER;
+    out = encode(out, end, header, header_size);
+    if (out != NULL) {
+        out = encode(out, end, data, data_size);
+    }
+    if (out != NULL) {
+        out = encode_fill(out, end, padding, padding_size);
+    }
+    if (out == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+    *out++ = DELIMITER;
+
+    if (out - frame > UINT16_MAX) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+    *encoded_size = out - frame;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t SLIP_send_encoded(const uint8_t *frame, size_t size, size_t payload_size)
+{
+    stats_bytes(payload_size, 0, 0);
+
+    return peripheral_write(frame, size);
+}
+
+
+static esp_loader_error_t send_plain(const uint8_t *data, size_t size)
+{
+    return (size > 0) ? peripheral_write(data, size) : ESP_LOADER_SUCCESS;
+}
+
+
+// Frame of packet framing is sent as it is, header first
+static esp_loader_error_t send_plain_frame(esp_loader_t *ctx, const uint8_t *header, size_t header_size,
+                                           const uint8_t *data, size_t data_size,
+                                           uint8_t padding, size_t padding_size)
+{
+    size_t size = header_size + data_size + padding_size;
+
+    if (ctx->tx_buffer != NULL && size <= ctx->tx_buffer_size) {
+        memcpy(ctx->tx_buffer, header, header_size);
+        if (data_size > 0) {
+            memcpy(ctx->tx_buffer + header_size, data, data_size);
+        }
+        memset(ctx->tx_buffer + header_size + data_size, padding, padding_size);
+        return peripheral_write(ctx->tx_buffer, size);
+    }
+
+    RETURN_ON_ERROR( peripheral_write(header, header_size) );
+    RETURN_ON_ERROR( send_plain(data, data_size) );
+    return send_fill(padding, padding_size, send_plain);
+}
+
+
+esp_loader_error_t SLIP_send_frame_padded(const uint8_t *header, size_t header_size,
+                                          const uint8_t *data, size_t data_size,
+                                          uint8_t padding, size_t padding_size)
+{
+    esp_loader_t *ctx = loader_current();
+
+    stats_bytes(header_size + data_size + padding_size, 0, 0);
+
+    if (port_framing() == ESP_LOADER_FRAMING_PACKET) {
+        return send_plain_frame(ctx, header, header_size, data, data_size, padding, padding_size);
+    }
+
+    if (ctx->tx_buffer != NULL) {
+        size_t encoded_size;
+        if (SLIP_encode_frame(header, header_size, data, data_size, padding, padding_size,
+                              ctx->tx_buffer, ctx->tx_buffer_size, &encoded_size) == ESP_LOADER_SUCCESS) {
+            return peripheral_write(ctx->tx_buffer, encoded_size);
+        }
+        // Frame does not fit, send it piece by piece instead
+    }
+
+    RETURN_ON_ERROR( SLIP_send_delimiter() );
+    RETURN_ON_ERROR( SLIP_send(header, header_size) );
+    if (data_size > 0) {
+        RETURN_ON_ERROR( SLIP_send(data, data_size) );
+    }
+    RETURN_ON_ERROR( send_fill(padding, padding_size, SLIP_send) );
+
+    return SLIP_send_delimiter();
+}
+
+
+// Fallback for ports which do not provide a bulk read, one byte is read per call
+__attribute__ ((weak)) esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size,
+                                                                     uint16_t *bytes_read, uint32_t timeout)
+{
+    (void)size;
+
+    *bytes_read = 0;
+    RETURN_ON_ERROR( loader_port_read(data, 1, timeout) );
+    *bytes_read = 1;
+
+    return ESP_LOADER_SUCCESS;
+}
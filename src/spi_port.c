@@ -0,0 +1,294 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "esp_loader_io.h"
+#include "protocol.h"
+#include <string.h>
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b)) ? (a) : (b)
+#endif
+
+// Transactions of the half duplex SPI slave, command and address are followed by a dummy byte
+typedef enum {
+    CMD_WRITE_BUFFER = 0x01,    // Shared registers
+    CMD_READ_BUFFER  = 0x02,
+    CMD_WRITE_DMA    = 0x03,    // Frame into the receive buffer of the target
+    CMD_READ_DMA     = 0x04,    // Frame out of the send buffer of the target
+    CMD_WRITE_DONE   = 0x07,    // Hands the written frame over to the target
+    CMD_READ_DONE    = 0x08,    // Releases the send buffer of the target
+} spi_slave_cmd_t;
+
+// Shared registers telling the state of the DMA buffers
+static const uint8_t RX_STATUS_REG = 4;
+static const uint8_t TX_STATUS_REG = 8;
+
+#define STATUS_TOGGLE       (1u << 0)   // Flipped each time a buffer gets ready
+#define STATUS_INIT         (1u << 1)   // Set with the first buffer since the target booted
+#define STATUS_LENGTH_SHIFT 2           // Size of the receive buffer, or of the frame to be sent
+
+static const uint32_t STATUS_POLL_INTERVAL_MS = 1;
+
+typedef struct {
+    uint8_t *toggle;
+    bool *first;
+} buffer_state_t;
+
+static esp_loader_error_t start_transaction(esp_loader_spi_port_t *port, spi_slave_cmd_t cmd, uint8_t address,
+                                            uint32_t timeout)
+{
+    const uint8_t header[3] = { cmd, address, 0 };
+
+    port->bus->spi_set_cs(port->bus_arg, 0);
+    esp_loader_error_t err = port->bus->write(port->bus_arg, header, sizeof(header), timeout);
+    if (err != ESP_LOADER_SUCCESS) {
+        port->bus->spi_set_cs(port->bus_arg, 1);
+    }
+
+    return err;
+}
+
+// Either tx or rx carries size bytes of data, none if both are NULL
+static esp_loader_error_t transaction(esp_loader_spi_port_t *port, spi_slave_cmd_t cmd, uint8_t address,
+                                      const uint8_t *tx, uint8_t *rx, uint16_t size, uint32_t timeout)
+{
+    RETURN_ON_ERROR( start_transaction(port, cmd, address, timeout) );
+
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+    if (tx != NULL) {
+        err = port->bus->write(port->bus_arg, tx, size, timeout);
+    } else if (rx != NULL) {
+        err = port->bus->read(port->bus_arg, rx, size, timeout);
+    }
+    port->bus->spi_set_cs(port->bus_arg, 1);
+
+    return err;
+}
+
+static void buffer_reset(buffer_state_t buffer)
+{
+    *buffer.toggle = 0;
+    *buffer.first = true;
+}
+
+// Target announces its first buffer with the init bit, later ones by flipping the toggle bit.
+// Status of a target which has just booted has both set, it announces buffers once cleared.
+static esp_loader_error_t read_status(esp_loader_spi_port_t *port, uint8_t reg, buffer_state_t buffer,
+                                      bool *ready, uint32_t *length, uint32_t timeout)
+{
+    uint8_t raw[4];
+
+    *ready = false;
+    RETURN_ON_ERROR( transaction(port, CMD_READ_BUFFER, reg, NULL, raw, sizeof(raw), timeout) );
+    uint32_t status = raw[0] | (raw[1] << 8) | (raw[2] << 16) | ((uint32_t)raw[3] << 24);
+
+    if ((status & (STATUS_TOGGLE | STATUS_INIT)) == (STATUS_TOGGLE | STATUS_INIT)) {
+        static const uint8_t cleared[4] = { 0 };
+        buffer_reset(buffer);
+        return transaction(port, CMD_WRITE_BUFFER, reg, cleared, NULL, sizeof(cleared), timeout);
+    }
+
+    bool init = (status & STATUS_INIT) != 0;
+    if ((status & STATUS_TOGGLE) == *buffer.toggle && init == *buffer.first) {
+        *ready = true;
+        *length = status >> STATUS_LENGTH_SHIFT;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Polls the status until the buffer is ready, only once with zero timeout
+static esp_loader_error_t wait_buffer(esp_loader_spi_port_t *port, uint8_t reg, buffer_state_t buffer,
+                                      uint32_t *length, uint32_t timeout)
+{
+    bool ready;
+
+    while (true) {
+        RETURN_ON_ERROR( read_status(port, reg, buffer, &ready, length, timeout) );
+        if (ready) {
+            return ESP_LOADER_SUCCESS;
+        }
+        if (timeout == 0 || port->bus->remaining_time(port->bus_arg) == 0) {
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+        port->bus->delay_ms(port->bus_arg, STATUS_POLL_INTERVAL_MS);
+    }
+}
+
+static void buffer_done(buffer_state_t buffer)
+{
+    *buffer.toggle ^= STATUS_TOGGLE;
+    *buffer.first = false;
+}
+
+static buffer_state_t rx_buffer(esp_loader_spi_port_t *port)
+{
+    return (buffer_state_t) { .toggle = &port->rx_toggle, .first = &port->rx_first };
+}
+
+static buffer_state_t tx_buffer(esp_loader_spi_port_t *port)
+{
+    return (buffer_state_t) { .toggle = &port->tx_toggle, .first = &port->tx_first };
+}
+
+// Frame is written by one DMA transaction, held open until all of its bytes came
+static esp_loader_error_t spi_write(void *arg, const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+
+    if (port->tx_remaining == 0) {
+        command_common_t header;
+        uint32_t buffer_size;
+
+        if (size < sizeof(header)) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+        memcpy(&header, data, sizeof(header));
+        uint32_t frame_size = sizeof(header) + header.size;
+
+        RETURN_ON_ERROR( wait_buffer(port, RX_STATUS_REG, rx_buffer(port), &buffer_size, timeout) );
+        if (frame_size > buffer_size) {
+            return ESP_LOADER_ERROR_INVALID_PARAM;
+        }
+        RETURN_ON_ERROR( start_transaction(port, CMD_WRITE_DMA, 0, timeout) );
+        port->tx_remaining = (uint16_t)frame_size;
+    }
+
+    esp_loader_error_t err = ESP_LOADER_ERROR_INVALID_PARAM;
+    if (size <= port->tx_remaining) {
+        err = port->bus->write(port->bus_arg, data, size, timeout);
+        port->tx_remaining -= size;
+    }
+
+    if (err != ESP_LOADER_SUCCESS || port->tx_remaining == 0) {
+        port->tx_remaining = 0;
+        port->bus->spi_set_cs(port->bus_arg, 1);
+        RETURN_ON_ERROR( err );
+        RETURN_ON_ERROR( transaction(port, CMD_WRITE_DONE, 0, NULL, NULL, 0, timeout) );
+        buffer_done(rx_buffer(port));
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+// Reads the frame the target has ready, bytes past size are dropped
+static esp_loader_error_t spi_read_available(void *arg, uint8_t *data, uint16_t size,
+                                             uint16_t *bytes_read, uint32_t timeout)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    uint32_t length;
+
+    *bytes_read = 0;
+    RETURN_ON_ERROR( wait_buffer(port, TX_STATUS_REG, tx_buffer(port), &length, timeout) );
+
+    uint16_t to_read = (uint16_t)MIN(length, size);
+    RETURN_ON_ERROR( transaction(port, CMD_READ_DMA, 0, NULL, data, to_read, timeout) );
+    RETURN_ON_ERROR( transaction(port, CMD_READ_DONE, 0, NULL, NULL, 0, timeout) );
+    buffer_done(tx_buffer(port));
+    *bytes_read = to_read;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t spi_read(void *arg, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    while (size > 0) {
+        uint16_t bytes_read;
+        RETURN_ON_ERROR( spi_read_available(arg, data, size, &bytes_read, timeout) );
+        data += bytes_read;
+        size -= bytes_read;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static void spi_delay_ms(void *arg, uint32_t ms)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    port->bus->delay_ms(port->bus_arg, ms);
+}
+
+static void spi_start_timer(void *arg, uint32_t ms)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    port->bus->start_timer(port->bus_arg, ms);
+}
+
+static uint32_t spi_remaining_time(void *arg)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    return port->bus->remaining_time(port->bus_arg);
+}
+
+// Target boots anew, buffers are announced from the first one again
+static void spi_enter_bootloader(void *arg)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    buffer_reset(rx_buffer(port));
+    buffer_reset(tx_buffer(port));
+    port->tx_remaining = 0;
+    port->bus->enter_bootloader(port->bus_arg);
+}
+
+static void spi_reset_target(void *arg)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    buffer_reset(rx_buffer(port));
+    buffer_reset(tx_buffer(port));
+    port->tx_remaining = 0;
+    port->bus->reset_target(port->bus_arg);
+}
+
+static void spi_debug_print(void *arg, const char *str)
+{
+    esp_loader_spi_port_t *port = (esp_loader_spi_port_t *)arg;
+    if (port->bus->debug_print != NULL) {
+        port->bus->debug_print(port->bus_arg, str);
+    }
+}
+
+const esp_loader_port_ops_t esp_loader_spi_port_ops = {
+    .write = spi_write,
+    .read = spi_read,
+    .read_available = spi_read_available,
+    .delay_ms = spi_delay_ms,
+    .start_timer = spi_start_timer,
+    .remaining_time = spi_remaining_time,
+    .enter_bootloader = spi_enter_bootloader,
+    .reset_target = spi_reset_target,
+    .debug_print = spi_debug_print,
+    .change_transmission_rate = NULL,
+    .spi_set_cs = NULL,
+    .framing = ESP_LOADER_FRAMING_PACKET,
+};
+
+
+esp_loader_error_t esp_loader_spi_port_init(esp_loader_spi_port_t *port, const esp_loader_port_ops_t *bus,
+                                            void *bus_arg)
+{
+    if (bus == NULL || bus->write == NULL || bus->read == NULL || bus->delay_ms == NULL ||
+            bus->start_timer == NULL || bus->remaining_time == NULL || bus->enter_bootloader == NULL ||
+            bus->reset_target == NULL || bus->spi_set_cs == NULL) {
+        return ESP_LOADER_ERROR_INVALID_PARAM;
+    }
+
+    memset(port, 0, sizeof(*port));
+    port->bus = bus;
+    port->bus_arg = bus_arg;
+    buffer_reset(rx_buffer(port));
+    buffer_reset(tx_buffer(port));
+
+    return ESP_LOADER_SUCCESS;
+}
@@ -0,0 +1,512 @@
+/* Copyright 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Throughput benchmark of the host side. Target is simulated by a ROM responder
+   on a virtual clock, advanced by the time bytes take on the wire at the given
+   baud rate, by response latency of the target and by a simple flash model.
+   Reported simulated times thus estimate flashing time of a real link, while
+   CPU times tell the cost of the library itself. */
+
+#include "esp_loader.h"
+#include "esp_loader_io.h"
+#include "esp_targets.h"
+#include "inflate_size.h"
+#include "md5_hash.h"
+#include "protocol.h"
+#include "slip.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const uint32_t ESP32_MAGIC_VALUE = 0x00f01d83;
+static const uint32_t FLASH_SIZE = 16 * 1024 * 1024;
+static const uint32_t SECTOR_SIZE = 4096;
+static const uint64_t ERASE_US_PER_SECTOR = 10000;  // Large regions are erased by 64 KiB blocks
+static const uint64_t WRITE_US_PER_KB = 1600;       // Page program, 0.4 ms per 256 bytes
+static const uint32_t APP_ADDRESS = 0x10000;
+static const uint32_t BLOCK_SIZE = 0x400;
+static const uint32_t DEFLATE_BLOCK_SIZE = 0x400;
+
+/* Virtual time in microseconds */
+static uint64_t s_now;
+static uint64_t s_timer_end;
+static uint32_t s_baud = 115200;
+static uint32_t s_latency_us = 100;
+
+struct pending_response {
+    uint64_t ready;
+    vector<uint8_t> bytes;
+};
+
+/* Simulated ROM loader */
+static struct {
+    vector<uint8_t> flash = vector<uint8_t>(FLASH_SIZE, 0xFF);
+    vector<uint8_t> frame;
+    bool in_frame;
+    bool escape;
+    uint64_t busy_until;        // Commands are processed one after another
+    deque<pending_response> responses;
+    uint32_t write_offset;
+    uint32_t block_size;
+    inflate_size_t inflate_size;
+} s_rom;
+
+/* Benchmarks of SLIP bypass the responder */
+static bool s_discard_writes;
+static vector<uint8_t> s_replay;
+static size_t s_replay_pos;
+
+
+static uint64_t wire_time_us(size_t bytes)
+{
+    return (uint64_t)bytes * 10 * 1000000 / s_baud;
+}
+
+static vector<uint8_t> slip_encode(const vector<uint8_t> &data)
+{
+    vector<uint8_t> out = { 0xC0 };
+    for (uint8_t byte : data) {
+        if (byte == 0xC0) {
+            out.insert(out.end(), { 0xDB, 0xDC });
+        } else if (byte == 0xDB) {
+            out.insert(out.end(), { 0xDB, 0xDD });
+        } else {
+            out.push_back(byte);
+        }
+    }
+    out.push_back(0xC0);
+    return out;
+}
+
+static void respond(uint8_t command, uint32_t value, uint64_t processing_us,
+                    const uint8_t *data = NULL, size_t data_size = 0)
+{
+    common_response_t common = {};
+    common.direction = READ_DIRECTION;
+    common.command = command;
+    common.size = data_size + sizeof(response_status_t);
+    common.value = value;
+    response_status_t status = {};
+    status.failed = STATUS_SUCCESS;
+
+    vector<uint8_t> response((uint8_t *)&common, (uint8_t *)&common + sizeof(common));
+    response.insert(response.end(), data, data + data_size);
+    response.insert(response.end(), (uint8_t *)&status, (uint8_t *)&status + sizeof(status));
+    vector<uint8_t> encoded = slip_encode(response);
+
+    // Command is processed once fully received, its response then takes time on the wire
+    uint64_t start = max(s_now, s_rom.busy_until) + s_latency_us;
+    s_rom.busy_until = start + processing_us;
+    s_rom.responses.push_back({ s_rom.busy_until + wire_time_us(encoded.size()), encoded });
+}
+
+static uint32_t word_at(const vector<uint8_t> &frame, size_t offset)
+{
+    uint32_t word = 0;
+    if (offset + 4 <= frame.size()) {
+        memcpy(&word, &frame[offset], 4);
+    }
+    return word;
+}
+
+static void handle_command(const vector<uint8_t> &frame)
+{
+    if (frame.size() < sizeof(command_common_t) || frame[0] != WRITE_DIRECTION) {
+        return;
+    }
+
+    uint8_t command = frame[1];
+    const size_t args = sizeof(command_common_t);
+
+    switch (command) {
+    case READ_REG: {
+        uint32_t address = word_at(frame, args);
+        respond(command, address == CHIP_DETECT_MAGIC_REG_ADDR ? ESP32_MAGIC_VALUE : 0, 0);
+        break;
+    }
+    case FLASH_BEGIN:
+    case FLASH_DEFL_BEGIN: {
+        uint32_t size = word_at(frame, args);
+        s_rom.block_size = word_at(frame, args + 8);
+        s_rom.write_offset = word_at(frame, args + 12);
+        inflate_size_init(&s_rom.inflate_size);
+        uint64_t sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        respond(command, 0, sectors * ERASE_US_PER_SECTOR);
+        break;
+    }
+    case FLASH_DATA: {
+        const size_t header = sizeof(data_command_t);
+        uint32_t sequence = word_at(frame, args + 4);
+        uint32_t address = s_rom.write_offset + sequence * s_rom.block_size;
+        size_t size = frame.size() - header;
+        if (address + size <= FLASH_SIZE) {
+            copy(frame.begin() + header, frame.end(), s_rom.flash.begin() + address);
+        }
+        respond(command, 0, size * WRITE_US_PER_KB / 1024);
+        break;
+    }
+    case FLASH_DEFL_DATA: {
+        // Contents are not inflated, only the write time depends on them
+        uint32_t produced = 0;
+        const size_t header = sizeof(data_command_t);
+        inflate_size_scan(&s_rom.inflate_size, &frame[header], frame.size() - header, &produced);
+        respond(command, 0, (uint64_t)produced * WRITE_US_PER_KB / 1024);
+        break;
+    }
+    case SPI_FLASH_MD5: {
+        uint32_t address = word_at(frame, args);
+        uint32_t size = word_at(frame, args + 4);
+        uint8_t digest[16];
+        uint8_t hex[32];
+        struct MD5Context context;
+        MD5Init(&context);
+        if (address + size <= FLASH_SIZE) {
+            MD5Update(&context, &s_rom.flash[address], size);
+        }
+        MD5Final(digest, &context);
+        loader_hexify(digest, sizeof(digest), hex);
+        // Target reads flash at about 10 MB/s
+        respond(command, 0, size / 10, hex, sizeof(hex));
+        break;
+    }
+    default:
+        respond(command, 0, 0);
+        break;
+    }
+}
+
+// Decodes SLIP frames sent by the host
+static void receive_byte(uint8_t byte)
+{
+    if (byte == 0xC0) {
+        if (s_rom.in_frame && !s_rom.frame.empty()) {
+            handle_command(s_rom.frame);
+        }
+        s_rom.in_frame = true;
+        s_rom.frame.clear();
+    } else if (s_rom.escape) {
+        s_rom.frame.push_back(byte == 0xDC ? 0xC0 : 0xDB);
+        s_rom.escape = false;
+    } else if (byte == 0xDB) {
+        s_rom.escape = true;
+    } else {
+        s_rom.frame.push_back(byte);
+    }
+}
+
+
+esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    if (s_discard_writes) {
+        return ESP_LOADER_SUCCESS;
+    }
+
+    // Host blocks until its bytes leave the UART, target receives them meanwhile
+    s_now += wire_time_us(size);
+    for (uint16_t i = 0; i < size; i++) {
+        receive_byte(data[i]);
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    *bytes_read = 0;
+
+    if (!s_replay.empty()) {
+        size_t to_read = min((size_t)size, s_replay.size() - s_replay_pos);
+        memcpy(data, &s_replay[s_replay_pos], to_read);
+        s_replay_pos = (s_replay_pos + to_read) % s_replay.size();
+        *bytes_read = to_read;
+        return ESP_LOADER_SUCCESS;
+    }
+
+    if (s_rom.responses.empty() || s_rom.responses.front().ready > s_now + (uint64_t)timeout * 1000) {
+        s_now += (uint64_t)timeout * 1000;
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    pending_response &response = s_rom.responses.front();
+    s_now = max(s_now, response.ready);
+
+    size_t to_read = min((size_t)size, response.bytes.size());
+    copy_n(response.bytes.begin(), to_read, data);
+    response.bytes.erase(response.bytes.begin(), response.bytes.begin() + to_read);
+    if (response.bytes.empty()) {
+        s_rom.responses.pop_front();
+    }
+
+    *bytes_read = to_read;
+    return ESP_LOADER_SUCCESS;
+}
+
+
+esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    while (size > 0) {
+        uint16_t bytes_read;
+        RETURN_ON_ERROR( loader_port_read_available(data, size, &bytes_read, timeout) );
+        data += bytes_read;
+        size -= bytes_read;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+
+void loader_port_enter_bootloader(void) { }
+
+void loader_port_reset_target(void) { }
+
+void loader_port_delay_ms(uint32_t ms)
+{
+    s_now += (uint64_t)ms * 1000;
+}
+
+void loader_port_start_timer(uint32_t ms)
+{
+    s_timer_end = s_now + (uint64_t)ms * 1000;
+}
+
+uint32_t loader_port_remaining_time(void)
+{
+    return (s_timer_end > s_now) ? (uint32_t)((s_timer_end - s_now) / 1000) : 0;
+}
+
+void loader_port_debug_print(const char *str) { }
+
+esp_loader_error_t loader_port_change_transmission_rate(uint32_t transmission_rate)
+{
+    s_baud = transmission_rate;
+    return ESP_LOADER_SUCCESS;
+}
+
+
+typedef chrono::steady_clock host_clock;
+
+static double elapsed_ms(host_clock::time_point start)
+{
+    return chrono::duration<double, milli>(host_clock::now() - start).count();
+}
+
+static vector<uint8_t> pseudo_random_data(size_t size)
+{
+    vector<uint8_t> data(size);
+    uint32_t seed = 1;
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = seed >> 16;
+    }
+    return data;
+}
+
+static void benchmark_slip(void)
+{
+    const size_t total = 64 * 1024 * 1024;
+    vector<uint8_t> block = pseudo_random_data(4096);
+    data_command_t header = {};
+
+    s_discard_writes = true;
+    auto start = host_clock::now();
+    for (size_t sent = 0; sent < total; sent += block.size()) {
+        SLIP_send_frame((const uint8_t *)&header, sizeof(header), block.data(), block.size());
+    }
+    double ms = elapsed_ms(start);
+    s_discard_writes = false;
+    printf("SLIP encode:            %8.1f MB/s\n", total / 1000.0 / ms);
+
+    s_replay = slip_encode(block);
+    s_replay_pos = 0;
+    SLIP_flush_rx();
+    vector<uint8_t> frame(block.size());
+    size_t frame_size;
+    start = host_clock::now();
+    for (size_t received = 0; received < total; received += block.size()) {
+        SLIP_receive_frame(frame.data(), frame.size(), &frame_size);
+    }
+    ms = elapsed_ms(start);
+    s_replay.clear();
+    SLIP_flush_rx();
+    printf("SLIP decode:            %8.1f MB/s\n", total / 1000.0 / ms);
+}
+
+static void benchmark_md5(void)
+{
+    const size_t total = 64 * 1024 * 1024;
+    vector<uint8_t> block = pseudo_random_data(4096);
+    struct MD5Context context;
+    uint8_t digest[16];
+
+    auto start = host_clock::now();
+    MD5Init(&context);
+    for (size_t hashed = 0; hashed < total; hashed += block.size()) {
+        MD5Update(&context, block.data(), block.size());
+    }
+    MD5Final(digest, &context);
+    printf("MD5:                    %8.1f MB/s\n", total / 1000.0 / elapsed_ms(start));
+}
+
+static bool connect(void)
+{
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    uint64_t sim_start = s_now;
+
+    if (esp_loader_connect(&connect_config) != ESP_LOADER_SUCCESS) {
+        printf("Connection to simulated target failed\n");
+        return false;
+    }
+
+    printf("Connect:                %8.1f ms simulated\n", (s_now - sim_start) / 1000.0);
+    return true;
+}
+
+static void benchmark_commands(void)
+{
+    const uint32_t count = 10000;
+    uint32_t value;
+
+    uint64_t sim_start = s_now;
+    auto start = host_clock::now();
+    for (uint32_t i = 0; i < count; i++) {
+        esp_loader_read_register(0x3FF00000, &value);
+    }
+    double ms = elapsed_ms(start);
+    printf("Command overhead:       %8.2f us CPU, %.3f ms simulated per READ_REG\n",
+           ms * 1000 / count, (s_now - sim_start) / 1000.0 / count);
+}
+
+static void report_flash(const char *name, size_t size, uint64_t sim_start, host_clock::time_point start)
+{
+    double sim_ms = (s_now - sim_start) / 1000.0;
+    printf("  %-20s %8.1f ms simulated (%6.1f KB/s), %7.2f ms CPU\n",
+           name, sim_ms, size / sim_ms, elapsed_ms(start));
+}
+
+static bool flash_image(const char *path)
+{
+    ifstream file(path, ios::binary);
+    if (!file) {
+        printf("Image %s could not be opened\n", path);
+        return false;
+    }
+    vector<uint8_t> image((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    printf("%s, %zu bytes:\n", path, image.size());
+
+    uint64_t sim_start = s_now;
+    auto start = host_clock::now();
+    esp_loader_error_t err = esp_loader_flash_start(APP_ADDRESS, image.size(), BLOCK_SIZE);
+    for (size_t pos = 0; pos < image.size() && err == ESP_LOADER_SUCCESS; pos += BLOCK_SIZE) {
+        err = esp_loader_flash_write(&image[pos], min((size_t)BLOCK_SIZE, image.size() - pos));
+    }
+    if (err != ESP_LOADER_SUCCESS) {
+        printf("  Raw flashing failed with error %d\n", err);
+        return false;
+    }
+    report_flash("raw write", image.size(), sim_start, start);
+
+    sim_start = s_now;
+    start = host_clock::now();
+    err = esp_loader_flash_verify();
+    if (err != ESP_LOADER_SUCCESS) {
+        printf("  Verification failed with error %d\n", err);
+        return false;
+    }
+    report_flash("MD5 verify", image.size(), sim_start, start);
+
+    static uint8_t work[ESP_LOADER_DEFLATE_WORK_SIZE(DEFLATE_BLOCK_SIZE)] __attribute__((aligned(4)));
+    esp_loader_reset_stats();
+    sim_start = s_now;
+    start = host_clock::now();
+    err = esp_loader_flash_deflate_start(APP_ADDRESS, image.size(), DEFLATE_BLOCK_SIZE, work, sizeof(work));
+    if (err == ESP_LOADER_SUCCESS) {
+        err = esp_loader_flash_deflate_write(image.data(), image.size());
+    }
+    if (err == ESP_LOADER_SUCCESS) {
+        err = esp_loader_flash_deflate_flush();
+    }
+    if (err != ESP_LOADER_SUCCESS) {
+        printf("  Deflate flashing failed with error %d\n", err);
+        return false;
+    }
+    report_flash("deflate write", image.size(), sim_start, start);
+
+    esp_loader_stats_t stats;
+    esp_loader_get_stats(&stats);
+    printf("  %-20s %8u payload bytes, %u on wire\n", "deflate traffic", stats.payload_bytes, stats.wire_bytes);
+
+    return true;
+}
+
+static void usage(const char *name)
+{
+    printf("Usage: %s [--baud <rate>] [--latency-us <us>] [image.bin ...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    vector<const char *> images;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc) {
+            s_baud = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) {
+            s_latency_us = strtoul(argv[++i], NULL, 0);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            images.push_back(argv[i]);
+        }
+    }
+
+    if (s_baud == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (images.empty()) {
+        images.push_back(BENCHMARK_DEFAULT_IMAGE);
+    }
+
+    printf("Simulated link: %u baud, %u us response latency\n\n", s_baud, s_latency_us);
+
+    benchmark_slip();
+    benchmark_md5();
+
+    if (!connect()) {
+        return 1;
+    }
+    benchmark_commands();
+
+    for (const char *image : images) {
+        if (!flash_image(image)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
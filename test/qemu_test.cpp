@@ -18,8 +18,13 @@
 #include "esp_loader.h"
 #include "esp_loader_io.h"
 #include <algorithm>
+#include <chrono>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <sstream>
+#include <vector>
 
 using namespace std;
 
@@ -117,4 +122,127 @@ TEST_CASE( "Can write and read register" )
     ESP_ERR_CHECK( esp_loader_write_register(SPI_MOSI_DLEN_REG, 55) );
     ESP_ERR_CHECK( esp_loader_read_register(SPI_MOSI_DLEN_REG, &reg_value) );
     REQUIRE ( reg_value == 55 );
-}
\ No newline at end of file
+}
+
+
+/* Performance mode, only run when selected by its tag: ./serial_flasher_test [perf]
+
+   Durations are written as JSON object to file named by PERF_RESULTS environment
+   variable (perf_results.json by default). If PERF_BASELINE names results of
+   a previous run, the test fails when any duration exceeds its baseline by more
+   than PERF_THRESHOLD percent (10 by default). */
+
+typedef map<string, double> perf_results_t;
+
+template<typename F>
+static double measure_ms(F operation)
+{
+    auto start = chrono::steady_clock::now();
+    operation();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static void write_perf_results(const perf_results_t &results, const char *path)
+{
+    ofstream out(path);
+    const char *separator = "";
+
+    out << "{";
+    for (auto &result : results) {
+        out << separator << "\n  \"" << result.first << "\": " << result.second;
+        separator = ",";
+    }
+    out << "\n}\n";
+}
+
+// Reads flat object of numbers, as written above
+static perf_results_t read_perf_results(const char *path)
+{
+    ifstream in(path);
+    stringstream content;
+    perf_results_t results;
+
+    content << in.rdbuf();
+    string text = content.str();
+
+    for (size_t pos = text.find('"'); pos != string::npos; pos = text.find('"', pos)) {
+        size_t name_end = text.find('"', pos + 1);
+        size_t value_start = text.find(':', name_end);
+        if (name_end == string::npos || value_start == string::npos) {
+            break;
+        }
+        results[text.substr(pos + 1, name_end - pos - 1)] = strtod(&text[value_start + 1], NULL);
+        pos = text.find_first_of(",}", value_start);
+    }
+
+    return results;
+}
+
+static const char *env_or(const char *name, const char *fallback)
+{
+    const char *value = getenv(name);
+    return value ? value : fallback;
+}
+
+TEST_CASE( "Flashing performance", "[.][perf]" )
+{
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    const uint32_t block_size = 1024;
+    static uint8_t work[ESP_LOADER_DEFLATE_WORK_SIZE(block_size)] __attribute__((aligned(4)));
+    perf_results_t results;
+
+    ifstream file("../hello-world.bin", ios::binary);
+    REQUIRE( file.is_open() );
+    vector<uint8_t> image((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    uint32_t image_size = image.size();
+
+    results["connect_ms"] = measure_ms([&] {
+        ESP_ERR_CHECK( esp_loader_connect(&connect_config) );
+    });
+
+    results["raw_erase_ms"] = measure_ms([&] {
+        ESP_ERR_CHECK( esp_loader_flash_start(APP_START_ADDRESS, image_size, block_size) );
+    });
+
+    results["raw_write_ms"] = measure_ms([&] {
+        for (uint32_t pos = 0; pos < image_size; pos += block_size) {
+            ESP_ERR_CHECK( esp_loader_flash_write(&image[pos], min(block_size, image_size - pos)) );
+        }
+    });
+
+    results["md5_verify_ms"] = measure_ms([&] {
+        ESP_ERR_CHECK( esp_loader_flash_verify() );
+    });
+
+    results["deflate_erase_ms"] = measure_ms([&] {
+        ESP_ERR_CHECK( esp_loader_flash_deflate_start(APP_START_ADDRESS, image_size, block_size,
+                                                      work, sizeof(work)) );
+    });
+
+    results["deflate_write_ms"] = measure_ms([&] {
+        ESP_ERR_CHECK( esp_loader_flash_deflate_write(image.data(), image_size) );
+        ESP_ERR_CHECK( esp_loader_flash_deflate_flush() );
+    });
+
+    results["image_bytes"] = image_size;
+
+    for (auto &result : results) {
+        cout << result.first << ": " << result.second << endl;
+    }
+    write_perf_results(results, env_or("PERF_RESULTS", "perf_results.json"));
+
+    const char *baseline_path = getenv("PERF_BASELINE");
+    if (baseline_path != NULL) {
+        perf_results_t baseline = read_perf_results(baseline_path);
+        double threshold = strtod(env_or("PERF_THRESHOLD", "10"), NULL);
+
+        REQUIRE( !baseline.empty() );
+        for (auto &expected : baseline) {
+            if (results.count(expected.first) == 0 || expected.first == "image_bytes") {
+                continue;
+            }
+            INFO( expected.first << ": " << results[expected.first] << " ms, baseline " << expected.second << " ms" );
+            CHECK( results[expected.first] <= expected.second * (1 + threshold / 100) );
+        }
+    }
+}
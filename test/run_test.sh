@@ -5,7 +5,11 @@ mkdir -p build && cd build
 
 if [ "$1" = "host" ]; then
     cmake -DQEMU_TEST=False .. && cmake --build . && ./serial_flasher_test
-elif [ "$1" = "qemu" ]; then
+elif [ "$1" = "benchmark" ]; then
+    # Remaining arguments, i.e. --baud 921600 image.bin, are passed to the benchmark
+    shift
+    cmake -DQEMU_TEST=False .. && cmake --build . && ./serial_flasher_benchmark "$@"
+elif [ "$1" = "qemu" ] || [ "$1" = "qemu-perf" ]; then
     # QEMU_PATH environment variable has to be defined, pointing to qemu-system-xtensa
     # Example: export QEMU_PATH=/home/user/esp/qemu/xtensa-softmmu/qemu-system-xtensa
     if [ -z "${QEMU_PATH}" ]; then
@@ -24,10 +28,16 @@ elif [ "$1" = "qemu" ]; then
         -global driver=esp32.gpio,property=strap_mode,value=0x0f \
         -serial tcp::5555,server,nowait
 
-    cmake -DQEMU_TEST=True .. && cmake --build . && ./serial_flasher_test
+    # Performance mode only runs the test selected by its tag
+    TEST_FILTER=""
+    if [ "$1" = "qemu-perf" ]; then
+        TEST_FILTER="[perf]"
+    fi
+
+    cmake -DQEMU_TEST=True .. && cmake --build . && ./serial_flasher_test ${TEST_FILTER}
 
     # Kill qemu process running in background
     kill -9 $(pidof qemu-system-xtensa)
 else
-    echo "Please select which test to run: qemu or host"
+    echo "Please select which test to run: qemu, qemu-perf, host or benchmark"
 fi
\ No newline at end of file
@@ -14,20 +14,53 @@
  */
 
 #include <limits>
+#include <deque>
 #include <vector>
 #include <iterator>
 #include <algorithm>
 #include <iostream>
 #include <stdio.h>
+#include <string.h>
 #include "esp_loader_io.h"
 #include "serial_io_mock.h"
+#include "slip.h"
+#include "protocol.h"
 
 using namespace std;
 
 static vector<int8_t> write_buffer;
 static vector<int8_t> read_buffer;
+static size_t write_count = 0;
 static uint32_t receive_delay = 0;
 static int32_t timer = 0;
+static uint32_t transmission_rate = 0;
+
+// Bytes which arrive once the host waited for them, after those already in read_buffer
+struct scheduled_read {
+    uint32_t delay;
+    vector<int8_t> bytes;
+};
+static deque<scheduled_read> scheduled_reads;
+
+static bool wait_for_scheduled(uint32_t timeout)
+{
+    if (!read_buffer.empty() || scheduled_reads.empty()) {
+        return true;
+    }
+
+    scheduled_read &next = scheduled_reads.front();
+    if (next.delay > timeout) {
+        next.delay -= timeout;
+        timer -= timeout;
+        return false;
+    }
+
+    timer -= next.delay;
+    read_buffer.insert(read_buffer.end(), next.bytes.begin(), next.bytes.end());
+    scheduled_reads.pop_front();
+
+    return true;
+}
 
 
 esp_loader_error_t loader_port_mock_init(const loader_serial_config_t *config)
@@ -43,21 +76,25 @@ void loader_port_mock_deinit()
 esp_loader_error_t loader_port_write(const uint8_t *data, uint16_t size, uint32_t timeout)
 {
     copy(&data[0], &data[size], back_inserter(write_buffer));
+    write_count++;
 
     return ESP_LOADER_SUCCESS;
 }
 
 esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeout)
 {
-    if (read_buffer.size() < size) {
+    if (!wait_for_scheduled(timeout) || read_buffer.size() < size) {
         return ESP_LOADER_ERROR_TIMEOUT;
     }
 
-    if (receive_delay != 0 && timeout != 0) {
+    // Data still on their way are not there for a read which does not wait
+    if (receive_delay != 0) {
         if (receive_delay > timeout) {
             receive_delay -= timeout;
+            timer -= timeout;
             return ESP_LOADER_ERROR_TIMEOUT;
         }
+        timer -= receive_delay;
         receive_delay = 0;
     }
 
@@ -67,6 +104,40 @@ esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeo
     return ESP_LOADER_SUCCESS;
 }
 
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    *bytes_read = 0;
+
+    if (!wait_for_scheduled(timeout) || read_buffer.empty()) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+
+    // Data still on their way are not there for a read which does not wait
+    if (receive_delay != 0) {
+        if (receive_delay > timeout) {
+            receive_delay -= timeout;
+            timer -= timeout;
+            return ESP_LOADER_ERROR_TIMEOUT;
+        }
+        timer -= receive_delay;
+        receive_delay = 0;
+    }
+
+    size_t to_read = min((size_t)size, read_buffer.size());
+    copy_n(read_buffer.begin(), to_read, data);
+    read_buffer.erase(read_buffer.begin(), read_buffer.begin() + to_read);
+    *bytes_read = (uint16_t)to_read;
+
+    return ESP_LOADER_SUCCESS;
+}
+
+esp_loader_error_t loader_port_change_transmission_rate(uint32_t rate)
+{
+    transmission_rate = rate;
+
+    return ESP_LOADER_SUCCESS;
+}
+
 void loader_port_enter_bootloader()
 {
     // GPIO0 and GPIO2 must be LOW
@@ -80,7 +151,17 @@ void loader_port_reset_target()
 
 void loader_port_delay_ms(uint32_t ms)
 {
-
+    // Frames scheduled to arrive meanwhile are received
+    while (!scheduled_reads.empty()) {
+        scheduled_read &next = scheduled_reads.front();
+        if (next.delay > ms) {
+            next.delay -= ms;
+            break;
+        }
+        ms -= next.delay;
+        read_buffer.insert(read_buffer.end(), next.bytes.begin(), next.bytes.end());
+        scheduled_reads.pop_front();
+    }
 }
 
 
@@ -122,6 +203,9 @@ void clear_buffers()
 {
     write_buffer.clear();
     read_buffer.clear();
+    scheduled_reads.clear();
+    write_count = 0;
+    SLIP_flush_rx();
 }
 
 int8_t *write_buffer_data()
@@ -134,11 +218,27 @@ size_t write_buffer_size()
     return write_buffer.size();
 }
 
+size_t write_calls_count()
+{
+    return write_count;
+}
+
+uint32_t port_transmission_rate()
+{
+    return transmission_rate;
+}
+
 void set_read_buffer(const void *data, size_t size)
 {
     SLIP_encode((const int8_t *)data, size, read_buffer);
 }
 
+void set_raw_read_buffer(const void *data, size_t size)
+{
+    const int8_t *bytes = (const int8_t *)data;
+    read_buffer.insert(read_buffer.end(), bytes, bytes + size);
+}
+
 void print_array(int8_t *data, uint32_t size)
 {
     for (uint32_t i = 0; i < size; i++) {
@@ -155,4 +255,63 @@ void write_buffer_print()
 void serial_set_time_delay(uint32_t miliseconds)
 {
     receive_delay = miliseconds;
+}
+
+void set_read_buffer_delayed(const void *data, size_t size, uint32_t delay)
+{
+    scheduled_read next = { delay, {} };
+    SLIP_encode((const int8_t *)data, size, next.bytes);
+    scheduled_reads.push_back(next);
+}
+
+void replay_trace(const esp_loader_trace_entry_t *entries, size_t count)
+{
+    uint32_t last_time = count > 0 ? entries[0].time_ms : 0;
+
+    for (size_t i = 0; i < count; i++) {
+        const esp_loader_trace_entry_t &entry = entries[i];
+
+        // Host waits for the frame once it sent its command or got the previous frame,
+        // including time it gave up waiting after
+        uint32_t delay = entry.time_ms - last_time;
+        if (entry.event != ESP_LOADER_TRACE_FAILURE) {
+            last_time = entry.time_ms;
+        }
+
+        if (entry.event == ESP_LOADER_TRACE_RESPONSE) {
+            vector<uint8_t> frame(max<size_t>(entry.size, sizeof(response_t)), 0);
+            common_response_t header = {
+                .direction = READ_DIRECTION,
+                .command = entry.command,
+                .size = (uint16_t)(frame.size() - sizeof(common_response_t)),
+                .value = entry.value,
+            };
+            memcpy(frame.data(), &header, sizeof(header));
+            frame[frame.size() - 2] = entry.status;
+            frame[frame.size() - 1] = entry.error;
+            set_read_buffer_delayed(frame.data(), frame.size(), delay);
+        } else if (entry.event == ESP_LOADER_TRACE_FRAME || entry.event == ESP_LOADER_TRACE_FRAME_SKIPPED) {
+            vector<uint8_t> frame(max<uint32_t>(entry.size, 1), 0);
+            set_read_buffer_delayed(frame.data(), frame.size(), delay);
+        }
+    }
+}
+
+bool replay_trace_file(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    vector<esp_loader_trace_entry_t> entries;
+    esp_loader_trace_entry_t entry;
+    while (fread(&entry, sizeof(entry), 1, file) == 1) {
+        entries.push_back(entry);
+    }
+    fclose(file);
+
+    replay_trace(entries.data(), entries.size());
+
+    return true;
 }
\ No newline at end of file
@@ -24,11 +24,22 @@ void clear_buffers();
 void write_buffer_print();
 size_t write_buffer_size();
 int8_t* write_buffer_data();
+size_t write_calls_count();
+uint32_t port_transmission_rate();
 
 void set_read_buffer(const void *data, size_t size);
+void set_raw_read_buffer(const void *data, size_t size);
 void print_array(int8_t *data, uint32_t size);
 void serial_set_time_delay(uint32_t miliseconds);
 
+// Frame arrives once the host waited delay milliseconds for it, after all frames queued before
+void set_read_buffer_delayed(const void *data, size_t size, uint32_t delay);
+
+// Queues frames received in the trace, each delayed by the time it took to arrive after
+// the preceding event. Contents of the frames apart from response headers are zero.
+void replay_trace(const esp_loader_trace_entry_t *entries, size_t count);
+bool replay_trace_file(const char *path);
+
 
 typedef struct {
     uint32_t dummy;
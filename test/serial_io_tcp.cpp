@@ -116,6 +116,22 @@ esp_loader_error_t loader_port_read(uint8_t *data, uint16_t size, uint32_t timeo
     return ESP_LOADER_SUCCESS;
 }
 
+esp_loader_error_t loader_port_read_available(uint8_t *data, uint16_t size, uint16_t *bytes_read, uint32_t timeout)
+{
+    int received = read(sock, data, size);
+    if (received <= 0) {
+        cout << "Socket connection lost\n";
+        *bytes_read = 0;
+        return ESP_LOADER_ERROR_FAIL;
+    }
+
+    file.write((const char*)data, received);
+    file.flush();
+
+    *bytes_read = (uint16_t)received;
+    return ESP_LOADER_SUCCESS;
+}
+
 void loader_port_enter_bootloader()
 {
     // GPIO0 and GPIO2 must be LOW
@@ -15,6 +15,9 @@
 
 #include "catch.hpp"
 #include "protocol.h"
+#include "deflate.h"
+#include "inflate_size.h"
+#include "md5_hash.h"
 #include "serial_io_mock.h"
 #include "esp_loader.h"
 #include "esp_loader_io.h"
@@ -24,6 +27,7 @@
 #include <map>
 #include <iostream>
 #include <algorithm>
+#include <vector>
 
 using namespace std;
 
@@ -65,7 +69,7 @@ struct __attribute__((packed)) expected_response {
     {
         data.common.direction = READ_DIRECTION;
         data.common.command = cmd;
-        data.common.size = 16;
+        data.common.size = sizeof(response_status_t);
         data.common.value = 0;
         data.status.failed = STATUS_SUCCESS;
         data.status.error = 0;
@@ -89,6 +93,7 @@ expected_response write_reg_response(WRITE_REG);
 expected_response read_reg_response(READ_REG);
 expected_response attach_response(SPI_ATTACH);
 expected_response sync_response(SYNC);
+expected_response change_baudrate_response(CHANGE_BAUDRATE);
 
 const uint32_t reg_address = 0x1000;
 const uint32_t reg_value = 55;
@@ -120,7 +125,8 @@ map<target_chip_t, uint32_t> chip_magic_value = {
     {ESP32H4_CHIP,  0xca26cc22},
 };
 
-void queue_connect_response(target_chip_t target = ESP32_CHIP, uint32_t magic_value = 0)
+void queue_connect_response(target_chip_t target = ESP32_CHIP, uint32_t magic_value = 0,
+                            uint32_t console_buf_no = 0)
 {
     // Set magic value register used for detection of attached chip
     auto magic_value_response = read_reg_response;
@@ -129,6 +135,13 @@ void queue_connect_response(target_chip_t target = ESP32_CHIP, uint32_t magic_va
     queue_response(sync_response);
     queue_response(magic_value_response);
 
+    // Chips with USB tell which console their ROM uses, UART by default
+    if (target == ESP32S2_CHIP || target == ESP32C3_CHIP || target == ESP32S3_CHIP) {
+        auto console_response = read_reg_response;
+        console_response.data.common.value = console_buf_no;
+        queue_response(console_response);
+    }
+
     if (target == ESP8266_CHIP) {
         queue_response(flash_begin_response);
     } else {
@@ -175,9 +188,49 @@ TEST_CASE( "Can connect within specified time " )
         REQUIRE( esp_loader_connect(&connect_config) == ESP_LOADER_ERROR_TIMEOUT );
     }
 
+    SECTION( "Number of trials and time is reported" ) {
+        esp_loader_connect_stats_t stats;
+        connect_config.trials = 5;
+        connect_config.trial_delay = 10;
+        serial_set_time_delay(25);
+        REQUIRE_SUCCESS( esp_loader_connect_with_stats(&connect_config, &stats) );
+        REQUIRE( stats.trials == 3 );
+        // Two failed trials, delays of 10 and 20 ms, response received 5 ms into the third
+        REQUIRE( stats.time_ms == 10 + 10 + 10 + 20 + 5 );
+    }
+
     serial_set_time_delay(0);
 }
 
+TEST_CASE( "Late response to a failed trial is not taken for the response to the next one" )
+{
+    esp_loader_connect_args_t connect_config = {
+        .sync_timeout = 10,
+        .trials = 2,
+        .trial_delay = 20,
+    };
+    auto magic_value_response = read_reg_response;
+    magic_value_response.data.common.value = chip_magic_value[ESP32_CHIP];
+
+    auto late_response = sync_response;
+    late_response.data.status.failed = STATUS_FAILURE;
+    late_response.data.status.error = INVALID_CRC;
+
+    // Response to the first trial arrives while waiting to retry, that to the second one after it
+    clear_buffers();
+    set_read_buffer_delayed(&late_response, sizeof(late_response), 15);
+    set_read_buffer_delayed(&sync_response, sizeof(sync_response), 20);
+    set_read_buffer_delayed(&magic_value_response, sizeof(magic_value_response), 0);
+    set_read_buffer_delayed(&read_reg_response, sizeof(read_reg_response), 0);
+    set_read_buffer_delayed(&read_reg_response, sizeof(read_reg_response), 0);
+    set_read_buffer_delayed(&attach_response, sizeof(attach_response), 0);
+
+    esp_loader_connect_stats_t stats;
+    REQUIRE_SUCCESS( esp_loader_connect_with_stats(&connect_config, &stats) );
+    REQUIRE( stats.trials == 2 );
+    REQUIRE( esp_loader_get_target() == ESP32_CHIP );
+}
+
 
 TEST_CASE( "Can detect attached target" )
 {
@@ -264,127 +317,2652 @@ TEST_CASE( "Register can be written correctly" )
     REQUIRE( memcmp(write_buffer_data(), &expected, sizeof(expected)) == 0 );
 }
 
-// --------------------  Serial comm test  -----------------------
+TEST_CASE( "Register operations are batched" )
+{
+    auto read_reg_response_1 = read_reg_response;
+    auto read_reg_response_2 = read_reg_response;
+    read_reg_response_1.data.common.value = 11;
+    read_reg_response_2.data.common.value = 22;
+
+    esp_loader_reg_op_t ops[] = {
+        { .address = 0x1000, .value = 0, .write = false },
+        { .address = 0x1004, .value = 5, .write = true },
+        { .address = 0x1008, .value = 0, .write = false },
+    };
 
-TEST_CASE ( "SLIP is encoded correctly" )
+    clear_buffers();
+    queue_response(read_reg_response_1);
+    queue_response(write_reg_response);
+    queue_response(read_reg_response_2);
+
+    SECTION( "Read values are stored in the order of operations" ) {
+        REQUIRE_SUCCESS( esp_loader_register_batch(ops, 3) );
+        REQUIRE( ops[0].value == 11 );
+        REQUIRE( ops[2].value == 22 );
+    }
+
+    SECTION( "Responses are consumed after an error" ) {
+        uint32_t value = 0;
+        auto read_reg_response_3 = read_reg_response;
+        read_reg_response_3.data.common.value = 33;
+
+        clear_buffers();
+        auto failed_response = write_reg_response;
+        failed_response.data.status.failed = STATUS_FAILURE;
+        failed_response.data.status.error = COMMAND_FAILED;
+        queue_response(read_reg_response_1);
+        queue_response(failed_response);
+        queue_response(read_reg_response_2);
+        queue_response(read_reg_response_3);
+
+        REQUIRE( esp_loader_register_batch(ops, 3) == ESP_LOADER_ERROR_INVALID_RESPONSE );
+        REQUIRE_SUCCESS( esp_loader_read_register(0x1000, &value) );
+        REQUIRE( value == 33 );
+    }
+}
+
+// Responses to reading JEDEC ID of 4 MB flash through SPI registers
+static void queue_flash_id_responses()
 {
-    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP); // To reset sequence number counter
+    auto flash_id_response = read_reg_response;
+    flash_id_response.data.common.value = 0x164020;
 
-    uint8_t data[] = { TEST_SLIP_PACKET };
+    // Save configuration, setup and start SPI transaction, check and read result, restore
+    queue_response(read_reg_response);
+    queue_response(read_reg_response);
+    for (int i = 0; i < 5; i++) {
+        queue_response(write_reg_response);
+    }
+    queue_response(read_reg_response);
+    queue_response(flash_id_response);
+    queue_response(write_reg_response);
+    queue_response(write_reg_response);
+}
 
-    uint8_t expected[] = {
-        0xc0,       // Begin
-        0x00,         // Write direction
-        0x03,         // FLASH_DATA command
-        16 + sizeof(data), 0, // Number of characters to send
-        0x33, 0, 0, 0,// Checksum
-        sizeof(data), 0, 0, 0, // Data size
-        0, 0, 0, 0,   // Sequence number
-        0, 0, 0, 0,   // zero
-        0, 0, 0, 0,   // zero
-        SLIP_ENCODED_PACKET,
-        0xc0,       // End
-    };
+static vector<uint8_t> slip_decode(const uint8_t *frame, size_t size)
+{
+    vector<uint8_t> decoded;
 
-    // write_buffer_print();
-    // print_array(expected, sizeof(expected));
+    for (size_t i = 1; i + 1 < size; i++) {
+        if (frame[i] == 0xdb) {
+            decoded.push_back(frame[++i] == 0xdc ? 0xc0 : 0xdb);
+        } else {
+            decoded.push_back(frame[i]);
+        }
+    }
 
+    return decoded;
+}
+
+TEST_CASE( "Detected flash is cached until invalidated" )
+{
+    auto flash_id_response = read_reg_response;
+    flash_id_response.data.common.value = 0x164020; // 4 MB
+    esp_loader_flash_info_t info;
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    // Save configuration, setup and start SPI transaction, check and read result, restore
     clear_buffers();
-    queue_response(flash_data_response);
+    queue_response(read_reg_response);
+    queue_response(read_reg_response);
+    for (int i = 0; i < 5; i++) {
+        queue_response(write_reg_response);
+    }
+    queue_response(read_reg_response);
+    queue_response(flash_id_response);
+    queue_response(write_reg_response);
+    queue_response(write_reg_response);
 
-    REQUIRE_SUCCESS( loader_flash_data_cmd(data, sizeof(data)) );
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+    REQUIRE( info.jedec_id == 0x164020 );
+    REQUIRE( info.size == 4 * 1024 * 1024 );
 
-    REQUIRE( memcmp(write_buffer_data(), expected, sizeof(expected)) == 0 );
+    clear_buffers();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+    REQUIRE( write_buffer_size() == 0 );
+
+    esp_loader_invalidate_flash_info();
+    REQUIRE( esp_loader_get_flash_info(&info) == ESP_LOADER_ERROR_TIMEOUT );
 }
 
+static void record_progress(uint32_t done, uint32_t total, void *arg)
+{
+    static_cast<vector<uint32_t> *>(arg)->push_back(total - done);
+}
 
-TEST_CASE( "Sync command is constructed correctly" )
+TEST_CASE( "Regions of flashing job sharing sectors are written together" )
 {
-    uint8_t expected[] = {
-        0xc0,         // Begin
-        0x00,         // Write direction
-        0x08,         // SYNC command
-        36, 0,        // Number of characters to send
-        0, 0, 0, 0,   // Checksum is ignored for this command
-        0x07, 0x07, 0x12, 0x20,
-        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
-        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
-        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
-        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
-        0xc0,         // End
+    esp_loader_flash_info_t info;
+    static uint8_t app[0x80];
+    static uint8_t bootloader[0x100];
+    uint8_t buffer[0x400];
+    vector<uint32_t> remaining;
+    esp_loader_stats_t stats;
+
+    // Listed out of order, bootloader ends within the sector preceding the application
+    esp_loader_region_t regions[] = {
+        { .address = 0x1000, .data = app, .size = sizeof(app), .compress = false },
+        { .address = 0x0, .data = bootloader, .size = sizeof(bootloader), .compress = false },
+    };
+    esp_loader_flash_job_t job = {
+        .regions = regions,
+        .region_count = 2,
+        .buffer = buffer,
+        .buffer_size = sizeof(buffer),
+        .progress = record_progress,
+        .progress_arg = &remaining,
     };
 
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
     clear_buffers();
-    queue_response(sync_response);
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
 
-    REQUIRE_SUCCESS( loader_sync_cmd() );
+    SECTION( "Gap between regions is filled and erased once" ) {
+        clear_buffers();
+        queue_response(set_params_response);
+        queue_response(flash_begin_response);
+        for (int i = 0; i < 5; i++) {
+            queue_response(flash_data_response);
+        }
 
-    REQUIRE( memcmp(write_buffer_data(), expected, sizeof(expected)) == 0 );
+        esp_loader_reset_stats();
+        REQUIRE_SUCCESS( esp_loader_flash_job(&job) );
+        esp_loader_get_stats(&stats);
+        REQUIRE( stats.region_size == 0x1080 );
+        REQUIRE(( remaining == vector<uint32_t>{ 0x80, 0x80, 0x80, 0x80, 0 } ));
+    }
+
+    SECTION( "Overlapping regions are rejected" ) {
+        regions[1].size = 0x1001;
+        clear_buffers();
+        REQUIRE( esp_loader_flash_job(&job) == ESP_LOADER_ERROR_INVALID_PARAM );
+        REQUIRE( write_buffer_size() == 0 );
+    }
 }
 
-TEST_CASE( "Register can be read and decoded correctly" )
+TEST_CASE( "Interrupted flashing resumes from the last written sector" )
 {
+    const uint32_t block_size = 0x400;
+    static uint8_t image[0x2000];
+    esp_loader_flash_info_t info;
+    uint32_t written = 0;
+
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    auto failed_response = flash_data_response;
+    failed_response.data.status.failed = STATUS_FAILURE;
+    failed_response.data.status.error = INVALID_CRC;
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
     clear_buffers();
-    read_reg_response.data.common.value = 55;
-    queue_response(read_reg_response);
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
 
-    uint32_t reg_value = 0;
-    esp_loader_read_register(0, &reg_value);
+    SECTION( "One block in flight" ) {
+        esp_loader_flash_set_window(1);
+    }
+    SECTION( "Several blocks in flight" ) {
+        esp_loader_flash_set_window(2);
+    }
 
-    REQUIRE( reg_value == 55 );
+    clear_buffers();
+    queue_response(set_params_response);
+    queue_response(flash_begin_response);
+    REQUIRE_SUCCESS( esp_loader_flash_start(0, sizeof(image), block_size) );
+
+    // Sixth block fails after the first sector and a block of the second one were written
+    for (int i = 0; i < 5; i++) {
+        queue_response(flash_data_response);
+    }
+    queue_response(failed_response);
+    esp_loader_error_t err = ESP_LOADER_SUCCESS;
+    for (uint32_t pos = 0; pos < sizeof(image) && err == ESP_LOADER_SUCCESS; pos += block_size) {
+        err = esp_loader_flash_write(&image[pos], block_size);
+    }
+    REQUIRE( err == ESP_LOADER_ERROR_INVALID_RESPONSE );
+    REQUIRE( esp_loader_flash_failed_sequence() == 5 );
+
+    clear_buffers();
+    queue_response(flash_begin_response);
+    REQUIRE_SUCCESS( esp_loader_flash_resume(&written) );
+    REQUIRE( written == 0x1000 );
+
+    for (uint32_t pos = written; pos < sizeof(image); pos += block_size) {
+        queue_response(flash_data_response);
+        REQUIRE_SUCCESS( esp_loader_flash_write(&image[pos], block_size) );
+    }
+    REQUIRE_SUCCESS( esp_loader_flash_wait_pending() );
+    esp_loader_flash_set_window(1);
+
+    // Digest of the whole region is expected, not only of its resumed part
+    struct MD5Context md5_context;
+    uint8_t digest[16];
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, image, sizeof(image));
+    MD5Final(digest, &md5_context);
+
+    rom_md5_response_t md5_response = {};
+    md5_response.common.direction = READ_DIRECTION;
+    md5_response.common.command = SPI_FLASH_MD5;
+    md5_response.common.size = sizeof(md5_response.md5) + sizeof(md5_response.status);
+    loader_hexify(digest, sizeof(digest), md5_response.md5);
+    set_read_buffer(&md5_response, sizeof(md5_response));
+
+    REQUIRE_SUCCESS( esp_loader_flash_verify() );
 }
 
-TEST_CASE( "Received response (in SLIP format) is decoded correctly" )
+struct test_port {
+    vector<uint8_t> written;
+    vector<uint8_t> to_read;
+    size_t read_pos = 0;
+};
+
+static esp_loader_error_t test_port_write(void *arg, const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    auto port = static_cast<test_port *>(arg);
+    port->written.insert(port->written.end(), data, data + size);
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t test_port_read(void *arg, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    auto port = static_cast<test_port *>(arg);
+    if (port->read_pos + size > port->to_read.size()) {
+        return ESP_LOADER_ERROR_TIMEOUT;
+    }
+    memcpy(data, &port->to_read[port->read_pos], size);
+    port->read_pos += size;
+    return ESP_LOADER_SUCCESS;
+}
+
+static void test_port_delay_ms(void *arg, uint32_t ms) { }
+static void test_port_start_timer(void *arg, uint32_t ms) { }
+static uint32_t test_port_remaining_time(void *arg) { return 100; }
+static void test_port_enter_bootloader(void *arg) { }
+static void test_port_reset_target(void *arg) { }
+
+static const esp_loader_port_ops_t test_port_ops = {
+    .write = test_port_write,
+    .read = test_port_read,
+    .read_available = NULL,
+    .delay_ms = test_port_delay_ms,
+    .start_timer = test_port_start_timer,
+    .remaining_time = test_port_remaining_time,
+    .enter_bootloader = test_port_enter_bootloader,
+    .reset_target = test_port_reset_target,
+    .debug_print = NULL,
+    .change_transmission_rate = NULL,
+};
+
+// Erase size of the begin command last written
+static uint32_t written_erase_size()
+{
+    vector<uint8_t> frame = slip_decode(reinterpret_cast<const uint8_t *>(write_buffer_data()),
+                                        write_buffer_size());
+    REQUIRE( frame.size() >= sizeof(flash_begin_command_t) - sizeof(uint32_t) );
+    REQUIRE( frame[1] == FLASH_BEGIN );
+    flash_begin_command_t begin;
+    memcpy(&begin, frame.data(), sizeof(begin) - sizeof(uint32_t));
+    return begin.erase_size;
+}
+
+static void record_flash_progress(const esp_loader_flash_progress_t *progress, void *arg)
 {
+    static_cast<vector<esp_loader_flash_progress_t> *>(arg)->push_back(*progress);
+}
+
+TEST_CASE( "Flash progress is reported as blocks are acknowledged" )
+{
+    const uint32_t block_size = 0x400;
+    static uint8_t image[0xF00];
+    vector<esp_loader_flash_progress_t> progress;
+    esp_loader_flash_info_t info;
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
     clear_buffers();
-    read_reg_response.data.common.value = 0xC0BD; // C0, BD has to be replaced
-    queue_response(read_reg_response);
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
 
-    uint32_t reg_value = 0;
-    esp_loader_read_register(0, &reg_value);
+    esp_loader_set_flash_progress_callback(record_flash_progress, 0x800, &progress);
+    esp_loader_flash_set_window(2);
 
-    REQUIRE( reg_value == 0xC0BD );
+    clear_buffers();
+    queue_response(set_params_response);
+    queue_response(flash_begin_response);
+    REQUIRE_SUCCESS( esp_loader_flash_start(0, sizeof(image), block_size) );
+
+    // Each acknowledgement takes 100 ms to arrive, once the window is full
+    for (uint32_t pos = 0; pos < sizeof(image); pos += block_size) {
+        if (pos > 0) {
+            queue_response(flash_data_response);
+            serial_set_time_delay(100);
+        }
+        REQUIRE_SUCCESS( esp_loader_flash_write(&image[pos], min(block_size, (uint32_t)sizeof(image) - pos)) );
+    }
+    queue_response(flash_data_response);
+    serial_set_time_delay(100);
+    REQUIRE_SUCCESS( esp_loader_flash_wait_pending() );
+
+    // Only every 0x800 bytes and at the end of the region
+    REQUIRE( progress.size() == 2 );
+
+    REQUIRE( progress[0].bytes_acked == 0x800 );
+    REQUIRE( progress[0].bytes_total == sizeof(image) );
+    REQUIRE( progress[0].bytes_on_wire > 3 * block_size );
+    REQUIRE( progress[0].elapsed_ms == 200 );
+    REQUIRE( progress[0].rate == 0x800 * 1000 / 200 );
+    REQUIRE( progress[0].eta_ms == (sizeof(image) - 0x800) * 200 / 0x800 );
+
+    REQUIRE( progress[1].bytes_acked == sizeof(image) );
+    REQUIRE( progress[1].bytes_on_wire > 4 * block_size );
+    REQUIRE( progress[1].elapsed_ms == 400 );
+    REQUIRE( progress[1].rate == sizeof(image) * 1000 / 400 );
+    REQUIRE( progress[1].eta_ms == 0 );
+
+    esp_loader_set_flash_progress_callback(NULL, 0, NULL);
+    esp_loader_flash_set_window(1);
 }
 
+static vector<esp_loader_trace_entry_t> traced_flashing(bool replayed, const vector<esp_loader_trace_entry_t> &trace)
+{
+    const uint32_t block_size = 0x400;
+    static uint8_t image[0xC00];
+    esp_loader_trace_entry_t ring[32];
+    esp_loader_flash_info_t info;
 
-// --------------------  Serial mock test  -----------------------
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
 
-TEST_CASE( "Serial read works correctly" )
+    clear_buffers();
+    if (replayed) {
+        replay_trace(trace.data(), trace.size());
+    } else {
+        // Target takes long to erase, acknowledgements come slower than blocks are sent
+        set_read_buffer_delayed(&set_params_response, sizeof(set_params_response), 5);
+        set_read_buffer_delayed(&flash_begin_response, sizeof(flash_begin_response), 500);
+        for (uint32_t i = 0; i < sizeof(image) / block_size; i++) {
+            set_read_buffer_delayed(&flash_data_response, sizeof(flash_data_response), 40 + i * 10);
+        }
+    }
+
+    esp_loader_set_trace_buffer(ring, 32);
+    esp_loader_flash_set_window(2);
+
+    REQUIRE_SUCCESS( esp_loader_flash_start(0, sizeof(image), block_size) );
+    for (uint32_t pos = 0; pos < sizeof(image); pos += block_size) {
+        REQUIRE_SUCCESS( esp_loader_flash_write(&image[pos], block_size) );
+    }
+    REQUIRE_SUCCESS( esp_loader_flash_wait_pending() );
+
+    vector<esp_loader_trace_entry_t> captured(32);
+    captured.resize(esp_loader_get_trace(captured.data(), captured.size()));
+
+    esp_loader_set_trace_buffer(NULL, 0);
+    esp_loader_flash_set_window(1);
+
+    return captured;
+}
+
+TEST_CASE( "Protocol trace is captured and replayed with its timing" )
 {
-    uint32_t reg_value = 5;
-    uint8_t readout[sizeof(reg_value) + 2];
-    uint8_t expected[] = { 0xc0, 5, 0, 0, 0, 0xc0 };
+    auto captured = traced_flashing(false, {});
+
+    // Set parameters and begin, three blocks and their acknowledgements
+    REQUIRE( captured.size() == 10 );
+    REQUIRE( captured[0].event == ESP_LOADER_TRACE_COMMAND );
+    REQUIRE( captured[0].command == SPI_SET_PARAMS );
+    REQUIRE( captured[3].event == ESP_LOADER_TRACE_RESPONSE );
+    REQUIRE( captured[3].command == FLASH_BEGIN );
+    REQUIRE( captured[3].time_ms - captured[2].time_ms == 500 );
+    REQUIRE( captured[4].event == ESP_LOADER_TRACE_DATA );
+    REQUIRE( captured[5].event == ESP_LOADER_TRACE_DATA );
+    REQUIRE( captured[5].value == 1 );
+    REQUIRE( captured[5].size == 0x400 );
+    REQUIRE( captured[6].event == ESP_LOADER_TRACE_RESPONSE );
+    REQUIRE( captured[6].command == FLASH_DATA );
+
+    auto replayed = traced_flashing(true, captured);
+
+    REQUIRE( replayed.size() == captured.size() );
+    for (size_t i = 0; i < captured.size(); i++) {
+        REQUIRE( replayed[i].event == captured[i].event );
+        REQUIRE( replayed[i].command == captured[i].command );
+        REQUIRE( replayed[i].size == captured[i].size );
+        REQUIRE( replayed[i].value == captured[i].value );
+        REQUIRE( replayed[i].time_ms - replayed[0].time_ms == captured[i].time_ms - captured[0].time_ms );
+    }
+
+    SECTION( "Ring keeps the most recent events" ) {
+        esp_loader_trace_entry_t ring[4];
+        esp_loader_trace_entry_t recent[2];
+
+        esp_loader_set_trace_buffer(ring, 4);
+        clear_buffers();
+        for (uint32_t i = 0; i < 6; i++) {
+            queue_response(write_reg_response);
+            REQUIRE_SUCCESS( esp_loader_write_register(reg_address, i) );
+        }
+
+        REQUIRE( esp_loader_get_trace(recent, 2) == 2 );
+        REQUIRE( recent[0].event == ESP_LOADER_TRACE_COMMAND );
+        REQUIRE( recent[1].event == ESP_LOADER_TRACE_RESPONSE );
+        REQUIRE( recent[1].command == WRITE_REG );
 
+        esp_loader_set_trace_buffer(NULL, 0);
+        REQUIRE( esp_loader_get_trace(recent, 2) == 0 );
+    }
+}
+
+TEST_CASE( "Region is erased by selected strategy" )
+{
+    esp_loader_flash_info_t info;
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
     clear_buffers();
+    queue_response(set_params_response);
+    queue_response(flash_begin_response);
+    REQUIRE_SUCCESS( esp_loader_flash_start(0, 0x1000, 0x400) );
 
-    set_read_buffer(&reg_value, sizeof(reg_value));
+    expected_response stub_response(ERASE_REGION);
 
-    SECTION( "Read buffer can be read" ) {
-        loader_port_read(readout, sizeof(readout), 0);
-        REQUIRE( memcmp(readout, expected, sizeof(readout)) == 0 );
+    SECTION( "Blocks the image occupies" ) {
+        clear_buffers();
+        queue_response(flash_begin_response);
+        REQUIRE_SUCCESS( esp_loader_flash_start(0x11000, 0x2100, 0x400) );
+        REQUIRE( written_erase_size() == 0x2400 );
     }
 
-    SECTION ( "Read buffer can be read in smaller chunks" ) {
-        loader_port_read(&readout[0], 3, 0);
-        loader_port_read(&readout[3], 3, 0);
-        REQUIRE( memcmp(readout, expected, sizeof(readout)) == 0 );
+    SECTION( "Up to the next 64 KB block" ) {
+        esp_loader_flash_set_erase_strategy(ESP_LOADER_ERASE_BLOCKS);
+        clear_buffers();
+        queue_response(flash_begin_response);
+        REQUIRE_SUCCESS( esp_loader_flash_start(0x11000, 0x20100, 0x400) );
+        REQUIRE( written_erase_size() == 0x2f000 );
+
+        // Not past the end of flash
+        clear_buffers();
+        queue_response(flash_begin_response);
+        REQUIRE_SUCCESS( esp_loader_flash_start(0x3fe000, 0x1000, 0x400) );
+        REQUIRE( written_erase_size() == 0x2000 );
     }
 
-    SECTION ( "Timeout is returned when requested amount of data is not available" ) {
-        REQUIRE( loader_port_read(readout, sizeof(readout) + 1, 0) == ESP_LOADER_ERROR_TIMEOUT);
+    SECTION( "Nothing, once erased" ) {
+        esp_loader_flash_set_erase_strategy(ESP_LOADER_ERASE_NONE);
+        clear_buffers();
+        queue_response(flash_begin_response);
+        REQUIRE_SUCCESS( esp_loader_flash_start(0x11000, 0x2100, 0x400) );
+        REQUIRE( written_erase_size() == 0 );
     }
 
-    SECTION ( "Read buffer is correctly SLIP encoded " ) {
-        uint8_t data_to_encode[] = { TEST_SLIP_PACKET };
-        uint8_t expected[] = { 0xc0, SLIP_ENCODED_PACKET, 0xc0};
-        uint8_t encoded[sizeof(expected)];
+    SECTION( "During write, by the stub" ) {
+        esp_loader_flash_set_erase_strategy(ESP_LOADER_ERASE_DURING_WRITE);
+        REQUIRE( esp_loader_flash_start(0x11000, 0x2100, 0x400) == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
 
+        loader_set_stub_mode(true);
         clear_buffers();
+        queue_response(flash_begin_response);
+        REQUIRE_SUCCESS( esp_loader_flash_start(0x11000, 0x2100, 0x400) );
+        REQUIRE( written_erase_size() == 0x2400 );
+        loader_set_stub_mode(false);
+    }
 
-        fill(encoded, &encoded[sizeof(encoded)], 0);
-        set_read_buffer(data_to_encode, sizeof(data_to_encode));
-        loader_port_read(encoded, sizeof(encoded), 0);
+    SECTION( "Chip and regions are erased by the stub" ) {
+        REQUIRE( esp_loader_flash_erase_chip() == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
+        REQUIRE( esp_loader_flash_erase_region(0, 0x1000) == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
 
-        REQUIRE( memcmp(expected, encoded, sizeof(expected)) == 0 );
+        loader_set_stub_mode(true);
+        REQUIRE( esp_loader_flash_erase_region(0x800, 0x1000) == ESP_LOADER_ERROR_INVALID_PARAM );
+
+        clear_buffers();
+        queue_response(stub_response);
+        REQUIRE_SUCCESS( esp_loader_flash_erase_region(0x10000, 0x20000) );
+        vector<uint8_t> frame = slip_decode(reinterpret_cast<const uint8_t *>(write_buffer_data()),
+                                            write_buffer_size());
+        erase_region_command_t erase_cmd;
+        REQUIRE( frame.size() == sizeof(erase_cmd) );
+        memcpy(&erase_cmd, frame.data(), sizeof(erase_cmd));
+        REQUIRE( erase_cmd.common.command == ERASE_REGION );
+        REQUIRE( erase_cmd.offset == 0x10000 );
+        REQUIRE( erase_cmd.size == 0x20000 );
+
+        expected_response erase_flash_response(ERASE_FLASH);
+        clear_buffers();
+        queue_response(erase_flash_response);
+        REQUIRE_SUCCESS( esp_loader_flash_erase_chip() );
+        loader_set_stub_mode(false);
+    }
+
+    esp_loader_flash_set_erase_strategy(ESP_LOADER_ERASE_REGION);
+}
+
+TEST_CASE( "Each loader context communicates through its own port" )
+{
+    write_reg_cmd_response expected;
+    test_port ports[2];
+    esp_loader_t *loaders[2];
+
+    write_reg_response.data.common.value = 55;
+    const uint8_t *response = reinterpret_cast<const uint8_t *>(&write_reg_response);
+
+    for (int i = 0; i < 2; i++) {
+        ports[i].to_read.push_back(0xc0);
+        ports[i].to_read.insert(ports[i].to_read.end(), response, response + sizeof(write_reg_response));
+        ports[i].to_read.push_back(0xc0);
+        REQUIRE_SUCCESS( esp_loader_create(&test_port_ops, &ports[i], &loaders[i]) );
+    }
+
+    esp_loader_t *extra;
+    REQUIRE( esp_loader_create(&test_port_ops, NULL, &extra) == ESP_LOADER_ERROR_FAIL );
+
+    clear_buffers();
+
+    for (int i = 0; i < 2; i++) {
+        esp_loader_select(loaders[i]);
+        REQUIRE_SUCCESS( esp_loader_write_register(reg_address, reg_value) );
+    }
+
+    esp_loader_select(NULL);
+
+    for (int i = 0; i < 2; i++) {
+        REQUIRE( ports[i].written.size() == sizeof(expected) );
+        REQUIRE( memcmp(ports[i].written.data(), &expected, sizeof(expected)) == 0 );
+        esp_loader_destroy(loaders[i]);
+    }
+
+    // Default context is left untouched
+    REQUIRE( write_buffer_size() == 0 );
+
+    esp_loader_port_ops_t incomplete_ops = test_port_ops;
+    incomplete_ops.write = NULL;
+    REQUIRE( esp_loader_create(&incomplete_ops, NULL, &extra) == ESP_LOADER_ERROR_INVALID_PARAM );
+}
+
+TEST_CASE( "Loader context is created in memory provided by the caller" )
+{
+    write_reg_cmd_response expected;
+    test_port port;
+    esp_loader_t *loader;
+    static uint8_t arena[ESP_LOADER_CONTEXT_SIZE + 1];
+
+    write_reg_response.data.common.value = 55;
+    const uint8_t *response = reinterpret_cast<const uint8_t *>(&write_reg_response);
+    port.to_read.push_back(0xc0);
+    port.to_read.insert(port.to_read.end(), response, response + sizeof(write_reg_response));
+    port.to_read.push_back(0xc0);
+
+    esp_loader_footprint_t footprint;
+    esp_loader_get_footprint(&footprint);
+    REQUIRE( footprint.context_size < ESP_LOADER_CONTEXT_SIZE );
+
+    REQUIRE( esp_loader_create_in(&arena[1], footprint.context_size / 2, &test_port_ops, &port, &loader)
+             == ESP_LOADER_ERROR_INVALID_PARAM );
+
+    // Arena does not have to be aligned, nor is it limited by the pool
+    REQUIRE_SUCCESS( esp_loader_create_in(&arena[1], ESP_LOADER_CONTEXT_SIZE, &test_port_ops, &port, &loader) );
+    REQUIRE( reinterpret_cast<uint8_t *>(loader) >= &arena[1] );
+    REQUIRE( reinterpret_cast<uint8_t *>(loader) + footprint.context_size <= &arena[sizeof(arena)] );
+
+    clear_buffers();
+    esp_loader_select(loader);
+    REQUIRE_SUCCESS( esp_loader_write_register(reg_address, reg_value) );
+    esp_loader_select(NULL);
+
+    REQUIRE( port.written.size() == sizeof(expected) );
+    REQUIRE( memcmp(port.written.data(), &expected, sizeof(expected)) == 0 );
+    REQUIRE( write_buffer_size() == 0 );
+
+    esp_loader_destroy(loader);
+}
+
+static void port_queue_response(test_port &port, const expected_response &response)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&response);
+
+    port.to_read.push_back(0xc0);
+    port.to_read.insert(port.to_read.end(), bytes, bytes + sizeof(response));
+    port.to_read.push_back(0xc0);
+}
+
+// Payloads of the data packets written to the port, decoded
+static vector<vector<uint8_t>> port_data_packets(const test_port &port)
+{
+    vector<vector<uint8_t>> packets;
+    size_t start = 0;
+
+    for (size_t i = 1; i < port.written.size(); i++) {
+        if (port.written[i] != 0xc0) {
+            continue;
+        }
+        if (port.written[start] == 0xc0 && i > start + 1) {
+            vector<uint8_t> frame = slip_decode(&port.written[start], i - start + 1);
+            if (frame.size() > sizeof(data_command_t) && frame[1] == FLASH_DATA) {
+                packets.push_back(frame);
+            }
+            start = i + 1;
+        } else {
+            start = i;
+        }
+    }
+
+    return packets;
+}
+
+TEST_CASE( "Identical image is flashed to a gang of targets and failing ones are dropped" )
+{
+    const uint32_t block_size = 0x400;
+    static uint8_t image[0xA00];
+    static uint8_t frames[2 * ESP_LOADER_GANG_FRAME_SIZE(0x400)];
+    test_port ports[2];
+    esp_loader_t *loaders[2];
+    esp_loader_error_t results[2];
+
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (uint8_t)(i * 13 + (i >> 7));
+    }
+
+    auto magic_value_response = read_reg_response;
+    magic_value_response.data.common.value = chip_magic_value[ESP32_CHIP];
+    auto flash_id_response = read_reg_response;
+    flash_id_response.data.common.value = 0x164020;
+    const expected_response connect_responses[] = {
+        sync_response, magic_value_response, read_reg_response, read_reg_response, attach_response,
+        read_reg_response, read_reg_response, write_reg_response, write_reg_response, write_reg_response,
+        write_reg_response, write_reg_response, read_reg_response, flash_id_response, write_reg_response,
+        write_reg_response,
+    };
+
+    for (int i = 0; i < 2; i++) {
+        REQUIRE_SUCCESS( esp_loader_create(&test_port_ops, &ports[i], &loaders[i]) );
+        for (const auto &response : connect_responses) {
+            port_queue_response(ports[i], response);
+        }
+
+        esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+        esp_loader_flash_info_t info;
+        esp_loader_select(loaders[i]);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+        esp_loader_flash_set_window(2);
+        ports[i].written.clear();
+
+        port_queue_response(ports[i], set_params_response);
+        port_queue_response(ports[i], flash_begin_response);
+        port_queue_response(ports[i], flash_data_response);
+    }
+    esp_loader_select(NULL);
+
+    // First target acknowledges all blocks and reports the digest of the image
+    struct MD5Context md5_context;
+    uint8_t digest[16];
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, image, sizeof(image));
+    MD5Final(digest, &md5_context);
+
+    rom_md5_response_t md5_response = {};
+    md5_response.common.direction = READ_DIRECTION;
+    md5_response.common.command = SPI_FLASH_MD5;
+    md5_response.common.size = sizeof(md5_response.md5) + sizeof(md5_response.status);
+    loader_hexify(digest, sizeof(digest), md5_response.md5);
+    const uint8_t *md5_bytes = reinterpret_cast<const uint8_t *>(&md5_response);
+
+    port_queue_response(ports[0], flash_data_response);
+    port_queue_response(ports[0], flash_data_response);
+    ports[0].to_read.push_back(0xc0);
+    ports[0].to_read.insert(ports[0].to_read.end(), md5_bytes, md5_bytes + sizeof(md5_response));
+    ports[0].to_read.push_back(0xc0);
+
+    esp_loader_gang_flash_args_t args = {
+        .loaders = loaders,
+        .count = 2,
+        .offset = 0x10000,
+        .image = image,
+        .size = sizeof(image),
+        .block_size = block_size,
+        .frames = frames,
+        .frames_size = sizeof(frames),
+        .lag = 2,
+        .verify = true,
+    };
+
+    SECTION( "Target which stops responding is dropped once it falls behind" ) {
+        REQUIRE( esp_loader_gang_flash(&args, results) == ESP_LOADER_ERROR_FAIL );
+        REQUIRE( results[0] == ESP_LOADER_SUCCESS );
+        REQUIRE( results[1] == ESP_LOADER_ERROR_TIMEOUT );
+
+        // Both targets got the same frames, numbered alike
+        auto packets = port_data_packets(ports[0]);
+        REQUIRE( packets.size() == 3 );
+        REQUIRE( port_data_packets(ports[1]) == packets );
+
+        data_command_t last;
+        memcpy(&last, packets[2].data(), sizeof(last));
+        REQUIRE( last.sequence_number == 2 );
+        REQUIRE( last.data_size == block_size );
+        REQUIRE( memcmp(&packets[2][sizeof(last)], &image[2 * block_size], sizeof(image) - 2 * block_size) == 0 );
+        REQUIRE( packets[2].back() == 0xff );
+    }
+
+    SECTION( "Target which fails a block is dropped, the others carry on" ) {
+        auto failed_response = flash_data_response;
+        failed_response.data.status.failed = STATUS_FAILURE;
+        failed_response.data.status.error = INVALID_CRC;
+        port_queue_response(ports[1], failed_response);
+
+        REQUIRE( esp_loader_gang_flash(&args, results) == ESP_LOADER_ERROR_FAIL );
+        REQUIRE( results[0] == ESP_LOADER_SUCCESS );
+        REQUIRE( results[1] == ESP_LOADER_ERROR_INVALID_RESPONSE );
+
+        esp_loader_select(loaders[1]);
+        REQUIRE( esp_loader_flash_failed_sequence() == 1 );
+        esp_loader_select(NULL);
+    }
+
+    SECTION( "Too small ring of frames is rejected" ) {
+        args.frames_size = ESP_LOADER_GANG_FRAME_SIZE(block_size);
+        REQUIRE( esp_loader_gang_flash(&args, results) == ESP_LOADER_ERROR_INVALID_PARAM );
+        REQUIRE( ports[0].written.empty() );
+    }
+
+    for (int i = 0; i < 2; i++) {
+        esp_loader_destroy(loaders[i]);
+    }
+}
+
+TEST_CASE( "RAM footprint of the library is reported" )
+{
+    esp_loader_footprint_t footprint;
+    esp_loader_get_footprint(&footprint);
+
+    // Default context and the pool of two
+    REQUIRE( footprint.static_size == 3 * footprint.context_size );
+    REQUIRE( footprint.rx_buffer_size > 0 );
+    REQUIRE( footprint.hash_state_size > 0 );
+    REQUIRE( footprint.inflate_state_size > 0 );
+    REQUIRE( footprint.rx_buffer_size + footprint.hash_state_size + footprint.inflate_state_size
+             < footprint.context_size );
+}
+
+static void record_command_stats(const esp_loader_command_stats_t *stats, void *arg)
+{
+    static_cast<vector<esp_loader_command_stats_t> *>(arg)->push_back(*stats);
+}
+
+TEST_CASE( "Command latency and bytes on wire are measured" )
+{
+    vector<esp_loader_command_stats_t> commands;
+    esp_loader_stats_t stats;
+
+    clear_buffers();
+    esp_loader_reset_stats();
+    esp_loader_set_stats_callback(record_command_stats, &commands);
+
+    // Value 0xc0 has to be escaped on the wire
+    write_reg_response.data.common.value = 0;
+    queue_response(write_reg_response);
+    serial_set_time_delay(5);
+
+    REQUIRE_SUCCESS( esp_loader_write_register(reg_address, 0xc0) );
+
+    esp_loader_get_stats(&stats);
+    REQUIRE( stats.commands == 1 );
+    REQUIRE( stats.payload_bytes == sizeof(write_reg_command_t) );
+    REQUIRE( stats.wire_bytes == sizeof(write_reg_command_t) + 3 );
+    REQUIRE( stats.received_bytes == sizeof(write_reg_response) + 2 );
+
+    REQUIRE( commands.size() == 1 );
+    REQUIRE( commands[0].command == WRITE_REG );
+    REQUIRE( commands[0].size == sizeof(write_reg_command_t) );
+    REQUIRE( commands[0].wait_time_ms == 5 );
+    REQUIRE( commands[0].result == ESP_LOADER_SUCCESS );
+
+    esp_loader_set_stats_callback(NULL, NULL);
+}
+
+// --------------------  Serial comm test  -----------------------
+
+TEST_CASE ( "SLIP is encoded correctly" )
+{
+    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP); // To reset sequence number counter
+
+    uint8_t data[] = { TEST_SLIP_PACKET };
+
+    uint8_t expected[] = {
+        0xc0,       // Begin
+        0x00,         // Write direction
+        0x03,         // FLASH_DATA command
+        16 + sizeof(data), 0, // Number of characters to send
+        0x33, 0, 0, 0,// Checksum
+        sizeof(data), 0, 0, 0, // Data size
+        0, 0, 0, 0,   // Sequence number
+        0, 0, 0, 0,   // zero
+        0, 0, 0, 0,   // zero
+        SLIP_ENCODED_PACKET,
+        0xc0,       // End
+    };
+
+    // write_buffer_print();
+    // print_array(expected, sizeof(expected));
+
+    clear_buffers();
+    queue_response(flash_data_response);
+
+    SECTION( "Frame is written piece by piece" ) {
+        REQUIRE_SUCCESS( loader_flash_data_cmd(data, sizeof(data)) );
+
+        REQUIRE( write_buffer_size() == sizeof(expected) );
+        REQUIRE( memcmp(write_buffer_data(), expected, sizeof(expected)) == 0 );
+    }
+
+    SECTION( "Frame is written at once from TX buffer" ) {
+        static uint8_t tx_buffer[ESP_LOADER_TX_BUFFER_SIZE(sizeof(data))];
+        esp_loader_set_tx_buffer(tx_buffer, sizeof(tx_buffer));
+
+        REQUIRE_SUCCESS( loader_flash_data_cmd(data, sizeof(data)) );
+
+        REQUIRE( write_calls_count() == 1 );
+        REQUIRE( write_buffer_size() == sizeof(expected) );
+        REQUIRE( memcmp(write_buffer_data(), expected, sizeof(expected)) == 0 );
+
+        esp_loader_set_tx_buffer(NULL, 0);
+    }
+}
+
+
+TEST_CASE( "Bytes to escape and checksum are handled at any position and alignment" )
+{
+    uint8_t data[64 + 8];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = static_cast<uint8_t>(i * 37 + 1);
+    }
+    data[5] = 0xc0;
+    data[13] = 0xdb;
+    data[14] = 0xc0;
+    data[40] = 0xdb;
+    data[71] = 0xc0;
+
+    static uint8_t tx_buffer[ESP_LOADER_TX_BUFFER_SIZE(sizeof(data))];
+
+    for (bool use_tx_buffer : { false, true }) {
+        esp_loader_set_tx_buffer(use_tx_buffer ? tx_buffer : NULL, sizeof(tx_buffer));
+
+        for (size_t offset = 0; offset < 8; offset++) {
+            for (size_t size = 0; size <= 64; size += (size < 12) ? 1 : 13) {
+                clear_buffers();
+                REQUIRE_SUCCESS( loader_data_cmd_send(FLASH_DATA, &data[offset], size) );
+
+                uint8_t checksum = 0xef;
+                for (size_t i = 0; i < size; i++) {
+                    checksum ^= data[offset + i];
+                }
+
+                vector<uint8_t> decoded = slip_decode(reinterpret_cast<const uint8_t *>(write_buffer_data()),
+                                                       write_buffer_size());
+                REQUIRE( decoded.size() == sizeof(data_command_t) + size );
+                REQUIRE( decoded[4] == checksum );
+                REQUIRE( memcmp(&decoded[sizeof(data_command_t)], &data[offset], size) == 0 );
+            }
+        }
+    }
+
+    esp_loader_set_tx_buffer(NULL, 0);
+    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP); // To reset sequence number counter
+}
+
+TEST_CASE( "Data packets can be acknowledged after several were sent" )
+{
+    uint8_t data[16] = { 0 };
+    uint32_t sequence_number;
+
+    clear_buffers();
+    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP); // To reset sequence number counter
+
+    for (int i = 0; i < 3; i++) {
+        REQUIRE_SUCCESS( loader_data_cmd_send(FLASH_DATA, data, sizeof(data)) );
+    }
+    REQUIRE( loader_data_cmds_pending() == 3 );
+
+    SECTION( "All packets are acknowledged in order" ) {
+        for (int i = 0; i < 3; i++) {
+            queue_response(flash_data_response);
+        }
+
+        for (uint32_t i = 0; i < 3; i++) {
+            REQUIRE_SUCCESS( loader_data_cmd_wait_ack(&sequence_number) );
+            REQUIRE( sequence_number == i );
+        }
+        REQUIRE( loader_data_cmds_pending() == 0 );
+    }
+
+    SECTION( "Failed packet is reported with its sequence number" ) {
+        auto failed_response = flash_data_response;
+        failed_response.data.status.failed = STATUS_FAILURE;
+        failed_response.data.status.error = INVALID_CRC;
+
+        queue_response(flash_data_response);
+        queue_response(failed_response);
+
+        REQUIRE_SUCCESS( loader_data_cmd_wait_ack(&sequence_number) );
+        REQUIRE( loader_data_cmd_wait_ack(&sequence_number) == ESP_LOADER_ERROR_INVALID_RESPONSE );
+        REQUIRE( sequence_number == 1 );
+        REQUIRE( esp_loader_get_last_rom_error() == INVALID_CRC );
+    }
+}
+
+static void record_ack(uint32_t sequence_number, esp_loader_error_t result, void *arg)
+{
+    static_cast<vector<uint32_t> *>(arg)->push_back(result == ESP_LOADER_SUCCESS ? sequence_number : UINT32_MAX);
+}
+
+TEST_CASE( "Data packets are acknowledged by polling without waiting" )
+{
+    uint8_t data[16] = { 0 };
+    vector<uint32_t> acked;
+
+    clear_buffers();
+    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP); // To reset sequence number counter
+    esp_loader_set_ack_callback(record_ack, &acked);
+    loader_port_start_timer(1000);
+
+    for (int i = 0; i < 2; i++) {
+        REQUIRE_SUCCESS( loader_data_cmd_send(FLASH_DATA, data, sizeof(data)) );
+    }
+
+    REQUIRE( esp_loader_poll() == ESP_LOADER_IN_PROGRESS );
+
+    SECTION( "Responses are processed as they arrive" ) {
+        queue_response(flash_data_response);
+        REQUIRE( esp_loader_poll() == ESP_LOADER_IN_PROGRESS );
+        REQUIRE( acked == vector<uint32_t>{ 0 } );
+
+        // Response split across two polls
+        uint8_t encoded[sizeof(flash_data_response) + 2];
+        encoded[0] = 0xc0;
+        memcpy(&encoded[1], &flash_data_response, sizeof(flash_data_response));
+        encoded[sizeof(encoded) - 1] = 0xc0;
+
+        set_raw_read_buffer(encoded, 5);
+        REQUIRE( esp_loader_poll() == ESP_LOADER_IN_PROGRESS );
+        set_raw_read_buffer(&encoded[5], sizeof(encoded) - 5);
+        REQUIRE_SUCCESS( esp_loader_poll() );
+        REQUIRE(( acked == vector<uint32_t>{ 0, 1 } ));
+        REQUIRE( loader_data_cmds_pending() == 0 );
+    }
+
+    SECTION( "Missing response times out" ) {
+        loader_port_start_timer(0);
+        REQUIRE( esp_loader_poll() == ESP_LOADER_ERROR_TIMEOUT );
+        REQUIRE( esp_loader_flash_failed_sequence() == 0 );
+        REQUIRE( acked == vector<uint32_t>{ UINT32_MAX } );
+    }
+
+    esp_loader_set_ack_callback(NULL, NULL);
+}
+
+TEST_CASE( "Flashing succeeds after reconnecting to target whose acknowledgement timed out" )
+{
+    const uint32_t block_size = 0x400;
+    static uint8_t image[2 * block_size];
+    esp_loader_flash_info_t info;
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+
+    esp_loader_flash_set_window(2);
+
+    // Target stops responding with both blocks in flight
+    clear_buffers();
+    queue_response(set_params_response);
+    queue_response(flash_begin_response);
+    REQUIRE_SUCCESS( esp_loader_flash_start(0, sizeof(image), block_size) );
+    REQUIRE_SUCCESS( esp_loader_flash_write(&image[0], block_size) );
+    REQUIRE( esp_loader_flash_write(&image[block_size], block_size) == ESP_LOADER_ERROR_TIMEOUT );
+    REQUIRE( loader_data_cmds_pending() == 0 );
+
+    clear_buffers();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+
+    clear_buffers();
+    queue_response(set_params_response);
+    queue_response(flash_begin_response);
+    REQUIRE_SUCCESS( esp_loader_flash_start(0, sizeof(image), block_size) );
+    for (uint32_t pos = 0; pos < sizeof(image); pos += block_size) {
+        queue_response(flash_data_response);
+        REQUIRE_SUCCESS( esp_loader_flash_write(&image[pos], block_size) );
+    }
+    REQUIRE_SUCCESS( esp_loader_flash_wait_pending() );
+    REQUIRE( loader_data_cmds_pending() == 0 );
+
+    esp_loader_flash_set_window(1);
+}
+
+TEST_CASE( "Padded data packet matches packet padded in buffer" )
+{
+    uint8_t padded[16];
+    uint8_t data[11] = { 0xc0, 0x01, 0xdb, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09 };
+
+    memset(padded, 0xff, sizeof(padded));
+    memcpy(padded, data, sizeof(data));
+
+    clear_buffers();
+    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP); // To reset sequence number counter
+    clear_buffers();
+    REQUIRE_SUCCESS( loader_data_cmd_send(FLASH_DATA, padded, sizeof(padded)) );
+    std::vector<int8_t> expected(write_buffer_data(), write_buffer_data() + write_buffer_size());
+
+    loader_flash_begin_cmd(0, 0, 0, 0, ESP32_CHIP);
+    clear_buffers();
+    REQUIRE_SUCCESS( loader_data_cmd_send_padded(FLASH_DATA, data, sizeof(data), 0xff,
+                                                 sizeof(padded) - sizeof(data)) );
+
+    REQUIRE( write_buffer_size() == expected.size() );
+    REQUIRE( memcmp(write_buffer_data(), expected.data(), expected.size()) == 0 );
+}
+
+TEST_CASE( "Block size is reduced when target rejects it" )
+{
+    expected_response mem_begin_response(MEM_BEGIN);
+    auto rejected_response = mem_begin_response;
+    rejected_response.data.status.failed = STATUS_FAILURE;
+    rejected_response.data.status.error = INVALID_COMMAND;
+    uint32_t block_size = 0;
+
+    clear_buffers();
+
+    SECTION( "Host limit is respected" ) {
+        queue_response(mem_begin_response);
+        REQUIRE_SUCCESS( esp_loader_mem_start_auto(0x40000000, 0x4000, 1000, &block_size) );
+        REQUIRE( block_size == 1000 );
+    }
+
+    SECTION( "Rejected block size is halved" ) {
+        queue_response(rejected_response);
+        queue_response(mem_begin_response);
+        REQUIRE_SUCCESS( esp_loader_mem_start_auto(0x40000000, 0x4000, UINT32_MAX, &block_size) );
+        REQUIRE( block_size == 0xc00 );
+        REQUIRE( esp_loader_get_last_rom_error() == 0 );
+    }
+
+    SECTION( "Other errors are not retried" ) {
+        rejected_response.data.status.error = COMMAND_FAILED;
+        queue_response(rejected_response);
+        queue_response(mem_begin_response);
+        REQUIRE( esp_loader_mem_start_auto(0x40000000, 0x4000, UINT32_MAX, &block_size) ==
+                 ESP_LOADER_ERROR_INVALID_RESPONSE );
+        REQUIRE( block_size == 0 );
+    }
+}
+
+TEST_CASE( "Flasher stub is loaded and its responses are decoded" )
+{
+    const uint8_t text[8] = { 1, 2, 3, 4, 5, 6, 7, 8 };
+    const esp_loader_stub_t stub = {
+        .text = text, .text_addr = 0x40080000, .text_size = sizeof(text),
+        .data = NULL, .data_addr = 0, .data_size = 0,
+        .entry = 0x40080004,
+    };
+    expected_response mem_begin_response(MEM_BEGIN);
+    expected_response mem_data_response(MEM_DATA);
+    expected_response mem_end_response(MEM_END);
+
+    clear_buffers();
+    loader_set_stub_mode(false);
+
+    queue_response(mem_begin_response);
+    queue_response(mem_data_response);
+    queue_response(mem_end_response);
+
+    SECTION( "Stub is running after greeting" ) {
+        set_read_buffer("OHAI", 4);
+        REQUIRE_SUCCESS( esp_loader_run_stub(&stub) );
+        REQUIRE( esp_loader_stub_running() );
+
+        stub_md5_response_t md5_response = {};
+        md5_response.common.direction = READ_DIRECTION;
+        md5_response.common.command = SPI_FLASH_MD5;
+        md5_response.common.size = sizeof(md5_response.md5) + sizeof(md5_response.status);
+        for (uint8_t i = 0; i < sizeof(md5_response.md5); i++) {
+            md5_response.md5[i] = i * 0x11;
+        }
+        set_read_buffer(&md5_response, sizeof(md5_response));
+
+        uint8_t md5[MD5_SIZE];
+        REQUIRE_SUCCESS( loader_md5_cmd(0, 0x1000, md5) );
+        REQUIRE( memcmp(md5, "00112233445566778899aabbccddeeff", MD5_SIZE) == 0 );
+    }
+
+    SECTION( "Stub is not running without greeting" ) {
+        set_read_buffer("HELO", 4);
+        REQUIRE( esp_loader_run_stub(&stub) == ESP_LOADER_ERROR_INVALID_RESPONSE );
+        REQUIRE( !esp_loader_stub_running() );
+    }
+
+    loader_set_stub_mode(false);
+}
+
+struct image_reader {
+    vector<uint8_t> image;
+    size_t position;
+    vector<uint32_t> pending;   // Blocks in flight at each read
+};
+
+static esp_loader_error_t read_image(uint8_t *buffer, uint32_t size, void *arg)
+{
+    auto reader = static_cast<image_reader *>(arg);
+    if (reader->position + size > reader->image.size()) {
+        return ESP_LOADER_ERROR_FAIL;
+    }
+    memcpy(buffer, &reader->image[reader->position], size);
+    reader->position += size;
+    reader->pending.push_back(loader_data_cmds_pending());
+    return ESP_LOADER_SUCCESS;
+}
+
+static void append_word(vector<uint8_t> &image, uint32_t word)
+{
+    for (int i = 0; i < 4; i++) {
+        image.push_back(word >> (8 * i));
+    }
+}
+
+TEST_CASE( "RAM image is streamed through a buffer of one block" )
+{
+    expected_response mem_begin_response(MEM_BEGIN);
+    expected_response mem_data_response(MEM_DATA);
+    expected_response mem_end_response(MEM_END);
+    uint8_t buffer[0x100];
+
+    // Header, extended header and two segments of three and one block
+    image_reader reader = { { 0xE9, 2, 0, 0 }, 0, {} };
+    append_word(reader.image, 0x40080004);
+    reader.image.resize(24);
+    append_word(reader.image, 0x3FFB0000);
+    append_word(reader.image, 0x300);
+    reader.image.resize(reader.image.size() + 0x300, 0xAA);
+    append_word(reader.image, 0x40080000);
+    append_word(reader.image, 0x100);
+    reader.image.resize(reader.image.size() + 0x100, 0x55);
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    SECTION( "Blocks and begin of the next segment are not waited for" ) {
+        clear_buffers();
+        queue_response(mem_begin_response);
+        for (int i = 0; i < 3; i++) {
+            queue_response(mem_data_response);
+        }
+        queue_response(mem_begin_response);
+        queue_response(mem_data_response);
+        queue_response(mem_end_response);
+
+        esp_loader_flash_set_window(4);
+        REQUIRE_SUCCESS( esp_loader_load_ram_image(read_image, &reader, buffer, sizeof(buffer)) );
+        esp_loader_flash_set_window(1);
+
+        REQUIRE( reader.position == reader.image.size() );
+        // Header of the second segment is read with all blocks of the first one in flight
+        REQUIRE(( reader.pending == vector<uint32_t>{ 0, 0, 0, 0, 1, 2, 3, 0 } ));
+    }
+
+    SECTION( "Image without magic byte is rejected" ) {
+        reader.image[0] = 0;
+        clear_buffers();
+        REQUIRE( esp_loader_load_ram_image(read_image, &reader, buffer, sizeof(buffer)) == ESP_LOADER_ERROR_INVALID_PARAM );
+        REQUIRE( write_buffer_size() == 0 );
+    }
+}
+
+// ROM of a target in SPI slave download mode, on the SPI bus of the host
+struct spi_slave_target {
+    uint32_t status[3] = { 0, 3, 3 };   // Indexed by register / 4, toggle and init bits set at boot
+    uint32_t announced[3] = { 0, 0, 0 }; // Buffers announced since boot
+    uint32_t buffer_size = 0x1100;
+    bool selected = false;
+    vector<uint8_t> transaction;        // Bytes written with chip select held
+    vector<uint8_t> received;           // Frame written by DMA, not handed over yet
+    vector<vector<uint8_t>> frames;     // Frames handed over
+    vector<vector<uint8_t>> responses;  // Frames to be sent, the first one is in the send buffer
+    size_t read_position = 0;
+    uint32_t remaining_time = 0;
+};
+
+static const uint8_t SPI_RX_STATUS = 1;
+static const uint8_t SPI_TX_STATUS = 2;
+
+static void spi_announce(spi_slave_target &target, uint8_t buffer, uint32_t length)
+{
+    uint32_t count = target.announced[buffer]++;
+    target.status[buffer] = (count == 0 ? 2 : count & 1) | (length << 2);
+}
+
+static void spi_respond(spi_slave_target &target, const vector<uint8_t> &frame)
+{
+    common_response_t response = { READ_DIRECTION, frame[1], 4, 0 };
+    uint32_t address;
+    memcpy(&address, &frame[sizeof(command_common_t)], sizeof(address));
+    if (frame[1] == READ_REG && address == 0x40001000) {
+        response.value = 0x00000009; // ESP32-S3
+    }
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&response);
+    vector<uint8_t> packet(bytes, bytes + sizeof(response));
+    packet.resize(packet.size() + 4, 0);
+    target.responses.push_back(packet);
+    if (target.responses.size() == 1) {
+        spi_announce(target, SPI_TX_STATUS, packet.size());
+    }
+}
+
+static void spi_bus_set_cs(void *arg, uint32_t level)
+{
+    auto &target = *static_cast<spi_slave_target *>(arg);
+
+    if (level == 0) {
+        target.selected = true;
+        target.transaction.clear();
+        target.read_position = 0;
+        return;
+    }
+
+    target.selected = false;
+    REQUIRE( target.transaction.size() >= 3 );
+    uint8_t cmd = target.transaction[0];
+    uint8_t buffer = target.transaction[1] / 4;
+    if (cmd == 0x01 && target.transaction.size() == 7 && target.transaction[3] == 0) {
+        // Host cleared the status after boot, receive buffer is ready at once
+        target.status[buffer] = 0;
+        if (buffer == SPI_RX_STATUS) {
+            spi_announce(target, SPI_RX_STATUS, target.buffer_size);
+        }
+    } else if (cmd == 0x03) {
+        target.received.assign(target.transaction.begin() + 3, target.transaction.end());
+    } else if (cmd == 0x07) {
+        target.frames.push_back(target.received);
+        spi_respond(target, target.received);
+        spi_announce(target, SPI_RX_STATUS, target.buffer_size);
+    } else if (cmd == 0x08) {
+        target.responses.erase(target.responses.begin());
+        if (!target.responses.empty()) {
+            spi_announce(target, SPI_TX_STATUS, target.responses.front().size());
+        }
+    }
+}
+
+static esp_loader_error_t spi_bus_write(void *arg, const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    auto &target = *static_cast<spi_slave_target *>(arg);
+    REQUIRE( target.selected );
+    target.transaction.insert(target.transaction.end(), data, data + size);
+    return ESP_LOADER_SUCCESS;
+}
+
+static esp_loader_error_t spi_bus_read(void *arg, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+    auto &target = *static_cast<spi_slave_target *>(arg);
+    REQUIRE( target.selected );
+    REQUIRE( target.transaction.size() == 3 );
+
+    if (target.transaction[0] == 0x02) {
+        REQUIRE( size == 4 );
+        memcpy(data, &target.status[target.transaction[1] / 4], size);
+    } else {
+        REQUIRE( target.transaction[0] == 0x04 );
+        REQUIRE( !target.responses.empty() );
+        REQUIRE( target.read_position + size <= target.responses.front().size() );
+        memcpy(data, &target.responses.front()[target.read_position], size);
+        target.read_position += size;
+    }
+
+    return ESP_LOADER_SUCCESS;
+}
+
+static void spi_bus_delay_ms(void *arg, uint32_t ms)
+{
+    auto &target = *static_cast<spi_slave_target *>(arg);
+    target.remaining_time -= min(ms, target.remaining_time);
+}
+
+static void spi_bus_start_timer(void *arg, uint32_t ms)
+{
+    static_cast<spi_slave_target *>(arg)->remaining_time = ms;
+}
+
+static uint32_t spi_bus_remaining_time(void *arg)
+{
+    return static_cast<spi_slave_target *>(arg)->remaining_time;
+}
+
+static void spi_bus_enter_bootloader(void *arg)
+{
+    auto &target = *static_cast<spi_slave_target *>(arg);
+    target.status[SPI_RX_STATUS] = 3;
+    target.status[SPI_TX_STATUS] = 3;
+    target.announced[SPI_RX_STATUS] = 0;
+    target.announced[SPI_TX_STATUS] = 0;
+    target.responses.clear();
+}
+
+static const esp_loader_port_ops_t spi_bus_ops = {
+    .write = spi_bus_write,
+    .read = spi_bus_read,
+    .read_available = NULL,
+    .delay_ms = spi_bus_delay_ms,
+    .start_timer = spi_bus_start_timer,
+    .remaining_time = spi_bus_remaining_time,
+    .enter_bootloader = spi_bus_enter_bootloader,
+    .reset_target = test_port_reset_target,
+    .debug_print = NULL,
+    .change_transmission_rate = NULL,
+    .spi_set_cs = spi_bus_set_cs,
+};
+
+TEST_CASE( "RAM is loaded through SPI slave download mode of ROM" )
+{
+    spi_slave_target target;
+    esp_loader_spi_port_t port;
+    esp_loader_t *loader;
+    uint8_t image[0x1800];
+
+    // Bytes SLIP would escape are sent as they are
+    for (size_t i = 0; i < sizeof(image); i++) {
+        image[i] = (i % 3 == 0) ? 0xC0 : (uint8_t)(i * 5);
+    }
+
+    REQUIRE_SUCCESS( esp_loader_spi_port_init(&port, &spi_bus_ops, &target) );
+    REQUIRE_SUCCESS( esp_loader_create(&esp_loader_spi_port_ops, &port, &loader) );
+    esp_loader_select(loader);
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    REQUIRE( esp_loader_get_target() == ESP32S3_CHIP );
+    size_t connect_frames = target.frames.size();
+
+    REQUIRE_SUCCESS( esp_loader_mem_start(0x40380000, sizeof(image), 0x1000) );
+    REQUIRE_SUCCESS( esp_loader_mem_write(&image[0], 0x1000) );
+    REQUIRE_SUCCESS( esp_loader_mem_write(&image[0x1000], sizeof(image) - 0x1000) );
+    REQUIRE_SUCCESS( esp_loader_mem_finish(0x40380400) );
+
+    // Frame larger than the receive buffer of the target is not sent
+    REQUIRE( esp_loader_mem_start(0x40380000, 0x2000, 0x2000) == ESP_LOADER_SUCCESS );
+    static uint8_t large[0x2000];
+    REQUIRE( esp_loader_mem_write(large, sizeof(large)) == ESP_LOADER_ERROR_INVALID_PARAM );
+
+    REQUIRE( esp_loader_flash_start(0, 0x1000, 0x400) == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
+
+    esp_loader_select(NULL);
+    esp_loader_destroy(loader);
+
+    // Chip is detected without synchronization, flash is not attached
+    REQUIRE( connect_frames > 0 );
+    for (size_t i = 0; i < connect_frames; i++) {
+        REQUIRE( target.frames[i][1] == READ_REG );
+    }
+
+    REQUIRE( target.frames.size() == connect_frames + 5 );
+    const vector<uint8_t> *frames = &target.frames[connect_frames];
+    REQUIRE( frames[0][1] == MEM_BEGIN );
+    REQUIRE( frames[3][1] == MEM_END );
+    REQUIRE( frames[4][1] == MEM_BEGIN );
+
+    for (uint32_t i = 0; i < 2; i++) {
+        const vector<uint8_t> &frame = frames[1 + i];
+        uint32_t size = (i == 0) ? 0x1000 : sizeof(image) - 0x1000;
+        REQUIRE( frame[1] == MEM_DATA );
+        REQUIRE( frame.size() == sizeof(data_command_t) + size );
+        REQUIRE( memcmp(&frame[sizeof(data_command_t)], &image[i * 0x1000], size) == 0 );
+    }
+
+    // Nothing went through the loader_port_* functions of the default context
+    REQUIRE( write_buffer_size() == 0 );
+}
+
+static esp_loader_error_t collect_read_data(const uint8_t *data, uint32_t size, void *arg)
+{
+    auto collected = static_cast<vector<uint8_t> *>(arg);
+    collected->insert(collected->end(), data, data + size);
+    return ESP_LOADER_SUCCESS;
+}
+
+TEST_CASE( "Flash contents are streamed back and verified" )
+{
+    expected_response read_flash_response(READ_FLASH);
+    uint8_t flash[40];
+    uint8_t digest[16];
+    uint8_t buffer[16];
+    vector<uint8_t> collected;
+
+    for (uint8_t i = 0; i < sizeof(flash); i++) {
+        flash[i] = i;
+    }
+
+    struct MD5Context md5_context;
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, flash, sizeof(flash));
+    MD5Final(digest, &md5_context);
+
+    clear_buffers();
+
+    SECTION( "Read requires flasher stub" ) {
+        REQUIRE( esp_loader_flash_read(0, sizeof(flash), buffer, sizeof(buffer), 2, collect_read_data, &collected) ==
+                 ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
+    }
+
+    loader_set_stub_mode(true);
+    queue_response(read_flash_response);
+    set_read_buffer(&flash[0], 16);
+    set_read_buffer(&flash[16], 16);
+    set_read_buffer(&flash[32], 8);
+
+    SECTION( "Data matching digest are delivered" ) {
+        set_read_buffer(digest, sizeof(digest));
+
+        REQUIRE_SUCCESS( esp_loader_flash_read(0, sizeof(flash), buffer, sizeof(buffer), 2,
+                                               collect_read_data, &collected) );
+        REQUIRE( collected == vector<uint8_t>(flash, flash + sizeof(flash)) );
+
+        // Last acknowledgement reports all bytes received
+        const uint8_t last_ack[] = { 0xc0, sizeof(flash), 0, 0, 0, 0xc0 };
+        REQUIRE( memcmp(write_buffer_data() + write_buffer_size() - sizeof(last_ack), last_ack, sizeof(last_ack)) == 0 );
+    }
+
+    SECTION( "Corrupted data are detected" ) {
+        digest[0] ^= 1;
+        set_read_buffer(digest, sizeof(digest));
+
+        REQUIRE( esp_loader_flash_read(0, sizeof(flash), buffer, sizeof(buffer), 2, collect_read_data, &collected) ==
+                 ESP_LOADER_ERROR_INVALID_MD5 );
+    }
+
+    loader_set_stub_mode(false);
+}
+
+TEST_CASE( "Fastest stable transmission rate is negotiated" )
+{
+    static const uint32_t rates[] = { 921600, 460800 };
+    auto failed_read_reg_response = read_reg_response;
+    failed_read_reg_response.data.status.failed = STATUS_FAILURE;
+    failed_read_reg_response.data.status.error = INVALID_CRC;
+    uint32_t rate = 0;
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    clear_buffers();
+
+    SECTION( "Fastest rate is used when stable" ) {
+        queue_response(change_baudrate_response);
+        for (int i = 0; i < 3; i++) {
+            queue_response(read_reg_response);
+        }
+
+        REQUIRE_SUCCESS( esp_loader_negotiate_transmission_rate(rates, 2, 115200, &rate) );
+        REQUIRE( rate == 921600 );
+        REQUIRE( port_transmission_rate() == 921600 );
+    }
+
+    SECTION( "Unstable rates are left for slower ones" ) {
+        // 921600 fails the check, target is asked to return to 115200
+        queue_response(change_baudrate_response);
+        queue_response(failed_read_reg_response);
+        queue_response(change_baudrate_response);
+        for (int i = 0; i < 3; i++) {
+            queue_response(read_reg_response);
+        }
+        // 460800 is stable
+        queue_response(change_baudrate_response);
+        for (int i = 0; i < 3; i++) {
+            queue_response(read_reg_response);
+        }
+
+        REQUIRE_SUCCESS( esp_loader_negotiate_transmission_rate(rates, 2, 115200, &rate) );
+        REQUIRE( rate == 460800 );
+        REQUIRE( port_transmission_rate() == 460800 );
+
+        // Dropping down ends at the rate of connection
+        queue_response(change_baudrate_response);
+        for (int i = 0; i < 3; i++) {
+            queue_response(read_reg_response);
+        }
+
+        REQUIRE_SUCCESS( esp_loader_lower_transmission_rate(&rate) );
+        REQUIRE( rate == 115200 );
+        REQUIRE( port_transmission_rate() == 115200 );
+        REQUIRE( esp_loader_lower_transmission_rate(&rate) == ESP_LOADER_ERROR_FAIL );
+    }
+}
+
+TEST_CASE( "USB console of the target removes rate changes and limits blocks" )
+{
+    static const uint32_t rates[] = { 921600, 460800 };
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    expected_response mem_begin_response(MEM_BEGIN);
+    uint32_t rate = 0;
+    uint32_t block_size = 0;
+
+    SECTION( "UART console of chip with USB" ) {
+        queue_connect_response(ESP32S3_CHIP, 0, 1);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        REQUIRE( esp_loader_get_console() == ESP_LOADER_CONSOLE_UART );
+    }
+
+    SECTION( "USB-Serial/JTAG" ) {
+        queue_connect_response(ESP32C3_CHIP, 0, 3);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        REQUIRE( esp_loader_get_console() == ESP_LOADER_CONSOLE_USB_SERIAL_JTAG );
+        clear_buffers();
+
+        // Nothing is sent to the target
+        REQUIRE_SUCCESS( esp_loader_change_transmission_rate(921600) );
+        REQUIRE_SUCCESS( esp_loader_negotiate_transmission_rate(rates, 2, 115200, &rate) );
+        REQUIRE( rate == 115200 );
+        REQUIRE( esp_loader_lower_transmission_rate(&rate) == ESP_LOADER_ERROR_FAIL );
+        REQUIRE( write_buffer_size() == 0 );
+
+        queue_response(mem_begin_response);
+        REQUIRE_SUCCESS( esp_loader_mem_start_auto(0x40000000, 0x4000, UINT32_MAX, &block_size) );
+        REQUIRE( block_size == 0x1800 );
+    }
+
+    SECTION( "Upper bytes of the console variable are ignored" ) {
+        queue_connect_response(ESP32S3_CHIP, 0, 0xA5A50004);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        REQUIRE( esp_loader_get_console() == ESP_LOADER_CONSOLE_USB_SERIAL_JTAG );
+    }
+
+    SECTION( "USB-OTG" ) {
+        queue_connect_response(ESP32S2_CHIP, 0, 2);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        REQUIRE( esp_loader_get_console() == ESP_LOADER_CONSOLE_USB_OTG );
+        clear_buffers();
+
+        queue_response(mem_begin_response);
+        REQUIRE_SUCCESS( esp_loader_mem_start_auto(0x40000000, 0x4000, UINT32_MAX, &block_size) );
+        REQUIRE( block_size == 0x800 );
+    }
+
+    // Following tests expect UART
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+    REQUIRE( esp_loader_get_console() == ESP_LOADER_CONSOLE_UART );
+}
+
+// Frames written since the buffers were cleared, without SLIP escaping
+static vector<vector<uint8_t>> written_frames()
+{
+    const uint8_t *data = reinterpret_cast<const uint8_t *>(write_buffer_data());
+    vector<vector<uint8_t>> frames;
+    vector<uint8_t> frame;
+
+    for (size_t i = 0; i < write_buffer_size(); i++) {
+        if (data[i] == 0xc0) {
+            if (!frame.empty()) {
+                frames.push_back(frame);
+                frame.clear();
+            }
+        } else if (data[i] == 0xdb) {
+            frame.push_back(data[++i] == 0xdc ? 0xc0 : 0xdb);
+        } else {
+            frame.push_back(data[i]);
+        }
+    }
+
+    return frames;
+}
+
+static write_reg_command_t written_write_reg(const vector<uint8_t> &frame)
+{
+    write_reg_command_t cmd;
+    REQUIRE( frame.size() == sizeof(cmd) );
+    memcpy(&cmd, frame.data(), sizeof(cmd));
+    REQUIRE( cmd.common.command == WRITE_REG );
+    return cmd;
+}
+
+TEST_CASE( "Flasher stub is told the rate the target was connected at" )
+{
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    change_baudrate_command_t cmd;
+
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    clear_buffers();
+    loader_set_stub_mode(true);
+    queue_response(change_baudrate_response);
+    REQUIRE_SUCCESS( esp_loader_change_transmission_rate(921600) );
+
+    auto frames = written_frames();
+    REQUIRE( frames.size() == 1 );
+    REQUIRE( frames[0].size() == sizeof(cmd) );
+    memcpy(&cmd, frames[0].data(), sizeof(cmd));
+    REQUIRE( cmd.common.command == CHANGE_BAUDRATE );
+    REQUIRE( cmd.new_baudrate == 921600 );
+    REQUIRE( cmd.old_baudrate == 115200 );
+
+    // Next change starts from the rate set by this one
+    clear_buffers();
+    queue_response(change_baudrate_response);
+    REQUIRE_SUCCESS( esp_loader_change_transmission_rate(460800) );
+    frames = written_frames();
+    REQUIRE( frames.size() == 1 );
+    memcpy(&cmd, frames[0].data(), sizeof(cmd));
+    REQUIRE( cmd.old_baudrate == 921600 );
+
+    loader_set_stub_mode(false);
+}
+
+TEST_CASE( "Connected target is reset without the reset and boot pins" )
+{
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    esp_loader_reset_timing_t timing;
+
+    SECTION( "Reset timing profile replaces the defaults" ) {
+        esp_loader_reset_timing_t defaults;
+        esp_loader_get_reset_timing(&defaults);
+        REQUIRE( defaults.reset_hold_ms == 100 );
+        REQUIRE( defaults.boot_hold_ms == 50 );
+
+        esp_loader_reset_timing_t profile = { .reset_hold_ms = 12, .boot_hold_ms = 3 };
+        esp_loader_set_reset_timing(&profile);
+        esp_loader_get_reset_timing(&timing);
+        REQUIRE( timing.reset_hold_ms == 12 );
+        REQUIRE( timing.boot_hold_ms == 3 );
+
+        esp_loader_set_reset_timing(NULL);
+        esp_loader_get_reset_timing(&timing);
+        REQUIRE( timing.reset_hold_ms == defaults.reset_hold_ms );
+        REQUIRE( timing.boot_hold_ms == defaults.boot_hold_ms );
+    }
+
+    SECTION( "RTC control register resets ESP32-S3 into ROM loader and into application" ) {
+        queue_connect_response(ESP32S3_CHIP);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        clear_buffers();
+
+        // Restarted loader responds once it booted
+        queue_response(write_reg_response);
+        set_read_buffer_delayed(&sync_response, sizeof(sync_response), 5);
+        set_read_buffer_delayed(&read_reg_response, sizeof(read_reg_response), 0);
+        set_read_buffer_delayed(&read_reg_response, sizeof(read_reg_response), 0);
+        set_read_buffer_delayed(&attach_response, sizeof(attach_response), 0);
+        REQUIRE_SUCCESS( esp_loader_soft_reset_to_loader(&connect_config) );
+
+        auto frames = written_frames();
+        REQUIRE( frames.size() == 6 );
+        auto force_download = written_write_reg(frames[0]);
+        REQUIRE( force_download.address == 0x6000812C );
+        REQUIRE( force_download.value == 1 );
+        REQUIRE( force_download.mask == 1 );
+        auto sys_reset = written_write_reg(frames[1]);
+        REQUIRE( sys_reset.address == 0x60008000 );
+        REQUIRE( sys_reset.value == 0x80000000 );
+        REQUIRE( frames[2][1] == SYNC );
+        REQUIRE( frames[5][1] == SPI_ATTACH );
+
+        clear_buffers();
+        queue_response(write_reg_response);
+        loader_set_stub_mode(true);
+        REQUIRE_SUCCESS( esp_loader_soft_reset_to_run() );
+        REQUIRE( !loader_stub_mode() );
+
+        frames = written_frames();
+        REQUIRE( frames.size() == 2 );
+        force_download = written_write_reg(frames[0]);
+        REQUIRE( force_download.address == 0x6000812C );
+        REQUIRE( force_download.value == 0 );
+        REQUIRE( force_download.mask == 1 );
+        REQUIRE( written_write_reg(frames[1]).address == 0x60008000 );
+    }
+
+    SECTION( "ESP32 is only rebooted into application, by the loader" ) {
+        queue_connect_response(ESP32_CHIP);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        clear_buffers();
+
+        REQUIRE( esp_loader_soft_reset_to_loader(&connect_config) == ESP_LOADER_ERROR_UNSUPPORTED_FUNC );
+        REQUIRE( write_buffer_size() == 0 );
+
+        queue_response(flash_begin_response);
+        queue_response(flash_end_response);
+        REQUIRE_SUCCESS( esp_loader_soft_reset_to_run() );
+        REQUIRE( !loader_stub_mode() );
+
+        auto frames = written_frames();
+        REQUIRE( frames.size() == 2 );
+        REQUIRE( frames[0][1] == FLASH_BEGIN );
+        REQUIRE( frames[1][1] == FLASH_END );
+    }
+
+    // Following tests expect ESP32
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+}
+
+static vector<uint32_t> read_reg_addresses(const vector<vector<uint8_t>> &frames)
+{
+    vector<uint32_t> addresses;
+
+    for (auto &frame : frames) {
+        read_reg_command_t cmd;
+        REQUIRE( frame.size() == sizeof(cmd) );
+        memcpy(&cmd, frame.data(), sizeof(cmd));
+        REQUIRE( cmd.common.command == READ_REG );
+        addresses.push_back(cmd.address);
+    }
+
+    return addresses;
+}
+
+static void queue_read_reg_values(const vector<uint32_t> &values)
+{
+    for (uint32_t value : values) {
+        auto response = read_reg_response;
+        response.data.common.value = value;
+        queue_response(response);
+    }
+}
+
+TEST_CASE( "Target is identified by eFuses read in one burst" )
+{
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    esp_loader_efuse_snapshot_t snapshot;
+    const uint8_t mac[6] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66 };
+
+    SECTION( "Range of registers is read" ) {
+        queue_connect_response(ESP32_CHIP);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        clear_buffers();
+
+        uint32_t values[3];
+        queue_read_reg_values({ 7, 8, 9 });
+        REQUIRE_SUCCESS( esp_loader_read_registers(0x1000, 3, values) );
+        REQUIRE( values[0] == 7 );
+        REQUIRE( values[2] == 9 );
+        REQUIRE( read_reg_addresses(written_frames()) == vector<uint32_t>({ 0x1000, 0x1004, 0x1008 }) );
+    }
+
+    SECTION( "ESP32-S3 fields are decoded and cached for the connection" ) {
+        queue_connect_response(ESP32S3_CHIP);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        clear_buffers();
+
+        // v0.2 with 8 MB of embedded flash and 2 MB of PSRAM
+        queue_read_reg_values({ 0x33445566, 0x1122, 0, (2 << 18) | (1 << 27), 2 << 3, 0, 0, 0 });
+        REQUIRE_SUCCESS( esp_loader_get_efuse_snapshot(&snapshot) );
+
+        auto addresses = read_reg_addresses(written_frames());
+        REQUIRE( addresses.size() == ESP_LOADER_EFUSE_SNAPSHOT_WORDS );
+        REQUIRE( addresses[0] == 0x60007044 );
+        REQUIRE( addresses[7] == 0x60007060 );
+
+        REQUIRE( memcmp(snapshot.mac, mac, sizeof(mac)) == 0 );
+        REQUIRE( snapshot.chip_revision == 2 );
+        REQUIRE( snapshot.flash_cap == 1 );
+        REQUIRE( snapshot.psram_cap == 2 );
+        REQUIRE( snapshot.efuse_address == 0x60007044 );
+        REQUIRE( snapshot.efuse[1] == 0x1122 );
+
+        clear_buffers();
+        esp_loader_efuse_snapshot_t cached;
+        REQUIRE_SUCCESS( esp_loader_get_efuse_snapshot(&cached) );
+        REQUIRE( write_buffer_size() == 0 );
+        REQUIRE( memcmp(&cached, &snapshot, sizeof(snapshot)) == 0 );
+    }
+
+    SECTION( "ESP32 revision is read from eFuses and APB_CTL_DATE" ) {
+        queue_connect_response(ESP32_CHIP);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        clear_buffers();
+
+        queue_read_reg_values({ 0, 0x33445566, 0x1122, 1 << 15, 0, (1 << 20) | (1 << 24), 0, 0, 1u << 31 });
+        REQUIRE_SUCCESS( esp_loader_get_efuse_snapshot(&snapshot) );
+
+        auto addresses = read_reg_addresses(written_frames());
+        REQUIRE( addresses.size() == ESP_LOADER_EFUSE_SNAPSHOT_WORDS + 1 );
+        REQUIRE( addresses.back() == 0x3FF6607C );
+        REQUIRE( memcmp(snapshot.mac, mac, sizeof(mac)) == 0 );
+        REQUIRE( snapshot.chip_revision == 301 );
+    }
+
+    SECTION( "ESP8266 eFuses are not decoded" ) {
+        queue_connect_response(ESP8266_CHIP);
+        REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+        clear_buffers();
+
+        REQUIRE( esp_loader_get_efuse_snapshot(&snapshot) == ESP_LOADER_ERROR_UNSUPPORTED_CHIP );
+        REQUIRE( write_buffer_size() == 0 );
+    }
+
+    // Following tests expect ESP32
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+}
+
+TEST_CASE( "Sync command is constructed correctly" )
+{
+    uint8_t expected[] = {
+        0xc0,         // Begin
+        0x00,         // Write direction
+        0x08,         // SYNC command
+        36, 0,        // Number of characters to send
+        0, 0, 0, 0,   // Checksum is ignored for this command
+        0x07, 0x07, 0x12, 0x20,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55, 0x55,
+        0xc0,         // End
+    };
+
+    clear_buffers();
+    queue_response(sync_response);
+
+    REQUIRE_SUCCESS( loader_sync_cmd() );
+
+    REQUIRE( memcmp(write_buffer_data(), expected, sizeof(expected)) == 0 );
+}
+
+TEST_CASE( "Register can be read and decoded correctly" )
+{
+    clear_buffers();
+    read_reg_response.data.common.value = 55;
+    queue_response(read_reg_response);
+
+    uint32_t reg_value = 0;
+    esp_loader_read_register(0, &reg_value);
+
+    REQUIRE( reg_value == 55 );
+}
+
+TEST_CASE( "Received response (in SLIP format) is decoded correctly" )
+{
+    clear_buffers();
+    read_reg_response.data.common.value = 0xC0BD; // C0, BD has to be replaced
+    queue_response(read_reg_response);
+
+    uint32_t reg_value = 0;
+    esp_loader_read_register(0, &reg_value);
+
+    REQUIRE( reg_value == 0xC0BD );
+}
+
+
+TEST_CASE( "Responses received in one read are decoded one by one" )
+{
+    clear_buffers();
+    auto first_response = read_reg_response;
+    auto second_response = read_reg_response;
+    first_response.data.common.value = 0x11;
+    second_response.data.common.value = 0xC0DB;
+    queue_response(first_response);
+    queue_response(second_response);
+
+    uint32_t reg_value = 0;
+    REQUIRE_SUCCESS( esp_loader_read_register(0, &reg_value) );
+    REQUIRE( reg_value == 0x11 );
+
+    REQUIRE_SUCCESS( esp_loader_read_register(0, &reg_value) );
+    REQUIRE( reg_value == 0xC0DB );
+}
+
+
+TEST_CASE( "Response is decoded by its length and garbage before it is skipped" )
+{
+    auto response = read_reg_response;
+    response.data.common.value = 0x1234;
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(&response);
+    uint32_t reg_value = 0;
+
+    clear_buffers();
+
+    SECTION( "Frame is complete without its closing delimiter" ) {
+        vector<uint8_t> frame = { 0xc0 };
+        frame.insert(frame.end(), raw, raw + sizeof(response));
+        set_raw_read_buffer(frame.data(), frame.size());
+
+        REQUIRE_SUCCESS( esp_loader_read_register(0, &reg_value) );
+        REQUIRE( reg_value == 0x1234 );
+    }
+
+    SECTION( "Stale bytes after delimiter do not swallow the response" ) {
+        // Delimiter of the response would close the frame of stale bytes otherwise
+        vector<uint8_t> stale = { 0xc0, 'e', 't', 's', ' ', 0xdb, 'J', 'u', 'n', '\r', '\n' };
+        set_raw_read_buffer(stale.data(), stale.size());
+        queue_response(response);
+
+        REQUIRE_SUCCESS( esp_loader_read_register(0, &reg_value) );
+        REQUIRE( reg_value == 0x1234 );
+    }
+
+    SECTION( "Frame which is not a response is skipped" ) {
+        auto command = response;
+        command.data.common.direction = WRITE_DIRECTION;
+        queue_response(command);
+        queue_response(response);
+
+        REQUIRE_SUCCESS( esp_loader_read_register(0, &reg_value) );
+        REQUIRE( reg_value == 0x1234 );
+    }
+
+    SECTION( "Digest is decoded by length of the response" ) {
+        stub_md5_response_t stub_response = {};
+        stub_response.common.direction = READ_DIRECTION;
+        stub_response.common.command = SPI_FLASH_MD5;
+        stub_response.common.size = sizeof(stub_response.md5) + sizeof(stub_response.status);
+        for (size_t i = 0; i < sizeof(stub_response.md5); i++) {
+            stub_response.md5[i] = (uint8_t)(0x10 * i + i);
+        }
+        set_read_buffer(&stub_response, sizeof(stub_response));
+
+        uint8_t md5[MD5_SIZE + 1] = { 0 };
+        loader_set_stub_mode(true);
+        REQUIRE_SUCCESS( loader_md5_cmd_wait(md5) );
+        loader_set_stub_mode(false);
+        REQUIRE( memcmp(md5, "00112233445566778899aabbccddeeff", MD5_SIZE) == 0 );
+    }
+}
+
+// --------------------  Serial mock test  -----------------------
+
+TEST_CASE( "Serial read works correctly" )
+{
+    uint32_t reg_value = 5;
+    uint8_t readout[sizeof(reg_value) + 2];
+    uint8_t expected[] = { 0xc0, 5, 0, 0, 0, 0xc0 };
+
+    clear_buffers();
+
+    set_read_buffer(&reg_value, sizeof(reg_value));
+
+    SECTION( "Read buffer can be read" ) {
+        loader_port_read(readout, sizeof(readout), 0);
+        REQUIRE( memcmp(readout, expected, sizeof(readout)) == 0 );
+    }
+
+    SECTION ( "Read buffer can be read in smaller chunks" ) {
+        loader_port_read(&readout[0], 3, 0);
+        loader_port_read(&readout[3], 3, 0);
+        REQUIRE( memcmp(readout, expected, sizeof(readout)) == 0 );
+    }
+
+    SECTION ( "Timeout is returned when requested amount of data is not available" ) {
+        REQUIRE( loader_port_read(readout, sizeof(readout) + 1, 0) == ESP_LOADER_ERROR_TIMEOUT);
+    }
+
+    SECTION ( "Read buffer is correctly SLIP encoded " ) {
+        uint8_t data_to_encode[] = { TEST_SLIP_PACKET };
+        uint8_t expected[] = { 0xc0, SLIP_ENCODED_PACKET, 0xc0};
+        uint8_t encoded[sizeof(expected)];
+
+        clear_buffers();
+
+        fill(encoded, &encoded[sizeof(encoded)], 0);
+        set_read_buffer(data_to_encode, sizeof(data_to_encode));
+        loader_port_read(encoded, sizeof(encoded), 0);
+
+        REQUIRE( memcmp(expected, encoded, sizeof(expected)) == 0 );
+    }
+}
+
+
+// --------------------  Deflate test  -----------------------
+
+// Minimal inflate of a zlib stream made of fixed Huffman blocks only
+struct fixed_inflate {
+    const vector<uint8_t> &in;
+    size_t bit_pos = 0;
+
+    fixed_inflate(const vector<uint8_t> &data) : in(data) { }
+
+    uint32_t bits(uint32_t count)
+    {
+        uint32_t value = 0;
+        for (uint32_t i = 0; i < count; i++, bit_pos++) {
+            value |= ((in.at(bit_pos / 8) >> (bit_pos % 8)) & 1) << i;
+        }
+        return value;
+    }
+
+    uint32_t code(uint32_t count)
+    {
+        uint32_t value = 0;
+        while (count--) {
+            value = (value << 1) | bits(1);
+        }
+        return value;
+    }
+
+    uint32_t symbol()
+    {
+        uint32_t value = code(7);
+        if (value < 24) {
+            return 256 + value;
+        }
+        value = (value << 1) | bits(1);
+        if (value >= 0x30 && value < 0xC0) {
+            return value - 0x30;
+        }
+        if (value >= 0xC0 && value < 0xC8) {
+            return 280 + value - 0xC0;
+        }
+        value = (value << 1) | bits(1);
+        return 144 + value - 0x190;
+    }
+
+    vector<uint8_t> run()
+    {
+        static const uint16_t len_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                             35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+        static const uint8_t len_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                             3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+        static const uint16_t dist_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                              257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                              8193, 12289, 16385, 24577 };
+        static const uint8_t dist_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                              7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+        vector<uint8_t> out;
+
+        REQUIRE( in.at(0) == 0x78 );
+        REQUIRE( ((in.at(0) << 8) | in.at(1)) % 31 == 0 );
+        bit_pos = 16;
+        REQUIRE( bits(1) == 1 );  // Final block
+        REQUIRE( bits(2) == 1 );  // Fixed Huffman codes
+
+        for (uint32_t sym = symbol(); sym != 256; sym = symbol()) {
+            if (sym < 256) {
+                out.push_back(sym);
+                continue;
+            }
+            uint32_t length = len_base[sym - 257] + bits(len_extra[sym - 257]);
+            uint32_t dist_code = code(5);
+            uint32_t distance = dist_base[dist_code] + bits(dist_extra[dist_code]);
+            REQUIRE( distance <= out.size() );
+            for (uint32_t i = 0; i < length; i++) {
+                out.push_back(out[out.size() - distance]);
+            }
+        }
+
+        return out;
+    }
+};
+
+static esp_loader_error_t collect_deflate_output(void *arg, const uint8_t *data, uint32_t size)
+{
+    auto *blocks = (vector<vector<uint8_t>> *)arg;
+    blocks->emplace_back(data, data + size);
+    return ESP_LOADER_SUCCESS;
+}
+
+TEST_CASE( "MD5 is computed correctly regardless of input alignment" )
+{
+    // MD5 of 1000 bytes, where byte n is n & 0xff
+    const uint8_t expected[16] = {
+        0xcb, 0xec, 0xbd, 0xb0, 0xfd, 0xd5, 0xce, 0xc1,
+        0xe2, 0x42, 0x49, 0x3b, 0x60, 0x08, 0xcc, 0x79
+    };
+    alignas(4) uint8_t buffer[1001];
+    uint8_t digest[16];
+    struct MD5Context context;
+
+    for (uint32_t offset = 0; offset < 2; offset++) {
+        uint8_t *data = &buffer[offset];
+        for (uint32_t i = 0; i < 1000; i++) {
+            data[i] = i & 0xff;
+        }
+
+        MD5Init(&context);
+        MD5Update(&context, data, 3);
+        MD5Update(&context, data + 3, 128);
+        MD5Update(&context, data + 131, 1000 - 131);
+        MD5Final(digest, &context);
+
+        REQUIRE( memcmp(digest, expected, sizeof(expected)) == 0 );
+    }
+}
+
+TEST_CASE( "MD5 contexts can be interleaved" )
+{
+    // MD5 of 1000 bytes, where byte n is n & 0xff
+    const uint8_t expected[16] = {
+        0xcb, 0xec, 0xbd, 0xb0, 0xfd, 0xd5, 0xce, 0xc1,
+        0xe2, 0x42, 0x49, 0x3b, 0x60, 0x08, 0xcc, 0x79
+    };
+    uint8_t data[1000];
+    uint8_t digest[2][16];
+    struct MD5Context contexts[2];
+
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = i & 0xff;
+    }
+
+    // Second digest is started while the first is in progress, and finished first
+    MD5Init(&contexts[0]);
+    MD5Update(&contexts[0], data, 5);
+    MD5Init(&contexts[1]);
+    MD5Update(&contexts[1], data, 130);
+    MD5Update(&contexts[0], data + 5, 500);
+    MD5Update(&contexts[1], data + 130, 870);
+    MD5Final(digest[1], &contexts[1]);
+    MD5Update(&contexts[0], data + 505, 495);
+    MD5Final(digest[0], &contexts[0]);
+
+    REQUIRE( memcmp(digest[0], expected, sizeof(expected)) == 0 );
+    REQUIRE( memcmp(digest[1], expected, sizeof(expected)) == 0 );
+}
+
+TEST_CASE( "Deflate stream is decompressed to the original data" )
+{
+    const uint32_t block_size = 256;
+    static uint8_t work[ESP_LOADER_DEFLATE_WORK_SIZE(block_size)] __attribute__((aligned(4)));
+    vector<vector<uint8_t>> blocks;
+    vector<uint8_t> image(3 * ESP_LOADER_DEFLATE_WINDOW_SIZE + 123);
+    deflate_t deflate;
+
+    // Mix of repeated patterns and bytes which do not compress
+    uint32_t seed = 1;
+    for (size_t i = 0; i < image.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = (i % 1024 < 512) ? (uint8_t)(i % 7) : (uint8_t)(seed >> 16);
+    }
+
+    REQUIRE_SUCCESS( deflate_init(&deflate, work, sizeof(work), block_size, collect_deflate_output, &blocks) );
+
+    // Feed input in uneven chunks
+    for (size_t pos = 0, chunk = 1; pos < image.size(); pos += chunk, chunk = chunk * 3 + 1) {
+        chunk = min(chunk, image.size() - pos);
+        REQUIRE_SUCCESS( deflate_write(&deflate, &image[pos], chunk) );
+    }
+    REQUIRE_SUCCESS( deflate_finish(&deflate) );
+
+    vector<uint8_t> stream;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (i + 1 < blocks.size()) {
+            REQUIRE( blocks[i].size() == block_size );
+        }
+        stream.insert(stream.end(), blocks[i].begin(), blocks[i].end());
+    }
+
+    REQUIRE( stream.size() < image.size() );
+    REQUIRE( fixed_inflate(stream).run() == image );
+}
+
+TEST_CASE( "Deflate rejects too small work buffer" )
+{
+    static uint8_t work[ESP_LOADER_DEFLATE_WORK_SIZE(256)] __attribute__((aligned(4)));
+    deflate_t deflate;
+
+    REQUIRE( deflate_init(&deflate, work, sizeof(work) - 1, 256, collect_deflate_output, NULL)
+             == ESP_LOADER_ERROR_INVALID_PARAM );
+}
+
+static void queue_rom_md5_response(const uint8_t *data, size_t size)
+{
+    struct MD5Context md5_context;
+    uint8_t digest[16];
+    MD5Init(&md5_context);
+    MD5Update(&md5_context, data, size);
+    MD5Final(digest, &md5_context);
+
+    rom_md5_response_t md5_response = {};
+    md5_response.common.direction = READ_DIRECTION;
+    md5_response.common.command = SPI_FLASH_MD5;
+    md5_response.common.size = sizeof(md5_response.md5) + sizeof(md5_response.status);
+    loader_hexify(digest, sizeof(digest), md5_response.md5);
+    set_read_buffer(&md5_response, sizeof(md5_response));
+}
+
+static uint32_t read_u32(const vector<uint8_t> &data, size_t pos)
+{
+    uint32_t value;
+    REQUIRE( pos + sizeof(value) <= data.size() );
+    memcpy(&value, &data[pos], sizeof(value));
+    return value;
+}
+
+TEST_CASE( "Artifact is flashed from its stored blocks" )
+{
+    const uint32_t block_size = 1024;
+    const uint32_t segment_size = 0x1000;
+    static uint8_t work[ESP_LOADER_DEFLATE_WORK_SIZE(block_size)] __attribute__((aligned(4)));
+    vector<uint8_t> image(2 * segment_size + 1808);
+    esp_loader_flash_info_t info;
+    esp_loader_flash_sync_stats_t stats;
+    expected_response defl_begin_response(FLASH_DEFL_BEGIN);
+    expected_response defl_data_response(FLASH_DEFL_DATA);
+
+    uint32_t seed = 1;
+    for (size_t i = 0; i < image.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = (i % 1024 < 768) ? (uint8_t)(i % 5) : (uint8_t)(seed >> 16);
+    }
+
+    esp_loader_artifact_build_args_t build_args = {
+        .image = image.data(),
+        .image_size = (uint32_t)image.size(),
+        .block_size = block_size,
+        .segment_size = segment_size,
+        .work = work,
+        .work_size = sizeof(work),
+    };
+    uint32_t bound = esp_loader_artifact_size_bound(image.size(), block_size, segment_size);
+    vector<uint8_t> artifact(bound);
+    uint32_t artifact_size = 0;
+
+    REQUIRE_SUCCESS( esp_loader_artifact_build(&build_args, artifact.data(), bound, &artifact_size) );
+    REQUIRE( artifact_size < image.size() );
+    artifact.resize(artifact_size);
+
+    // Segments are separate streams made of frames of one block
+    REQUIRE( read_u32(artifact, 8) == image.size() );
+    REQUIRE( read_u32(artifact, 20) == 3 );
+    vector<uint32_t> frame_counts;
+    for (uint32_t i = 0; i < 3; i++) {
+        uint32_t pos = read_u32(artifact, 40 + i * 24);
+        uint32_t compressed_size = read_u32(artifact, 40 + i * 24 + 4);
+        uint32_t inflated = 0;
+        vector<uint8_t> stream;
+        while (stream.size() < compressed_size) {
+            uint32_t size = read_u32(artifact, pos);
+            REQUIRE( size <= block_size );
+            inflated += read_u32(artifact, pos + 4);
+            stream.insert(stream.end(), &artifact[pos + 8], &artifact[pos + 8] + size);
+            pos += 8 + ((size + 3) & ~3);
+        }
+        frame_counts.push_back((compressed_size + block_size - 1) / block_size);
+
+        size_t length = min<size_t>(segment_size, image.size() - i * segment_size);
+        vector<uint8_t> segment(&image[i * segment_size], &image[i * segment_size] + length);
+        REQUIRE( fixed_inflate(stream).run() == segment );
+        REQUIRE( inflated == length );
+    }
+
+    esp_loader_artifact_flash_args_t args = {
+        .offset = 0x10000,
+        .artifact = artifact.data(),
+        .size = artifact_size,
+        .skip_unchanged = true,
+        .verify = true,
+    };
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+
+    SECTION( "Only segment differing from flash is written" ) {
+        clear_buffers();
+        queue_response(set_params_response);
+        queue_rom_md5_response(&image[0], segment_size);
+        queue_rom_md5_response(&image[0], 1);
+        queue_response(defl_begin_response);
+        for (uint32_t i = 0; i < frame_counts[1]; i++) {
+            queue_response(defl_data_response);
+        }
+        queue_rom_md5_response(&image[segment_size], segment_size);
+        queue_rom_md5_response(&image[2 * segment_size], image.size() - 2 * segment_size);
+
+        REQUIRE_SUCCESS( esp_loader_flash_artifact(&args, &stats) );
+        REQUIRE( stats.bytes_skipped == image.size() - segment_size );
+        REQUIRE( stats.bytes_written == segment_size );
+        REQUIRE( stats.ranges_written == 1 );
+    }
+
+    SECTION( "Whole image is verified once" ) {
+        args.skip_unchanged = false;
+        clear_buffers();
+        queue_response(set_params_response);
+        for (uint32_t i = 0; i < 3; i++) {
+            queue_response(defl_begin_response);
+            for (uint32_t j = 0; j < frame_counts[i]; j++) {
+                queue_response(defl_data_response);
+            }
+        }
+        queue_rom_md5_response(image.data(), image.size());
+
+        REQUIRE_SUCCESS( esp_loader_flash_artifact(&args, &stats) );
+        REQUIRE( stats.bytes_written == image.size() );
+        REQUIRE( stats.ranges_written == 3 );
+    }
+
+    SECTION( "Damaged artifact is rejected before anything is sent" ) {
+        clear_buffers();
+        args.size = artifact_size - 1;
+        REQUIRE( esp_loader_flash_artifact(&args, &stats) == ESP_LOADER_ERROR_INVALID_PARAM );
+        args.size = artifact_size;
+        artifact[0] ^= 1;
+        REQUIRE( esp_loader_flash_artifact(&args, &stats) == ESP_LOADER_ERROR_INVALID_PARAM );
+        REQUIRE( write_buffer_size() == 0 );
+    }
+
+    SECTION( "Segment missing its last frame is rejected before anything is sent" ) {
+        // Frames of the second segment are walked to find the size of the last one
+        const size_t entry = 40 + 24;
+        uint32_t pos = read_u32(artifact, entry);
+        uint32_t compressed_size = read_u32(artifact, entry + 4);
+        uint32_t compressed = 0;
+        uint32_t last_size = 0;
+        uint32_t frames = 0;
+        while (compressed < compressed_size) {
+            last_size = read_u32(artifact, pos);
+            compressed += last_size;
+            pos += 8 + ((last_size + 3) & ~3);
+            frames++;
+        }
+        REQUIRE( frames > 1 );
+
+        uint32_t truncated = compressed_size - last_size;
+        memcpy(&artifact[entry + 4], &truncated, sizeof(truncated));
+
+        clear_buffers();
+        REQUIRE( esp_loader_flash_artifact(&args, &stats) == ESP_LOADER_ERROR_INVALID_PARAM );
+        REQUIRE( write_buffer_size() == 0 );
+    }
+}
+
+TEST_CASE( "Only regions differing from flash are written by differential flashing" )
+{
+    const uint32_t region_size = 0x1000;
+    const uint32_t block_size = 0x400;
+    vector<uint8_t> image(4 * region_size + 0x800);
+    vector<uint8_t> stale(region_size, 0xFF);
+    esp_loader_flash_info_t info;
+    esp_loader_flash_sync_stats_t stats;
+
+    for (size_t i = 0; i < image.size(); i++) {
+        image[i] = (uint8_t)(i * 7 + i / region_size);
+    }
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+
+    // Regions 1 and 2 differ and are written together, as is the partial region 4
+    clear_buffers();
+    queue_response(set_params_response);
+    queue_rom_md5_response(&image[0], region_size);
+    queue_rom_md5_response(stale.data(), region_size);
+    queue_rom_md5_response(stale.data(), region_size);
+    queue_rom_md5_response(&image[3 * region_size], region_size);
+    queue_response(flash_begin_response);
+    for (uint32_t i = 0; i < 2 * region_size / block_size; i++) {
+        queue_response(flash_data_response);
+    }
+    queue_rom_md5_response(&image[region_size], 2 * region_size);
+    queue_rom_md5_response(stale.data(), 0x800);
+    queue_response(flash_begin_response);
+    for (uint32_t i = 0; i < 0x800 / block_size; i++) {
+        queue_response(flash_data_response);
+    }
+    queue_rom_md5_response(&image[4 * region_size], 0x800);
+
+    esp_loader_flash_sync_args_t args = {
+        .offset = 0x10000,
+        .data = image.data(),
+        .size = (uint32_t)image.size(),
+        .region_size = region_size,
+        .block_size = block_size,
+    };
+    REQUIRE_SUCCESS( esp_loader_flash_sync(&args, &stats) );
+
+    REQUIRE( stats.bytes_skipped == 2 * region_size );
+    REQUIRE( stats.bytes_written == 2 * region_size + 0x800 );
+    REQUIRE( stats.ranges_written == 2 );
+
+    vector<uint32_t> begin_offsets;
+    vector<uint32_t> data_sizes;
+    for (auto &frame : written_frames()) {
+        if (frame[1] == FLASH_BEGIN) {
+            flash_begin_command_t begin;
+            memcpy(&begin, frame.data(), sizeof(begin) - sizeof(uint32_t));
+            begin_offsets.push_back(begin.offset);
+        } else if (frame[1] == FLASH_DATA) {
+            data_command_t data;
+            memcpy(&data, frame.data(), sizeof(data));
+            data_sizes.push_back(data.data_size);
+            uint32_t pos = begin_offsets.back() - args.offset + data.sequence_number * block_size;
+            REQUIRE( memcmp(&frame[sizeof(data)], &image[pos], block_size) == 0 );
+        }
+    }
+    REQUIRE( begin_offsets == vector<uint32_t>({ 0x11000, 0x14000 }) );
+    REQUIRE( data_sizes.size() == 2 * region_size / block_size + 0x800 / block_size );
+}
+
+TEST_CASE( "Flash ranges are audited against expected digests" )
+{
+    static uint8_t content[3][0x100];
+    esp_loader_flash_info_t info;
+    esp_loader_audit_region_t regions[3];
+
+    for (uint32_t i = 0; i < 3; i++) {
+        memset(content[i], 0x11 * (i + 1), sizeof(content[i]));
+        struct MD5Context md5_context;
+        MD5Init(&md5_context);
+        MD5Update(&md5_context, content[i], sizeof(content[i]));
+        regions[i].address = 0x1000 * i;
+        regions[i].length = sizeof(content[i]);
+        MD5Final(regions[i].md5, &md5_context);
+    }
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+
+    SECTION( "Each range is reported" ) {
+        clear_buffers();
+        queue_response(set_params_response);
+        queue_rom_md5_response(content[0], sizeof(content[0]));
+        queue_rom_md5_response(content[0], sizeof(content[0]));
+        queue_rom_md5_response(content[2], sizeof(content[2]));
+
+        REQUIRE( esp_loader_flash_audit(regions, 3) == ESP_LOADER_ERROR_INVALID_MD5 );
+        REQUIRE( regions[0].matches );
+        REQUIRE( !regions[1].matches );
+        REQUIRE( regions[2].matches );
+
+        // Flash parameters are only set once per connection
+        clear_buffers();
+        queue_rom_md5_response(content[1], sizeof(content[1]));
+        REQUIRE_SUCCESS( esp_loader_flash_audit(&regions[1], 1) );
+        REQUIRE( regions[1].matches );
+    }
+
+    SECTION( "Range beyond flash is rejected before anything is sent" ) {
+        regions[2].address = info.size - 0x10;
+        clear_buffers();
+        REQUIRE( esp_loader_flash_audit(regions, 3) == ESP_LOADER_ERROR_IMAGE_SIZE );
+        REQUIRE( write_buffer_size() == 0 );
+    }
+}
+
+TEST_CASE( "Segments of flashing job are verified once all their blocks were sent" )
+{
+    static uint8_t bootloader[0x100];
+    static uint8_t app[0x800];
+    uint8_t buffer[0x400];
+    esp_loader_flash_info_t info;
+
+    memset(bootloader, 0x5A, sizeof(bootloader));
+    for (size_t i = 0; i < sizeof(app); i++) {
+        app[i] = (uint8_t)(i * 3);
+    }
+
+    esp_loader_region_t regions[] = {
+        { .address = 0x0, .data = bootloader, .size = sizeof(bootloader), .compress = false },
+        { .address = 0x10000, .data = app, .size = sizeof(app), .compress = false },
+    };
+    esp_loader_flash_job_t job = {
+        .regions = regions,
+        .region_count = 2,
+        .buffer = buffer,
+        .buffer_size = sizeof(buffer),
+        .verify = true,
+    };
+
+    esp_loader_connect_args_t connect_config = ESP_LOADER_CONNECT_DEFAULT();
+    queue_connect_response(ESP32_CHIP);
+    REQUIRE_SUCCESS( esp_loader_connect(&connect_config) );
+
+    clear_buffers();
+    queue_flash_id_responses();
+    REQUIRE_SUCCESS( esp_loader_get_flash_info(&info) );
+
+    esp_loader_flash_set_window(2);
+    clear_buffers();
+    queue_response(set_params_response);
+    queue_response(flash_begin_response);
+    queue_response(flash_data_response);
+    queue_response(flash_begin_response);
+    queue_response(flash_data_response);
+    queue_response(flash_data_response);
+
+    SECTION( "Digests of all segments follow the last block" ) {
+        queue_rom_md5_response(bootloader, sizeof(bootloader));
+        queue_rom_md5_response(app, sizeof(app));
+
+        REQUIRE_SUCCESS( esp_loader_flash_job(&job) );
+
+        vector<uint8_t> commands;
+        vector<uint32_t> md5_ranges;
+        for (auto &frame : written_frames()) {
+            commands.push_back(frame[1]);
+            if (frame[1] == SPI_FLASH_MD5) {
+                spi_flash_md5_command_t md5_cmd;
+                memcpy(&md5_cmd, frame.data(), sizeof(md5_cmd));
+                md5_ranges.push_back(md5_cmd.address);
+                md5_ranges.push_back(md5_cmd.size);
+            }
+        }
+        REQUIRE( commands == vector<uint8_t>({ SPI_SET_PARAMS, FLASH_BEGIN, FLASH_DATA, FLASH_BEGIN,
+                                               FLASH_DATA, FLASH_DATA, SPI_FLASH_MD5, SPI_FLASH_MD5 }) );
+        REQUIRE( md5_ranges == vector<uint32_t>({ 0x0, sizeof(bootloader), 0x10000, sizeof(app) }) );
+    }
+
+    SECTION( "Segment differing from its digest fails the job" ) {
+        queue_rom_md5_response(bootloader, sizeof(bootloader));
+        queue_rom_md5_response(bootloader, sizeof(bootloader));
+
+        REQUIRE( esp_loader_flash_job(&job) == ESP_LOADER_ERROR_INVALID_MD5 );
+    }
+
+    esp_loader_flash_set_window(1);
+}
+
+static uint32_t scan_inflated_size(const uint8_t *stream, size_t size, size_t chunk)
+{
+    inflate_size_t scanner;
+    uint32_t total = 0;
+
+    inflate_size_init(&scanner);
+    for (size_t pos = 0; pos < size; pos += chunk) {
+        uint32_t produced;
+        REQUIRE_SUCCESS( inflate_size_scan(&scanner, &stream[pos], min(chunk, size - pos), &produced) );
+        total += produced;
+    }
+    REQUIRE( scanner.state == INFLATE_SIZE_DONE );
+
+    return total;
+}
+
+TEST_CASE( "Inflated size of compressed stream is determined without inflating it" )
+{
+    SECTION( "Block with dynamic Huffman codes" ) {
+        // zlib.compress(b"".join(b"esp%d," % (i * i % 97) for i in range(90)), 9)
+        const uint8_t stream[] = {
+            0x78, 0xda, 0x4d, 0x91, 0x41, 0x0e, 0xc4, 0x20, 0x0c, 0x03, 0x3f, 0xb4, 0x87, 0x05, 0x4a, 0x48,
+            0x1f, 0xd4, 0x7b, 0xa5, 0xfe, 0x5f, 0xda, 0x32, 0xb3, 0x12, 0x5c, 0xa2, 0xd4, 0x35, 0x76, 0xe2,
+            0x5c, 0xcf, 0xfd, 0xfd, 0x5c, 0xcf, 0x5d, 0x66, 0x39, 0x66, 0x39, 0xf9, 0x8c, 0x59, 0x6b, 0x9f,
+            0xb5, 0xd1, 0x1f, 0xe0, 0x01, 0x25, 0x61, 0x37, 0x28, 0x00, 0xc7, 0x98, 0x75, 0x54, 0x10, 0xfe,
+            0xc1, 0x08, 0xfa, 0x53, 0x15, 0xe8, 0x43, 0x33, 0xf0, 0x0e, 0x72, 0xaa, 0xae, 0xb5, 0x53, 0x88,
+            0x83, 0x74, 0xf8, 0x89, 0x18, 0x32, 0x15, 0xa7, 0x04, 0xe9, 0x50, 0x2a, 0x62, 0xe9, 0x78, 0x0e,
+            0x06, 0xb3, 0xd0, 0x27, 0xf2, 0xa1, 0x09, 0xaf, 0x1a, 0xfc, 0xa2, 0x26, 0x4e, 0xf8, 0x25, 0x8f,
+            0x06, 0x32, 0xc3, 0xbe, 0x6d, 0x75, 0xfb, 0x2b, 0xd3, 0x57, 0xb1, 0xb4, 0xd4, 0xd5, 0x43, 0x3f,
+            0xbd, 0xcb, 0x36, 0x93, 0xf3, 0x39, 0xab, 0x73, 0xbb, 0x83, 0xfb, 0xb8, 0x9b, 0x7b, 0xe6, 0xda,
+            0xde, 0x24, 0xfe, 0xa9, 0x94, 0x2d, 0xad, 0x58, 0x29, 0x9a, 0xa8, 0xe9, 0x9a, 0xb4, 0xa9, 0xc7,
+            0x76, 0x8d, 0xba, 0x6e, 0xe4, 0xbd, 0xbc, 0x5d, 0x5b, 0x17, 0x7d, 0xaf, 0xfb, 0x03, 0x91, 0xe6,
+            0xa5, 0x5f
+        };
+
+        REQUIRE( scan_inflated_size(stream, sizeof(stream), sizeof(stream)) == 528 );
+        REQUIRE( scan_inflated_size(stream, sizeof(stream), 1) == 528 );
+    }
+
+    SECTION( "Stored block" ) {
+        uint8_t stream[2 + 5 + 40 + 4] = { 0x78, 0x01, 0x01, 0x28, 0x00, 0xd7, 0xff };
+
+        REQUIRE( scan_inflated_size(stream, sizeof(stream), 3) == 40 );
+    }
+
+    SECTION( "Blocks of built-in compressor" ) {
+        const uint32_t block_size = 256;
+        static uint8_t work[ESP_LOADER_DEFLATE_WORK_SIZE(block_size)] __attribute__((aligned(4)));
+        vector<vector<uint8_t>> blocks;
+        vector<uint8_t> image(2 * ESP_LOADER_DEFLATE_WINDOW_SIZE + 77);
+        deflate_t deflate;
+
+        for (size_t i = 0; i < image.size(); i++) {
+            image[i] = (uint8_t)((i * i) >> 5);
+        }
+
+        REQUIRE_SUCCESS( deflate_init(&deflate, work, sizeof(work), block_size, collect_deflate_output, &blocks) );
+        REQUIRE_SUCCESS( deflate_write(&deflate, image.data(), image.size()) );
+        REQUIRE_SUCCESS( deflate_finish(&deflate) );
+
+        vector<uint8_t> stream;
+        for (auto &block : blocks) {
+            stream.insert(stream.end(), block.begin(), block.end());
+        }
+
+        REQUIRE( scan_inflated_size(stream.data(), stream.size(), block_size) == image.size() );
+    }
+
+    SECTION( "Invalid stream is rejected" ) {
+        const uint8_t stream[] = { 0x78, 0x01, 0x07, 0x00 }; // Reserved block type
+        inflate_size_t scanner;
+        uint32_t produced;
+
+        inflate_size_init(&scanner);
+        REQUIRE( inflate_size_scan(&scanner, stream, sizeof(stream), &produced) == ESP_LOADER_ERROR_INVALID_PARAM );
+        REQUIRE( inflate_size_scan(&scanner, stream, 0, &produced) == ESP_LOADER_ERROR_INVALID_PARAM );
     }
 }